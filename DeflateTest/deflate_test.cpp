@@ -0,0 +1,630 @@
+#include "shared.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * Round-trip tests and per-level throughput for the module's deflate
+ * encoder. Output is decoded by the independent inflater below and the
+ * zlib and gzip framing and checksums are checked against the input.
+ *
+ *   DeflateTest.exe              runs every case, exit code is the failure count
+ *   DeflateTest.exe bench [file] compresses file, or 8 MB of generated text, at every level
+ */
+
+typedef struct _Inflate
+{
+	const unsigned char* input;
+	size_t input_length;
+	size_t position;
+	UINT32 bit_buffer;
+	int bit_count;
+	std::string output;
+} Inflate;
+
+typedef struct _InflateHuffman
+{
+	short count[16];
+	short symbol[288];
+} InflateHuffman;
+
+static const short inflate_length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short inflate_length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short inflate_dist_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short inflate_dist_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static bool
+inflate_bits(Inflate* inflate, int count, UINT32* value)
+{
+	while (inflate->bit_count < count)
+	{
+		if (inflate->position == inflate->input_length)
+			return false;
+
+		inflate->bit_buffer |= (UINT32)inflate->input[inflate->position++] << inflate->bit_count;
+		inflate->bit_count += 8;
+	}
+
+	*value = inflate->bit_buffer & ((1u << count) - 1);
+	inflate->bit_buffer >>= count;
+	inflate->bit_count -= count;
+
+	return true;
+}
+
+static bool
+inflate_build(InflateHuffman* huffman, const short* lengths, int count)
+{
+	short offsets[16];
+
+	memset(huffman->count, 0, sizeof(huffman->count));
+
+	for (int i = 0; i < count; i++)
+		huffman->count[lengths[i]]++;
+
+	// Over-subscribed code sets are invalid, incomplete ones are allowed.
+	int left = 1;
+
+	for (int length = 1; length < 16; length++)
+	{
+		left = (left << 1) - huffman->count[length];
+
+		if (left < 0)
+			return false;
+	}
+
+	offsets[1] = 0;
+
+	for (int length = 1; length < 15; length++)
+		offsets[length + 1] = offsets[length] + huffman->count[length];
+
+	for (int i = 0; i < count; i++)
+	{
+		if (lengths[i])
+			huffman->symbol[offsets[lengths[i]]++] = (short)i;
+	}
+
+	return true;
+}
+
+static int
+inflate_decode(Inflate* inflate, const InflateHuffman* huffman)
+{
+	int code = 0;
+	int first = 0;
+	int index = 0;
+
+	for (int length = 1; length < 16; length++)
+	{
+		UINT32 bit;
+
+		if (!inflate_bits(inflate, 1, &bit))
+			return -1;
+
+		code |= (int)bit;
+
+		int count = huffman->count[length];
+
+		if (code - count < first)
+			return huffman->symbol[index + (code - first)];
+
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+static bool
+inflate_codes(Inflate* inflate, const InflateHuffman* litlen, const InflateHuffman* dist)
+{
+	for (;;)
+	{
+		int symbol = inflate_decode(inflate, litlen);
+
+		if (symbol < 0)
+			return false;
+
+		if (symbol < 256)
+		{
+			inflate->output.push_back((char)symbol);
+			continue;
+		}
+
+		if (symbol == 256)
+			return true;
+
+		symbol -= 257;
+
+		if (symbol >= 29)
+			return false;
+
+		UINT32 extra;
+
+		if (!inflate_bits(inflate, inflate_length_extra[symbol], &extra))
+			return false;
+
+		size_t length = inflate_length_base[symbol] + extra;
+		int dist_symbol = inflate_decode(inflate, dist);
+
+		if (dist_symbol < 0 || dist_symbol >= 30)
+			return false;
+
+		if (!inflate_bits(inflate, inflate_dist_extra[dist_symbol], &extra))
+			return false;
+
+		size_t distance = inflate_dist_base[dist_symbol] + extra;
+
+		if (distance > inflate->output.size() || distance > 32768)
+			return false;
+
+		for (size_t i = 0; i < length; i++)
+			inflate->output.push_back(inflate->output[inflate->output.size() - distance]);
+	}
+}
+
+static bool
+inflate_stored(Inflate* inflate)
+{
+	inflate->bit_buffer = 0;
+	inflate->bit_count = 0;
+
+	if (inflate->input_length - inflate->position < 4)
+		return false;
+
+	const unsigned char* header = inflate->input + inflate->position;
+	size_t length = header[0] | (header[1] << 8);
+	size_t complement = header[2] | (header[3] << 8);
+
+	inflate->position += 4;
+
+	if (length != (~complement & 0xffff) || inflate->input_length - inflate->position < length)
+		return false;
+
+	inflate->output.append((const char*)inflate->input + inflate->position, length);
+	inflate->position += length;
+
+	return true;
+}
+
+static bool
+inflate_fixed(Inflate* inflate)
+{
+	short lengths[288];
+	InflateHuffman litlen;
+	InflateHuffman dist;
+
+	for (int i = 0; i < 288; i++)
+		lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+
+	inflate_build(&litlen, lengths, 288);
+
+	for (int i = 0; i < 30; i++)
+		lengths[i] = 5;
+
+	inflate_build(&dist, lengths, 30);
+
+	return inflate_codes(inflate, &litlen, &dist);
+}
+
+static bool
+inflate_dynamic(Inflate* inflate)
+{
+	static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	UINT32 litlen_count, dist_count, clen_count;
+
+	if (!inflate_bits(inflate, 5, &litlen_count) || !inflate_bits(inflate, 5, &dist_count) || !inflate_bits(inflate, 4, &clen_count))
+		return false;
+
+	litlen_count += 257;
+	dist_count += 1;
+	clen_count += 4;
+
+	if (litlen_count > 286 || dist_count > 30)
+		return false;
+
+	short lengths[320] = { 0 };
+	InflateHuffman clen;
+
+	for (UINT32 i = 0; i < clen_count; i++)
+	{
+		UINT32 length;
+
+		if (!inflate_bits(inflate, 3, &length))
+			return false;
+
+		lengths[order[i]] = (short)length;
+	}
+
+	if (!inflate_build(&clen, lengths, 19))
+		return false;
+
+	for (UINT32 i = 0; i < litlen_count + dist_count; )
+	{
+		int symbol = inflate_decode(inflate, &clen);
+		UINT32 repeat;
+		short value = 0;
+
+		if (symbol < 0)
+			return false;
+
+		if (symbol < 16)
+		{
+			lengths[i++] = (short)symbol;
+			continue;
+		}
+
+		if (symbol == 16)
+		{
+			if (!i || !inflate_bits(inflate, 2, &repeat))
+				return false;
+
+			value = lengths[i - 1];
+			repeat += 3;
+		}
+		else if (symbol == 17)
+		{
+			if (!inflate_bits(inflate, 3, &repeat))
+				return false;
+
+			repeat += 3;
+		}
+		else
+		{
+			if (!inflate_bits(inflate, 7, &repeat))
+				return false;
+
+			repeat += 11;
+		}
+
+		if (i + repeat > litlen_count + dist_count)
+			return false;
+
+		while (repeat--)
+			lengths[i++] = value;
+	}
+
+	if (!lengths[256])
+		return false;
+
+	InflateHuffman litlen;
+	InflateHuffman dist;
+
+	if (!inflate_build(&litlen, lengths, litlen_count) || !inflate_build(&dist, lengths + litlen_count, dist_count))
+		return false;
+
+	return inflate_codes(inflate, &litlen, &dist);
+}
+
+static bool
+inflate_raw(Inflate* inflate)
+{
+	UINT32 last;
+
+	do
+	{
+		UINT32 type;
+
+		if (!inflate_bits(inflate, 1, &last) || !inflate_bits(inflate, 2, &type))
+			return false;
+
+		bool success = false;
+
+		switch (type)
+		{
+		case 0: success = inflate_stored(inflate); break;
+		case 1: success = inflate_fixed(inflate); break;
+		case 2: success = inflate_dynamic(inflate); break;
+		default: break;
+		}
+
+		if (!success)
+			return false;
+
+	} while (!last);
+
+	// The trailer starts on the next byte boundary.
+	inflate->bit_buffer = 0;
+	inflate->bit_count = 0;
+
+	return true;
+}
+
+static UINT32
+test_crc32(const std::string& data)
+{
+	UINT32 crc = 0xffffffff;
+
+	for (unsigned char c : data)
+	{
+		crc ^= c;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+	}
+
+	return ~crc;
+}
+
+static UINT32
+test_adler32(const std::string& data)
+{
+	UINT32 a = 1;
+	UINT32 b = 0;
+
+	for (unsigned char c : data)
+	{
+		a = (a + c) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return (b << 16) | a;
+}
+
+/**
+ * Unwraps and decodes a whole stream, checking the framing and the checksum.
+ */
+static bool
+test_decode(const std::string& stream, DeflateFormat format, std::string* output)
+{
+	const unsigned char* bytes = (const unsigned char*)stream.data();
+	size_t header_length = format == DEFLATE_FORMAT_GZIP ? 10 : 2;
+	size_t trailer_length = format == DEFLATE_FORMAT_GZIP ? 8 : 4;
+
+	if (stream.size() < header_length + trailer_length)
+		return false;
+
+	if (format == DEFLATE_FORMAT_GZIP)
+	{
+		// No optional fields are ever written.
+		if (bytes[0] != 0x1f || bytes[1] != 0x8b || bytes[2] != 8 || bytes[3] != 0)
+			return false;
+	}
+	else if ((bytes[0] & 0x0f) != 8 || ((bytes[0] << 8) | bytes[1]) % 31 || (bytes[1] & 0x20))
+	{
+		return false;
+	}
+
+	Inflate inflate;
+	inflate.input = bytes;
+	inflate.input_length = stream.size() - trailer_length;
+	inflate.position = header_length;
+	inflate.bit_buffer = 0;
+	inflate.bit_count = 0;
+
+	if (!inflate_raw(&inflate) || inflate.position != inflate.input_length)
+		return false;
+
+	const unsigned char* trailer = bytes + inflate.input_length;
+
+	if (format == DEFLATE_FORMAT_GZIP)
+	{
+		UINT32 crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((UINT32)trailer[3] << 24);
+		UINT32 size = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((UINT32)trailer[7] << 24);
+
+		if (crc != test_crc32(inflate.output) || size != (UINT32)inflate.output.size())
+			return false;
+	}
+	else
+	{
+		UINT32 adler = ((UINT32)trailer[0] << 24) | (trailer[1] << 16) | (trailer[2] << 8) | trailer[3];
+
+		if (adler != test_adler32(inflate.output))
+			return false;
+	}
+
+	output->swap(inflate.output);
+
+	return true;
+}
+
+static bool
+test_sink(void* context, const char* data, size_t length)
+{
+	((std::string*)context)->append(data, length);
+	return true;
+}
+
+/**
+ * Feeds input in pieces of chunk bytes, sync flushing every sync_every bytes when non-zero.
+ */
+static bool
+test_compress(const std::string& input, DeflateFormat format, int level, size_t chunk, size_t sync_every, std::string* output)
+{
+	std::vector<char> memory(deflate_get_size());
+	Deflate* deflate = deflate_init(memory.data(), format, level, test_sink, output);
+
+	size_t since_sync = 0;
+
+	for (size_t position = 0; position < input.size(); )
+	{
+		size_t length = min(chunk, input.size() - position);
+		DeflateFlush flush = DEFLATE_NO_FLUSH;
+
+		since_sync += length;
+
+		if (sync_every && since_sync >= sync_every)
+		{
+			flush = DEFLATE_SYNC_FLUSH;
+			since_sync = 0;
+		}
+
+		if (!deflate_feed(deflate, input.data() + position, length, flush))
+			return false;
+
+		position += length;
+	}
+
+	return deflate_feed(deflate, nullptr, 0, DEFLATE_FINISH);
+}
+
+static UINT32
+test_random(UINT32* seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+/**
+ * Markup-like text from a small vocabulary, compresses roughly like real pages.
+ */
+static std::string
+test_text(size_t length, UINT32 seed)
+{
+	static const char* words[] = {
+		"<div class=\"item\">", "</div>", "<span>", "</span>", "the", "request", "response",
+		"module", "header", "value", "lua", "script", "engine", "cache", "\n", "  ", ", ", ". "
+	};
+
+	std::string text;
+
+	while (text.size() < length)
+	{
+		text += words[test_random(&seed) % _countof(words)];
+		text += ' ';
+	}
+
+	text.resize(length);
+
+	return text;
+}
+
+static std::string
+test_bytes(size_t length, UINT32 seed)
+{
+	std::string bytes(length, '\0');
+
+	for (size_t i = 0; i < length; i++)
+		bytes[i] = (char)test_random(&seed);
+
+	return bytes;
+}
+
+static int
+test_run()
+{
+	struct { const char* name; std::string data; } inputs[] = {
+		{ "empty", std::string() },
+		{ "one byte", std::string("a") },
+		{ "two bytes", std::string("ab") },
+		{ "zeros", std::string(200000, '\0') },
+		{ "random", test_bytes(100000, 1) },
+		{ "text", test_text(300000, 2) },
+		{ "mixed", test_text(50000, 3) + test_bytes(70000, 4) + std::string(40000, 'x') + test_text(50000, 3) },
+	};
+
+	struct { size_t chunk; size_t sync_every; } patterns[] = {
+		{ (size_t)-1, 0 },
+		{ 1000, 0 },
+		{ 7, 0 },
+		{ 4096, 10000 },
+		{ 65536, 1 },
+	};
+
+	int failures = 0;
+	int cases = 0;
+
+	for (auto& input : inputs)
+	{
+		for (int format = DEFLATE_FORMAT_ZLIB; format <= DEFLATE_FORMAT_GZIP; format++)
+		{
+			for (int level = 1; level <= 9; level++)
+			{
+				for (auto& pattern : patterns)
+				{
+					// Byte at a time feeding is only worth it on small inputs.
+					if (pattern.chunk == 7 && input.data.size() > 20000)
+						continue;
+
+					std::string compressed;
+					std::string decompressed;
+
+					cases++;
+
+					bool success = test_compress(input.data, (DeflateFormat)format, level, pattern.chunk, pattern.sync_every, &compressed)
+						&& test_decode(compressed, (DeflateFormat)format, &decompressed)
+						&& decompressed == input.data;
+
+					if (!success)
+					{
+						printf(
+							"FAIL %s %s level %d chunk %zu sync %zu\n", 
+							input.name, 
+							format == DEFLATE_FORMAT_GZIP ? "gzip" : "zlib", 
+							level, 
+							pattern.chunk, 
+							pattern.sync_every
+						);
+
+						failures++;
+					}
+				}
+			}
+		}
+	}
+
+	printf("%d of %d cases passed\n", cases - failures, cases);
+
+	return failures;
+}
+
+static int
+test_bench(const char* file_path)
+{
+	std::string input;
+
+	if (file_path)
+	{
+		FILE* file = nullptr;
+
+		if (fopen_s(&file, file_path, "rb") || !file)
+		{
+			printf("failed to open '%s'\n", file_path);
+			return 1;
+		}
+
+		char buffer[65536];
+		size_t length;
+
+		while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+			input.append(buffer, length);
+
+		fclose(file);
+	}
+	else
+	{
+		input = test_text(8 * 1024 * 1024, 5);
+	}
+
+	printf("%zu bytes\n", input.size());
+
+	for (int level = 1; level <= 9; level++)
+	{
+		std::string compressed;
+
+		auto start = std::chrono::steady_clock::now();
+		test_compress(input, DEFLATE_FORMAT_GZIP, level, 16384, 0, &compressed);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		printf(
+			"level %d: %6.1f MB/s, %5.1f%% of input\n", 
+			level, 
+			input.size() / 1e6 / seconds, 
+			100.0 * compressed.size() / (input.size() ? input.size() : 1)
+		);
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+	if (argc >= 2 && !strcmp(argv[1], "bench"))
+		return test_bench(argc >= 3 ? argv[2] : nullptr);
+
+	return test_run();
+}
@@ -0,0 +1,309 @@
+#include "shared.h"
+
+#define COMPRESSION_CACHE_BUCKETS 256
+
+// A single body may take at most this share of the cache, and never more
+// than the cap so its encoding always fits one response queue.
+#define COMPRESSION_CACHE_ENTRY_SHARE 8
+#define COMPRESSION_CACHE_MAX_ENTRY_SIZE (16 * 1024 * 1024)
+
+/**
+ * Compressed body keyed by what it was compressed from, along with the
+ * encoding and level. The hash only picks candidates, the source bytes
+ * follow the entry and are compared in full, then the compressed data.
+ */
+typedef struct _CompressionCacheEntry
+{
+	volatile LONG ref_count;
+
+	UINT64 hash;
+	UINT64 length;
+	DeflateFormat format;
+	int level;
+
+	// Tick count, written with interlocked exchanges under the shared lock.
+	volatile LONGLONG last_used;
+
+	size_t data_length;
+	struct _CompressionCacheEntry* next;
+} CompressionCacheEntry;
+
+// Process-wide, each entry holds one reference on its body.
+static SRWLOCK compression_cache_lock = SRWLOCK_INIT;
+static CompressionCacheEntry* compression_cache_buckets[COMPRESSION_CACHE_BUCKETS];
+static size_t compression_cache_size = 0;
+static size_t compression_cache_capacity = 0;
+
+static UINT64
+compression_cache_get_length(const HTTP_DATA_CHUNK* chunks, USHORT chunk_count)
+{
+	UINT64 length = 0;
+
+	for (USHORT i = 0; i < chunk_count; i++)
+	{
+		length += chunks[i].FromMemory.BufferLength;
+	}
+
+	return length;
+}
+
+static bool
+compression_cache_matches(
+	const CompressionCacheEntry* entry, 
+	UINT64 hash, 
+	UINT64 length, 
+	const HTTP_DATA_CHUNK* source, 
+	USHORT source_count, 
+	DeflateFormat format, 
+	int level
+)
+{
+	if (entry->hash != hash || entry->length != length || entry->format != format || entry->level != level)
+		return false;
+
+	const char* data = (const char*)(entry + 1);
+
+	for (USHORT i = 0; i < source_count; i++)
+	{
+		if (memcmp(data, source[i].FromMemory.pBuffer, source[i].FromMemory.BufferLength))
+			return false;
+
+		data += source[i].FromMemory.BufferLength;
+	}
+
+	return true;
+}
+
+/**
+ * Unlinks an entry and drops the cache's reference, expects the exclusive lock.
+ */
+static void
+compression_cache_remove(CompressionCacheEntry** link)
+{
+	CompressionCacheEntry* entry = *link;
+	*link = entry->next;
+
+	compression_cache_size -= (size_t)entry->length + entry->data_length;
+	compression_cache_release(entry);
+}
+
+/**
+ * Evicts the least recently used entry, expects the exclusive lock.
+ */
+static void
+compression_cache_evict()
+{
+	CompressionCacheEntry** oldest = nullptr;
+
+	for (DWORD i = 0; i < COMPRESSION_CACHE_BUCKETS; i++)
+	{
+		for (CompressionCacheEntry** link = &compression_cache_buckets[i]; *link; link = &(*link)->next)
+		{
+			if (!oldest || (*link)->last_used < (*oldest)->last_used)
+				oldest = link;
+		}
+	}
+
+	if (oldest)
+		compression_cache_remove(oldest);
+}
+
+/**
+ * FNV-1a, continue a hash by passing the previous result back in and start
+ * one with COMPRESSION_CACHE_HASH_SEED.
+ */
+UINT64
+compression_cache_hash(UINT64 hash, const char* data, size_t length)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Looks up the encoding of the memory chunks in source, hashed beforehand
+ * with compression_cache_hash.
+ */
+CompressionCacheEntry*
+compression_cache_acquire(
+	UINT64 hash, 
+	const HTTP_DATA_CHUNK* source, 
+	USHORT source_count, 
+	DeflateFormat format, 
+	int level
+)
+{
+	CompressionCacheEntry* entry = nullptr;
+	UINT64 length = compression_cache_get_length(source, source_count);
+
+	AcquireSRWLockShared(&compression_cache_lock);
+
+	for (CompressionCacheEntry* candidate = compression_cache_buckets[hash % COMPRESSION_CACHE_BUCKETS]; candidate; candidate = candidate->next)
+	{
+		if (compression_cache_matches(candidate, hash, length, source, source_count, format, level))
+		{
+			InterlockedIncrement(&candidate->ref_count);
+			InterlockedExchange64(&candidate->last_used, (LONGLONG)GetTickCount64());
+
+			entry = candidate;
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&compression_cache_lock);
+
+	return entry;
+}
+
+CompressionCacheEntry*
+compression_cache_release(CompressionCacheEntry* entry)
+{
+	if (entry && InterlockedDecrement(&entry->ref_count) == 0)
+	{
+		free(entry);
+	}
+
+	return nullptr;
+}
+
+const char*
+compression_cache_get_data(const CompressionCacheEntry* entry, size_t* length)
+{
+	assert(entry != nullptr);
+	assert(length != nullptr);
+
+	*length = entry ? entry->data_length : 0;
+
+	return entry ? (const char*)(entry + 1) + entry->length : nullptr;
+}
+
+/**
+ * Copies a source body and its encoding into the cache, replacing any
+ * entry with the same key. Sources larger than the per-entry share are
+ * not kept. Both sets of chunks have to be in memory.
+ */
+void
+compression_cache_insert(
+	UINT64 hash,
+	const HTTP_DATA_CHUNK* source,
+	USHORT source_count,
+	DeflateFormat format,
+	int level,
+	const HTTP_DATA_CHUNK* chunks,
+	USHORT chunk_count
+)
+{
+	size_t length = (size_t)compression_cache_get_length(source, source_count);
+	size_t data_length = (size_t)compression_cache_get_length(chunks, chunk_count);
+
+	for (USHORT i = 0; i < source_count; i++)
+	{
+		if (source[i].DataChunkType != HttpDataChunkFromMemory)
+			return;
+	}
+
+	for (USHORT i = 0; i < chunk_count; i++)
+	{
+		if (chunks[i].DataChunkType != HttpDataChunkFromMemory)
+			return;
+	}
+
+	if (!data_length || length > compression_cache_get_max_entry_size())
+		return;
+
+	CompressionCacheEntry* entry = (CompressionCacheEntry*)malloc(sizeof(CompressionCacheEntry) + length + data_length);
+
+	if (!entry)
+		return;
+
+	entry->ref_count = 1;
+	entry->hash = hash;
+	entry->length = length;
+	entry->format = format;
+	entry->level = level;
+	entry->last_used = (LONGLONG)GetTickCount64();
+	entry->data_length = data_length;
+	entry->next = nullptr;
+
+	char* data = (char*)(entry + 1);
+
+	for (USHORT i = 0; i < source_count; i++)
+	{
+		memcpy(data, source[i].FromMemory.pBuffer, source[i].FromMemory.BufferLength);
+		data += source[i].FromMemory.BufferLength;
+	}
+
+	for (USHORT i = 0; i < chunk_count; i++)
+	{
+		memcpy(data, chunks[i].FromMemory.pBuffer, chunks[i].FromMemory.BufferLength);
+		data += chunks[i].FromMemory.BufferLength;
+	}
+
+	AcquireSRWLockExclusive(&compression_cache_lock);
+
+	for (CompressionCacheEntry** link = &compression_cache_buckets[hash % COMPRESSION_CACHE_BUCKETS]; *link; link = &(*link)->next)
+	{
+		if (compression_cache_matches(*link, hash, length, source, source_count, format, level))
+		{
+			compression_cache_remove(link);
+			break;
+		}
+	}
+
+	while (compression_cache_size && compression_cache_size + length + data_length > compression_cache_capacity)
+	{
+		compression_cache_evict();
+	}
+
+	entry->next = compression_cache_buckets[hash % COMPRESSION_CACHE_BUCKETS];
+	compression_cache_buckets[hash % COMPRESSION_CACHE_BUCKETS] = entry;
+	compression_cache_size += length + data_length;
+
+	ReleaseSRWLockExclusive(&compression_cache_lock);
+}
+
+size_t
+compression_cache_get_max_entry_size()
+{
+	return min(compression_cache_capacity / COMPRESSION_CACHE_ENTRY_SHARE, (size_t)COMPRESSION_CACHE_MAX_ENTRY_SIZE);
+}
+
+/**
+ * Bounds the bytes kept, sources included, a capacity of zero disables caching.
+ */
+void
+compression_cache_set_capacity(size_t capacity)
+{
+	AcquireSRWLockExclusive(&compression_cache_lock);
+
+	compression_cache_capacity = capacity;
+
+	while (compression_cache_size > compression_cache_capacity)
+	{
+		compression_cache_evict();
+	}
+
+	ReleaseSRWLockExclusive(&compression_cache_lock);
+}
+
+void
+compression_cache_clear()
+{
+	AcquireSRWLockExclusive(&compression_cache_lock);
+
+	for (DWORD i = 0; i < COMPRESSION_CACHE_BUCKETS; i++)
+	{
+		while (compression_cache_buckets[i])
+		{
+			compression_cache_remove(&compression_cache_buckets[i]);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&compression_cache_lock);
+}
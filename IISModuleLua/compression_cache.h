@@ -0,0 +1,35 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _COMPRESSION_CACHE
+#define _COMPRESSION_CACHE
+
+#define COMPRESSION_CACHE_HASH_SEED 14695981039346656037ULL
+
+typedef struct _CompressionCacheEntry CompressionCacheEntry;
+
+UINT64 compression_cache_hash(UINT64 hash, const char* data, size_t length);
+CompressionCacheEntry* compression_cache_acquire(
+	UINT64 hash, 
+	const HTTP_DATA_CHUNK* source, 
+	USHORT source_count, 
+	DeflateFormat format, 
+	int level
+);
+CompressionCacheEntry* compression_cache_release(CompressionCacheEntry* entry);
+const char* compression_cache_get_data(const CompressionCacheEntry* entry, size_t* length);
+void compression_cache_insert(
+	UINT64 hash, 
+	const HTTP_DATA_CHUNK* source, 
+	USHORT source_count, 
+	DeflateFormat format, 
+	int level, 
+	const HTTP_DATA_CHUNK* chunks, 
+	USHORT chunk_count
+);
+
+size_t compression_cache_get_max_entry_size();
+void compression_cache_set_capacity(size_t capacity);
+void compression_cache_clear();
+
+#endif
@@ -0,0 +1,1162 @@
+#include "shared.h"
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define DEFLATE_BUFFER_SIZE (2 * DEFLATE_WINDOW_SIZE)
+
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+
+// Short matches far away cost more than the literals they replace.
+#define DEFLATE_TOO_FAR 4096
+
+#define DEFLATE_SYMBOL_COUNT 16384
+#define DEFLATE_OUTPUT_SIZE 16384
+#define DEFLATE_MAX_STORED 65535
+
+#define DEFLATE_LITLEN_CODES 286
+#define DEFLATE_DIST_CODES 30
+#define DEFLATE_CLEN_CODES 19
+#define DEFLATE_MAX_BITS 15
+#define DEFLATE_MAX_CLEN_BITS 7
+#define DEFLATE_END_OF_BLOCK 256
+
+typedef struct _DeflateLevel
+{
+	UINT32 good_length;
+	// Lazy levels stop looking for a better match past this, greedy levels
+	// stop inserting the strings inside a match past it.
+	UINT32 max_lazy;
+	UINT32 nice_length;
+	UINT32 max_chain;
+	bool lazy;
+} DeflateLevel;
+
+// Same trade-offs as zlib's levels so the numbers mean what operators expect.
+static const DeflateLevel deflate_levels[] =
+{
+	{ 0, 0, 0, 0, false },
+	{ 4, 4, 8, 4, false },
+	{ 4, 5, 16, 8, false },
+	{ 4, 6, 32, 32, false },
+	{ 4, 4, 16, 16, true },
+	{ 8, 16, 32, 32, true },
+	{ 8, 16, 128, 128, true },
+	{ 8, 32, 128, 256, true },
+	{ 32, 128, 258, 1024, true },
+	{ 32, 258, 258, 4096, true },
+};
+
+static const UINT16 deflate_length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const UINT8 deflate_length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const UINT16 deflate_dist_base[DEFLATE_DIST_CODES] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const UINT8 deflate_dist_extra[DEFLATE_DIST_CODES] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const UINT8 deflate_clen_order[DEFLATE_CLEN_CODES] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/**
+ * LZ77 over a 32 KB window with hash chains, emitted as whichever of a
+ * dynamic Huffman, fixed Huffman or stored block is smallest. Positions
+ * are stream offsets plus one, zero meaning none, and only ever compared
+ * by their distance so they are free to wrap.
+ */
+typedef struct _Deflate
+{
+	DeflateFormat format;
+	const DeflateLevel* level;
+	int level_number;
+
+	DeflateSink sink;
+	void* context;
+
+	bool header_written;
+	bool finished;
+	bool failed;
+
+	UINT32 checksum;
+	UINT32 total_in;
+
+	unsigned char window[DEFLATE_BUFFER_SIZE];
+	UINT32 window_start;
+	UINT32 strstart;
+	UINT32 end;
+
+	UINT32 head[DEFLATE_HASH_SIZE];
+	UINT32 prev[DEFLATE_WINDOW_SIZE];
+
+	// Lazy matching state, see deflate_compress_lazy.
+	UINT32 match_length;
+	UINT32 match_start;
+	UINT32 prev_length;
+	UINT32 prev_match;
+	bool match_available;
+
+	// Symbols of the current block, a zero distance marks a literal.
+	UINT16 sym_litlen[DEFLATE_SYMBOL_COUNT];
+	UINT16 sym_dist[DEFLATE_SYMBOL_COUNT];
+	UINT32 sym_count;
+	UINT32 block_start;
+
+	UINT32 litlen_freq[DEFLATE_LITLEN_CODES];
+	UINT32 dist_freq[DEFLATE_DIST_CODES];
+
+	UINT8 length_code[256];
+	UINT8 dist_code[512];
+	UINT32 crc_table[256];
+
+	UINT64 bit_buffer;
+	UINT32 bit_count;
+
+	unsigned char output[DEFLATE_OUTPUT_SIZE];
+	size_t output_used;
+} Deflate;
+
+//////////////////////////////////////////////////////////////////////////////
+// Output
+//////////////////////////////////////////////////////////////////////////////
+
+static void
+deflate_flush_output(Deflate* deflate)
+{
+	if (deflate->output_used && !deflate->failed)
+	{
+		if (!deflate->sink(deflate->context, (const char*)deflate->output, deflate->output_used))
+			deflate->failed = true;
+	}
+
+	deflate->output_used = 0;
+}
+
+static void
+deflate_put_byte(Deflate* deflate, unsigned char value)
+{
+	if (deflate->output_used == DEFLATE_OUTPUT_SIZE)
+		deflate_flush_output(deflate);
+
+	deflate->output[deflate->output_used++] = value;
+}
+
+static void
+deflate_put_bits(Deflate* deflate, UINT32 value, UINT32 count)
+{
+	deflate->bit_buffer |= (UINT64)value << deflate->bit_count;
+	deflate->bit_count += count;
+
+	if (deflate->bit_count >= 32)
+	{
+		deflate_put_byte(deflate, (unsigned char)deflate->bit_buffer);
+		deflate_put_byte(deflate, (unsigned char)(deflate->bit_buffer >> 8));
+		deflate_put_byte(deflate, (unsigned char)(deflate->bit_buffer >> 16));
+		deflate_put_byte(deflate, (unsigned char)(deflate->bit_buffer >> 24));
+
+		deflate->bit_buffer >>= 32;
+		deflate->bit_count -= 32;
+	}
+}
+
+static void
+deflate_align(Deflate* deflate)
+{
+	deflate_put_bits(deflate, 0, (8 - (deflate->bit_count & 7)) & 7);
+
+	while (deflate->bit_count)
+	{
+		deflate_put_byte(deflate, (unsigned char)deflate->bit_buffer);
+
+		deflate->bit_buffer >>= 8;
+		deflate->bit_count -= 8;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Checksums
+//////////////////////////////////////////////////////////////////////////////
+
+static void
+deflate_update_checksum(Deflate* deflate, const unsigned char* data, size_t length)
+{
+	if (deflate->format == DEFLATE_FORMAT_GZIP)
+	{
+		UINT32 crc = ~deflate->checksum;
+
+		for (size_t i = 0; i < length; i++)
+			crc = deflate->crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+		deflate->checksum = ~crc;
+	}
+	else
+	{
+		UINT32 a = deflate->checksum & 0xFFFF;
+		UINT32 b = deflate->checksum >> 16;
+
+		while (length)
+		{
+			// Largest run before b can overflow 32 bits.
+			size_t run = length < 5552 ? length : 5552;
+			length -= run;
+
+			for (size_t i = 0; i < run; i++)
+			{
+				a += *data++;
+				b += a;
+			}
+
+			a %= 65521;
+			b %= 65521;
+		}
+
+		deflate->checksum = (b << 16) | a;
+	}
+}
+
+static void
+deflate_write_header(Deflate* deflate)
+{
+	if (deflate->format == DEFLATE_FORMAT_GZIP)
+	{
+		static const unsigned char header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+
+		for (size_t i = 0; i < sizeof(header); i++)
+			deflate_put_byte(deflate, header[i]);
+	}
+	else
+	{
+		UINT32 cmf = 0x78;
+		UINT32 flevel = deflate->level_number < 2 ? 0 : deflate->level_number < 6 ? 1 : deflate->level_number == 6 ? 2 : 3;
+		UINT32 flg = flevel << 6;
+
+		flg += (31 - (cmf * 256 + flg) % 31) % 31;
+
+		deflate_put_byte(deflate, (unsigned char)cmf);
+		deflate_put_byte(deflate, (unsigned char)flg);
+	}
+
+	deflate->header_written = true;
+}
+
+static void
+deflate_write_trailer(Deflate* deflate)
+{
+	if (deflate->format == DEFLATE_FORMAT_GZIP)
+	{
+		for (int shift = 0; shift < 32; shift += 8)
+			deflate_put_byte(deflate, (unsigned char)(deflate->checksum >> shift));
+
+		for (int shift = 0; shift < 32; shift += 8)
+			deflate_put_byte(deflate, (unsigned char)(deflate->total_in >> shift));
+	}
+	else
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			deflate_put_byte(deflate, (unsigned char)(deflate->checksum >> shift));
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Huffman codes
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Builds code lengths no longer than max_bits. Overlong trees are rebuilt
+ * from halved frequencies, which converges quickly and costs next to
+ * nothing on real content.
+ */
+static void
+deflate_build_lengths(const UINT32* freq, UINT32 count, UINT32 max_bits, UINT8* lengths)
+{
+	UINT32 weights[DEFLATE_LITLEN_CODES];
+	UINT16 leaves[DEFLATE_LITLEN_CODES];
+	UINT32 node_weights[2 * DEFLATE_LITLEN_CODES];
+	UINT16 parents[2 * DEFLATE_LITLEN_CODES];
+	UINT8 depths[2 * DEFLATE_LITLEN_CODES];
+
+	memcpy(weights, freq, count * sizeof(UINT32));
+
+	while (true)
+	{
+		memset(lengths, 0, count);
+
+		UINT32 leaf_count = 0;
+
+		// Insertion sort by weight, ties by symbol, alphabets are at most 286 long.
+		for (UINT32 symbol = 0; symbol < count; symbol++)
+		{
+			if (!weights[symbol])
+				continue;
+
+			UINT32 position = leaf_count++;
+
+			while (position && weights[leaves[position - 1]] > weights[symbol])
+			{
+				leaves[position] = leaves[position - 1];
+				position--;
+			}
+
+			leaves[position] = (UINT16)symbol;
+		}
+
+		if (!leaf_count)
+			return;
+
+		if (leaf_count == 1)
+		{
+			lengths[leaves[0]] = 1;
+			return;
+		}
+
+		// Two queue construction, leaves are nodes 0..n-1 and internal nodes
+		// follow in order of creation, so their weights never decrease.
+		for (UINT32 i = 0; i < leaf_count; i++)
+			node_weights[i] = weights[leaves[i]];
+
+		UINT32 next_leaf = 0;
+		UINT32 next_internal = leaf_count;
+		UINT32 node_count = leaf_count;
+
+		for (UINT32 i = 0; i < leaf_count - 1; i++)
+		{
+			UINT32 children[2];
+
+			for (int j = 0; j < 2; j++)
+			{
+				if (next_leaf < leaf_count
+					&& (next_internal == node_count || node_weights[next_leaf] <= node_weights[next_internal]))
+				{
+					children[j] = next_leaf++;
+				}
+				else
+				{
+					children[j] = next_internal++;
+				}
+			}
+
+			node_weights[node_count] = node_weights[children[0]] + node_weights[children[1]];
+			parents[children[0]] = (UINT16)node_count;
+			parents[children[1]] = (UINT16)node_count;
+
+			node_count++;
+		}
+
+		// Parents always come after their children, so one backwards pass sets every depth.
+		UINT32 max_depth = 0;
+		depths[node_count - 1] = 0;
+
+		for (UINT32 node = node_count - 1; node-- > 0;)
+		{
+			depths[node] = depths[parents[node]] + 1;
+
+			if (node < leaf_count && depths[node] > max_depth)
+				max_depth = depths[node];
+		}
+
+		if (max_depth <= max_bits)
+		{
+			for (UINT32 i = 0; i < leaf_count; i++)
+				lengths[leaves[i]] = depths[i];
+
+			return;
+		}
+
+		for (UINT32 symbol = 0; symbol < count; symbol++)
+		{
+			if (weights[symbol])
+				weights[symbol] = (weights[symbol] >> 1) | 1;
+		}
+	}
+}
+
+/**
+ * Canonical codes, bit reversed because deflate writes them from the most
+ * significant bit while everything else goes out least significant first.
+ */
+static void
+deflate_build_codes(const UINT8* lengths, UINT32 count, UINT16* codes)
+{
+	UINT16 length_count[DEFLATE_MAX_BITS + 1] = { 0 };
+	UINT16 next_code[DEFLATE_MAX_BITS + 1] = { 0 };
+
+	for (UINT32 i = 0; i < count; i++)
+		length_count[lengths[i]]++;
+
+	length_count[0] = 0;
+
+	UINT16 code = 0;
+
+	for (UINT32 bits = 1; bits <= DEFLATE_MAX_BITS; bits++)
+	{
+		code = (code + length_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+
+	for (UINT32 i = 0; i < count; i++)
+	{
+		UINT32 length = lengths[i];
+
+		if (!length)
+			continue;
+
+		UINT32 value = next_code[length]++;
+		UINT32 reversed = 0;
+
+		for (UINT32 bit = 0; bit < length; bit++)
+		{
+			reversed = (reversed << 1) | (value & 1);
+			value >>= 1;
+		}
+
+		codes[i] = (UINT16)reversed;
+	}
+}
+
+static void
+deflate_fixed_lengths(UINT8* litlen_lengths, UINT8* dist_lengths)
+{
+	for (UINT32 i = 0; i < 288; i++)
+		litlen_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+
+	for (UINT32 i = 0; i < 32; i++)
+		dist_lengths[i] = 5;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Blocks
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct _DeflateClen
+{
+	UINT8 symbol;
+	UINT8 extra;
+} DeflateClen;
+
+/**
+ * Run length codes for the concatenated code lengths, 16 repeats the last
+ * length, 17 and 18 are short and long runs of zeros.
+ */
+static UINT32
+deflate_encode_lengths(const UINT8* lengths, UINT32 count, DeflateClen* output)
+{
+	UINT32 output_count = 0;
+	UINT32 i = 0;
+
+	while (i < count)
+	{
+		UINT8 length = lengths[i];
+		UINT32 run = 1;
+
+		while (i + run < count && lengths[i + run] == length)
+			run++;
+
+		i += run;
+
+		if (!length)
+		{
+			while (run >= 11)
+			{
+				UINT32 chunk = run < 138 ? run : 138;
+
+				output[output_count++] = { 18, (UINT8)(chunk - 11) };
+				run -= chunk;
+			}
+
+			if (run >= 3)
+			{
+				output[output_count++] = { 17, (UINT8)(run - 3) };
+				run = 0;
+			}
+		}
+		else
+		{
+			output[output_count++] = { length, 0 };
+			run--;
+
+			while (run >= 3)
+			{
+				UINT32 chunk = run < 6 ? run : 6;
+
+				output[output_count++] = { 16, (UINT8)(chunk - 3) };
+				run -= chunk;
+			}
+		}
+
+		while (run--)
+			output[output_count++] = { length, 0 };
+	}
+
+	return output_count;
+}
+
+static UINT64
+deflate_data_bits(const Deflate* deflate, const UINT8* litlen_lengths, const UINT8* dist_lengths)
+{
+	UINT64 bits = 0;
+
+	for (UINT32 i = 0; i < DEFLATE_LITLEN_CODES; i++)
+	{
+		bits += (UINT64)deflate->litlen_freq[i] * litlen_lengths[i];
+
+		if (i > DEFLATE_END_OF_BLOCK)
+			bits += (UINT64)deflate->litlen_freq[i] * deflate_length_extra[i - DEFLATE_END_OF_BLOCK - 1];
+	}
+
+	for (UINT32 i = 0; i < DEFLATE_DIST_CODES; i++)
+		bits += (UINT64)deflate->dist_freq[i] * (dist_lengths[i] + deflate_dist_extra[i]);
+
+	return bits;
+}
+
+static void
+deflate_write_symbols(Deflate* deflate, const UINT8* litlen_lengths, const UINT16* litlen_codes, const UINT8* dist_lengths, const UINT16* dist_codes)
+{
+	for (UINT32 i = 0; i < deflate->sym_count; i++)
+	{
+		UINT32 dist = deflate->sym_dist[i];
+		UINT32 litlen = deflate->sym_litlen[i];
+
+		if (!dist)
+		{
+			deflate_put_bits(deflate, litlen_codes[litlen], litlen_lengths[litlen]);
+			continue;
+		}
+
+		UINT32 code = deflate->length_code[litlen - DEFLATE_MIN_MATCH];
+		UINT32 symbol = code + DEFLATE_END_OF_BLOCK + 1;
+
+		deflate_put_bits(deflate, litlen_codes[symbol], litlen_lengths[symbol]);
+		deflate_put_bits(deflate, litlen - deflate_length_base[code], deflate_length_extra[code]);
+
+		dist--;
+		code = dist < 256 ? deflate->dist_code[dist] : deflate->dist_code[256 + (dist >> 7)];
+
+		deflate_put_bits(deflate, dist_codes[code], dist_lengths[code]);
+		deflate_put_bits(deflate, dist + 1 - deflate_dist_base[code], deflate_dist_extra[code]);
+	}
+
+	deflate_put_bits(deflate, litlen_codes[DEFLATE_END_OF_BLOCK], litlen_lengths[DEFLATE_END_OF_BLOCK]);
+}
+
+static void
+deflate_write_stored(Deflate* deflate, const unsigned char* data, UINT32 length, bool final)
+{
+	do
+	{
+		UINT32 chunk = length < DEFLATE_MAX_STORED ? length : DEFLATE_MAX_STORED;
+		length -= chunk;
+
+		deflate_put_bits(deflate, final && !length, 1);
+		deflate_put_bits(deflate, 0, 2);
+		deflate_align(deflate);
+
+		deflate_put_byte(deflate, (unsigned char)chunk);
+		deflate_put_byte(deflate, (unsigned char)(chunk >> 8));
+		deflate_put_byte(deflate, (unsigned char)~chunk);
+		deflate_put_byte(deflate, (unsigned char)(~chunk >> 8));
+
+		for (UINT32 i = 0; i < chunk; i++)
+			deflate_put_byte(deflate, data[i]);
+
+		data += chunk;
+	} while (length);
+}
+
+/**
+ * Writes the pending symbols as one block, in whichever encoding is
+ * smallest. Stored blocks are only an option while the block's bytes are
+ * still in the window.
+ */
+static void
+deflate_write_block(Deflate* deflate, bool final)
+{
+	deflate->litlen_freq[DEFLATE_END_OF_BLOCK]++;
+
+	UINT8 fixed_litlen_lengths[288];
+	UINT8 fixed_dist_lengths[32];
+	deflate_fixed_lengths(fixed_litlen_lengths, fixed_dist_lengths);
+
+	UINT64 fixed_bits = 3 + deflate_data_bits(deflate, fixed_litlen_lengths, fixed_dist_lengths);
+
+	// Decoders expect at least two codes in each tree, as zlib always sends.
+	UINT32 litlen_freq[DEFLATE_LITLEN_CODES];
+	UINT32 dist_freq[DEFLATE_DIST_CODES];
+
+	memcpy(litlen_freq, deflate->litlen_freq, sizeof(litlen_freq));
+	memcpy(dist_freq, deflate->dist_freq, sizeof(dist_freq));
+
+	UINT32 litlen_used = 0, dist_used = 0;
+
+	for (UINT32 i = 0; i < DEFLATE_LITLEN_CODES; i++)
+		litlen_used += litlen_freq[i] != 0;
+
+	for (UINT32 i = 0; i < DEFLATE_DIST_CODES; i++)
+		dist_used += dist_freq[i] != 0;
+
+	for (UINT32 i = 0; litlen_used < 2; i++)
+	{
+		if (!litlen_freq[i])
+		{
+			litlen_freq[i] = 1;
+			litlen_used++;
+		}
+	}
+
+	for (UINT32 i = 0; dist_used < 2; i++)
+	{
+		if (!dist_freq[i])
+		{
+			dist_freq[i] = 1;
+			dist_used++;
+		}
+	}
+
+	UINT8 litlen_lengths[DEFLATE_LITLEN_CODES];
+	UINT8 dist_lengths[DEFLATE_DIST_CODES];
+
+	deflate_build_lengths(litlen_freq, DEFLATE_LITLEN_CODES, DEFLATE_MAX_BITS, litlen_lengths);
+	deflate_build_lengths(dist_freq, DEFLATE_DIST_CODES, DEFLATE_MAX_BITS, dist_lengths);
+
+	UINT32 hlit = DEFLATE_LITLEN_CODES;
+	while (hlit > 257 && !litlen_lengths[hlit - 1])
+		hlit--;
+
+	UINT32 hdist = DEFLATE_DIST_CODES;
+	while (hdist > 1 && !dist_lengths[hdist - 1])
+		hdist--;
+
+	UINT8 all_lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+	memcpy(all_lengths, litlen_lengths, hlit);
+	memcpy(all_lengths + hlit, dist_lengths, hdist);
+
+	DeflateClen clens[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+	UINT32 clen_count = deflate_encode_lengths(all_lengths, hlit + hdist, clens);
+
+	UINT32 clen_freq[DEFLATE_CLEN_CODES] = { 0 };
+
+	for (UINT32 i = 0; i < clen_count; i++)
+		clen_freq[clens[i].symbol]++;
+
+	UINT8 clen_lengths[DEFLATE_CLEN_CODES];
+	deflate_build_lengths(clen_freq, DEFLATE_CLEN_CODES, DEFLATE_MAX_CLEN_BITS, clen_lengths);
+
+	UINT32 hclen = DEFLATE_CLEN_CODES;
+	while (hclen > 4 && !clen_lengths[deflate_clen_order[hclen - 1]])
+		hclen--;
+
+	UINT64 dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + deflate_data_bits(deflate, litlen_lengths, dist_lengths);
+
+	for (UINT32 i = 0; i < DEFLATE_CLEN_CODES; i++)
+		dynamic_bits += (UINT64)clen_freq[i] * clen_lengths[i];
+
+	dynamic_bits += clen_freq[16] * 2 + clen_freq[17] * 3 + clen_freq[18] * 7;
+
+	// Stored blocks pay for alignment and a four byte header per 64 KB.
+	UINT32 raw_length = deflate->strstart - deflate->block_start;
+	bool stored_possible = deflate->block_start - deflate->window_start <= deflate->strstart - deflate->window_start;
+	UINT64 stored_bits = ((UINT64)raw_length + 5 * (raw_length / DEFLATE_MAX_STORED + 1)) * 8;
+
+	if (stored_possible && stored_bits <= fixed_bits && stored_bits <= dynamic_bits)
+	{
+		deflate_write_stored(
+			deflate,
+			deflate->window + (deflate->block_start - deflate->window_start),
+			raw_length,
+			final
+		);
+	}
+	else if (fixed_bits <= dynamic_bits)
+	{
+		UINT16 litlen_codes[288];
+		UINT16 dist_codes[32];
+
+		deflate_build_codes(fixed_litlen_lengths, 288, litlen_codes);
+		deflate_build_codes(fixed_dist_lengths, 32, dist_codes);
+
+		deflate_put_bits(deflate, final, 1);
+		deflate_put_bits(deflate, 1, 2);
+
+		deflate_write_symbols(deflate, fixed_litlen_lengths, litlen_codes, fixed_dist_lengths, dist_codes);
+	}
+	else
+	{
+		UINT16 litlen_codes[DEFLATE_LITLEN_CODES];
+		UINT16 dist_codes[DEFLATE_DIST_CODES];
+		UINT16 clen_codes[DEFLATE_CLEN_CODES];
+
+		deflate_build_codes(litlen_lengths, DEFLATE_LITLEN_CODES, litlen_codes);
+		deflate_build_codes(dist_lengths, DEFLATE_DIST_CODES, dist_codes);
+		deflate_build_codes(clen_lengths, DEFLATE_CLEN_CODES, clen_codes);
+
+		deflate_put_bits(deflate, final, 1);
+		deflate_put_bits(deflate, 2, 2);
+		deflate_put_bits(deflate, hlit - 257, 5);
+		deflate_put_bits(deflate, hdist - 1, 5);
+		deflate_put_bits(deflate, hclen - 4, 4);
+
+		for (UINT32 i = 0; i < hclen; i++)
+			deflate_put_bits(deflate, clen_lengths[deflate_clen_order[i]], 3);
+
+		for (UINT32 i = 0; i < clen_count; i++)
+		{
+			UINT32 symbol = clens[i].symbol;
+
+			deflate_put_bits(deflate, clen_codes[symbol], clen_lengths[symbol]);
+
+			if (symbol >= 16)
+				deflate_put_bits(deflate, clens[i].extra, symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+		}
+
+		deflate_write_symbols(deflate, litlen_lengths, litlen_codes, dist_lengths, dist_codes);
+	}
+
+	memset(deflate->litlen_freq, 0, sizeof(deflate->litlen_freq));
+	memset(deflate->dist_freq, 0, sizeof(deflate->dist_freq));
+
+	deflate->sym_count = 0;
+	deflate->block_start = deflate->strstart;
+}
+
+static bool
+deflate_tally_literal(Deflate* deflate, unsigned char literal)
+{
+	deflate->sym_litlen[deflate->sym_count] = literal;
+	deflate->sym_dist[deflate->sym_count] = 0;
+	deflate->sym_count++;
+
+	deflate->litlen_freq[literal]++;
+
+	return deflate->sym_count == DEFLATE_SYMBOL_COUNT;
+}
+
+static bool
+deflate_tally_match(Deflate* deflate, UINT32 dist, UINT32 length)
+{
+	deflate->sym_litlen[deflate->sym_count] = (UINT16)length;
+	deflate->sym_dist[deflate->sym_count] = (UINT16)dist;
+	deflate->sym_count++;
+
+	dist--;
+
+	deflate->litlen_freq[deflate->length_code[length - DEFLATE_MIN_MATCH] + DEFLATE_END_OF_BLOCK + 1]++;
+	deflate->dist_freq[dist < 256 ? deflate->dist_code[dist] : deflate->dist_code[256 + (dist >> 7)]]++;
+
+	return deflate->sym_count == DEFLATE_SYMBOL_COUNT;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Matching
+//////////////////////////////////////////////////////////////////////////////
+
+static unsigned char*
+deflate_at(Deflate* deflate, UINT32 position)
+{
+	return deflate->window + (position - deflate->window_start);
+}
+
+/**
+ * Links the string at position into its hash chain and returns the
+ * previous head, or zero. Needs three bytes of lookahead.
+ */
+static UINT32
+deflate_insert(Deflate* deflate, UINT32 position)
+{
+	const unsigned char* bytes = deflate_at(deflate, position);
+	UINT32 hash = ((bytes[0] | (bytes[1] << 8) | (bytes[2] << 16)) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+
+	UINT32 head = deflate->head[hash];
+
+	deflate->prev[position & DEFLATE_WINDOW_MASK] = head;
+	deflate->head[hash] = position + 1;
+
+	return head;
+}
+
+/**
+ * Walks the chain from head and returns the longest match better than
+ * threshold, storing its position in match_start, or MIN_MATCH - 1.
+ */
+static UINT32
+deflate_longest_match(Deflate* deflate, UINT32 head, UINT32 threshold)
+{
+	UINT32 lookahead = deflate->end - deflate->strstart;
+	UINT32 max_length = lookahead < DEFLATE_MAX_MATCH ? lookahead : DEFLATE_MAX_MATCH;
+	UINT32 nice_length = deflate->level->nice_length < max_length ? deflate->level->nice_length : max_length;
+	UINT32 max_dist = deflate->strstart - deflate->window_start;
+	UINT32 chain = deflate->level->max_chain;
+
+	if (max_dist > DEFLATE_WINDOW_SIZE)
+		max_dist = DEFLATE_WINDOW_SIZE;
+
+	if (threshold >= max_length)
+		return DEFLATE_MIN_MATCH - 1;
+
+	if (threshold >= deflate->level->good_length)
+		chain >>= 2;
+
+	const unsigned char* scan = deflate_at(deflate, deflate->strstart);
+	UINT32 best_length = threshold;
+	UINT32 last_dist = 0;
+
+	while (head && chain--)
+	{
+		UINT32 candidate = head - 1;
+		UINT32 dist = deflate->strstart - candidate;
+
+		// Chains only ever point backwards, anything else is a stale slot.
+		if (dist <= last_dist || dist > max_dist)
+			break;
+
+		last_dist = dist;
+
+		const unsigned char* match = deflate_at(deflate, candidate);
+
+		if (match[best_length] == scan[best_length] && match[0] == scan[0] && match[1] == scan[1])
+		{
+			UINT32 length = 2;
+
+			while (length < max_length && match[length] == scan[length])
+				length++;
+
+			if (length > best_length)
+			{
+				best_length = length;
+				deflate->match_start = candidate;
+
+				if (length >= nice_length)
+					break;
+			}
+		}
+
+		head = deflate->prev[candidate & DEFLATE_WINDOW_MASK];
+	}
+
+	return best_length > threshold ? best_length : DEFLATE_MIN_MATCH - 1;
+}
+
+/**
+ * Greedy matching for the fast levels, every match is taken as found.
+ */
+static void
+deflate_compress_greedy(Deflate* deflate, bool flush)
+{
+	while (true)
+	{
+		UINT32 lookahead = deflate->end - deflate->strstart;
+
+		if (!lookahead || (lookahead < DEFLATE_MIN_LOOKAHEAD && !flush))
+			return;
+
+		UINT32 head = lookahead >= DEFLATE_MIN_MATCH ? deflate_insert(deflate, deflate->strstart) : 0;
+		UINT32 match_length = head ? deflate_longest_match(deflate, head, DEFLATE_MIN_MATCH - 1) : DEFLATE_MIN_MATCH - 1;
+
+		bool full;
+
+		if (match_length >= DEFLATE_MIN_MATCH)
+		{
+			full = deflate_tally_match(deflate, deflate->strstart - deflate->match_start, match_length);
+
+			if (match_length <= deflate->level->max_lazy && lookahead - match_length >= DEFLATE_MIN_MATCH)
+			{
+				while (--match_length)
+					deflate_insert(deflate, ++deflate->strstart);
+
+				deflate->strstart++;
+			}
+			else
+			{
+				deflate->strstart += match_length;
+			}
+		}
+		else
+		{
+			full = deflate_tally_literal(deflate, *deflate_at(deflate, deflate->strstart));
+			deflate->strstart++;
+		}
+
+		if (full)
+			deflate_write_block(deflate, false);
+	}
+}
+
+/**
+ * Lazy matching, a match is only taken once the next position has been
+ * shown not to start a longer one.
+ */
+static void
+deflate_compress_lazy(Deflate* deflate, bool flush)
+{
+	while (true)
+	{
+		UINT32 lookahead = deflate->end - deflate->strstart;
+
+		if (!lookahead || (lookahead < DEFLATE_MIN_LOOKAHEAD && !flush))
+			return;
+
+		UINT32 head = lookahead >= DEFLATE_MIN_MATCH ? deflate_insert(deflate, deflate->strstart) : 0;
+
+		deflate->prev_length = deflate->match_length;
+		deflate->prev_match = deflate->match_start;
+		deflate->match_length = DEFLATE_MIN_MATCH - 1;
+
+		if (head && deflate->prev_length < deflate->level->max_lazy)
+		{
+			deflate->match_length = deflate_longest_match(deflate, head, deflate->prev_length);
+
+			if (deflate->match_length == DEFLATE_MIN_MATCH
+				&& deflate->strstart - deflate->match_start > DEFLATE_TOO_FAR)
+			{
+				deflate->match_length = DEFLATE_MIN_MATCH - 1;
+			}
+		}
+
+		if (deflate->prev_length >= DEFLATE_MIN_MATCH && deflate->match_length <= deflate->prev_length)
+		{
+			// The previous position's match wins, it starts one byte back.
+			UINT32 max_insert = deflate->end - DEFLATE_MIN_MATCH;
+
+			bool full = deflate_tally_match(
+				deflate,
+				deflate->strstart - 1 - deflate->prev_match,
+				deflate->prev_length
+			);
+
+			// The current position is already inserted.
+			UINT32 remaining = deflate->prev_length - 2;
+
+			while (remaining--)
+			{
+				if (++deflate->strstart <= max_insert)
+					deflate_insert(deflate, deflate->strstart);
+			}
+
+			deflate->match_available = false;
+			deflate->match_length = DEFLATE_MIN_MATCH - 1;
+			deflate->strstart++;
+
+			if (full)
+				deflate_write_block(deflate, false);
+		}
+		else if (deflate->match_available)
+		{
+			if (deflate_tally_literal(deflate, *deflate_at(deflate, deflate->strstart - 1)))
+				deflate_write_block(deflate, false);
+
+			deflate->strstart++;
+		}
+		else
+		{
+			deflate->match_available = true;
+			deflate->strstart++;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Stream
+//////////////////////////////////////////////////////////////////////////////
+
+size_t
+deflate_get_size()
+{
+	return sizeof(Deflate);
+}
+
+/**
+ * Initialises a stream in caller provided memory of deflate_get_size()
+ * bytes, so request scoped streams can live in request memory. Levels are
+ * clamped to 1 through 9.
+ */
+Deflate*
+deflate_init(void* memory, DeflateFormat format, int level, DeflateSink sink, void* context)
+{
+	assert(memory != nullptr);
+	assert(sink != nullptr);
+
+	if (!memory || !sink)
+		return nullptr;
+
+	Deflate* deflate = (Deflate*)memory;
+
+	deflate->format = format;
+	deflate->level_number = level < 1 ? 1 : level > 9 ? 9 : level;
+	deflate->level = &deflate_levels[deflate->level_number];
+
+	deflate->sink = sink;
+	deflate->context = context;
+
+	deflate->header_written = false;
+	deflate->finished = false;
+	deflate->failed = false;
+
+	deflate->checksum = format == DEFLATE_FORMAT_GZIP ? 0 : 1;
+	deflate->total_in = 0;
+
+	deflate->window_start = 0;
+	deflate->strstart = 0;
+	deflate->end = 0;
+
+	memset(deflate->head, 0, sizeof(deflate->head));
+	memset(deflate->prev, 0, sizeof(deflate->prev));
+
+	deflate->match_length = DEFLATE_MIN_MATCH - 1;
+	deflate->match_start = 0;
+	deflate->prev_length = DEFLATE_MIN_MATCH - 1;
+	deflate->prev_match = 0;
+	deflate->match_available = false;
+
+	deflate->sym_count = 0;
+	deflate->block_start = 0;
+
+	memset(deflate->litlen_freq, 0, sizeof(deflate->litlen_freq));
+	memset(deflate->dist_freq, 0, sizeof(deflate->dist_freq));
+
+	for (UINT32 code = 0; code < 28; code++)
+	{
+		for (UINT32 i = 0; i < (1u << deflate_length_extra[code]); i++)
+			deflate->length_code[deflate_length_base[code] - DEFLATE_MIN_MATCH + i] = (UINT8)code;
+	}
+
+	deflate->length_code[DEFLATE_MAX_MATCH - DEFLATE_MIN_MATCH] = 28;
+
+	for (UINT32 code = 0; code < DEFLATE_DIST_CODES; code++)
+	{
+		UINT32 first = deflate_dist_base[code] - 1;
+		UINT32 last = first + (1u << deflate_dist_extra[code]);
+
+		for (UINT32 dist = first; dist < last; dist++)
+		{
+			if (dist < 256)
+				deflate->dist_code[dist] = (UINT8)code;
+			else
+				deflate->dist_code[256 + (dist >> 7)] = (UINT8)code;
+		}
+	}
+
+	for (UINT32 i = 0; i < 256; i++)
+	{
+		UINT32 crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+
+		deflate->crc_table[i] = crc;
+	}
+
+	deflate->bit_buffer = 0;
+	deflate->bit_count = 0;
+	deflate->output_used = 0;
+
+	return deflate;
+}
+
+/**
+ * Compresses data, handing output to the sink as it fills. Nothing is
+ * guaranteed to reach the sink before a sync flush or the finish.
+ */
+bool
+deflate_feed(Deflate* deflate, const char* data, size_t length, DeflateFlush flush)
+{
+	assert(deflate != nullptr);
+
+	if (!deflate || deflate->finished || deflate->failed)
+		return false;
+
+	if (!deflate->header_written)
+		deflate_write_header(deflate);
+
+	const unsigned char* input = (const unsigned char*)data;
+
+	while (true)
+	{
+		UINT32 used = deflate->end - deflate->window_start;
+
+		// Keep exactly one window of history behind the current position.
+		if (used == DEFLATE_BUFFER_SIZE)
+		{
+			UINT32 shift = deflate->strstart - deflate->window_start - DEFLATE_WINDOW_SIZE;
+
+			memmove(deflate->window, deflate->window + shift, used - shift);
+
+			deflate->window_start += shift;
+			used -= shift;
+		}
+
+		size_t copy = DEFLATE_BUFFER_SIZE - used;
+
+		if (copy > length)
+			copy = length;
+
+		if (copy)
+		{
+			memcpy(deflate->window + used, input, copy);
+			deflate_update_checksum(deflate, input, copy);
+
+			deflate->end += (UINT32)copy;
+			deflate->total_in += (UINT32)copy;
+
+			input += copy;
+			length -= copy;
+		}
+
+		bool drain = !length && flush != DEFLATE_NO_FLUSH;
+
+		if (deflate->level->lazy)
+			deflate_compress_lazy(deflate, drain);
+		else
+			deflate_compress_greedy(deflate, drain);
+
+		if (!length || deflate->failed)
+			break;
+	}
+
+	if (flush != DEFLATE_NO_FLUSH && !deflate->failed)
+	{
+		if (deflate->match_available)
+		{
+			deflate_tally_literal(deflate, *deflate_at(deflate, deflate->strstart - 1));
+			deflate->match_available = false;
+		}
+
+		deflate->match_length = DEFLATE_MIN_MATCH - 1;
+
+		if (flush == DEFLATE_FINISH)
+		{
+			deflate_write_block(deflate, true);
+			deflate_align(deflate);
+			deflate_write_trailer(deflate);
+
+			deflate->finished = true;
+		}
+		else
+		{
+			if (deflate->sym_count)
+				deflate_write_block(deflate, false);
+
+			// An empty stored block byte aligns the stream so a reader can
+			// decode everything written so far.
+			deflate_write_stored(deflate, nullptr, 0, false);
+		}
+
+		deflate_flush_output(deflate);
+	}
+
+	return !deflate->failed;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _DEFLATE
+#define _DEFLATE
+
+typedef enum _DeflateFormat
+{
+	// Content-Encoding: deflate is the zlib wrapper, not a raw stream.
+	DEFLATE_FORMAT_ZLIB,
+	DEFLATE_FORMAT_GZIP
+} DeflateFormat;
+
+typedef enum _DeflateFlush
+{
+	DEFLATE_NO_FLUSH,
+	// Emits everything fed so far and byte aligns, the stream stays open.
+	DEFLATE_SYNC_FLUSH,
+	DEFLATE_FINISH
+} DeflateFlush;
+
+// Receives compressed output, returning false fails the stream.
+typedef bool (*DeflateSink)(void* context, const char* data, size_t length);
+
+typedef struct _Deflate Deflate;
+
+size_t deflate_get_size();
+Deflate* deflate_init(void* memory, DeflateFormat format, int level, DeflateSink sink, void* context);
+bool deflate_feed(Deflate* deflate, const char* data, size_t length, DeflateFlush flush);
+
+#endif
@@ -0,0 +1,314 @@
+#include "shared.h"
+
+#define FILE_CACHE_BUCKETS 256
+#define FILE_CACHE_VALIDATE_INTERVAL 1000
+
+/**
+ * Open handle and metadata for one file. Entries are reference counted, the
+ * cache holds one reference and every response chunk using the handle holds
+ * another, so eviction never closes a handle IIS is still sending from.
+ */
+typedef struct _FileCacheEntry
+{
+	volatile LONG ref_count;
+	char file_path[MAX_PATH];
+	UINT32 hash;
+
+	HANDLE file_handle;
+	UINT64 file_size;
+	FILETIME last_write_time;
+
+	// Tick counts, written with interlocked exchanges under the shared lock.
+	volatile LONGLONG last_used;
+	volatile LONGLONG last_validated;
+
+	struct _FileCacheEntry* next;
+} FileCacheEntry;
+
+// Process-wide, each entry holds one reference on its file.
+static SRWLOCK file_cache_lock = SRWLOCK_INIT;
+static FileCacheEntry* file_cache_buckets[FILE_CACHE_BUCKETS];
+static DWORD file_cache_count = 0;
+static DWORD file_cache_capacity = 256;
+
+static UINT32
+file_cache_hash(const char* file_path)
+{
+	UINT32 hash = 2166136261u;
+
+	for (const char* c = file_path; *c; c++)
+	{
+		char lower = (*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c;
+
+		hash ^= (unsigned char)lower;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void
+file_cache_free(FileCacheEntry* entry)
+{
+	if (entry)
+	{
+		if (entry->file_handle != INVALID_HANDLE_VALUE)
+			CloseHandle(entry->file_handle);
+
+		free(entry);
+	}
+}
+
+static FileCacheEntry*
+file_cache_open(const char* file_path, UINT32 hash)
+{
+	FileCacheEntry* entry = nullptr;
+	BY_HANDLE_FILE_INFORMATION information;
+
+	// Opened the way the static file handler does, writers and deletes are
+	// not blocked and are picked up by the next validation.
+	HANDLE file_handle = CreateFileA(
+		file_path,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN,
+		nullptr
+	);
+
+	if (file_handle == INVALID_HANDLE_VALUE)
+		goto error;
+
+	if (!GetFileInformationByHandle(file_handle, &information))
+		goto error;
+
+	if (information.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		goto error;
+
+	entry = (FileCacheEntry*)malloc(sizeof(FileCacheEntry));
+
+	if (!entry)
+		goto error;
+
+	entry->ref_count = 1;
+	strcpy_s(entry->file_path, file_path);
+	entry->hash = hash;
+
+	entry->file_handle = file_handle;
+	entry->file_size = ((UINT64)information.nFileSizeHigh << 32) | information.nFileSizeLow;
+	entry->last_write_time = information.ftLastWriteTime;
+
+	entry->last_used = (LONGLONG)GetTickCount64();
+	entry->last_validated = entry->last_used;
+
+	entry->next = nullptr;
+
+	return entry;
+
+error:
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+
+	return nullptr;
+}
+
+/**
+ * Unlinks an entry and drops the cache's reference, expects the exclusive lock.
+ */
+static void
+file_cache_remove(FileCacheEntry** link)
+{
+	FileCacheEntry* entry = *link;
+	*link = entry->next;
+
+	file_cache_count--;
+	file_cache_release(entry);
+}
+
+/**
+ * Evicts the least recently used entry, expects the exclusive lock.
+ */
+static void
+file_cache_evict()
+{
+	FileCacheEntry** oldest = nullptr;
+
+	for (DWORD i = 0; i < FILE_CACHE_BUCKETS; i++)
+	{
+		for (FileCacheEntry** link = &file_cache_buckets[i]; *link; link = &(*link)->next)
+		{
+			if (!oldest || (*link)->last_used < (*oldest)->last_used)
+				oldest = link;
+		}
+	}
+
+	if (oldest)
+		file_cache_remove(oldest);
+}
+
+/**
+ * Returns an open handle for the file, reusing the cached one while the
+ * file's size and last write time are unchanged. Metadata is revalidated at
+ * most once a second per file, so a change can go unnoticed for that long.
+ */
+FileCacheEntry*
+file_cache_acquire(const char* file_path)
+{
+	assert(file_path != nullptr);
+
+	FileCacheEntry* entry = nullptr;
+
+	if (!file_path || strlen(file_path) >= MAX_PATH)
+		return entry;
+
+	UINT32 hash = file_cache_hash(file_path);
+	LONGLONG now = (LONGLONG)GetTickCount64();
+
+	AcquireSRWLockShared(&file_cache_lock);
+
+	for (FileCacheEntry* candidate = file_cache_buckets[hash % FILE_CACHE_BUCKETS]; candidate; candidate = candidate->next)
+	{
+		if (candidate->hash == hash && _stricmp(candidate->file_path, file_path) == 0)
+		{
+			InterlockedIncrement(&candidate->ref_count);
+			InterlockedExchange64(&candidate->last_used, now);
+
+			entry = candidate;
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&file_cache_lock);
+
+	if (entry)
+	{
+		if (now - entry->last_validated < FILE_CACHE_VALIDATE_INTERVAL)
+			return entry;
+
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+		if (GetFileAttributesExA(file_path, GetFileExInfoStandard, &attributes))
+		{
+			UINT64 file_size = ((UINT64)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+
+			if (file_size == entry->file_size 
+				&& CompareFileTime(&attributes.ftLastWriteTime, &entry->last_write_time) == 0)
+			{
+				InterlockedExchange64(&entry->last_validated, now);
+				return entry;
+			}
+		}
+
+		entry = file_cache_release(entry);
+	}
+
+	entry = file_cache_open(file_path, hash);
+
+	if (!entry)
+		return entry;
+
+	AcquireSRWLockExclusive(&file_cache_lock);
+
+	// Replace any stale entry for the same file, holders of it keep their handle.
+	for (FileCacheEntry** link = &file_cache_buckets[hash % FILE_CACHE_BUCKETS]; *link; link = &(*link)->next)
+	{
+		if ((*link)->hash == hash && _stricmp((*link)->file_path, file_path) == 0)
+		{
+			file_cache_remove(link);
+			break;
+		}
+	}
+
+	while (file_cache_count && file_cache_count >= file_cache_capacity)
+	{
+		file_cache_evict();
+	}
+
+	if (file_cache_capacity)
+	{
+		InterlockedIncrement(&entry->ref_count);
+		entry->next = file_cache_buckets[hash % FILE_CACHE_BUCKETS];
+		file_cache_buckets[hash % FILE_CACHE_BUCKETS] = entry;
+
+		file_cache_count++;
+	}
+
+	ReleaseSRWLockExclusive(&file_cache_lock);
+
+	return entry;
+}
+
+FileCacheEntry*
+file_cache_release(FileCacheEntry* entry)
+{
+	if (entry && InterlockedDecrement(&entry->ref_count) == 0)
+	{
+		file_cache_free(entry);
+	}
+
+	return nullptr;
+}
+
+/**
+ * Bounds the number of open handles, a capacity of zero disables caching.
+ */
+void
+file_cache_set_capacity(DWORD capacity)
+{
+	AcquireSRWLockExclusive(&file_cache_lock);
+
+	file_cache_capacity = capacity;
+
+	while (file_cache_count > file_cache_capacity)
+	{
+		file_cache_evict();
+	}
+
+	ReleaseSRWLockExclusive(&file_cache_lock);
+}
+
+void
+file_cache_clear()
+{
+	AcquireSRWLockExclusive(&file_cache_lock);
+
+	for (DWORD i = 0; i < FILE_CACHE_BUCKETS; i++)
+	{
+		while (file_cache_buckets[i])
+		{
+			file_cache_remove(&file_cache_buckets[i]);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&file_cache_lock);
+}
+
+HANDLE
+file_cache_get_handle(const FileCacheEntry* entry)
+{
+	assert(entry != nullptr);
+
+	return entry ? entry->file_handle : INVALID_HANDLE_VALUE;
+}
+
+UINT64
+file_cache_get_size(const FileCacheEntry* entry)
+{
+	assert(entry != nullptr);
+
+	return entry ? entry->file_size : 0;
+}
+
+FILETIME
+file_cache_get_last_write_time(const FileCacheEntry* entry)
+{
+	assert(entry != nullptr);
+
+	FILETIME last_write_time = { 0 };
+
+	if (entry)
+		last_write_time = entry->last_write_time;
+
+	return last_write_time;
+}
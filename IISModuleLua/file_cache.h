@@ -0,0 +1,18 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _FILE_CACHE
+#define _FILE_CACHE
+
+typedef struct _FileCacheEntry FileCacheEntry;
+
+FileCacheEntry* file_cache_acquire(const char* file_path);
+FileCacheEntry* file_cache_release(FileCacheEntry* entry);
+void file_cache_set_capacity(DWORD capacity);
+void file_cache_clear();
+
+HANDLE file_cache_get_handle(const FileCacheEntry* entry);
+UINT64 file_cache_get_size(const FileCacheEntry* entry);
+FILETIME file_cache_get_last_write_time(const FileCacheEntry* entry);
+
+#endif
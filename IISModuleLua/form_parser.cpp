@@ -0,0 +1,609 @@
+#include "shared.h"
+
+#define FORM_PARSER_MAX_BOUNDARY 70
+#define FORM_PARSER_MAX_HEADERS 8192
+
+typedef enum _FormParserType
+{
+	FORM_PARSER_URLENCODED,
+	FORM_PARSER_MULTIPART
+} FormParserType;
+
+typedef enum _FormParserState
+{
+	FORM_PARSER_PREAMBLE,
+	FORM_PARSER_AFTER_DELIMITER,
+	FORM_PARSER_AFTER_DASH,
+	FORM_PARSER_AFTER_CR,
+	FORM_PARSER_HEADERS,
+	FORM_PARSER_BODY,
+	FORM_PARSER_DONE,
+	FORM_PARSER_FAILED
+} FormParserState;
+
+/**
+ * Push parser for form bodies, fed one chunk at a time. Memory is fixed at
+ * creation: the part headers buffer for multipart, and two field buffers of
+ * max_field_size for urlencoded bodies. Part data is handed out as slices of
+ * the caller's chunks.
+ */
+typedef struct _FormParser
+{
+	FormParserType type;
+	FormParserState state;
+	FormParserCallbacks callbacks;
+	const char* error;
+
+	// "\r\n--" followed by the boundary. CR only ever appears first, so a
+	// mismatch can always restart the match from the current byte.
+	char delimiter[FORM_PARSER_MAX_BOUNDARY + 4];
+	size_t delimiter_length;
+
+	// Delimiter bytes matched so far, and how many of those came from earlier
+	// chunks. Those are not in the current chunk, but they are the delimiter's own prefix.
+	size_t match;
+	size_t carried;
+
+	char headers[FORM_PARSER_MAX_HEADERS];
+	size_t headers_length;
+
+	size_t max_field_size;
+	char* field;
+	size_t field_length;
+	char* decoded;
+} FormParser;
+
+static bool
+form_parser_fail(FormParser* parser, const char* error)
+{
+	parser->state = FORM_PARSER_FAILED;
+	parser->error = error;
+
+	return false;
+}
+
+static bool
+form_parser_equals(const char* value, size_t length, const char* literal)
+{
+	size_t literal_length = strlen(literal);
+
+	return length == literal_length && _strnicmp(value, literal, length) == 0;
+}
+
+static void
+form_parser_trim(const char** value, size_t* length)
+{
+	while (*length && (**value == ' ' || **value == '\t'))
+	{
+		(*value)++;
+		(*length)--;
+	}
+
+	while (*length && ((*value)[*length - 1] == ' ' || (*value)[*length - 1] == '\t'))
+	{
+		(*length)--;
+	}
+}
+
+/**
+ * Finds parameter `key` in a header value such as `form-data; name="a"`,
+ * quoted values are returned without their quotes.
+ */
+static bool
+form_parser_get_parameter(
+	const char* value,
+	size_t length,
+	const char* key,
+	const char** parameter,
+	size_t* parameter_length
+)
+{
+	const char* position = value;
+	const char* end = value + length;
+
+	while (position < end)
+	{
+		const char* semicolon = (const char*)memchr(position, ';', end - position);
+
+		if (!semicolon)
+			break;
+
+		position = semicolon + 1;
+
+		while (position < end && (*position == ' ' || *position == '\t'))
+			position++;
+
+		const char* name = position;
+
+		while (position < end && *position != '=' && *position != ';')
+			position++;
+
+		size_t name_length = position - name;
+		form_parser_trim(&name, &name_length);
+
+		if (position >= end || *position != '=')
+			continue;
+
+		position++;
+
+		const char* start;
+		size_t start_length;
+
+		if (position < end && *position == '"')
+		{
+			start = ++position;
+
+			while (position < end && *position != '"')
+			{
+				if (*position == '\\' && position + 1 < end)
+					position++;
+
+				position++;
+			}
+
+			start_length = position - start;
+
+			if (position < end)
+				position++;
+		}
+		else
+		{
+			start = position;
+
+			while (position < end && *position != ';')
+				position++;
+
+			start_length = position - start;
+			form_parser_trim(&start, &start_length);
+		}
+
+		if (form_parser_equals(name, name_length, key))
+		{
+			*parameter = start;
+			*parameter_length = start_length;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+form_parser_begin_part(FormParser* parser)
+{
+	FormPart part = { 0 };
+
+	const char* line = parser->headers;
+	const char* end = parser->headers + parser->headers_length;
+
+	while (line < end)
+	{
+		const char* line_end = (const char*)memchr(line, '\r', end - line);
+
+		if (!line_end)
+			line_end = end;
+
+		const char* colon = (const char*)memchr(line, ':', line_end - line);
+
+		if (colon)
+		{
+			const char* value = colon + 1;
+			size_t value_length = line_end - value;
+			form_parser_trim(&value, &value_length);
+
+			if (form_parser_equals(line, colon - line, "Content-Disposition"))
+			{
+				form_parser_get_parameter(value, value_length, "name", &part.name, &part.name_length);
+				form_parser_get_parameter(value, value_length, "filename", &part.filename, &part.filename_length);
+			}
+			else if (form_parser_equals(line, colon - line, "Content-Type"))
+			{
+				part.content_type = value;
+				part.content_type_length = value_length;
+			}
+		}
+
+		line = line_end + 2;
+	}
+
+	if (!part.name)
+	{
+		part.name = "";
+	}
+
+	return parser->callbacks.part_begin(parser->callbacks.context, &part);
+}
+
+static bool
+form_parser_emit(FormParser* parser, const char* data, size_t length)
+{
+	return !length || parser->callbacks.part_data(parser->callbacks.context, data, length);
+}
+
+/**
+ * Scans for the delimiter, emitting everything before it as part data when
+ * `emit` is set. A partial delimiter at the end of a chunk is held back until
+ * the next chunk decides whether it was data after all.
+ */
+static bool
+form_parser_scan(
+	FormParser* parser,
+	const char* data,
+	size_t length,
+	bool emit,
+	size_t* consumed,
+	bool* found
+)
+{
+	size_t i = 0;
+
+	*found = false;
+
+	while (i < length)
+	{
+		if (!parser->match)
+		{
+			const char* cr = (const char*)memchr(data + i, '\r', length - i);
+
+			if (!cr)
+			{
+				i = length;
+				break;
+			}
+
+			i = (cr - data) + 1;
+			parser->match = 1;
+
+			continue;
+		}
+
+		if (data[i] == parser->delimiter[parser->match])
+		{
+			i++;
+
+			if (++parser->match == parser->delimiter_length)
+			{
+				size_t in_chunk = parser->delimiter_length - parser->carried;
+
+				if (emit && !form_parser_emit(parser, data, i - in_chunk))
+					return false;
+
+				parser->match = 0;
+				parser->carried = 0;
+
+				*consumed = i;
+				*found = true;
+
+				return true;
+			}
+
+			continue;
+		}
+
+		// The held bytes were data, they precede everything in this chunk.
+		if (parser->carried)
+		{
+			if (emit && !form_parser_emit(parser, parser->delimiter, parser->carried))
+				return false;
+
+			parser->carried = 0;
+		}
+
+		parser->match = 0;
+	}
+
+	size_t held = parser->match - parser->carried;
+
+	if (emit && !form_parser_emit(parser, data, length - held))
+		return false;
+
+	parser->carried = parser->match;
+	*consumed = length;
+
+	return true;
+}
+
+static bool
+form_parser_feed_multipart(FormParser* parser, const char* data, size_t length)
+{
+	size_t i = 0;
+
+	while (i < length)
+	{
+		switch (parser->state)
+		{
+		case FORM_PARSER_PREAMBLE:
+		case FORM_PARSER_BODY:
+		{
+			bool body = parser->state == FORM_PARSER_BODY;
+			bool found = false;
+			size_t consumed = 0;
+
+			if (!form_parser_scan(parser, data + i, length - i, body, &consumed, &found))
+				return form_parser_fail(parser, "form callback failed");
+
+			i += consumed;
+
+			if (found)
+			{
+				if (body && !parser->callbacks.part_end(parser->callbacks.context))
+					return form_parser_fail(parser, "form callback failed");
+
+				parser->state = FORM_PARSER_AFTER_DELIMITER;
+			}
+
+			break;
+		}
+		case FORM_PARSER_AFTER_DELIMITER:
+		{
+			char c = data[i++];
+
+			if (c == '-')
+				parser->state = FORM_PARSER_AFTER_DASH;
+			else if (c == '\r')
+				parser->state = FORM_PARSER_AFTER_CR;
+			else if (c != ' ' && c != '\t')
+				return form_parser_fail(parser, "malformed multipart boundary");
+
+			break;
+		}
+		case FORM_PARSER_AFTER_DASH:
+		{
+			if (data[i++] != '-')
+				return form_parser_fail(parser, "malformed multipart boundary");
+
+			parser->state = FORM_PARSER_DONE;
+			break;
+		}
+		case FORM_PARSER_AFTER_CR:
+		{
+			if (data[i++] != '\n')
+				return form_parser_fail(parser, "malformed multipart boundary");
+
+			parser->headers_length = 0;
+			parser->state = FORM_PARSER_HEADERS;
+			break;
+		}
+		case FORM_PARSER_HEADERS:
+		{
+			while (i < length)
+			{
+				if (parser->headers_length == sizeof(parser->headers))
+					return form_parser_fail(parser, "multipart headers too large");
+
+				parser->headers[parser->headers_length++] = data[i++];
+
+				size_t n = parser->headers_length;
+
+				// Either an empty header block, or the blank line that ends one.
+				if (n >= 2 && parser->headers[n - 2] == '\r' && parser->headers[n - 1] == '\n'
+					&& (n == 2 || (n >= 4 && parser->headers[n - 4] == '\r' && parser->headers[n - 3] == '\n')))
+				{
+					parser->headers_length = n == 2 ? 0 : n - 4;
+
+					if (!form_parser_begin_part(parser))
+						return form_parser_fail(parser, "form callback failed");
+
+					parser->match = 0;
+					parser->carried = 0;
+					parser->state = FORM_PARSER_BODY;
+					break;
+				}
+			}
+
+			break;
+		}
+		case FORM_PARSER_DONE:
+			// The epilogue carries nothing.
+			i = length;
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+form_parser_flush_field(FormParser* parser)
+{
+	if (!parser->field_length)
+		return true;
+
+	const char* equals = (const char*)memchr(parser->field, '=', parser->field_length);
+
+	size_t key_length = equals ? equals - parser->field : parser->field_length;
+	const char* value = equals ? equals + 1 : parser->field + parser->field_length;
+	size_t value_length = parser->field + parser->field_length - value;
+
+	parser->field_length = 0;
+
+	// Decoding never grows, key and value fit side by side in one buffer.
+	FormPart part = { 0 };
+	part.name = parser->decoded;
+	part.name_length = query_string_decode(parser->field, key_length, parser->decoded);
+
+	char* decoded_value = parser->decoded + part.name_length;
+	size_t decoded_value_length = query_string_decode(value, value_length, decoded_value);
+
+	return parser->callbacks.part_begin(parser->callbacks.context, &part)
+		&& form_parser_emit(parser, decoded_value, decoded_value_length)
+		&& parser->callbacks.part_end(parser->callbacks.context);
+}
+
+static bool
+form_parser_feed_urlencoded(FormParser* parser, const char* data, size_t length)
+{
+	const char* position = data;
+	const char* end = data + length;
+
+	while (position < end)
+	{
+		const char* separator = (const char*)memchr(position, '&', end - position);
+		const char* segment_end = separator ? separator : end;
+		size_t segment_length = segment_end - position;
+
+		if (parser->field_length + segment_length > parser->max_field_size)
+			return form_parser_fail(parser, "form field too large");
+
+		memcpy(parser->field + parser->field_length, position, segment_length);
+		parser->field_length += segment_length;
+
+		if (separator && !form_parser_flush_field(parser))
+			return form_parser_fail(parser, "form callback failed");
+
+		position = separator ? separator + 1 : end;
+	}
+
+	return true;
+}
+
+FormParser*
+form_parser_create(
+	const char* content_type,
+	size_t content_type_length,
+	size_t max_field_size,
+	const FormParserCallbacks* callbacks
+)
+{
+	assert(content_type != nullptr);
+	assert(callbacks != nullptr);
+
+	FormParser* parser = nullptr;
+
+	if (!content_type || !callbacks)
+		return parser;
+
+	const char* semicolon = (const char*)memchr(content_type, ';', content_type_length);
+	const char* media_type = content_type;
+	size_t media_type_length = semicolon ? semicolon - content_type : content_type_length;
+	form_parser_trim(&media_type, &media_type_length);
+
+	const char* boundary = nullptr;
+	size_t boundary_length = 0;
+	FormParserType type;
+
+	if (form_parser_equals(media_type, media_type_length, "application/x-www-form-urlencoded"))
+	{
+		type = FORM_PARSER_URLENCODED;
+	}
+	else if (form_parser_equals(media_type, media_type_length, "multipart/form-data"))
+	{
+		type = FORM_PARSER_MULTIPART;
+
+		if (!form_parser_get_parameter(content_type, content_type_length, "boundary", &boundary, &boundary_length)
+			|| !boundary_length
+			|| boundary_length > FORM_PARSER_MAX_BOUNDARY
+			|| memchr(boundary, '\r', boundary_length))
+		{
+			return parser;
+		}
+	}
+	else
+	{
+		return parser;
+	}
+
+	parser = (FormParser*)malloc(sizeof(FormParser));
+
+	if (!parser)
+		return parser;
+
+	parser->type = type;
+	parser->state = FORM_PARSER_PREAMBLE;
+	parser->callbacks = *callbacks;
+	parser->error = nullptr;
+	parser->headers_length = 0;
+	parser->max_field_size = max_field_size;
+	parser->field = nullptr;
+	parser->field_length = 0;
+	parser->decoded = nullptr;
+
+	memcpy(parser->delimiter, "\r\n--", 4);
+	parser->delimiter_length = boundary_length + 4;
+
+	if (boundary)
+		memcpy(parser->delimiter + 4, boundary, boundary_length);
+
+	// The first boundary may open the body, pretend a line break preceded it.
+	parser->match = 2;
+	parser->carried = 2;
+
+	if (type == FORM_PARSER_URLENCODED)
+	{
+		parser->field = (char*)malloc(max_field_size ? max_field_size : 1);
+		parser->decoded = (char*)malloc(max_field_size ? max_field_size : 1);
+
+		if (!parser->field || !parser->decoded)
+		{
+			parser = form_parser_destroy(parser);
+		}
+	}
+
+	return parser;
+}
+
+FormParser*
+form_parser_destroy(FormParser* parser)
+{
+	if (parser)
+	{
+		if (parser->field)
+			free(parser->field);
+
+		if (parser->decoded)
+			free(parser->decoded);
+
+		free(parser);
+		parser = nullptr;
+	}
+
+	return parser;
+}
+
+bool
+form_parser_feed(FormParser* parser, const char* data, size_t length)
+{
+	assert(parser != nullptr);
+
+	if (!parser || parser->state == FORM_PARSER_FAILED)
+		return false;
+
+	if (!length)
+		return true;
+
+	return parser->type == FORM_PARSER_URLENCODED
+		? form_parser_feed_urlencoded(parser, data, length)
+		: form_parser_feed_multipart(parser, data, length);
+}
+
+bool
+form_parser_finish(FormParser* parser)
+{
+	assert(parser != nullptr);
+
+	if (!parser || parser->state == FORM_PARSER_FAILED)
+		return false;
+
+	if (parser->type == FORM_PARSER_URLENCODED)
+	{
+		if (!form_parser_flush_field(parser))
+			return form_parser_fail(parser, "form callback failed");
+
+		return true;
+	}
+
+	if (parser->state != FORM_PARSER_DONE)
+		return form_parser_fail(parser, "multipart body ended before its closing boundary");
+
+	return true;
+}
+
+const char*
+form_parser_get_error(FormParser* parser)
+{
+	return parser && parser->error ? parser->error : "invalid form body";
+}
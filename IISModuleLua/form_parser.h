@@ -0,0 +1,43 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _FORM_PARSER
+#define _FORM_PARSER
+
+// Slices point into the parser and are only valid during part_begin.
+typedef struct _FormPart
+{
+	const char* name;
+	size_t name_length;
+
+	// Null for plain fields.
+	const char* filename;
+	size_t filename_length;
+
+	const char* content_type;
+	size_t content_type_length;
+} FormPart;
+
+typedef struct _FormParserCallbacks
+{
+	void* context;
+
+	bool (*part_begin)(void* context, const FormPart* part);
+	bool (*part_data)(void* context, const char* data, size_t length);
+	bool (*part_end)(void* context);
+} FormParserCallbacks;
+
+typedef struct _FormParser FormParser;
+
+FormParser* form_parser_create(
+	const char* content_type,
+	size_t content_type_length,
+	size_t max_field_size,
+	const FormParserCallbacks* callbacks
+);
+FormParser* form_parser_destroy(FormParser* parser);
+bool form_parser_feed(FormParser* parser, const char* data, size_t length);
+bool form_parser_finish(FormParser* parser);
+const char* form_parser_get_error(FormParser* parser);
+
+#endif
@@ -12,9 +12,46 @@ REQUEST_NOTIFICATION_STATUS HttpModule::OnBeginRequest(
 
 	if (!m_lua_engine)
 		m_lua_engine = lua_state_manager_aquire(m_lua_state_manager);
+
+	if (!m_lua_engine)
+	{
+		pHttpContext->GetResponse()->SetStatus(503, "Service Unavailable");
+		return RQ_NOTIFICATION_FINISH_REQUEST;
+	}
 	
-	return lua_engine_begin_request(
+	REQUEST_NOTIFICATION_STATUS status = lua_engine_begin_request(
 		m_lua_engine, 
-		pHttpContext
+		pHttpContext,
+		&m_lua_request
+	);
+
+	// The handler is waiting on the client, the engine can serve other requests
+	// until the read completes and the handler is resumed on it.
+	if (status == RQ_NOTIFICATION_PENDING)
+		m_lua_engine = lua_state_manager_release(m_lua_state_manager, m_lua_engine);
+
+	return status;
+}
+
+REQUEST_NOTIFICATION_STATUS HttpModule::OnAsyncCompletion(
+	IN IHttpContext* pHttpContext,
+	IN DWORD dwNotification,
+	IN BOOL fPostNotification,
+	IN IHttpEventProvider* pProvider,
+	IN IHttpCompletionInfo* pCompletionInfo
+)
+{
+	UNREFERENCED_PARAMETER(dwNotification);
+	UNREFERENCED_PARAMETER(fPostNotification);
+	UNREFERENCED_PARAMETER(pProvider);
+
+	if (!pHttpContext || !pCompletionInfo || !m_lua_request.thread)
+		return RQ_NOTIFICATION_CONTINUE;
+
+	return lua_engine_resume_request(
+		&m_lua_request,
+		pHttpContext,
+		pCompletionInfo->GetCompletionBytes(),
+		pCompletionInfo->GetCompletionStatus()
 	);
 }  
\ No newline at end of file
@@ -9,16 +9,33 @@ public:
 		IN IHttpEventProvider* pProvider
 	);
 
+	REQUEST_NOTIFICATION_STATUS OnAsyncCompletion(
+		IN IHttpContext* pHttpContext,
+		IN DWORD dwNotification,
+		IN BOOL fPostNotification,
+		IN IHttpEventProvider* pProvider,
+		IN IHttpCompletionInfo* pCompletionInfo
+	);
+
 	HttpModule(LuaStateManager* lua_state_manager) 
 		: m_lua_state_manager(lua_state_manager), m_lua_engine(nullptr)
-	{};
+	{
+		m_lua_request = { 0 };
+		m_lua_request.thread_ref = LUA_NOREF;
+		m_lua_request.pin_ref = LUA_NOREF;
+	};
 
 	~HttpModule() 
 	{
-		m_lua_engine = lua_state_manager_release(m_lua_state_manager, m_lua_engine);
+		// A handler still waiting on a read is never going to be resumed.
+		lua_engine_end_request(&m_lua_request);
+
+		if (m_lua_engine)
+			m_lua_engine = lua_state_manager_release(m_lua_state_manager, m_lua_engine);
 	};
 
 private:
 	LuaEngine* m_lua_engine = nullptr;
 	LuaStateManager* m_lua_state_manager = nullptr;
+	LuaEngineRequest m_lua_request;
 };
@@ -0,0 +1,336 @@
+#include "shared.h"
+
+// 100ns intervals between 1601-01-01 and 1970-01-01.
+#define HTTP_RANGE_EPOCH_DIFFERENCE 116444736000000000ULL
+
+static const char* http_range_days[] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+static const char* http_range_months[] = { 
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" 
+};
+
+static bool
+http_range_is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static bool
+http_range_parse_number(const char** position, const char* end, UINT64* value)
+{
+	const char* c = *position;
+	UINT64 result = 0;
+
+	if (c == end || *c < '0' || *c > '9')
+		return false;
+
+	for (; c < end && *c >= '0' && *c <= '9'; c++)
+	{
+		if (result > (MAXUINT64 - 9) / 10)
+			return false;
+
+		result = result * 10 + (*c - '0');
+	}
+
+	*position = c;
+	*value = result;
+
+	return true;
+}
+
+/**
+ * Parses "bytes=first-last, first-, -suffix" against a body of the given
+ * size. Unsatisfiable entries are dropped, a header where none remain is
+ * answered with 416 and a malformed one is ignored as the RFC asks.
+ */
+HttpRangeResult
+http_range_parse(
+	const char* header,
+	size_t header_length,
+	UINT64 size,
+	HttpRange ranges[HTTP_RANGE_MAX_RANGES],
+	DWORD* range_count
+)
+{
+	assert(ranges != nullptr);
+	assert(range_count != nullptr);
+
+	*range_count = 0;
+
+	const size_t unit_length = sizeof("bytes=") - 1;
+
+	if (!header || header_length < unit_length || _strnicmp(header, "bytes=", unit_length) != 0)
+		return HTTP_RANGE_NONE;
+
+	const char* position = header + unit_length;
+	const char* end = header + header_length;
+
+	DWORD specified = 0;
+	DWORD count = 0;
+
+	while (position < end)
+	{
+		while (position < end && (http_range_is_space(*position) || *position == ','))
+			position++;
+
+		if (position == end)
+			break;
+
+		if (++specified > HTTP_RANGE_MAX_RANGES)
+			return HTTP_RANGE_NONE;
+
+		UINT64 first = 0;
+		UINT64 last = 0;
+
+		if (*position == '-')
+		{
+			position++;
+
+			UINT64 suffix;
+
+			if (!http_range_parse_number(&position, end, &suffix))
+				return HTTP_RANGE_NONE;
+
+			if (!suffix || !size)
+				goto next;
+
+			first = suffix < size ? size - suffix : 0;
+			last = size - 1;
+		}
+		else
+		{
+			if (!http_range_parse_number(&position, end, &first))
+				return HTTP_RANGE_NONE;
+
+			if (position == end || *position != '-')
+				return HTTP_RANGE_NONE;
+
+			position++;
+
+			if (position < end && *position >= '0' && *position <= '9')
+			{
+				if (!http_range_parse_number(&position, end, &last) || last < first)
+					return HTTP_RANGE_NONE;
+			}
+			else
+			{
+				last = MAXUINT64;
+			}
+
+			if (first >= size)
+				goto next;
+
+			if (last >= size)
+				last = size - 1;
+		}
+
+		ranges[count].offset = first;
+		ranges[count].length = last - first + 1;
+		count++;
+
+	next:
+		while (position < end && http_range_is_space(*position))
+			position++;
+
+		if (position < end && *position != ',')
+			return HTTP_RANGE_NONE;
+	}
+
+	if (!specified)
+		return HTTP_RANGE_NONE;
+
+	*range_count = count;
+
+	return count ? HTTP_RANGE_SATISFIABLE : HTTP_RANGE_UNSATISFIABLE;
+}
+
+/**
+ * Strong validator built from the size and last write time, both of which
+ * change whenever the contents are replaced.
+ */
+size_t
+http_range_format_etag(UINT64 size, UINT64 last_write_time, char etag[HTTP_RANGE_ETAG_SIZE])
+{
+	int length = sprintf_s(etag, HTTP_RANGE_ETAG_SIZE, "\"%llx-%llx\"", size, last_write_time);
+
+	return length > 0 ? (size_t)length : 0;
+}
+
+/**
+ * Matches an If-None-Match or If-Range list. The weak comparison ignores
+ * W/ prefixes, the strong one never matches a weak tag.
+ */
+bool
+http_range_etag_matches(const char* header, size_t header_length, const char* etag, size_t etag_length, bool weak)
+{
+	const char* position = header;
+	const char* end = header + header_length;
+
+	while (position < end)
+	{
+		while (position < end && (http_range_is_space(*position) || *position == ','))
+			position++;
+
+		if (position == end)
+			break;
+
+		if (*position == '*')
+			return true;
+
+		bool is_weak = end - position >= 2 && position[0] == 'W' && position[1] == '/';
+
+		if (is_weak)
+			position += 2;
+
+		const char* tag = position;
+
+		if (position < end && *position == '"')
+		{
+			const char* closing = (const char*)memchr(position + 1, '"', end - position - 1);
+			position = closing ? closing + 1 : end;
+		}
+		else
+		{
+			while (position < end && *position != ',' && !http_range_is_space(*position))
+				position++;
+		}
+
+		if ((weak || !is_weak) 
+			&& (size_t)(position - tag) == etag_length 
+			&& memcmp(tag, etag, etag_length) == 0)
+		{
+			return true;
+		}
+
+		while (position < end && *position != ',')
+			position++;
+	}
+
+	return false;
+}
+
+INT64
+http_range_filetime_to_seconds(UINT64 file_time)
+{
+	return (INT64)(file_time / 10000000ULL) - (INT64)(HTTP_RANGE_EPOCH_DIFFERENCE / 10000000ULL);
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian date.
+static INT64
+http_range_days_from_civil(INT64 year, unsigned month, unsigned day)
+{
+	year -= month <= 2;
+
+	INT64 era = (year >= 0 ? year : year - 399) / 400;
+	unsigned year_of_era = (unsigned)(year - era * 400);
+	unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+	return era * 146097 + (INT64)day_of_era - 719468;
+}
+
+static void
+http_range_civil_from_days(INT64 days, INT64* year, unsigned* month, unsigned* day)
+{
+	days += 719468;
+
+	INT64 era = (days >= 0 ? days : days - 146096) / 146097;
+	unsigned day_of_era = (unsigned)(days - era * 146097);
+	unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	unsigned mp = (5 * day_of_year + 2) / 153;
+
+	*day = day_of_year - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = (INT64)year_of_era + era * 400 + (*month <= 2);
+}
+
+/**
+ * Formats an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+size_t
+http_range_format_date(INT64 seconds, char date[HTTP_RANGE_DATE_SIZE])
+{
+	INT64 days = seconds >= 0 ? seconds / 86400 : -((-seconds + 86399) / 86400);
+	INT64 remainder = seconds - days * 86400;
+
+	INT64 year;
+	unsigned month, day;
+	http_range_civil_from_days(days, &year, &month, &day);
+
+	int length = sprintf_s(
+		date, 
+		HTTP_RANGE_DATE_SIZE,
+		"%s, %02u %s %04d %02d:%02d:%02d GMT",
+		http_range_days[((days % 7) + 7) % 7],
+		day,
+		http_range_months[month - 1],
+		(int)year,
+		(int)(remainder / 3600),
+		(int)(remainder / 60 % 60),
+		(int)(remainder % 60)
+	);
+
+	return length > 0 ? (size_t)length : 0;
+}
+
+static bool
+http_range_parse_digits(const char* text, size_t count, unsigned* value)
+{
+	*value = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (text[i] < '0' || text[i] > '9')
+			return false;
+
+		*value = *value * 10 + (text[i] - '0');
+	}
+
+	return true;
+}
+
+/**
+ * Parses an IMF-fixdate, the obsolete formats are treated as absent which
+ * only ever costs a full response.
+ */
+bool
+http_range_parse_date(const char* header, size_t header_length, INT64* seconds)
+{
+	// "Sun, 06 Nov 1994 08:49:37 GMT"
+	const size_t fixdate_length = 29;
+
+	if (!header || header_length != fixdate_length)
+		return false;
+
+	if (header[3] != ',' || header[4] != ' ' || header[7] != ' ' || header[11] != ' ' || header[16] != ' ' 
+		|| header[19] != ':' || header[22] != ':' || memcmp(header + 25, " GMT", 4) != 0)
+	{
+		return false;
+	}
+
+	unsigned day, year, hour, minute, second;
+
+	if (!http_range_parse_digits(header + 5, 2, &day)
+		|| !http_range_parse_digits(header + 12, 4, &year)
+		|| !http_range_parse_digits(header + 17, 2, &hour)
+		|| !http_range_parse_digits(header + 20, 2, &minute)
+		|| !http_range_parse_digits(header + 23, 2, &second))
+	{
+		return false;
+	}
+
+	unsigned month = 0;
+
+	for (unsigned i = 0; i < _countof(http_range_months); i++)
+	{
+		if (memcmp(header + 8, http_range_months[i], 3) == 0)
+			month = i + 1;
+	}
+
+	if (!month || !day || day > 31 || hour > 23 || minute > 59 || second > 60)
+		return false;
+
+	*seconds = http_range_days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+
+	return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _HTTP_RANGE
+#define _HTTP_RANGE
+
+#define HTTP_RANGE_MAX_RANGES 16
+#define HTTP_RANGE_ETAG_SIZE 40
+#define HTTP_RANGE_DATE_SIZE 32
+
+typedef struct _HttpRange
+{
+	UINT64 offset;
+	UINT64 length;
+} HttpRange;
+
+typedef enum _HttpRangeResult
+{
+	// Missing, malformed or too many ranges, the whole body is sent.
+	HTTP_RANGE_NONE,
+	HTTP_RANGE_SATISFIABLE,
+	HTTP_RANGE_UNSATISFIABLE
+} HttpRangeResult;
+
+HttpRangeResult http_range_parse(
+	const char* header, 
+	size_t header_length, 
+	UINT64 size, 
+	HttpRange ranges[HTTP_RANGE_MAX_RANGES], 
+	DWORD* range_count
+);
+
+size_t http_range_format_etag(UINT64 size, UINT64 last_write_time, char etag[HTTP_RANGE_ETAG_SIZE]);
+bool http_range_etag_matches(const char* header, size_t header_length, const char* etag, size_t etag_length, bool weak);
+
+INT64 http_range_filetime_to_seconds(UINT64 file_time);
+size_t http_range_format_date(INT64 seconds, char date[HTTP_RANGE_DATE_SIZE]);
+bool http_range_parse_date(const char* header, size_t header_length, INT64* seconds);
+
+#endif
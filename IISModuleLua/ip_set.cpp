@@ -0,0 +1,627 @@
+#include "shared.h"
+
+#define IP_SET_MAX_FILE_SIZE (256 * 1024 * 1024)
+#define IP_SET_MAX_LINE 512
+
+typedef struct _IpSetNode
+{
+	// Index 0 is the root, so it doubles as "no child".
+	UINT32 children[2];
+	INT32 value;
+} IpSetNode;
+
+typedef struct _IpSetValue
+{
+	size_t offset;
+	size_t length;
+} IpSetValue;
+
+/**
+ * Binary trie over 128 bit keys, IPv4 addresses live in the ::ffff:0:0/96
+ * mapped range so one walk of at most the prefix length answers both
+ * families. Sets are immutable once built and shared between every engine
+ * through the registry below.
+ */
+typedef struct _IpSet
+{
+	volatile LONG ref_count;
+	char file_path[MAX_PATH];
+	FILETIME last_write_time;
+
+	IpSetNode* nodes;
+	UINT32 node_count;
+	UINT32 node_capacity;
+
+	IpSetValue* values;
+	UINT32 value_count;
+	UINT32 value_capacity;
+
+	char* strings;
+	size_t strings_length;
+	size_t strings_capacity;
+
+	struct _IpSet* next;
+} IpSet;
+
+typedef struct _IpSetKey
+{
+	UINT64 high;
+	UINT64 low;
+} IpSetKey;
+
+// Process-wide, each entry holds one reference on its set.
+static SRWLOCK ip_set_registry_lock = SRWLOCK_INIT;
+static IpSet* ip_set_registry = nullptr;
+
+static void
+ip_set_free(IpSet* ip_set)
+{
+	if (ip_set)
+	{
+		free(ip_set->nodes);
+		free(ip_set->values);
+		free(ip_set->strings);
+		free(ip_set);
+	}
+}
+
+static bool
+ip_set_grow(void** buffer, size_t element_size, size_t count, size_t* capacity)
+{
+	if (count < *capacity)
+		return true;
+
+	size_t new_capacity = *capacity ? *capacity * 2 : 256;
+	void* new_buffer = realloc(*buffer, new_capacity * element_size);
+
+	if (!new_buffer)
+		return false;
+
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+
+	return true;
+}
+
+static INT32
+ip_set_add_value(IpSet* ip_set, const char* value, size_t length)
+{
+	size_t value_capacity = ip_set->value_capacity;
+
+	if (!ip_set_grow((void**)&ip_set->values, sizeof(IpSetValue), ip_set->value_count, &value_capacity))
+		return -1;
+
+	ip_set->value_capacity = (UINT32)value_capacity;
+
+	while (ip_set->strings_length + length > ip_set->strings_capacity)
+	{
+		size_t capacity = ip_set->strings_capacity ? ip_set->strings_capacity * 2 : 4096;
+		char* strings = (char*)realloc(ip_set->strings, capacity);
+
+		if (!strings)
+			return -1;
+
+		ip_set->strings = strings;
+		ip_set->strings_capacity = capacity;
+	}
+
+	memcpy(ip_set->strings + ip_set->strings_length, value, length);
+
+	ip_set->values[ip_set->value_count].offset = ip_set->strings_length;
+	ip_set->values[ip_set->value_count].length = length;
+	ip_set->strings_length += length;
+
+	return (INT32)ip_set->value_count++;
+}
+
+static UINT32
+ip_set_new_node(IpSet* ip_set)
+{
+	size_t node_capacity = ip_set->node_capacity;
+
+	if (!ip_set_grow((void**)&ip_set->nodes, sizeof(IpSetNode), ip_set->node_count, &node_capacity))
+		return 0;
+
+	ip_set->node_capacity = (UINT32)node_capacity;
+
+	IpSetNode* node = &ip_set->nodes[ip_set->node_count];
+	node->children[0] = 0;
+	node->children[1] = 0;
+	node->value = -1;
+
+	return ip_set->node_count++;
+}
+
+static int
+ip_set_key_bit(IpSetKey key, int bit)
+{
+	return bit < 64 
+		? (int)((key.high >> (63 - bit)) & 1) 
+		: (int)((key.low >> (127 - bit)) & 1);
+}
+
+/**
+ * Later rules win when two of them cover exactly the same prefix.
+ */
+static bool
+ip_set_insert(IpSet* ip_set, IpSetKey key, int prefix_length, INT32 value)
+{
+	UINT32 node = 0;
+
+	for (int bit = 0; bit < prefix_length; bit++)
+	{
+		int direction = ip_set_key_bit(key, bit);
+		UINT32 child = ip_set->nodes[node].children[direction];
+
+		if (!child)
+		{
+			child = ip_set_new_node(ip_set);
+
+			if (!child)
+				return false;
+
+			ip_set->nodes[node].children[direction] = child;
+		}
+
+		node = child;
+	}
+
+	ip_set->nodes[node].value = value;
+
+	return true;
+}
+
+static IpSetKey
+ip_set_key_from_bytes(const unsigned char bytes[IP_SET_KEY_SIZE])
+{
+	IpSetKey key = { 0, 0 };
+
+	for (int i = 0; i < 8; i++)
+	{
+		key.high = (key.high << 8) | bytes[i];
+		key.low = (key.low << 8) | bytes[i + 8];
+	}
+
+	return key;
+}
+
+static bool
+ip_set_key_less_or_equal(IpSetKey a, IpSetKey b)
+{
+	return a.high < b.high || (a.high == b.high && a.low <= b.low);
+}
+
+/**
+ * Covers [start, end] with the fewest aligned prefixes, at most two per bit.
+ */
+static bool
+ip_set_insert_range(IpSet* ip_set, IpSetKey start, IpSetKey end, INT32 value)
+{
+	while (ip_set_key_less_or_equal(start, end))
+	{
+		// Largest block start is aligned to...
+		int size = 0;
+
+		while (size < 128 && ip_set_key_bit(start, 127 - size) == 0)
+			size++;
+
+		// ...that still ends inside the range.
+		for (;; size--)
+		{
+			IpSetKey last = start;
+
+			if (size >= 64)
+			{
+				last.low = ~0ULL;
+				last.high |= size == 128 ? ~0ULL : ((1ULL << (size - 64)) - 1);
+			}
+			else if (size > 0)
+			{
+				last.low |= (1ULL << size) - 1;
+			}
+
+			if (ip_set_key_less_or_equal(last, end))
+			{
+				if (!ip_set_insert(ip_set, start, 128 - size, value))
+					return false;
+
+				// Step past the block, stopping at the top of the address space.
+				if (last.high == ~0ULL && last.low == ~0ULL)
+					return true;
+
+				start.low = last.low + 1;
+				start.high = last.high + (start.low == 0 ? 1 : 0);
+
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool
+ip_set_parse_address(const char* address, unsigned char key[IP_SET_KEY_SIZE], bool* ipv4)
+{
+	IN_ADDR address_v4;
+	IN6_ADDR address_v6;
+
+	if (InetPtonA(AF_INET, address, &address_v4) == 1)
+	{
+		memset(key, 0, 10);
+		key[10] = 0xff;
+		key[11] = 0xff;
+		memcpy(key + 12, &address_v4, 4);
+
+		*ipv4 = true;
+		return true;
+	}
+
+	if (InetPtonA(AF_INET6, address, &address_v6) == 1)
+	{
+		memcpy(key, &address_v6, IP_SET_KEY_SIZE);
+
+		*ipv4 = false;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * One rule per line: an address, a CIDR prefix or a `first-last` range,
+ * optionally followed by a value. Blank lines and `#` comments are skipped.
+ */
+static bool
+ip_set_parse_line(IpSet* ip_set, char* line, size_t length, size_t line_number)
+{
+	while (length && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r'))
+		length--;
+
+	while (length && (*line == ' ' || *line == '\t'))
+	{
+		line++;
+		length--;
+	}
+
+	if (!length || *line == '#')
+		return true;
+
+	if (length >= IP_SET_MAX_LINE)
+	{
+		lua_engine_printf("ip set '%s' line %u is too long\n", ip_set->file_path, (unsigned)line_number);
+		return false;
+	}
+
+	char rule[IP_SET_MAX_LINE];
+	memcpy(rule, line, length);
+	rule[length] = '\0';
+
+	char* value = rule + strcspn(rule, " \t");
+
+	if (*value)
+	{
+		*value++ = '\0';
+		value += strspn(value, " \t");
+	}
+
+	INT32 value_index = ip_set_add_value(ip_set, value, strlen(value));
+
+	if (value_index < 0)
+		return false;
+
+	unsigned char first[IP_SET_KEY_SIZE];
+	unsigned char last[IP_SET_KEY_SIZE];
+	bool first_ipv4 = false;
+	bool last_ipv4 = false;
+
+	char* slash = strchr(rule, '/');
+	char* dash = strchr(rule, '-');
+
+	if (slash)
+	{
+		*slash = '\0';
+
+		char* end = nullptr;
+		long prefix_length = strtol(slash + 1, &end, 10);
+
+		if (ip_set_parse_address(rule, first, &first_ipv4) && end != slash + 1 && !*end
+			&& prefix_length >= 0 && prefix_length <= (first_ipv4 ? 32 : 128))
+		{
+			return ip_set_insert(
+				ip_set, 
+				ip_set_key_from_bytes(first), 
+				(int)prefix_length + (first_ipv4 ? 96 : 0), 
+				value_index
+			);
+		}
+	}
+	else if (dash)
+	{
+		*dash = '\0';
+
+		if (ip_set_parse_address(rule, first, &first_ipv4) 
+			&& ip_set_parse_address(dash + 1, last, &last_ipv4)
+			&& first_ipv4 == last_ipv4
+			&& ip_set_key_less_or_equal(ip_set_key_from_bytes(first), ip_set_key_from_bytes(last)))
+		{
+			return ip_set_insert_range(
+				ip_set, 
+				ip_set_key_from_bytes(first), 
+				ip_set_key_from_bytes(last), 
+				value_index
+			);
+		}
+	}
+	else if (ip_set_parse_address(rule, first, &first_ipv4))
+	{
+		return ip_set_insert(ip_set, ip_set_key_from_bytes(first), 128, value_index);
+	}
+
+	lua_engine_printf("ip set '%s' line %u is not a valid rule\n", ip_set->file_path, (unsigned)line_number);
+
+	return false;
+}
+
+static IpSet*
+ip_set_build(const char* file_path, const FILETIME* last_write_time)
+{
+	IpSet* ip_set = nullptr;
+	char* buffer = nullptr;
+	LARGE_INTEGER file_size;
+	DWORD bytes_read = 0;
+	size_t line_number = 0;
+
+	HANDLE file_handle = CreateFileA(
+		file_path,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		nullptr
+	);
+
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		lua_engine_printf("failed to open ip set '%s'\n", file_path);
+		return ip_set;
+	}
+
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart > IP_SET_MAX_FILE_SIZE)
+	{
+		lua_engine_printf("failed to size ip set '%s'\n", file_path);
+		goto error;
+	}
+
+	buffer = (char*)malloc((size_t)file_size.QuadPart + 1);
+	ip_set = (IpSet*)calloc(1, sizeof(IpSet));
+
+	if (!buffer || !ip_set)
+	{
+		lua_engine_printf("failed to allocate ip set '%s'\n", file_path);
+		goto error;
+	}
+
+	if (!ReadFile(file_handle, buffer, (DWORD)file_size.QuadPart, &bytes_read, nullptr))
+	{
+		lua_engine_printf("failed to read ip set '%s'\n", file_path);
+		goto error;
+	}
+
+	ip_set->ref_count = 1;
+	ip_set->last_write_time = *last_write_time;
+	strcpy_s(ip_set->file_path, file_path);
+
+	// The root always exists, inserts and lookups start from it.
+	ip_set_new_node(ip_set);
+
+	if (!ip_set->node_count)
+	{
+		lua_engine_printf("failed to allocate ip set '%s'\n", file_path);
+		goto error;
+	}
+
+	for (char* line = buffer; line < buffer + bytes_read; )
+	{
+		char* line_end = (char*)memchr(line, '\n', buffer + bytes_read - line);
+
+		if (!line_end)
+			line_end = buffer + bytes_read;
+
+		if (!ip_set_parse_line(ip_set, line, line_end - line, ++line_number))
+			goto error;
+
+		line = line_end + 1;
+	}
+
+	goto finish;
+
+error:
+	ip_set_free(ip_set);
+	ip_set = nullptr;
+
+finish:
+	if (buffer)
+		free(buffer);
+
+	CloseHandle(file_handle);
+
+	return ip_set;
+}
+
+/**
+ * Returns the shared set for a file, rebuilding it when the file changed
+ * since it was last loaded. Holders of the previous set keep using it.
+ */
+IpSet*
+ip_set_acquire(const char* file_path)
+{
+	assert(file_path != nullptr);
+
+	IpSet* ip_set = nullptr;
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+	if (!file_path || !GetFileAttributesExA(file_path, GetFileExInfoStandard, &attributes))
+	{
+		lua_engine_printf("failed to find ip set '%s'\n", file_path ? file_path : "");
+		return ip_set;
+	}
+
+	AcquireSRWLockShared(&ip_set_registry_lock);
+
+	for (IpSet* entry = ip_set_registry; entry; entry = entry->next)
+	{
+		if (_stricmp(entry->file_path, file_path) == 0 
+			&& CompareFileTime(&entry->last_write_time, &attributes.ftLastWriteTime) == 0)
+		{
+			InterlockedIncrement(&entry->ref_count);
+			ip_set = entry;
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&ip_set_registry_lock);
+
+	if (ip_set)
+		return ip_set;
+
+	ip_set = ip_set_build(file_path, &attributes.ftLastWriteTime);
+
+	if (!ip_set)
+		return ip_set;
+
+	AcquireSRWLockExclusive(&ip_set_registry_lock);
+
+	// Replace any stale entry for the same file, dropping the registry's reference on it.
+	for (IpSet** entry = &ip_set_registry; *entry; entry = &(*entry)->next)
+	{
+		if (_stricmp((*entry)->file_path, file_path) == 0)
+		{
+			IpSet* stale = *entry;
+			*entry = stale->next;
+
+			ip_set_release(stale);
+			break;
+		}
+	}
+
+	InterlockedIncrement(&ip_set->ref_count);
+	ip_set->next = ip_set_registry;
+	ip_set_registry = ip_set;
+
+	ReleaseSRWLockExclusive(&ip_set_registry_lock);
+
+	return ip_set;
+}
+
+IpSet*
+ip_set_release(IpSet* ip_set)
+{
+	if (ip_set && InterlockedDecrement(&ip_set->ref_count) == 0)
+	{
+		ip_set_free(ip_set);
+	}
+
+	return nullptr;
+}
+
+void
+ip_set_clear_registry()
+{
+	AcquireSRWLockExclusive(&ip_set_registry_lock);
+
+	IpSet* entry = ip_set_registry;
+	ip_set_registry = nullptr;
+
+	ReleaseSRWLockExclusive(&ip_set_registry_lock);
+
+	while (entry)
+	{
+		IpSet* next = entry->next;
+
+		ip_set_release(entry);
+		entry = next;
+	}
+}
+
+/**
+ * Longest-prefix match, touching at most one node per key bit.
+ */
+bool
+ip_set_lookup(
+	const IpSet* ip_set,
+	const unsigned char key[IP_SET_KEY_SIZE],
+	const char** value,
+	size_t* value_length
+)
+{
+	assert(ip_set != nullptr);
+
+	if (!ip_set || !ip_set->node_count)
+		return false;
+
+	INT32 best = -1;
+	UINT32 node = 0;
+
+	for (int bit = 0; ; bit++)
+	{
+		if (ip_set->nodes[node].value >= 0)
+			best = ip_set->nodes[node].value;
+
+		if (bit == 128)
+			break;
+
+		UINT32 child = ip_set->nodes[node].children[(key[bit >> 3] >> (7 - (bit & 7))) & 1];
+
+		if (!child)
+			break;
+
+		node = child;
+	}
+
+	if (best < 0)
+		return false;
+
+	if (value)
+		*value = ip_set->strings + ip_set->values[best].offset;
+
+	if (value_length)
+		*value_length = ip_set->values[best].length;
+
+	return true;
+}
+
+bool
+ip_set_key_from_sockaddr(const SOCKADDR* address, unsigned char key[IP_SET_KEY_SIZE])
+{
+	if (!address)
+		return false;
+
+	if (address->sa_family == AF_INET)
+	{
+		memset(key, 0, 10);
+		key[10] = 0xff;
+		key[11] = 0xff;
+		memcpy(key + 12, &((const sockaddr_in*)address)->sin_addr, 4);
+
+		return true;
+	}
+
+	if (address->sa_family == AF_INET6)
+	{
+		memcpy(key, &((const sockaddr_in6*)address)->sin6_addr, IP_SET_KEY_SIZE);
+
+		return true;
+	}
+
+	return false;
+}
+
+bool
+ip_set_key_from_string(const char* address, unsigned char key[IP_SET_KEY_SIZE])
+{
+	bool ipv4;
+
+	return address && ip_set_parse_address(address, key, &ipv4);
+}
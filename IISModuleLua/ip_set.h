@@ -0,0 +1,24 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _IP_SET
+#define _IP_SET
+
+#define IP_SET_KEY_SIZE 16
+
+typedef struct _IpSet IpSet;
+
+IpSet* ip_set_acquire(const char* file_path);
+IpSet* ip_set_release(IpSet* ip_set);
+void ip_set_clear_registry();
+
+bool ip_set_lookup(
+	const IpSet* ip_set, 
+	const unsigned char key[IP_SET_KEY_SIZE], 
+	const char** value, 
+	size_t* value_length
+);
+bool ip_set_key_from_sockaddr(const SOCKADDR* address, unsigned char key[IP_SET_KEY_SIZE]);
+bool ip_set_key_from_string(const char* address, unsigned char key[IP_SET_KEY_SIZE]);
+
+#endif
@@ -0,0 +1,402 @@
+#include "shared.h"
+
+// Slabs come straight from VirtualAlloc, whose 64 KB allocation granularity
+// keeps every slab aligned to its size so a block finds its slab by masking.
+#define LUA_ALLOCATOR_SLAB_SIZE (64 * 1024)
+#define LUA_ALLOCATOR_SLAB_HEADER 64
+#define LUA_ALLOCATOR_MAX_SMALL 512
+
+/**
+ * Every lua state gets its own private heap, small blocks are carved out of
+ * size-class slabs with a free list each. Lua always passes the old size back,
+ * so no per-block header is needed to find the class. A slab that empties out
+ * goes back to the system unless it is the last one of its class with free
+ * blocks, so an engine does not hold on to its peak after a large request.
+ */
+static const size_t lua_allocator_classes[] =
+{
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+#define LUA_ALLOCATOR_CLASS_COUNT _countof(lua_allocator_classes)
+
+typedef struct _LuaAllocatorBlock
+{
+	struct _LuaAllocatorBlock* next;
+} LuaAllocatorBlock;
+
+typedef struct _LuaAllocatorSlab
+{
+	struct _LuaAllocatorSlab* next;
+	struct _LuaAllocatorSlab* prev;
+
+	LuaAllocatorBlock* free_list;
+	size_t used;
+} LuaAllocatorSlab;
+
+static_assert(sizeof(LuaAllocatorSlab) <= LUA_ALLOCATOR_SLAB_HEADER, "slab header does not fit");
+
+typedef struct _LuaAllocator
+{
+	HANDLE heap_handle;
+
+	// Slabs with at least one free block, and slabs without any.
+	LuaAllocatorSlab* partial_slabs[LUA_ALLOCATOR_CLASS_COUNT];
+	LuaAllocatorSlab* full_slabs[LUA_ALLOCATOR_CLASS_COUNT];
+
+	size_t bytes_in_use;
+	size_t memory_limit;
+
+	// The limit is only enforced inside the protected handler call,
+	// failing anywhere else would take the process down through lua's panic.
+	bool enforced;
+} LuaAllocator;
+
+// Whether lua_newstate accepts a custom allocator, settled once by lua_allocator_probe.
+static bool lua_allocator_supported = false;
+
+static int
+lua_allocator_class(size_t size)
+{
+	for (int i = 0; i < (int)LUA_ALLOCATOR_CLASS_COUNT; i++)
+	{
+		if (size <= lua_allocator_classes[i])
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+lua_allocator_link(LuaAllocatorSlab** list, LuaAllocatorSlab* slab)
+{
+	slab->prev = nullptr;
+	slab->next = *list;
+
+	if (*list)
+		(*list)->prev = slab;
+
+	*list = slab;
+}
+
+static void
+lua_allocator_unlink(LuaAllocatorSlab** list, LuaAllocatorSlab* slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->next = slab->prev = nullptr;
+}
+
+static LuaAllocatorSlab*
+lua_allocator_slab_of(void* ptr)
+{
+	return (LuaAllocatorSlab*)((UINT_PTR)ptr & ~(UINT_PTR)(LUA_ALLOCATOR_SLAB_SIZE - 1));
+}
+
+static LuaAllocatorSlab*
+lua_allocator_refill(LuaAllocator* allocator, int size_class)
+{
+	char* memory = (char*)VirtualAlloc(nullptr, LUA_ALLOCATOR_SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+	if (!memory)
+		return nullptr;
+
+	assert(lua_allocator_slab_of(memory) == (LuaAllocatorSlab*)memory);
+
+	LuaAllocatorSlab* slab = (LuaAllocatorSlab*)memory;
+	slab->free_list = nullptr;
+	slab->used = 0;
+
+	size_t block_size = lua_allocator_classes[size_class];
+
+	for (size_t offset = LUA_ALLOCATOR_SLAB_HEADER; offset + block_size <= LUA_ALLOCATOR_SLAB_SIZE; offset += block_size)
+	{
+		LuaAllocatorBlock* block = (LuaAllocatorBlock*)(memory + offset);
+		block->next = slab->free_list;
+
+		slab->free_list = block;
+	}
+
+	lua_allocator_link(&allocator->partial_slabs[size_class], slab);
+
+	return slab;
+}
+
+static void*
+lua_allocator_malloc(LuaAllocator* allocator, size_t size)
+{
+	int size_class = lua_allocator_class(size);
+
+	if (size_class < 0)
+		return HeapAlloc(allocator->heap_handle, 0, size);
+
+	LuaAllocatorSlab* slab = allocator->partial_slabs[size_class];
+
+	if (!slab && !(slab = lua_allocator_refill(allocator, size_class)))
+		return nullptr;
+
+	LuaAllocatorBlock* block = slab->free_list;
+	slab->free_list = block->next;
+	slab->used++;
+
+	if (!slab->free_list)
+	{
+		lua_allocator_unlink(&allocator->partial_slabs[size_class], slab);
+		lua_allocator_link(&allocator->full_slabs[size_class], slab);
+	}
+
+	return block;
+}
+
+static void
+lua_allocator_free(LuaAllocator* allocator, void* ptr, size_t size)
+{
+	int size_class = lua_allocator_class(size);
+
+	if (size_class < 0)
+	{
+		HeapFree(allocator->heap_handle, 0, ptr);
+		return;
+	}
+
+	LuaAllocatorSlab* slab = lua_allocator_slab_of(ptr);
+
+	if (!slab->free_list)
+	{
+		lua_allocator_unlink(&allocator->full_slabs[size_class], slab);
+		lua_allocator_link(&allocator->partial_slabs[size_class], slab);
+	}
+
+	LuaAllocatorBlock* block = (LuaAllocatorBlock*)ptr;
+	block->next = slab->free_list;
+
+	slab->free_list = block;
+	slab->used--;
+
+	// Keeping the last one around stops a single allocation bouncing a
+	// slab in and out of the system at the boundary.
+	if (slab->used == 0 && (slab->prev || slab->next))
+	{
+		lua_allocator_unlink(&allocator->partial_slabs[size_class], slab);
+		VirtualFree(slab, 0, MEM_RELEASE);
+	}
+}
+
+static void
+lua_allocator_release_slabs(LuaAllocatorSlab** list)
+{
+	while (*list)
+	{
+		LuaAllocatorSlab* slab = *list;
+		*list = slab->next;
+
+		VirtualFree(slab, 0, MEM_RELEASE);
+	}
+}
+
+void*
+lua_allocator_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	LuaAllocator* allocator = (LuaAllocator*)ud;
+
+	if (!ptr)
+		osize = 0;
+
+	if (nsize == 0)
+	{
+		if (ptr)
+		{
+			lua_allocator_free(allocator, ptr, osize);
+			allocator->bytes_in_use -= osize;
+		}
+
+		return nullptr;
+	}
+
+	if (nsize > osize
+		&& allocator->enforced
+		&& allocator->memory_limit
+		&& allocator->bytes_in_use + (nsize - osize) > allocator->memory_limit)
+	{
+		return nullptr;
+	}
+
+	void* block = nullptr;
+	int old_class = ptr ? lua_allocator_class(osize) : -1;
+	int new_class = lua_allocator_class(nsize);
+
+	if (ptr && old_class >= 0 && old_class == new_class)
+	{
+		block = ptr;
+	}
+	else if (ptr && old_class < 0 && new_class < 0)
+	{
+		block = HeapReAlloc(allocator->heap_handle, 0, ptr, nsize);
+	}
+	else
+	{
+		block = lua_allocator_malloc(allocator, nsize);
+
+		if (block && ptr)
+		{
+			memcpy(block, ptr, min(osize, nsize));
+			lua_allocator_free(allocator, ptr, osize);
+		}
+	}
+
+	// Lua assumes shrinking never fails, the old block is big enough to keep.
+	if (!block && ptr && nsize <= osize)
+	{
+		block = ptr;
+	}
+
+	if (block)
+	{
+		allocator->bytes_in_use += nsize - osize;
+	}
+
+	return block;
+}
+
+LuaAllocator*
+lua_allocator_create(size_t memory_limit)
+{
+	LuaAllocator* allocator = (LuaAllocator*)calloc(1, sizeof(LuaAllocator));
+
+	assert(allocator != nullptr);
+
+	if (allocator)
+	{
+		// Only ever touched by the thread that currently owns the state.
+		allocator->heap_handle = HeapCreate(HEAP_NO_SERIALIZE, 0, 0);
+		allocator->memory_limit = memory_limit;
+
+		if (!allocator->heap_handle)
+		{
+			lua_engine_printf("failed to create lua state heap\n");
+
+			free(allocator);
+			allocator = nullptr;
+		}
+	}
+
+	return allocator;
+}
+
+LuaAllocator*
+lua_allocator_destroy(LuaAllocator* allocator)
+{
+	if (allocator)
+	{
+		for (int i = 0; i < (int)LUA_ALLOCATOR_CLASS_COUNT; i++)
+		{
+			lua_allocator_release_slabs(&allocator->partial_slabs[i]);
+			lua_allocator_release_slabs(&allocator->full_slabs[i]);
+		}
+
+		if (allocator->heap_handle)
+		{
+			HeapDestroy(allocator->heap_handle);
+			allocator->heap_handle = nullptr;
+		}
+
+		free(allocator);
+		allocator = nullptr;
+	}
+
+	return allocator;
+}
+
+void
+lua_allocator_set_enforced(LuaAllocator* allocator, bool enforced)
+{
+	if (allocator)
+	{
+		allocator->enforced = enforced;
+	}
+}
+
+/**
+ * 64-bit LuaJIT without GC64 refuses custom allocators outright, which is
+ * checked once here rather than on every state creation.
+ */
+bool
+lua_allocator_probe()
+{
+	LuaAllocator* allocator = lua_allocator_create(0);
+
+	if (allocator)
+	{
+		lua_State* L = lua_newstate(&lua_allocator_alloc, allocator);
+
+		lua_allocator_supported = L != nullptr;
+
+		if (L)
+		{
+			lua_close(L);
+		}
+
+		allocator = lua_allocator_destroy(allocator);
+	}
+
+	return lua_allocator_supported;
+}
+
+bool
+lua_allocator_is_supported()
+{
+	return lua_allocator_supported;
+}
+
+/**
+ * Without a custom allocator the figure comes from the collector's own count
+ * and there is no limit, which is reported as 0.
+ */
+static int
+lua_allocator_memory_usage(lua_State* L)
+{
+	lua_stack_guard(L, 2);
+
+	LuaAllocator* allocator = (LuaAllocator*)lua_touserdata(L, lua_upvalueindex(1));
+
+	if (allocator)
+	{
+		lua_pushnumber(L, (lua_Number)allocator->bytes_in_use);
+		lua_pushnumber(L, (lua_Number)allocator->memory_limit);
+	}
+	else
+	{
+		lua_Number bytes = (lua_Number)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+
+		lua_pushnumber(L, bytes);
+		lua_pushnumber(L, 0);
+	}
+
+	return 2;
+}
+
+/**
+ * Pushes iis.MemoryUsage into the table on top of the stack, allocator may
+ * be null when the custom allocator is not supported.
+ */
+void
+lua_allocator_register(lua_State* L, LuaAllocator* allocator)
+{
+	assert(L != nullptr);
+
+	if (L)
+	{
+		lua_stack_guard(L, 0);
+
+		lua_pushstring(L, "MemoryUsage");
+		lua_pushlightuserdata(L, allocator);
+		lua_pushcclosure(L, lua_allocator_memory_usage, 1);
+		lua_rawset(L, -3);
+	}
+}
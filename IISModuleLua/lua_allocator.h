@@ -0,0 +1,18 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _LUA_ALLOCATOR
+#define _LUA_ALLOCATOR
+
+typedef struct _LuaAllocator LuaAllocator;
+
+LuaAllocator* lua_allocator_create(size_t memory_limit);
+LuaAllocator* lua_allocator_destroy(LuaAllocator* allocator);
+void* lua_allocator_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+void lua_allocator_set_enforced(LuaAllocator* allocator, bool enforced);
+bool lua_allocator_probe();
+bool lua_allocator_is_supported();
+void lua_allocator_register(lua_State* L, LuaAllocator* allocator);
+
+#endif
@@ -0,0 +1,89 @@
+#include "shared.h"
+
+/**
+ * The configuration lives next to the script, in Public\<apppool>\<apppool>.ini,
+ * any missing file, section or key falls back to the defaults below.
+ */
+static void
+lua_config_set_defaults(LuaConfig* config)
+{
+	assert(config != nullptr);
+
+	config->min_engines = 1;
+	config->max_engines = 256;
+	config->max_waiters = 1024;
+	config->acquire_timeout = 5000;
+
+	config->reload_debounce = 250;
+
+	config->memory_limit = 0;
+
+	config->body_read_size = 64 * 1024;
+
+	config->file_cache_size = 256;
+
+	config->compression_level = 6;
+	config->compression_min_size = 1024;
+	config->compression_cache_size = 16 * 1024;
+
+	config->gc_steps = 4;
+	config->gc_step_size = 0;
+	config->gc_pause = 200;
+	config->gc_stepmul = 200;
+}
+
+static DWORD
+lua_config_read(
+	const wchar_t* file_path,
+	const wchar_t* section,
+	const wchar_t* key,
+	DWORD default_value
+)
+{
+	return GetPrivateProfileIntW(section, key, default_value, file_path);
+}
+
+void
+lua_config_load(LuaConfig* config, const wchar_t* file_path)
+{
+	assert(config != nullptr);
+
+	if (!config)
+		return;
+
+	lua_config_set_defaults(config);
+
+	if (file_path)
+	{
+		config->min_engines = lua_config_read(file_path, L"pool", L"min_engines", config->min_engines);
+		config->max_engines = lua_config_read(file_path, L"pool", L"max_engines", config->max_engines);
+		config->max_waiters = lua_config_read(file_path, L"pool", L"max_waiters", config->max_waiters);
+		config->acquire_timeout = lua_config_read(file_path, L"pool", L"acquire_timeout", config->acquire_timeout);
+
+		config->reload_debounce = lua_config_read(file_path, L"reload", L"debounce", config->reload_debounce);
+
+		config->memory_limit = lua_config_read(file_path, L"memory", L"limit", config->memory_limit);
+
+		config->body_read_size = lua_config_read(file_path, L"body", L"read_size", config->body_read_size);
+
+		config->file_cache_size = lua_config_read(file_path, L"files", L"cache_size", config->file_cache_size);
+
+		config->compression_level = lua_config_read(file_path, L"compression", L"level", config->compression_level);
+		config->compression_min_size = lua_config_read(file_path, L"compression", L"min_size", config->compression_min_size);
+		config->compression_cache_size = lua_config_read(file_path, L"compression", L"cache_size", config->compression_cache_size);
+
+		config->gc_steps = lua_config_read(file_path, L"gc", L"steps", config->gc_steps);
+		config->gc_step_size = lua_config_read(file_path, L"gc", L"step_size", config->gc_step_size);
+		config->gc_pause = lua_config_read(file_path, L"gc", L"pause", config->gc_pause);
+		config->gc_stepmul = lua_config_read(file_path, L"gc", L"stepmul", config->gc_stepmul);
+	}
+
+	if (config->max_engines < 1)
+		config->max_engines = 1;
+
+	if (config->min_engines > config->max_engines)
+		config->min_engines = config->max_engines;
+
+	if (config->compression_level > 9)
+		config->compression_level = 9;
+}
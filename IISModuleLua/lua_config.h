@@ -0,0 +1,43 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _LUA_CONFIG
+#define _LUA_CONFIG
+
+typedef struct _LuaConfig
+{
+	// [pool]
+	DWORD min_engines;
+	DWORD max_engines;
+	DWORD max_waiters;
+	DWORD acquire_timeout;
+
+	// [reload]
+	DWORD reload_debounce;
+
+	// [memory]
+	// Kilobytes per state, only enforced where LuaJIT accepts a custom
+	// allocator, which 64-bit builds only do with GC64.
+	DWORD memory_limit;
+
+	// [body]
+	DWORD body_read_size;
+
+	// [files]
+	DWORD file_cache_size;
+
+	// [compression]
+	DWORD compression_level;
+	DWORD compression_min_size;
+	DWORD compression_cache_size;
+
+	// [gc]
+	DWORD gc_steps;
+	DWORD gc_step_size;
+	DWORD gc_pause;
+	DWORD gc_stepmul;
+} LuaConfig;
+
+void lua_config_load(LuaConfig* config, const wchar_t* file_path);
+
+#endif
@@ -1,11 +1,73 @@
 #include "shared.h"
 
+#define LUA_ENGINE_IDLE 0
+#define LUA_ENGINE_BUSY 1
+
+/**
+ * Lives inside its lua state as an anchored userdata, so the dispatch path
+ * reaches the handler and the request objects through plain registry refs.
+ */
+// Finished handler coroutines kept for the next request, beyond this they are dropped.
+#define LUA_ENGINE_IDLE_THREADS 8
+
+typedef struct _LuaEngineThread
+{
+	lua_State* thread;
+	int thread_ref;
+} LuaEngineThread;
+
+typedef struct _LuaEngineBindings
+{
+	int handler_ref;
+
+	int request_ref;
+	RequestLua* request_lua;
+
+	int response_ref;
+	ResponseLua* response_lua;
+
+	// Still referenced from the registry, so they live as long as the state.
+	LuaEngineThread idle_threads[LUA_ENGINE_IDLE_THREADS];
+	int idle_thread_count;
+} LuaEngineBindings;
+
+/**
+ * A finished replacement build, published and taken as a single pointer so
+ * the state and its bindings always travel together.
+ */
+typedef struct _LuaEnginePending
+{
+	lua_State* L;
+	LuaEngineBindings* bindings;
+	LONG generation;
+} LuaEnginePending;
+
 typedef struct _LuaEngine
 {
 	lua_State* L;
-	HANDLE mutex_handle;
-	HANDLE directory_changes_handle;
-	char file_path[MAX_PATH];
+	LuaEngineBindings* bindings;
+	LuaScriptCache* script_cache;
+	LuaStats* stats;
+	const LuaConfig* config;
+
+	// Ownership word, engines are owned by exactly one request at a time
+	// so taking it is usually an uncontended interlocked exchange. Resuming
+	// a suspended handler is the one case that has to wait for the owner.
+	volatile LONG state;
+
+	// Handlers suspended on an asynchronous read, and finished requests
+	// with strings still pinned for IIS, each one pins this state.
+	volatile LONG suspended;
+
+	// Script generation this state was loaded from, see lua_engine_refresh.
+	LONG loaded_generation;
+
+	// Replacement state built off the request path, swapped in by the
+	// owner between requests once it has loaded successfully.
+	volatile LONG building;
+	LONG building_generation;
+	LuaScript* building_script;
+	LuaEnginePending* volatile pending;
 
 	SLIST_ENTRY* list_entry;
 } LuaEngine;
@@ -30,10 +92,13 @@ lua_engine_register(lua_State* L)
 {
 	lua_stack_guard(L, 0);
 
+	LuaEngineBindings* bindings = (LuaEngineBindings*)lua_touserdata(L, lua_upvalueindex(1));
+
 	luaL_checktype(L, 1, LUA_TFUNCTION);
 	lua_pushvalue(L, 1);
 
-	lua_setfield(L, LUA_REGISTRYINDEX, "lua_engine_begin_request");
+	luaL_unref(L, LUA_REGISTRYINDEX, bindings->handler_ref);
+	bindings->handler_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
 	return 0;
 }
@@ -86,31 +151,50 @@ static bool
 lua_engine_lock(LuaEngine* lua_engine)
 {
 	assert(lua_engine != nullptr);
-	assert(lua_engine->mutex_handle != nullptr);
 
-	DWORD retvalue = WAIT_FAILED;
+	if (!lua_engine)
+		return false;
 
-	if (lua_engine && lua_engine->mutex_handle)
+	for (DWORD spin_count = 0; 
+		InterlockedCompareExchange(&lua_engine->state, LUA_ENGINE_BUSY, LUA_ENGINE_IDLE) != LUA_ENGINE_IDLE;
+		spin_count++)
 	{
-		retvalue = WaitForSingleObject(lua_engine->mutex_handle, INFINITE);
+		if (spin_count < 64)
+		{
+			YieldProcessor();
+		}
+		else
+		{
+			LONG busy = LUA_ENGINE_BUSY;
+			WaitOnAddress(&lua_engine->state, &busy, sizeof(busy), INFINITE);
+		}
 	}
 
-	return retvalue == WAIT_OBJECT_0;
+	return true;
 }
 
 static bool 
 lua_engine_unlock(LuaEngine* lua_engine)
 {	
 	assert(lua_engine != nullptr);
-	assert(lua_engine->mutex_handle != nullptr);
+	assert(lua_engine->state == LUA_ENGINE_BUSY);
 
-	return lua_engine 
-		&& lua_engine->mutex_handle 
-		&& !ReleaseMutex(lua_engine->mutex_handle);
+	if (!lua_engine || InterlockedExchange(&lua_engine->state, LUA_ENGINE_IDLE) != LUA_ENGINE_BUSY)
+		return false;
+
+	WakeByAddressSingle((PVOID)&lua_engine->state);
+
+	return true;
 }
 
 static void 
-lua_engine_register_http(lua_State* L)
+lua_engine_register_http(
+	lua_State* L, 
+	LuaScriptCache* script_cache,
+	LuaEngineBindings* bindings,
+	LuaStats* stats, 
+	LuaAllocator* allocator
+)
 {
 	assert(L != nullptr);
 
@@ -140,9 +224,16 @@ lua_engine_register_http(lua_State* L)
 		}
 
 		lua_pushstring(L, "Register");
-		lua_pushcfunction(L, lua_engine_register);
+		lua_pushlightuserdata(L, bindings);
+		lua_pushcclosure(L, lua_engine_register, 1);
 		lua_rawset(L, -3);
 
+		lua_stats_register(L, stats);
+		lua_allocator_register(L, allocator);
+		lua_request_register_headers(L);
+		lua_request_register_server_variables(L);
+		lua_ip_set_register(L, lua_script_cache_get_directory(script_cache));
+
 		lua_rawset(L, -3);
 
 		lua_pushstring(L, "__newindex");
@@ -154,21 +245,103 @@ lua_engine_register_http(lua_State* L)
 	}
 }
 
+static LuaEngineBindings*
+lua_engine_new_bindings(lua_State* L, const LuaConfig* config, const char* directory_path)
+{
+	lua_stack_guard(L, 0);
+
+	LuaEngineBindings* bindings = (LuaEngineBindings*)lua_newuserdata(L, sizeof(LuaEngineBindings));
+	luaL_ref(L, LUA_REGISTRYINDEX);
+
+	bindings->handler_ref = LUA_NOREF;
+	bindings->idle_thread_count = 0;
+
+	bindings->response_lua = lua_response_push(L, config, directory_path);
+	bindings->response_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	bindings->request_lua = lua_request_push(L, config ? config->body_read_size : 0);
+	bindings->request_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lua_response_bind(bindings->response_lua, nullptr, nullptr, LUA_NOREF);
+	lua_request_bind(bindings->request_lua, nullptr, nullptr, nullptr);
+
+	return bindings;
+}
+
+static LuaAllocator*
+lua_engine_get_allocator(lua_State* L)
+{
+	void* ud = nullptr;
+	lua_Alloc alloc = lua_getallocf(L, &ud);
+
+	return alloc == &lua_allocator_alloc ? (LuaAllocator*)ud : nullptr;
+}
+
+static void
+lua_engine_close_lua_state(lua_State* L)
+{
+	LuaAllocator* allocator = lua_engine_get_allocator(L);
+
+	lua_close(L);
+
+	if (allocator)
+	{
+		allocator = lua_allocator_destroy(allocator);
+	}
+}
+
 static lua_State* 
-lua_engine_new_lua_state()
+lua_engine_new_lua_state(
+	LuaScriptCache* script_cache, 
+	LuaStats* stats, 
+	const LuaConfig* config,
+	LuaEngineBindings** bindings
+)
 {
-	lua_State* L = luaL_newstate();
+	lua_State* L = nullptr;
+	LuaAllocator* allocator = nullptr;
+
+	if (lua_allocator_is_supported())
+	{
+		allocator = lua_allocator_create(config ? (size_t)config->memory_limit * 1024 : 0);
+	}
+
+	if (allocator)
+	{
+		L = lua_newstate(&lua_allocator_alloc, allocator);
+
+		if (!L)
+		{
+			allocator = lua_allocator_destroy(allocator);
+		}
+	}
+
+	if (!L)
+	{
+		L = luaL_newstate();
+	}
 
 	assert(L != nullptr);
 
 	if (L)
 	{
-		luaL_openlibs(L);
+		if (config)
+		{
+			lua_gc(L, LUA_GCSETPAUSE, (int)config->gc_pause);
+			lua_gc(L, LUA_GCSETSTEPMUL, (int)config->gc_stepmul);
+		}
 
-		lua_engine_register_http(L);
+		luaL_openlibs(L);
 
 		lua_response_register(L);
 		lua_request_register(L);
+		lua_form_register(L);
+
+		*bindings = lua_engine_new_bindings(L, config, lua_script_cache_get_directory(script_cache));
+
+		lua_engine_register_http(L, script_cache, *bindings, stats, allocator);
+
+		lua_script_cache_register(L, script_cache);
 
 		lua_register(L, "print", lua_engine_print);
 	}
@@ -176,214 +349,478 @@ lua_engine_new_lua_state()
 	return L;
 }
 
-static void CALLBACK 
-lua_engine_watch_callback(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
+static lua_State*
+lua_engine_build_lua_state(
+	LuaScriptCache* script_cache, 
+	LuaStats* stats, 
+	const LuaConfig* config,
+	const LuaScript* script,
+	LuaEngineBindings** bindings
+)
+{
+	lua_State* L = lua_engine_new_lua_state(script_cache, stats, config, bindings);
+
+	if (!L)
+	{
+		lua_engine_printf("failed to create lua state\n");
+		return L;
+	}
+
+	if (script && (lua_script_load(L, script) || lua_pcall(L, 0, 0, 0)) != 0)
+	{
+		lua_engine_printf("%s\n", lua_tostring(L, -1));
+
+		lua_engine_close_lua_state(L);
+		L = nullptr;
+	}
+
+	return L;
+}
+
+static void
+lua_engine_free_pending(LuaEnginePending* pending)
+{
+	if (pending)
+	{
+		lua_engine_close_lua_state(pending->L);
+		free(pending);
+	}
+}
+
+static DWORD WINAPI
+lua_engine_build_callback(LPVOID lpParameter)
 {
 	assert(lpParameter != nullptr);
 
 	LuaEngine* lua_engine = (LuaEngine*)lpParameter;
+	LuaEngineBindings* bindings = nullptr;
+	lua_State* L = lua_engine_build_lua_state(
+		lua_engine->script_cache, 
+		lua_engine->stats, 
+		lua_engine->config,
+		lua_engine->building_script,
+		&bindings
+	);
 
-	if (lua_engine && lua_engine->L && lua_engine_lock(lua_engine))
+	lua_engine->building_script = lua_script_release(lua_engine->building_script);
+
+	LuaEnginePending* pending = L ? (LuaEnginePending*)malloc(sizeof(LuaEnginePending)) : nullptr;
+
+	if (pending)
 	{
-		lua_engine_printf("detected changes, reloading script\n");
+		pending->L = L;
+		pending->bindings = bindings;
+		pending->generation = lua_engine->building_generation;
+
+		// A newer build may have landed while nobody took the previous one.
+		LuaEnginePending* previous = (LuaEnginePending*)InterlockedExchangePointer(
+			(PVOID volatile*)&lua_engine->pending, 
+			pending
+		);
 
-		lua_close(lua_engine->L);
-		lua_engine->L = lua_engine_new_lua_state();
+		lua_engine_free_pending(previous);
+	}
+	else
+	{
+		lua_engine_printf("failed to build replacement lua state, keeping the current one\n");
 
-		if (lua_engine_load_file(lua_engine->L, lua_engine->file_path) != 0)
+		if (L)
 		{
-			lua_engine_printf("%s\n", lua_tostring(lua_engine->L, -1));
-			lua_pop(lua_engine->L, 1);
+			lua_engine_close_lua_state(L);
+			L = nullptr;
 		}
+	}
 
-		if (FindNextChangeNotification(lua_engine->directory_changes_handle))
-		{
-			HANDLE registration_handle;
-			BOOL result = RegisterWaitForSingleObject(
-				&registration_handle,
-				lua_engine->directory_changes_handle,
-				&lua_engine_watch_callback,
-				(void*)lua_engine,
-				INFINITE,
-				WT_EXECUTEONLYONCE
-			);
-
-			if (!result)
-			{
-				lua_engine_printf("failed to register a wait for further directory changes\n");
+	InterlockedExchange(&lua_engine->building, 0);
 
-				CloseHandle(lua_engine->directory_changes_handle);
-				lua_engine->directory_changes_handle = nullptr;
-			}
-		}
-		else
-		{
-			lua_engine_printf("failed to register a notification for further directory changes\n");
+	return 0;
+}
+
+static void
+lua_engine_swap_pending(LuaEngine* lua_engine)
+{
+	assert(lua_engine != nullptr);
+	assert(lua_engine->state == LUA_ENGINE_BUSY);
+
+	// Suspended handlers live in the current state, the swap waits until they are done.
+	if (lua_engine->suspended)
+		return;
+
+	LuaEnginePending* pending = (LuaEnginePending*)InterlockedExchangePointer(
+		(PVOID volatile*)&lua_engine->pending, 
+		nullptr
+	);
+
+	// The old state is only retired here, by its owner, between requests,
+	// so no handler can still be running on it.
+	if (pending)
+	{
+		lua_engine_close_lua_state(lua_engine->L);
 
-			CloseHandle(lua_engine->directory_changes_handle);
-			lua_engine->directory_changes_handle = nullptr;
+		lua_engine->L = pending->L;
+		lua_engine->bindings = pending->bindings;
+		lua_engine->loaded_generation = pending->generation;
+
+		free(pending);
+	}
+}
+
+/**
+ * Checks that a reloaded script loads before any engine moves to it. Only
+ * the bytecode is loaded, top-level code runs once per engine in its own
+ * replacement state and never in a throwaway one. A script whose top level
+ * fails leaves every engine on its current state.
+ */
+bool
+lua_engine_validate(LuaScriptCache* script_cache, const LuaScript* script)
+{
+	UNREFERENCED_PARAMETER(script_cache);
+	assert(script != nullptr);
+
+	bool valid = false;
+	lua_State* L = luaL_newstate();
+
+	if (L && script)
+	{
+		valid = lua_script_load(L, script) == 0;
+
+		if (!valid)
+		{
+			lua_engine_printf("%s\n", lua_tostring(L, -1));
 		}
+	}
 
-		lua_engine_unlock(lua_engine);
+	if (L)
+	{
+		lua_close(L);
+		L = nullptr;
+	}
+
+	return valid;
+}
+
+/**
+ * A coroutine that returned can run the next handler, which keeps a new
+ * thread per request off the collector. One that failed is dead, and one
+ * still suspended can never be resumed again, so both are dropped.
+ */
+static void
+lua_engine_release_thread(LuaEngine* lua_engine, LuaEngineRequest* request, bool finished)
+{
+	assert(lua_engine->state == LUA_ENGINE_BUSY);
+
+	LuaEngineBindings* bindings = lua_engine->bindings;
+
+	if (finished && bindings->idle_thread_count < LUA_ENGINE_IDLE_THREADS)
+	{
+		lua_settop(request->thread, 0);
+
+		LuaEngineThread* idle = &bindings->idle_threads[bindings->idle_thread_count++];
+		idle->thread = request->thread;
+		idle->thread_ref = request->thread_ref;
+	}
+	else
+	{
+		luaL_unref(lua_engine->L, LUA_REGISTRYINDEX, request->thread_ref);
 	}
+
+	request->thread = nullptr;
+	request->thread_ref = LUA_NOREF;
+	request->suspended = false;
+	request->request_cache = nullptr;
+	request->response_buffer = nullptr;
 }
 
-static void 
-lua_engine_load_and_watch(
-	LuaEngine* lua_engine, 
-	const wchar_t* name
+/**
+ * Runs the request coroutine until it returns, fails or yields on a read.
+ * Expects the engine to be locked and nargs values on the coroutine stack.
+ */
+static REQUEST_NOTIFICATION_STATUS
+lua_engine_run(
+	LuaEngine* lua_engine,
+	LuaEngineRequest* request,
+	IHttpContext* http_context,
+	int nargs
 )
 {
-	assert(lua_engine != nullptr);
-	assert(name != nullptr);
+	REQUEST_NOTIFICATION_STATUS result = RQ_NOTIFICATION_CONTINUE;
 
-	lua_stack_guard(lua_engine->L, 0);
+	lua_State* L = lua_engine->L;
+	lua_State* thread = request->thread;
+	LuaEngineBindings* bindings = lua_engine->bindings;
 
-	wchar_t* documents_path = nullptr;
+	ResponseLua* response_lua = bindings->response_lua;
+	RequestLua* request_lua = bindings->request_lua;
 
-	HRESULT hr = SHGetKnownFolderPath(
-		FOLDERID_Public,
-		0,
-		nullptr,
-		&documents_path
-	);
+	lua_response_bind(response_lua, http_context, request->response_buffer, request->pin_ref);
+	lua_request_bind(request_lua, http_context, thread, request->request_cache);
 
-	if (SUCCEEDED(hr) && documents_path)
+	LuaAllocator* allocator = lua_engine_get_allocator(L);
+	lua_allocator_set_enforced(allocator, true);
+
+	int status = lua_resume(thread, nargs);
+
+	lua_allocator_set_enforced(allocator, false);
+
+	// Nothing would ever resume a handler that yielded without a read outstanding.
+	if (status == LUA_YIELD && !(request_lua->cache && request_lua->cache->read_pending))
 	{
-		wchar_t directory_to_watch[MAX_PATH];
-		swprintf_s(directory_to_watch, L"%s\\%s", documents_path, name);
+		lua_settop(thread, 0);
+		lua_pushliteral(thread, "attempt to yield from the request handler");
 
-		HANDLE directory_changes_handle = FindFirstChangeNotificationW(
-			directory_to_watch,
-			TRUE,
-			FILE_NOTIFY_CHANGE_LAST_WRITE
-		);
+		status = LUA_ERRRUN;
+	}
 
-		if (directory_changes_handle != INVALID_HANDLE_VALUE)
+	// IIS can hold chunks pointing into pinned strings until the request
+	// completes, whether or not the handler gets that far.
+	if (request->pin_ref == LUA_NOREF && response_lua->pin_ref != LUA_NOREF)
+	{
+		InterlockedIncrement(&lua_engine->suspended);
+	}
+
+	request->pin_ref = response_lua->pin_ref;
+
+	if (status == LUA_YIELD)
+	{
+		// The module releases the engine until the read completes.
+		if (!request->suspended)
 		{
-			lua_engine->directory_changes_handle = directory_changes_handle;
-			sprintf_s(lua_engine->file_path, "%ls\\%ls\\%ls.lua", documents_path, name, name);
-
-			HANDLE registration_handle;
-			BOOL result = RegisterWaitForSingleObject(
-				&registration_handle,
-				lua_engine->directory_changes_handle,
-				&lua_engine_watch_callback,
-				(void*)lua_engine,
-				INFINITE,
-				WT_EXECUTEONLYONCE
-			);
-
-			if (result)
-			{
-				if ((luaL_loadfile(lua_engine->L, lua_engine->file_path) || lua_pcall(lua_engine->L, 0, 0, 0)) != 0)
-				{
-					lua_engine_printf("%s\n", lua_tostring(lua_engine->L, -1));
-					lua_pop(lua_engine->L, 1);
-				}
-			} 
-			else
-			{
-				lua_engine_printf("failed to register for directory changes\n");
+			InterlockedIncrement(&lua_engine->suspended);
+			request->suspended = true;
+		}
+
+		request->request_cache = request_lua->cache;
+		request->response_buffer = response_lua->buffer;
+		lua_settop(thread, 0);
 
-				CloseHandle(lua_engine->directory_changes_handle);
-				lua_engine->directory_changes_handle = nullptr;
+		result = RQ_NOTIFICATION_PENDING;
+	}
+	else
+	{
+		if (request->suspended)
+		{
+			InterlockedDecrement(&lua_engine->suspended);
+		}
+
+		if (status == 0)
+		{
+			result = lua_tointeger(thread, -1) ? RQ_NOTIFICATION_FINISH_REQUEST : RQ_NOTIFICATION_CONTINUE;
+
+			// Whatever the handler appended and did not flush goes out now.
+			HRESULT hr = lua_response_flush(response_lua, false);
+
+			if (FAILED(hr))
+			{
+				lua_engine_printf("failed to flush response, hresult: 0x%X\n", hr);
 			}
 		}
 		else
 		{
-			lua_engine_printf("failed to initially register for directory changes\n");
+			lua_engine_printf("%s\n", lua_tostring(thread, -1));
+
+			HRESULT hr = lua_response_abort(response_lua);
+
+			if (FAILED(hr))
+			{
+				lua_engine_printf("failed to finish response, hresult: 0x%X\n", hr);
+			}
+
+			// Only this request fails, the collection gives the state its memory back.
+			if (status == LUA_ERRMEM)
+			{
+				http_context->GetResponse()->SetStatus(500, "Internal Server Error");
+				result = RQ_NOTIFICATION_FINISH_REQUEST;
+			}
+			else if (request->suspended)
+			{
+				// The original notification already returned, nobody else can fail the request.
+				http_context->GetResponse()->SetStatus(500, "Internal Server Error");
+				result = RQ_NOTIFICATION_FINISH_REQUEST;
+			}
 		}
 
-		CoTaskMemFree(documents_path);
-		documents_path = nullptr;
+		lua_engine_release_thread(lua_engine, request, status == 0);
+
+		if (status == LUA_ERRMEM)
+		{
+			lua_gc(L, LUA_GCCOLLECT, 0);
+		}
 	}
+
+	lua_response_bind(response_lua, nullptr, nullptr, LUA_NOREF);
+	lua_request_bind(request_lua, nullptr, nullptr, nullptr);
+
+	return result;
 }
 
 REQUEST_NOTIFICATION_STATUS
 lua_engine_begin_request(
 	LuaEngine* lua_engine,
-	IHttpContext* http_context
+	IHttpContext* http_context,
+	LuaEngineRequest* request
 )
 {
 	assert(lua_engine != nullptr);
 	assert(http_context != nullptr);
+	assert(request != nullptr);
 
 	REQUEST_NOTIFICATION_STATUS result = RQ_NOTIFICATION_CONTINUE;
 
-	if (!lua_engine)
+	if (!lua_engine || !request)
 	{
 		lua_engine_printf("call to begin request failed\n");
 		return result;
 	}
 
-	lua_State* L = lua_engine->L;
+	if (lua_engine->L && lua_engine_lock(lua_engine))
+	{  
+		lua_engine_swap_pending(lua_engine);
 
-	assert(L != nullptr);
+		lua_State* L = lua_engine->L;
+		LuaEngineBindings* bindings = lua_engine->bindings;
 
-	if (L && lua_engine_lock(lua_engine))
-	{  
 		lua_stack_guard(L, 0);
-		lua_getfield(L, LUA_REGISTRYINDEX, "lua_engine_begin_request");
+		lua_rawgeti(L, LUA_REGISTRYINDEX, bindings->handler_ref);
 
 		if (lua_isfunction(L, -1))
 		{
-			ResponseLua* response_lua = lua_response_push(L);
-			RequestLua* request_lua = lua_request_push(L);
-			 
-			response_lua->http_context = http_context;
-			response_lua->http_response = http_context->GetResponse();
-			 
-			request_lua->http_context = http_context;
-			request_lua->http_request = http_context->GetRequest();
-
-			if (lua_pcall(L, 2, 1, 0) == 0)
+			request->lua_engine = lua_engine;
+
+			if (bindings->idle_thread_count)
 			{
-				result = (REQUEST_NOTIFICATION_STATUS)lua_tointeger(L, -1);
+				LuaEngineThread* idle = &bindings->idle_threads[--bindings->idle_thread_count];
+
+				request->thread = idle->thread;
+				request->thread_ref = idle->thread_ref;
 			}
 			else
 			{
-				lua_engine_printf("%s\n", lua_tostring(L, -1));
+				request->thread = lua_newthread(L);
+				request->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 			}
 
-			response_lua->http_context = nullptr;
-			response_lua->http_response = nullptr;
+			request->suspended = false;
+			request->request_cache = nullptr;
+			request->response_buffer = nullptr;
+
+			lua_xmove(L, request->thread, 1);
+			lua_rawgeti(request->thread, LUA_REGISTRYINDEX, bindings->response_ref);
+			lua_rawgeti(request->thread, LUA_REGISTRYINDEX, bindings->request_ref);
 
-			request_lua->http_context = nullptr;
-			request_lua->http_request = nullptr;
+			result = lua_engine_run(lua_engine, request, http_context, 2);
 		}
-		
-		lua_pop(L, 1);
+		else
+		{
+			lua_pop(L, 1);
+		}
+
 		lua_engine_unlock(lua_engine);
 	}
 
-	return result ? RQ_NOTIFICATION_FINISH_REQUEST : RQ_NOTIFICATION_CONTINUE;
+	return result;
 }
 
-LuaEngine* 
-lua_engine_create(const wchar_t* name)
+/**
+ * Continues a handler suspended on an asynchronous read, on whichever thread
+ * IIS delivered the completion. The engine may be serving another request by
+ * now, so this waits for its owner to let go.
+ */
+REQUEST_NOTIFICATION_STATUS
+lua_engine_resume_request(
+	LuaEngineRequest* request,
+	IHttpContext* http_context,
+	DWORD bytes_read,
+	HRESULT status
+)
 {
-	assert(name != nullptr);
+	assert(request != nullptr);
+	assert(http_context != nullptr);
 
-	LuaEngine* lua_engine = nullptr;
-	lua_State* L = nullptr;
-	HANDLE mutex_handle = nullptr;
+	REQUEST_NOTIFICATION_STATUS result = RQ_NOTIFICATION_CONTINUE;
 
-	//////////////////////////////////////////
+	if (!request || !request->thread || !request->lua_engine)
+	{
+		lua_engine_printf("call to resume request failed\n");
+		return result;
+	}
+
+	LuaEngine* lua_engine = request->lua_engine;
+
+	if (lua_engine_lock(lua_engine))
+	{
+		int nargs = lua_request_complete_read(
+			request->thread, 
+			request->request_cache, 
+			bytes_read, 
+			status
+		);
+
+		result = lua_engine_run(lua_engine, request, http_context, nargs);
+
+		lua_engine_unlock(lua_engine);
+	}
+
+	return result;
+}
+
+/**
+ * Called once the request completes. Drops a handler that will never be
+ * resumed, for instance because the client went away while a read was
+ * outstanding, and unpins strings written with WriteNoCopy.
+ */
+void
+lua_engine_end_request(LuaEngineRequest* request)
+{
+	assert(request != nullptr);
+
+	if (!request || !request->lua_engine)
+		return;
 
-	mutex_handle = CreateMutex(NULL, FALSE, NULL);
+	if (!request->thread && request->pin_ref == LUA_NOREF)
+		return;
 
-	assert(mutex_handle != nullptr);
+	LuaEngine* lua_engine = request->lua_engine;
 
-	if (!mutex_handle)
+	if (lua_engine_lock(lua_engine))
 	{
-		lua_engine_printf("failed to create mutex handle\n");
-		goto error;
+		if (request->thread)
+		{
+			if (request->suspended)
+			{
+				InterlockedDecrement(&lua_engine->suspended);
+			}
+
+			lua_engine_release_thread(lua_engine, request, false);
+		}
+
+		if (request->pin_ref != LUA_NOREF)
+		{
+			luaL_unref(lua_engine->L, LUA_REGISTRYINDEX, request->pin_ref);
+			request->pin_ref = LUA_NOREF;
+
+			InterlockedDecrement(&lua_engine->suspended);
+		}
+
+		lua_engine_unlock(lua_engine);
 	}
+}
+
+LuaEngine* 
+lua_engine_create(
+	LuaScriptCache* script_cache, 
+	LuaStats* stats,
+	const LuaConfig* config,
+	const LuaScript* script, 
+	LONG generation
+)
+{
+	LuaEngine* lua_engine = nullptr;
+	LuaEngineBindings* bindings = nullptr;
+	lua_State* L = nullptr;
 
 	//////////////////////////////////////////
 
-	L = lua_engine_new_lua_state();
+	L = lua_engine_new_lua_state(script_cache, stats, config, &bindings);
 
 	if (!L)
 	{
@@ -404,19 +841,33 @@ lua_engine_create(const wchar_t* name)
 	}
 
 	lua_engine->L = L;
-	lua_engine->mutex_handle = mutex_handle;
+	lua_engine->bindings = bindings;
+	lua_engine->script_cache = script_cache;
+	lua_engine->stats = stats;
+	lua_engine->config = config;
+	lua_engine->state = LUA_ENGINE_IDLE;
+	lua_engine->suspended = 0;
+	lua_engine->loaded_generation = generation;
+	lua_engine->building = 0;
+	lua_engine->building_generation = generation;
+	lua_engine->building_script = nullptr;
+	lua_engine->pending = nullptr;
 	lua_engine->list_entry = nullptr;
 
 	////////////////////////////////////////
 
-	lua_engine_load_and_watch(lua_engine, name);
+	if (script && (lua_script_load(L, script) || lua_pcall(L, 0, 0, 0)) != 0)
+	{
+		lua_engine_printf("%s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
 
 	goto finish;
 
 error:
 	if (L)
 	{
-		lua_close(L);
+		lua_engine_close_lua_state(L);
 		L = nullptr;
 	}
 
@@ -426,12 +877,6 @@ error:
 		lua_engine = nullptr;
 	}
 
-	if (mutex_handle)
-	{
-		CloseHandle(mutex_handle);
-		mutex_handle = nullptr;
-	}
-
 finish:
 	return lua_engine;
 }
@@ -441,21 +886,25 @@ lua_engine_destroy(LuaEngine* lua_engine)
 {
 	assert(lua_engine != nullptr);
 	assert(lua_engine->L != nullptr);
-	assert(lua_engine->mutex_handle != nullptr);
+	assert(lua_engine->state == LUA_ENGINE_IDLE);
+	assert(lua_engine->suspended == 0);
 	assert(lua_engine->list_entry != nullptr);
 
 	if (lua_engine)
 	{
-		if (lua_engine->L)
+		// Let an outstanding build finish before tearing down what it writes to.
+		while (lua_engine->building)
 		{
-			lua_close(lua_engine->L);
-			lua_engine->L = nullptr;
+			SwitchToThread();
 		}
 
-		if (lua_engine->mutex_handle)
+		lua_engine_free_pending(lua_engine->pending);
+		lua_engine->pending = nullptr;
+
+		if (lua_engine->L)
 		{
-			CloseHandle(lua_engine->mutex_handle);
-			lua_engine->mutex_handle = nullptr;
+			lua_engine_close_lua_state(lua_engine->L);
+			lua_engine->L = nullptr;
 		}
 
 		if (lua_engine->list_entry)
@@ -471,6 +920,91 @@ lua_engine_destroy(LuaEngine* lua_engine)
 	return lua_engine;
 }
 
+/**
+ * Runs a bounded amount of incremental collection once the response has been
+ * produced, so the handler itself rarely has to pay for it.
+ */
+void
+lua_engine_collect(LuaEngine* lua_engine)
+{
+	assert(lua_engine != nullptr);
+
+	if (!lua_engine || !lua_engine->L || !lua_engine->config || !lua_engine->config->gc_steps)
+		return;
+
+	if (lua_engine_lock(lua_engine))
+	{
+		LARGE_INTEGER start, end, frequency;
+		QueryPerformanceCounter(&start);
+
+		LONG64 steps = 0;
+		LONG64 cycles = 0;
+
+		for (DWORD i = 0; i < lua_engine->config->gc_steps; i++)
+		{
+			steps++;
+
+			// A non-zero result means a cycle just finished, leave the rest to the next request.
+			if (lua_gc(lua_engine->L, LUA_GCSTEP, (int)lua_engine->config->gc_step_size))
+			{
+				cycles++;
+				break;
+			}
+		}
+
+		QueryPerformanceCounter(&end);
+		QueryPerformanceFrequency(&frequency);
+
+		lua_engine_unlock(lua_engine);
+
+		if (lua_engine->stats)
+		{
+			InterlockedAdd64(&lua_engine->stats->gc_steps, steps);
+			InterlockedAdd64(&lua_engine->stats->gc_cycles, cycles);
+			InterlockedAdd64(&lua_engine->stats->gc_time, (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart);
+		}
+	}
+}
+
+LONG
+lua_engine_get_generation(LuaEngine* lua_engine)
+{
+	assert(lua_engine != nullptr);
+
+	return lua_engine ? lua_engine->loaded_generation : 0;
+}
+
+void 
+lua_engine_refresh(
+	LuaEngine* lua_engine, 
+	LONG generation, 
+	LuaScript* script
+)
+{
+	assert(lua_engine != nullptr);
+
+	// Only the owner reads these fields, and a build is only started once
+	// per generation, the request keeps running on the current state meanwhile.
+	if (lua_engine 
+		&& lua_engine->loaded_generation != generation 
+		&& lua_engine->building_generation != generation
+		&& InterlockedCompareExchange(&lua_engine->building, 1, 0) == 0)
+	{
+		lua_engine_printf("detected changes, building replacement lua state\n");
+
+		lua_engine->building_generation = generation;
+		lua_engine->building_script = lua_script_acquire(script);
+
+		if (!QueueUserWorkItem(&lua_engine_build_callback, (PVOID)lua_engine, WT_EXECUTEDEFAULT))
+		{
+			lua_engine_printf("failed to queue lua state build\n");
+
+			lua_engine->building_script = lua_script_release(lua_engine->building_script);
+			InterlockedExchange(&lua_engine->building, 0);
+		}
+	}
+}
+
 void lua_engine_set_list_entry(LuaEngine* lua_engine, SLIST_ENTRY* list_entry)
 {
 	assert(lua_engine != nullptr);
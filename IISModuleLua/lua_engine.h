@@ -4,20 +4,58 @@
 #ifndef _LUA_ENGINE_
 #define _LUA_ENGINE_
 
-#define lua_engine_load_file(L, s) (luaL_loadfile(L, s) || lua_pcall(L, 0, 0, 0))
-
 typedef struct _LuaEngine LuaEngine;
+typedef struct _RequestLuaCache RequestLuaCache;
+typedef struct _ResponseLuaBuffer ResponseLuaBuffer;
+
+/**
+ * Per-request dispatch state, owned by the http module. The handler runs in
+ * its own coroutine so it can be suspended on an asynchronous read while the
+ * engine goes back to the pool, and resumed on whichever thread completes it.
+ */
+typedef struct _LuaEngineRequest
+{
+    LuaEngine* lua_engine;
+    lua_State* thread;
+    int thread_ref;
+    bool suspended;
+
+    // Binding state saved while the handler is suspended.
+    RequestLuaCache* request_cache;
+    ResponseLuaBuffer* response_buffer;
+
+    // Strings IIS may still be sending, released once the request completes.
+    int pin_ref;
+} LuaEngineRequest;
 
 int lua_engine_printf(const char* format, ...);
-LuaEngine* lua_engine_create(const wchar_t* name);
+LuaEngine* lua_engine_create(
+    LuaScriptCache* script_cache, 
+    LuaStats* stats, 
+    const LuaConfig* config, 
+    const LuaScript* script, 
+    LONG generation
+);
 LuaEngine* lua_engine_destroy(LuaEngine* lua_engine);
+void lua_engine_collect(LuaEngine* lua_engine);
+LONG lua_engine_get_generation(LuaEngine* lua_engine);
+void lua_engine_refresh(LuaEngine* lua_engine, LONG generation, LuaScript* script);
+bool lua_engine_validate(LuaScriptCache* script_cache, const LuaScript* script);
 
 void lua_engine_set_list_entry(LuaEngine* lua_engine, SLIST_ENTRY* list_entry);
 SLIST_ENTRY* lua_engine_get_list_entry(LuaEngine* lua_engine);
 
 REQUEST_NOTIFICATION_STATUS lua_engine_begin_request(
     LuaEngine* lua_engine, 
-    IHttpContext* http_context
+    IHttpContext* http_context,
+    LuaEngineRequest* request
+);
+REQUEST_NOTIFICATION_STATUS lua_engine_resume_request(
+    LuaEngineRequest* request,
+    IHttpContext* http_context,
+    DWORD bytes_read,
+    HRESULT status
 );
+void lua_engine_end_request(LuaEngineRequest* request);
 
 #endif
@@ -0,0 +1,556 @@
+#include "shared.h"
+
+#define FormMetatable "HttpForm"
+#define FORM_LUA_DEFAULT_MAX_FIELD_SIZE (64 * 1024)
+
+/**
+ * Incremental form reader. Plain fields are collected into Lua strings up to
+ * max_field_size, file parts are handed to on_file chunk by chunk or, without
+ * a callback, spilled to a temporary file. Memory stays bounded by the field
+ * limit whatever the size of the upload.
+ */
+typedef struct _FormLua
+{
+    // Thread of the current Feed or Finish call, the parser callbacks run on it.
+    lua_State* L;
+    FormParser* parser;
+    const char* error;
+
+    size_t max_field_size;
+    char* value;
+    size_t value_length;
+
+    int fields_ref;
+    int files_ref;
+    int on_file_ref;
+
+    // Paths of the spill files this form created, the only ones it deletes.
+    int spills_ref;
+    int part_ref;
+
+    bool part_is_file;
+    UINT64 part_size;
+    HANDLE spill_handle;
+    wchar_t spill_directory[MAX_PATH];
+} FormLua;
+
+static FormLua*
+lua_form_check_type(lua_State* L, int index)
+{
+    lua_stack_guard(L, 0);
+
+    luaL_checktype(L, index, LUA_TUSERDATA);
+
+    FormLua* form_lua = (FormLua*)luaL_checkudata(L, index, FormMetatable);
+
+    if (!form_lua)
+        luaL_typerror(L, index, FormMetatable);
+
+    if (!form_lua->parser)
+        luaL_error(L, "form object is invalid");
+
+    return form_lua;
+}
+
+static void
+lua_form_set_field(lua_State* L, int table, const char* key, const char* value, size_t value_length)
+{
+    lua_pushstring(L, key);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, table);
+
+    // Repeated names collect into an array, the same shape GetQuery uses.
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_pushlstring(L, value, value_length);
+        lua_rawset(L, table);
+    }
+    else if (lua_istable(L, -1))
+    {
+        lua_pushlstring(L, value, value_length);
+        lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+        lua_pop(L, 2);
+    }
+    else
+    {
+        lua_createtable(L, 2, 0);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 1);
+        lua_pushlstring(L, value, value_length);
+        lua_rawseti(L, -2, 2);
+        lua_rawset(L, table);
+    }
+}
+
+static bool
+lua_form_open_spill(FormLua* form_lua)
+{
+    lua_State* L = form_lua->L;
+    wchar_t file_path[MAX_PATH];
+
+    if (!GetTempFileNameW(form_lua->spill_directory, L"iis", 0, file_path))
+    {
+        lua_engine_printf("failed to create temporary file for form upload\n");
+        return false;
+    }
+
+    form_lua->spill_handle = CreateFileW(
+        file_path,
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr
+    );
+
+    if (form_lua->spill_handle == INVALID_HANDLE_VALUE)
+    {
+        form_lua->spill_handle = nullptr;
+        DeleteFileW(file_path);
+
+        lua_engine_printf("failed to open temporary file for form upload\n");
+        return false;
+    }
+
+    char path[MAX_PATH * 3];
+    size_t length = utf8_convert_from_wide(file_path, wcslen(file_path), path, sizeof(path));
+
+    lua_pushliteral(L, "path");
+    lua_pushlstring(L, path, length);
+    lua_rawset(L, -3);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->spills_ref);
+    lua_pushlstring(L, path, length);
+    lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+    lua_pop(L, 1);
+
+    return true;
+}
+
+static bool
+lua_form_part_begin(void* context, const FormPart* part)
+{
+    FormLua* form_lua = (FormLua*)context;
+    lua_State* L = form_lua->L;
+
+    lua_stack_guard(L, 0);
+
+    form_lua->part_is_file = part->filename != nullptr;
+    form_lua->part_size = 0;
+    form_lua->value_length = 0;
+
+    lua_createtable(L, 0, 5);
+
+    lua_pushliteral(L, "name");
+    lua_pushlstring(L, part->name, part->name_length);
+    lua_rawset(L, -3);
+
+    if (part->filename)
+    {
+        lua_pushliteral(L, "filename");
+        lua_pushlstring(L, part->filename, part->filename_length);
+        lua_rawset(L, -3);
+    }
+
+    if (part->content_type)
+    {
+        lua_pushliteral(L, "content_type");
+        lua_pushlstring(L, part->content_type, part->content_type_length);
+        lua_rawset(L, -3);
+    }
+
+    if (form_lua->part_is_file)
+    {
+        // Listed before any data lands, so a failed upload still shows up in the files.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->files_ref);
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+        lua_pop(L, 1);
+
+        if (form_lua->on_file_ref == LUA_NOREF && !lua_form_open_spill(form_lua))
+        {
+            lua_pop(L, 1);
+            return false;
+        }
+    }
+
+    form_lua->part_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return true;
+}
+
+static bool
+lua_form_part_data(void* context, const char* data, size_t length)
+{
+    FormLua* form_lua = (FormLua*)context;
+    lua_State* L = form_lua->L;
+
+    form_lua->part_size += length;
+
+    if (!form_lua->part_is_file)
+    {
+        if (form_lua->value_length + length > form_lua->max_field_size)
+        {
+            form_lua->error = "form field exceeds the maximum field size";
+            return false;
+        }
+
+        if (!form_lua->value)
+        {
+            form_lua->value = (char*)malloc(form_lua->max_field_size);
+
+            if (!form_lua->value)
+            {
+                form_lua->error = "failed to allocate form field buffer";
+                return false;
+            }
+        }
+
+        memcpy(form_lua->value + form_lua->value_length, data, length);
+        form_lua->value_length += length;
+    }
+    else if (form_lua->on_file_ref != LUA_NOREF)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->on_file_ref);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->part_ref);
+        lua_pushlstring(L, data, length);
+        lua_call(L, 2, 0);
+    }
+    else
+    {
+        while (length)
+        {
+            DWORD bytes_written = 0;
+
+            if (!WriteFile(form_lua->spill_handle, data, (DWORD)min(length, MAXDWORD), &bytes_written, nullptr))
+            {
+                lua_engine_printf("failed to write form upload to temporary file\n");
+                return false;
+            }
+
+            data += bytes_written;
+            length -= bytes_written;
+        }
+    }
+
+    return true;
+}
+
+static bool
+lua_form_part_end(void* context)
+{
+    FormLua* form_lua = (FormLua*)context;
+    lua_State* L = form_lua->L;
+
+    lua_stack_guard(L, 0);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->part_ref);
+
+    lua_pushliteral(L, "size");
+    lua_pushnumber(L, (lua_Number)form_lua->part_size);
+    lua_rawset(L, -3);
+
+    if (!form_lua->part_is_file)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->fields_ref);
+        lua_getfield(L, -2, "name");
+
+        lua_form_set_field(
+            L, 
+            lua_gettop(L) - 1, 
+            lua_tostring(L, -1), 
+            form_lua->value ? form_lua->value : "", 
+            form_lua->value_length
+        );
+
+        lua_pop(L, 2);
+    }
+    else if (form_lua->on_file_ref != LUA_NOREF)
+    {
+        // A nil chunk tells the callback the part is complete.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->on_file_ref);
+        lua_pushvalue(L, -2);
+        lua_pushnil(L);
+        lua_call(L, 2, 0);
+    }
+    else if (form_lua->spill_handle)
+    {
+        CloseHandle(form_lua->spill_handle);
+        form_lua->spill_handle = nullptr;
+    }
+
+    lua_pop(L, 1);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, form_lua->part_ref);
+    form_lua->part_ref = LUA_NOREF;
+
+    return true;
+}
+
+static int
+lua_form_feed(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    FormLua* form_lua = lua_form_check_type(L, 1);
+
+    size_t length;
+    const char* data = luaL_checklstring(L, 2, &length);
+
+    form_lua->L = L;
+
+    if (!form_parser_feed(form_lua->parser, data, length))
+    {
+        return luaL_error(L, "%s", form_lua->error ? form_lua->error : form_parser_get_error(form_lua->parser));
+    }
+
+    return 0;
+}
+
+static int
+lua_form_finish(lua_State* L)
+{
+    lua_stack_guard(L, 2);
+
+    FormLua* form_lua = lua_form_check_type(L, 1);
+
+    form_lua->L = L;
+
+    if (!form_parser_finish(form_lua->parser))
+    {
+        return luaL_error(L, "%s", form_lua->error ? form_lua->error : form_parser_get_error(form_lua->parser));
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->fields_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->files_ref);
+
+    return 2;
+}
+
+/**
+ * Spilled files are removed with the form, a script that wants to keep an
+ * upload moves it out of the way first. Paths on parts handled by on_file
+ * belong to the script and are left alone.
+ */
+static int
+lua_form_gc(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    FormLua* form_lua = (FormLua*)luaL_checkudata(L, 1, FormMetatable);
+
+    if (form_lua->spill_handle)
+    {
+        CloseHandle(form_lua->spill_handle);
+        form_lua->spill_handle = nullptr;
+    }
+
+    if (form_lua->spills_ref != LUA_NOREF)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, form_lua->spills_ref);
+
+        for (int i = 1; i <= (int)lua_objlen(L, -1); i++)
+        {
+            lua_rawgeti(L, -1, i);
+
+            size_t length;
+            const char* path = lua_tolstring(L, -1, &length);
+            wchar_t file_path[MAX_PATH];
+
+            if (path && length < MAX_PATH)
+            {
+                size_t converted = utf8_convert_to_wide(path, length, file_path, MAX_PATH - 1);
+                file_path[converted] = L'\0';
+
+                DeleteFileW(file_path);
+            }
+
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, form_lua->fields_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, form_lua->files_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, form_lua->on_file_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, form_lua->spills_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, form_lua->part_ref);
+
+    form_lua->fields_ref = LUA_NOREF;
+    form_lua->files_ref = LUA_NOREF;
+    form_lua->on_file_ref = LUA_NOREF;
+    form_lua->spills_ref = LUA_NOREF;
+    form_lua->part_ref = LUA_NOREF;
+
+    if (form_lua->value)
+    {
+        free(form_lua->value);
+        form_lua->value = nullptr;
+    }
+
+    form_lua->parser = form_parser_destroy(form_lua->parser);
+
+    return 0;
+}
+
+static int
+lua_form_tostring(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    FormLua* form_lua = lua_form_check_type(L, 1);
+
+    lua_pushfstring(L, "%s: %p", FormMetatable, form_lua);
+
+    return 1;
+}
+
+const luaL_Reg lua_form_methods[] = {
+
+    {"Feed", lua_form_feed},
+    {"Finish", lua_form_finish},
+
+    {0, 0}
+};
+
+const luaL_Reg lua_form_meta[] =
+{
+    {"__tostring", lua_form_tostring},
+    {"__gc", lua_form_gc},
+    {0, 0}
+};
+
+void 
+lua_form_register(lua_State* L)
+{
+    assert(L != nullptr);
+
+    if (L)
+    {
+        lua_stack_guard(L, 0);
+
+        luaL_openlib(L, FormMetatable, lua_form_methods, 0);
+        luaL_newmetatable(L, FormMetatable);
+
+        luaL_openlib(L, 0, lua_form_meta, 0);
+        lua_pushliteral(L, "__index");
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+
+        lua_pushliteral(L, "__metatable");
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+
+        lua_pop(L, 2);
+    }
+}
+
+/**
+ * Pushes a form reader for the given content type. Options: max_field_size,
+ * on_file(part, chunk) and directory for spilled uploads.
+ */
+void
+lua_form_push(lua_State* L, const char* content_type, size_t content_type_length, int options_index)
+{
+    assert(L != nullptr);
+
+    lua_stack_guard(L, 1);
+
+    size_t max_field_size = FORM_LUA_DEFAULT_MAX_FIELD_SIZE;
+    bool has_options = !lua_isnoneornil(L, options_index);
+
+    if (has_options)
+    {
+        luaL_checktype(L, options_index, LUA_TTABLE);
+
+        lua_getfield(L, options_index, "max_field_size");
+
+        if (!lua_isnil(L, -1))
+        {
+            lua_Number size = luaL_checknumber(L, -1);
+
+            if (size < 1 || size > (lua_Number)MAXDWORD || size != (lua_Number)(DWORD)size)
+            {
+                luaL_error(L, "max_field_size must be a positive integer");
+            }
+
+            max_field_size = (size_t)size;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    FormLua* form_lua = (FormLua*)lua_newuserdata(L, sizeof(FormLua));
+
+    form_lua->L = L;
+    form_lua->parser = nullptr;
+    form_lua->error = nullptr;
+    form_lua->max_field_size = max_field_size;
+    form_lua->value = nullptr;
+    form_lua->value_length = 0;
+    form_lua->fields_ref = LUA_NOREF;
+    form_lua->files_ref = LUA_NOREF;
+    form_lua->on_file_ref = LUA_NOREF;
+    form_lua->spills_ref = LUA_NOREF;
+    form_lua->part_ref = LUA_NOREF;
+    form_lua->part_is_file = false;
+    form_lua->part_size = 0;
+    form_lua->spill_handle = nullptr;
+    form_lua->spill_directory[0] = L'\0';
+
+    luaL_getmetatable(L, FormMetatable);
+    lua_setmetatable(L, -2);
+
+    lua_newtable(L);
+    form_lua->fields_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_newtable(L);
+    form_lua->files_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_newtable(L);
+    form_lua->spills_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    if (has_options)
+    {
+        lua_getfield(L, options_index, "on_file");
+
+        if (lua_isfunction(L, -1))
+            form_lua->on_file_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        else
+            lua_pop(L, 1);
+
+        lua_getfield(L, options_index, "directory");
+
+        size_t length;
+        const char* directory = lua_tolstring(L, -1, &length);
+
+        if (directory && length < MAX_PATH)
+        {
+            size_t converted = utf8_convert_to_wide(directory, length, form_lua->spill_directory, MAX_PATH - 1);
+            form_lua->spill_directory[converted] = L'\0';
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (!form_lua->spill_directory[0] && !GetTempPathW(MAX_PATH, form_lua->spill_directory))
+    {
+        luaL_error(L, "failed to get temporary directory");
+    }
+
+    FormParserCallbacks callbacks;
+    callbacks.context = form_lua;
+    callbacks.part_begin = lua_form_part_begin;
+    callbacks.part_data = lua_form_part_data;
+    callbacks.part_end = lua_form_part_end;
+
+    form_lua->parser = form_parser_create(content_type, content_type_length, max_field_size, &callbacks);
+
+    if (!form_lua->parser)
+    {
+        luaL_error(L, "unsupported form content type");
+    }
+}
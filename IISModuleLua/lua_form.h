@@ -0,0 +1,10 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _LUA_FORM
+#define _LUA_FORM
+
+void lua_form_register(lua_State* L);
+void lua_form_push(lua_State* L, const char* content_type, size_t content_type_length, int options_index);
+
+#endif
@@ -0,0 +1,201 @@
+#include "shared.h"
+
+#define IpSetMetatable "IpSet"
+
+typedef struct _IpSetLua
+{
+    IpSet* ip_set;
+} IpSetLua;
+
+static IpSetLua*
+lua_ip_set_check_type(lua_State* L, int index)
+{
+    lua_stack_guard(L, 0);
+
+    luaL_checktype(L, index, LUA_TUSERDATA);
+
+    IpSetLua* ip_set_lua = (IpSetLua*)luaL_checkudata(L, index, IpSetMetatable);
+
+    if (!ip_set_lua)
+        luaL_typerror(L, index, IpSetMetatable);
+
+    if (!ip_set_lua->ip_set)
+        luaL_error(L, "ip set object is invalid");
+
+    return ip_set_lua;
+}
+
+/**
+ * Accepts the request object, which is matched on its binary remote address
+ * without formatting it, or an address string.
+ */
+static void
+lua_ip_set_check_key(lua_State* L, int index, unsigned char key[IP_SET_KEY_SIZE])
+{
+    if (lua_type(L, index) == LUA_TSTRING)
+    {
+        if (!ip_set_key_from_string(lua_tostring(L, index), key))
+        {
+            luaL_error(L, "invalid ip address '%s'", lua_tostring(L, index));
+        }
+
+        return;
+    }
+
+    if (!ip_set_key_from_sockaddr(lua_request_get_remote_sockaddr(L, index), key))
+    {
+        luaL_argerror(L, index, "expected a request or an ip address");
+    }
+}
+
+static int
+lua_ip_set_contains(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    IpSetLua* ip_set_lua = lua_ip_set_check_type(L, 1);
+
+    unsigned char key[IP_SET_KEY_SIZE];
+    lua_ip_set_check_key(L, 2, key);
+
+    lua_pushboolean(L, ip_set_lookup(ip_set_lua->ip_set, key, nullptr, nullptr));
+
+    return 1;
+}
+
+static int
+lua_ip_set_lookup(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    IpSetLua* ip_set_lua = lua_ip_set_check_type(L, 1);
+
+    unsigned char key[IP_SET_KEY_SIZE];
+    lua_ip_set_check_key(L, 2, key);
+
+    const char* value;
+    size_t value_length;
+
+    // Rules without a value still match, they report true.
+    if (!ip_set_lookup(ip_set_lua->ip_set, key, &value, &value_length))
+    {
+        lua_pushnil(L);
+    }
+    else if (!value_length)
+    {
+        lua_pushboolean(L, 1);
+    }
+    else
+    {
+        lua_pushlstring(L, value, value_length);
+    }
+
+    return 1;
+}
+
+static int
+lua_ip_set_gc(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    IpSetLua* ip_set_lua = (IpSetLua*)luaL_checkudata(L, 1, IpSetMetatable);
+
+    ip_set_lua->ip_set = ip_set_release(ip_set_lua->ip_set);
+
+    return 0;
+}
+
+static int
+lua_ip_set_tostring(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    IpSetLua* ip_set_lua = lua_ip_set_check_type(L, 1);
+
+    lua_pushfstring(L, "%s: %p", IpSetMetatable, ip_set_lua);
+
+    return 1;
+}
+
+/**
+ * iis.IpSet(path), relative paths are resolved against the script directory.
+ * The set is built once per file and shared by every engine in the process.
+ */
+static int
+lua_ip_set_new(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    const char* directory_path = lua_tostring(L, lua_upvalueindex(1));
+    const char* path = luaL_checkstring(L, 1);
+
+    char file_path[MAX_PATH];
+
+    if (!lua_script_cache_resolve_path(directory_path, path, file_path, sizeof(file_path)))
+    {
+        return luaL_error(L, "ip set path '%s' is too long", path);
+    }
+
+    IpSetLua* ip_set_lua = (IpSetLua*)lua_newuserdata(L, sizeof(IpSetLua));
+    ip_set_lua->ip_set = nullptr;
+
+    luaL_getmetatable(L, IpSetMetatable);
+    lua_setmetatable(L, -2);
+
+    ip_set_lua->ip_set = ip_set_acquire(file_path);
+
+    if (!ip_set_lua->ip_set)
+    {
+        return luaL_error(L, "failed to load ip set '%s'", file_path);
+    }
+
+    return 1;
+}
+
+const luaL_Reg lua_ip_set_methods[] = {
+
+    {"Contains", lua_ip_set_contains},
+    {"Lookup", lua_ip_set_lookup},
+
+    {0, 0}
+};
+
+const luaL_Reg lua_ip_set_meta[] =
+{
+    {"__tostring", lua_ip_set_tostring},
+    {"__gc", lua_ip_set_gc},
+    {0, 0}
+};
+
+/**
+ * Registers the metatable and pushes iis.IpSet into the table on top of the stack.
+ */
+void
+lua_ip_set_register(lua_State* L, const char* directory_path)
+{
+    assert(L != nullptr);
+
+    if (L)
+    {
+        lua_stack_guard(L, 0);
+
+        luaL_openlib(L, IpSetMetatable, lua_ip_set_methods, 0);
+        luaL_newmetatable(L, IpSetMetatable);
+
+        luaL_openlib(L, 0, lua_ip_set_meta, 0);
+        lua_pushliteral(L, "__index");
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+
+        lua_pushliteral(L, "__metatable");
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+
+        lua_pop(L, 2);
+
+        lua_pushliteral(L, "IpSet");
+        lua_pushstring(L, directory_path ? directory_path : "");
+        lua_pushcclosure(L, lua_ip_set_new, 1);
+        lua_rawset(L, -3);
+    }
+}
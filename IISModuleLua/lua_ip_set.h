@@ -0,0 +1,9 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _LUA_IP_SET
+#define _LUA_IP_SET
+
+void lua_ip_set_register(lua_State* L, const char* directory_path);
+
+#endif
@@ -23,276 +23,1131 @@ lua_request_check_type(lua_State* L, int index)
     return request_lua;
 }
 
+typedef struct _RequestLuaHeader
+{
+    const char* key;
+    const char* name;
+    HTTP_HEADER_ID id;
+} RequestLuaHeader;
+
+// Indexed by HTTP_HEADER_ID, so the known-header slot of a constant is its position.
+static const RequestLuaHeader lua_request_headers[HttpHeaderRequestMaximum] =
+{
+    {"CacheControl", "Cache-Control", HttpHeaderCacheControl},
+    {"Connection", "Connection", HttpHeaderConnection},
+    {"Date", "Date", HttpHeaderDate},
+    {"KeepAlive", "Keep-Alive", HttpHeaderKeepAlive},
+    {"Pragma", "Pragma", HttpHeaderPragma},
+    {"Trailer", "Trailer", HttpHeaderTrailer},
+    {"TransferEncoding", "Transfer-Encoding", HttpHeaderTransferEncoding},
+    {"Upgrade", "Upgrade", HttpHeaderUpgrade},
+    {"Via", "Via", HttpHeaderVia},
+    {"Warning", "Warning", HttpHeaderWarning},
+    {"Allow", "Allow", HttpHeaderAllow},
+    {"ContentLength", "Content-Length", HttpHeaderContentLength},
+    {"ContentType", "Content-Type", HttpHeaderContentType},
+    {"ContentEncoding", "Content-Encoding", HttpHeaderContentEncoding},
+    {"ContentLanguage", "Content-Language", HttpHeaderContentLanguage},
+    {"ContentLocation", "Content-Location", HttpHeaderContentLocation},
+    {"ContentMd5", "Content-MD5", HttpHeaderContentMd5},
+    {"ContentRange", "Content-Range", HttpHeaderContentRange},
+    {"Expires", "Expires", HttpHeaderExpires},
+    {"LastModified", "Last-Modified", HttpHeaderLastModified},
+    {"Accept", "Accept", HttpHeaderAccept},
+    {"AcceptCharset", "Accept-Charset", HttpHeaderAcceptCharset},
+    {"AcceptEncoding", "Accept-Encoding", HttpHeaderAcceptEncoding},
+    {"AcceptLanguage", "Accept-Language", HttpHeaderAcceptLanguage},
+    {"Authorization", "Authorization", HttpHeaderAuthorization},
+    {"Cookie", "Cookie", HttpHeaderCookie},
+    {"Expect", "Expect", HttpHeaderExpect},
+    {"From", "From", HttpHeaderFrom},
+    {"Host", "Host", HttpHeaderHost},
+    {"IfMatch", "If-Match", HttpHeaderIfMatch},
+    {"IfModifiedSince", "If-Modified-Since", HttpHeaderIfModifiedSince},
+    {"IfNoneMatch", "If-None-Match", HttpHeaderIfNoneMatch},
+    {"IfRange", "If-Range", HttpHeaderIfRange},
+    {"IfUnmodifiedSince", "If-Unmodified-Since", HttpHeaderIfUnmodifiedSince},
+    {"MaxForwards", "Max-Forwards", HttpHeaderMaxForwards},
+    {"ProxyAuthorization", "Proxy-Authorization", HttpHeaderProxyAuthorization},
+    {"Referer", "Referer", HttpHeaderReferer},
+    {"Range", "Range", HttpHeaderRange},
+    {"Te", "TE", HttpHeaderTe},
+    {"Translate", "Translate", HttpHeaderTranslate},
+    {"UserAgent", "User-Agent", HttpHeaderUserAgent},
+};
+
+typedef enum _RequestLuaValueType
+{
+    REQUEST_LUA_STRING,
+    REQUEST_LUA_NUMBER,
+    REQUEST_LUA_BOOLEAN
+} RequestLuaValueType;
+
+typedef struct _RequestLuaServerVariableInfo
+{
+    const char* key;
+    const char* name;
+    RequestLuaValueType type;
+} RequestLuaServerVariableInfo;
+
+// Position in this table is the iis.ServerVariable constant.
+static const RequestLuaServerVariableInfo lua_request_server_variables[] =
+{
+    {"Https", "HTTPS", REQUEST_LUA_BOOLEAN},
+    {"HttpsKeySize", "HTTPS_KEYSIZE", REQUEST_LUA_NUMBER},
+    {"HttpsServerIssuer", "HTTPS_SERVER_ISSUER", REQUEST_LUA_STRING},
+    {"HttpsServerSubject", "HTTPS_SERVER_SUBJECT", REQUEST_LUA_STRING},
+    {"ServerName", "SERVER_NAME", REQUEST_LUA_STRING},
+    {"ServerPort", "SERVER_PORT", REQUEST_LUA_NUMBER},
+    {"ServerPortSecure", "SERVER_PORT_SECURE", REQUEST_LUA_BOOLEAN},
+    {"ServerProtocol", "SERVER_PROTOCOL", REQUEST_LUA_STRING},
+    {"ServerSoftware", "SERVER_SOFTWARE", REQUEST_LUA_STRING},
+    {"InstanceId", "INSTANCE_ID", REQUEST_LUA_NUMBER},
+    {"LocalAddr", "LOCAL_ADDR", REQUEST_LUA_STRING},
+    {"RemoteAddr", "REMOTE_ADDR", REQUEST_LUA_STRING},
+    {"RemoteHost", "REMOTE_HOST", REQUEST_LUA_STRING},
+    {"RemotePort", "REMOTE_PORT", REQUEST_LUA_NUMBER},
+    {"RemoteUser", "REMOTE_USER", REQUEST_LUA_STRING},
+    {"AuthType", "AUTH_TYPE", REQUEST_LUA_STRING},
+    {"AuthUser", "AUTH_USER", REQUEST_LUA_STRING},
+    {"LogonUser", "LOGON_USER", REQUEST_LUA_STRING},
+    {"CertCookie", "CERT_COOKIE", REQUEST_LUA_STRING},
+    {"CertFlags", "CERT_FLAGS", REQUEST_LUA_NUMBER},
+    {"CertIssuer", "CERT_ISSUER", REQUEST_LUA_STRING},
+    {"CertKeySize", "CERT_KEYSIZE", REQUEST_LUA_NUMBER},
+    {"CertSerialNumber", "CERT_SERIALNUMBER", REQUEST_LUA_STRING},
+    {"CertSubject", "CERT_SUBJECT", REQUEST_LUA_STRING},
+    {"ApplMdPath", "APPL_MD_PATH", REQUEST_LUA_STRING},
+    {"ApplPhysicalPath", "APPL_PHYSICAL_PATH", REQUEST_LUA_STRING},
+    {"PathTranslated", "PATH_TRANSLATED", REQUEST_LUA_STRING},
+    {"RequestMethod", "REQUEST_METHOD", REQUEST_LUA_STRING},
+    {"ContentLength", "CONTENT_LENGTH", REQUEST_LUA_NUMBER},
+    {"ContentType", "CONTENT_TYPE", REQUEST_LUA_STRING},
+    {"UnencodedUrl", "UNENCODED_URL", REQUEST_LUA_STRING},
+    {"CacheUrl", "CACHE_URL", REQUEST_LUA_STRING},
+};
+
+#define REQUEST_LUA_SERVER_VARIABLE_COUNT _countof(lua_request_server_variables)
+
+static RequestLuaCache*
+lua_request_get_cache(lua_State* L, RequestLua* request_lua)
+{
+    if (!request_lua->cache)
+    {
+        request_lua->cache = (RequestLuaCache*)request_lua->http_context->AllocateRequestMemory(
+            sizeof(RequestLuaCache)
+        );
+
+        if (!request_lua->cache)
+        {
+            luaL_error(L, "failed to allocate request memory");
+        }
+
+        memset(request_lua->cache, 0, sizeof(RequestLuaCache));
+        request_lua->cache->epoch = request_lua->epoch;
+    }
+
+    return request_lua->cache;
+}
+
+static const char*
+lua_request_get_url(lua_State* L, RequestLua* request_lua, RequestLuaUrl url, size_t* length)
+{
+    RequestLuaCache* cache = lua_request_get_cache(L, request_lua);
+
+    if (!cache->urls[url])
+    {
+        HTTP_COOKED_URL* cooked_url = &request_lua->http_request->GetRawHttpRequest()->CookedUrl;
+
+        const wchar_t* source = nullptr;
+        size_t source_length = 0;
+
+        switch (url)
+        {
+        case REQUEST_LUA_FULL_URL:
+            source = cooked_url->pFullUrl;
+            source_length = cooked_url->FullUrlLength / sizeof(wchar_t);
+            break;
+        case REQUEST_LUA_ABS_URL:
+            source = cooked_url->pAbsPath;
+            source_length = cooked_url->AbsPathLength / sizeof(wchar_t);
+            break;
+        case REQUEST_LUA_HOST_URL:
+            source = cooked_url->pHost;
+            source_length = cooked_url->HostLength / sizeof(wchar_t);
+            break;
+        case REQUEST_LUA_QUERY_STRING:
+            source = cooked_url->pQueryString;
+            source_length = cooked_url->QueryStringLength / sizeof(wchar_t);
+            break;
+        }
+
+        size_t converted_length = utf8_convert_from_wide(source, source_length, nullptr, 0);
+
+        if (source_length && !converted_length)
+        {
+            luaL_error(L, "unable to convert to utf-8 string");
+        }
+
+        char* converted = (char*)request_lua->http_context->AllocateRequestMemory((DWORD)converted_length + 1);
+
+        if (!converted)
+        {
+            luaL_error(L, "failed to allocate request memory");
+        }
+
+        utf8_convert_from_wide(source, source_length, converted, converted_length);
+        converted[converted_length] = '\0';
+
+        cache->urls[url] = converted;
+        cache->url_lengths[url] = converted_length;
+    }
+
+    *length = cache->url_lengths[url];
+
+    return cache->urls[url];
+}
+
+static int
+lua_request_push_url(lua_State* L, RequestLua* request_lua, RequestLuaUrl url)
+{
+    size_t length;
+    const char* converted = lua_request_get_url(L, request_lua, url, &length);
+
+    lua_pushlstring(L, converted, length);
+
+    return 1;
+}
+
 static int 
 lua_request_get_full_url(lua_State* L)
 {
     lua_stack_guard(L, 1);
 
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    HTTP_REQUEST* raw_request = request_lua->http_request->GetRawHttpRequest();
 
-    size_t i;
-    char converted[2048];
+    return lua_request_push_url(L, request_lua, REQUEST_LUA_FULL_URL);
+}
 
-    errno_t result = wcstombs_s(
-        &i, 
-        converted, 
-        raw_request->CookedUrl.pFullUrl, 
-        (int)(raw_request->CookedUrl.FullUrlLength / sizeof(wchar_t))
-    );
+static int
+lua_request_get_abs_url(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    return lua_request_push_url(L, request_lua, REQUEST_LUA_ABS_URL);
+}
+
+static int
+lua_request_get_host_url(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    return lua_request_push_url(L, request_lua, REQUEST_LUA_HOST_URL);
+}
+
+static int
+lua_request_get_querystring(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    return lua_request_push_url(L, request_lua, REQUEST_LUA_QUERY_STRING);
+}
+
+static const char*
+lua_request_get_query_string(lua_State* L, RequestLua* request_lua, size_t* length, char** scratch)
+{
+    const char* query = lua_request_get_url(L, request_lua, REQUEST_LUA_QUERY_STRING, length);
+    RequestLuaCache* cache = request_lua->cache;
+
+    // Decoding never grows the text, so one buffer the size of the query covers every pair.
+    // SetUrl can bring in a longer query, which needs a bigger one.
+    if (!cache->query_scratch || cache->query_scratch_size < *length + 1)
+    {
+        cache->query_scratch = (char*)request_lua->http_context->AllocateRequestMemory((DWORD)*length + 1);
+
+        if (!cache->query_scratch)
+        {
+            luaL_error(L, "failed to allocate request memory");
+        }
+
+        cache->query_scratch_size = *length + 1;
+    }
+
+    *scratch = cache->query_scratch;
+
+    return query;
+}
 
-    if (result)
+static void
+lua_request_push_decoded(lua_State* L, const char* source, size_t length, char* scratch)
+{
+    if (query_string_needs_decode(source, length))
+    {
+        lua_pushlstring(L, scratch, query_string_decode(source, length, scratch));
+    }
+    else
     {
-        return luaL_error(L, "unable to convert to narrow string");
+        lua_pushlstring(L, source, length);
+    }
+}
+
+static void
+lua_request_append_value(lua_State* L, int count)
+{
+    // Stack: [existing] value, a repeated key turns the first value into an array.
+    if (count == 2)
+    {
+        lua_createtable(L, 2, 0);
+        lua_insert(L, -3);
+        lua_rawseti(L, -3, 2);
+        lua_rawseti(L, -2, 1);
+    }
+    else if (count > 2)
+    {
+        lua_rawseti(L, -2, count);
+    }
+}
+
+static int
+lua_request_get_query(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    size_t query_length;
+    char* scratch;
+    const char* query = lua_request_get_query_string(L, request_lua, &query_length, &scratch);
+    const char* end = query + query_length;
+
+    int pair_count = 0;
+
+    for (const char* c = query; c < end; c++)
+    {
+        if (*c == '&')
+            pair_count++;
+    }
+
+    lua_createtable(L, 0, pair_count + 1);
+
+    QueryStringPair pair;
+    const char* cursor = query;
+
+    while (query_string_next(&cursor, end, &pair))
+    {
+        lua_request_push_decoded(L, pair.key, pair.key_length, scratch);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_request_push_decoded(L, pair.value, pair.value_length, scratch);
+            lua_rawset(L, -3);
+        }
+        else if (lua_istable(L, -1))
+        {
+            lua_request_push_decoded(L, pair.value, pair.value_length, scratch);
+            lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+            lua_pop(L, 2);
+        }
+        else
+        {
+            lua_request_push_decoded(L, pair.value, pair.value_length, scratch);
+            lua_request_append_value(L, 2);
+            lua_rawset(L, -3);
+        }
     }
 
-    lua_pushstring(L, converted);
-  
     return 1;
 }
 
 static int
-lua_request_get_abs_url(lua_State* L)
+lua_request_get_query_param(lua_State* L)
 {
     lua_stack_guard(L, 1);
 
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    HTTP_REQUEST* raw_request = request_lua->http_request->GetRawHttpRequest();
 
-    size_t i;
-    char converted[2048];
+    size_t name_length;
+    const char* name = luaL_checklstring(L, 2, &name_length);
+
+    size_t query_length;
+    char* scratch;
+    const char* query = lua_request_get_query_string(L, request_lua, &query_length, &scratch);
+    const char* end = query + query_length;
+
+    int count = 0;
+    QueryStringPair pair;
+    const char* cursor = query;
+
+    // Scans the raw query in place, only matching values are ever materialised.
+    while (query_string_next(&cursor, end, &pair))
+    {
+        const char* key = pair.key;
+        size_t key_length = pair.key_length;
+
+        if (query_string_needs_decode(key, key_length))
+        {
+            key_length = query_string_decode(key, key_length, scratch);
+            key = scratch;
+        }
+
+        if (key_length == name_length && memcmp(key, name, name_length) == 0)
+        {
+            lua_request_push_decoded(L, pair.value, pair.value_length, scratch);
+            lua_request_append_value(L, ++count);
+        }
+    }
+
+    if (!count)
+    {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+/**
+ * Everything memoised from the URL is stale once SetUrl rewrites it, server
+ * variables included since URL, QUERY_STRING and friends derive from it.
+ */
+static void
+lua_request_forget_url(RequestLuaCache* cache)
+{
+    if (!cache)
+        return;
+
+    memset(cache->urls, 0, sizeof(cache->urls));
+    memset(cache->url_lengths, 0, sizeof(cache->url_lengths));
+
+    if (cache->server_variables)
+    {
+        for (size_t i = 0; i < REQUEST_LUA_SERVER_VARIABLE_COUNT; i++)
+        {
+            cache->server_variables[i].fetched = false;
+        }
+    }
+
+    for (RequestLuaServerVariable* variable = cache->named_server_variables; variable; variable = variable->next)
+    {
+        variable->fetched = false;
+    }
+}
+
+static int
+lua_request_set_url(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+    const char* url = luaL_checkstring(L, 2);
+
+    bool reset_querystring = true;
+
+    if (lua_gettop(L) >= 3 && lua_isboolean(L, 3))
+    {
+        reset_querystring = lua_toboolean(L, 3);
+    }
 
-    errno_t result = wcstombs_s(
-        &i,
-        converted,
-        raw_request->CookedUrl.pAbsPath,
-        (int)(raw_request->CookedUrl.AbsPathLength / sizeof(wchar_t))
+    HRESULT hr = request_lua->http_request->SetUrl(
+        url, 
+        (DWORD)strlen(url), 
+        reset_querystring
     );
 
-    if (result)
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to set url, hresult: 0x%X", hr);
+    }
+
+    lua_request_forget_url(request_lua->cache);
+
+    return 0;
+}
+
+static DWORD
+lua_request_read_chunk(lua_State* L, RequestLua* request_lua, void* buffer, DWORD buffer_size)
+{
+    DWORD bytes_read = 0;
+
+    HRESULT hr = request_lua->http_request->ReadEntityBody(buffer, buffer_size, FALSE, &bytes_read, nullptr);
+
+    if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+    {
+        return 0;
+    }
+
+    if (FAILED(hr))
+    {
+        luaL_error(L, "failed to read entity body, hresult: 0x%X", hr);
+    }
+
+    return bytes_read;
+}
+
+static int
+lua_request_read(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    ///////////////////////////////////////////////
+
+    // max_bytes: number {optional}, rewrite: bool {optional}
+    // Read(rewrite) is still accepted and reads without a cap.
+    int rewrite_index = 2;
+    size_t max_bytes = SIZE_MAX;
+
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Number limit = lua_tonumber(L, 2);
+
+        if (limit < 0)
+        {
+            return luaL_error(L, "max bytes must not be negative");
+        }
+
+        max_bytes = (size_t)limit;
+        rewrite_index = 3;
+    }
+
+    bool rewrite = lua_gettop(L) >= rewrite_index && lua_isboolean(L, rewrite_index) && lua_toboolean(L, rewrite_index);
+
+    IHttpRequest* http_request = request_lua->http_request;
+    DWORD remaining_bytes = http_request->GetRemainingEntityBytes();
+
+    if (!remaining_bytes)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Chunked bodies report an unknown length, so the cap is also checked while reading.
+    bool known_length = remaining_bytes != ULONG_MAX;
+
+    if (known_length && remaining_bytes > max_bytes)
     {
-        return luaL_error(L, "unable to convert to narrow string");
+        return luaL_error(L, "entity body of %d bytes exceeds limit of %d bytes", (int)remaining_bytes, (int)max_bytes);
     }
 
-    lua_pushstring(L, converted);
+    ///////////////////////////////////////////////
+
+    // A rewritten body with a known length is read straight into request memory, which
+    // is then handed to both Lua and InsertEntityBody without a second copy.
+    if (rewrite && known_length)
+    {
+        char* context_buffer = (char*)request_lua->http_context->AllocateRequestMemory(remaining_bytes);
+
+        if (!context_buffer)
+        {
+            return luaL_error(L, "failed to allocate request memory");
+        }
+
+        DWORD total_bytes = 0;
+
+        while (total_bytes < remaining_bytes)
+        {
+            DWORD bytes_read = lua_request_read_chunk(L, request_lua, context_buffer + total_bytes, remaining_bytes - total_bytes);
+
+            if (!bytes_read)
+                break;
+
+            total_bytes += bytes_read;
+        }
+
+        lua_pushlstring(L, context_buffer, total_bytes);
+
+        HRESULT hr = http_request->InsertEntityBody(context_buffer, total_bytes);
+
+        if (FAILED(hr)) 
+        {
+            return luaL_error(L, "failed to insert entity body, hresult: 0x%X", hr);
+        }
+
+        return 1;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    size_t total_bytes = 0;
+
+    while (remaining_bytes)
+    {
+        DWORD bytes_read = lua_request_read_chunk(L, request_lua, request_lua->read_buffer, request_lua->read_size);
+
+        if (!bytes_read)
+            break;
+
+        total_bytes += bytes_read;
+
+        if (total_bytes > max_bytes)
+        {
+            return luaL_error(L, "entity body exceeds limit of %d bytes", (int)max_bytes);
+        }
+
+        luaL_addlstring(&b, request_lua->read_buffer, bytes_read);
+
+        remaining_bytes = http_request->GetRemainingEntityBytes();
+    }
+
+    luaL_pushresult(&b);
+
+    ///////////////////////////////////////////////
+
+    if (rewrite)
+    {
+        size_t lua_buffer_length;
+        const char* lua_buffer = lua_tolstring(L, -1, &lua_buffer_length);
+
+        void* context_buffer = request_lua->http_context->AllocateRequestMemory(
+            (DWORD)lua_buffer_length
+        );
+
+        if (!context_buffer)
+        {
+            return luaL_error(L, "failed to allocate request memory");
+        }
+
+        memcpy(context_buffer, lua_buffer, lua_buffer_length);
+
+        HRESULT hr = http_request->InsertEntityBody(
+            context_buffer, 
+            (DWORD)lua_buffer_length
+        );
+
+        if (FAILED(hr)) 
+        {
+            return luaL_error(L, "failed to insert entity body, hresult: 0x%X", hr);
+        }
+    }
 
     return 1;
 }
 
+// No stack guard, the iterator may yield or return an error message alongside nil.
 static int
-lua_request_get_host_url(lua_State* L)
+lua_request_body_next(lua_State* L)
+{
+    RequestLua* request_lua = lua_request_check_type(L, lua_upvalueindex(1));
+    DWORD chunk_size = (DWORD)lua_tointeger(L, lua_upvalueindex(2));
+
+    if (!request_lua->http_request->GetRemainingEntityBytes())
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Inside the handler coroutine the read is asynchronous and suspends the handler
+    // when it cannot complete at once. The buffer then has to outlive this engine
+    // binding, so it comes from request memory.
+    if (L == request_lua->thread)
+    {
+        RequestLuaCache* cache = lua_request_get_cache(L, request_lua);
+
+        if (cache->read_buffer_size < chunk_size)
+        {
+            cache->read_buffer = (char*)request_lua->http_context->AllocateRequestMemory(chunk_size);
+            cache->read_buffer_size = cache->read_buffer ? chunk_size : 0;
+
+            if (!cache->read_buffer)
+            {
+                return luaL_error(L, "failed to allocate request memory");
+            }
+        }
+
+        DWORD bytes_read = 0;
+        BOOL completion_pending = FALSE;
+
+        HRESULT hr = request_lua->http_request->ReadEntityBody(
+            cache->read_buffer, 
+            chunk_size, 
+            TRUE, 
+            &bytes_read, 
+            &completion_pending
+        );
+
+        if (hr != HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) && FAILED(hr))
+        {
+            return luaL_error(L, "failed to read entity body, hresult: 0x%X", hr);
+        }
+
+        if (completion_pending)
+        {
+            cache->read_pending = true;
+            return lua_yield(L, 0);
+        }
+
+        return lua_request_complete_read(L, cache, bytes_read, hr);
+    }
+
+    DWORD bytes_read = lua_request_read_chunk(L, request_lua, request_lua->read_buffer, chunk_size);
+
+    if (bytes_read)
+    {
+        lua_pushlstring(L, request_lua->read_buffer, bytes_read);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+/**
+ * Returns an iterator over the entity body, each chunk is at most chunk_size
+ * bytes and is read into the state's reusable read buffer.
+ */
+static int
+lua_request_body(lua_State* L)
 {
     lua_stack_guard(L, 1);
 
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    HTTP_REQUEST* raw_request = request_lua->http_request->GetRawHttpRequest();
 
-    size_t i;
-    char converted[2048];
+    // chunk_size: number {optional}
+    lua_Integer chunk_size = luaL_optinteger(L, 2, request_lua->read_size);
 
-    errno_t result = wcstombs_s(
-        &i,
-        converted,
-        raw_request->CookedUrl.pHost,
-        (int)(raw_request->CookedUrl.HostLength / sizeof(wchar_t))
-    );
+    if (chunk_size <= 0)
+    {
+        return luaL_error(L, "chunk size must be positive");
+    }
 
-    if (result)
+    if ((DWORD)chunk_size > request_lua->read_size)
     {
-        return luaL_error(L, "unable to convert to narrow string");
+        chunk_size = request_lua->read_size;
     }
 
-    lua_pushstring(L, converted);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, chunk_size);
+    lua_pushcclosure(L, lua_request_body_next, 2);
 
     return 1;
 }
 
 static int
-lua_request_get_querystring(lua_State* L)
+lua_request_set_header(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+    const char* header_name = luaL_checkstring(L, 2);
+    const char* header_value = luaL_checkstring(L, 3);
+    bool should_replace = true;
+
+    int args = lua_gettop(L);
+    if (args >= 4 && lua_isboolean(L, 4))
+    {
+        should_replace = lua_toboolean(L, 4);
+    }
+
+    HRESULT hr = request_lua->http_request->SetHeader(
+        header_name, 
+        header_value, 
+        (unsigned int)strlen(header_value), 
+        should_replace
+    );
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to set header, hresult: 0x%X", hr);
+    }
+
+    return 0;
+}
+
+static PCSTR
+lua_request_find_header(lua_State* L, RequestLua* request_lua, int index, USHORT* header_value_size)
+{
+    PCSTR header_value = nullptr;
+
+    if (lua_type(L, index) == LUA_TNUMBER)
+    {
+        lua_Integer header_id = lua_tointeger(L, index);
+
+        if (header_id < 0 || header_id >= HttpHeaderRequestMaximum)
+        {
+            luaL_error(L, "invalid header id %d", (int)header_id);
+        }
+
+        const HTTP_KNOWN_HEADER* known_header = 
+            &request_lua->http_request->GetRawHttpRequest()->Headers.KnownHeaders[header_id];
+
+        if (known_header->pRawValue)
+        {
+            header_value = known_header->pRawValue;
+            *header_value_size = known_header->RawValueLength;
+        }
+    }
+    else
+    {
+        const char* header_name = luaL_checkstring(L, index);
+
+        header_value = request_lua->http_request->GetHeader(header_name, header_value_size);
+    }
+
+    return header_value;
+}
+
+static int
+lua_request_get_header(lua_State* L)
 {
     lua_stack_guard(L, 1);
 
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    HTTP_REQUEST* raw_request = request_lua->http_request->GetRawHttpRequest();
 
-    size_t i;
-    char converted[2048];
+    USHORT header_value_size = 0;
+    PCSTR header_value = lua_request_find_header(L, request_lua, 2, &header_value_size);
+
+    if (header_value)
+    {
+        lua_pushlstring(L, header_value, header_value_size);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+static bool
+lua_request_is_cookie_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * Splits the Cookie header into name and value offsets, once per request.
+ * Pairs without '=' are skipped and quoted values lose their quotes.
+ */
+static RequestLuaCache*
+lua_request_get_cookies(lua_State* L, RequestLua* request_lua)
+{
+    RequestLuaCache* cache = lua_request_get_cache(L, request_lua);
+
+    const HTTP_KNOWN_HEADER* header =
+        &request_lua->http_request->GetRawHttpRequest()->Headers.KnownHeaders[HttpHeaderCookie];
+
+    if (cache->cookies && cache->cookie_header == header->pRawValue)
+    {
+        return cache;
+    }
+
+    cache->cookie_header = header->pRawValue;
+    cache->cookie_count = 0;
+
+    const char* cookie = header->pRawValue;
+    USHORT length = cookie ? header->RawValueLength : 0;
 
-    errno_t result = wcstombs_s(
-        &i,
-        converted,
-        raw_request->CookedUrl.pQueryString,
-        (int)(raw_request->CookedUrl.QueryStringLength / sizeof(wchar_t))
+    // Every pair needs its own ';', so this bounds the index.
+    DWORD capacity = 1;
+
+    for (DWORD i = 0; i < length; i++)
+    {
+        if (cookie[i] == ';')
+            capacity++;
+    }
+
+    cache->cookies = (RequestLuaCookie*)request_lua->http_context->AllocateRequestMemory(
+        capacity * sizeof(RequestLuaCookie)
     );
 
-    if (result)
+    if (!cache->cookies)
+    {
+        luaL_error(L, "failed to allocate request memory");
+    }
+
+    DWORD position = 0;
+
+    while (position < length)
+    {
+        DWORD end = position;
+
+        while (end < length && cookie[end] != ';')
+            end++;
+
+        DWORD name_begin = position;
+        DWORD value_end = end;
+
+        position = end + 1;
+
+        while (name_begin < value_end && lua_request_is_cookie_space(cookie[name_begin]))
+            name_begin++;
+
+        while (value_end > name_begin && lua_request_is_cookie_space(cookie[value_end - 1]))
+            value_end--;
+
+        const char* equals = (const char*)memchr(cookie + name_begin, '=', value_end - name_begin);
+
+        if (!equals)
+            continue;
+
+        DWORD name_end = (DWORD)(equals - cookie);
+        DWORD value_begin = name_end + 1;
+
+        while (name_end > name_begin && lua_request_is_cookie_space(cookie[name_end - 1]))
+            name_end--;
+
+        while (value_begin < value_end && lua_request_is_cookie_space(cookie[value_begin]))
+            value_begin++;
+
+        if (name_end == name_begin)
+            continue;
+
+        if (value_end - value_begin >= 2 && cookie[value_begin] == '"' && cookie[value_end - 1] == '"')
+        {
+            value_begin++;
+            value_end--;
+        }
+
+        RequestLuaCookie* entry = &cache->cookies[cache->cookie_count++];
+        entry->name_offset = (USHORT)name_begin;
+        entry->name_length = (USHORT)(name_end - name_begin);
+        entry->value_offset = (USHORT)value_begin;
+        entry->value_length = (USHORT)(value_end - value_begin);
+    }
+
+    return cache;
+}
+
+/**
+ * GetCookie(name) returns the first cookie with that name, which is the most
+ * specific one when the browser sent several.
+ */
+static int
+lua_request_get_cookie(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    size_t name_length;
+    const char* name = luaL_checklstring(L, 2, &name_length);
+
+    RequestLuaCache* cache = lua_request_get_cookies(L, request_lua);
+
+    for (USHORT i = 0; i < cache->cookie_count; i++)
     {
-        return luaL_error(L, "unable to convert to narrow string");
+        const RequestLuaCookie* entry = &cache->cookies[i];
+
+        if (entry->name_length == name_length && 
+            memcmp(cache->cookie_header + entry->name_offset, name, name_length) == 0)
+        {
+            lua_pushlstring(L, cache->cookie_header + entry->value_offset, entry->value_length);
+            return 1;
+        }
     }
 
-    lua_pushstring(L, converted);
+    lua_pushnil(L);
+    return 1;
+}
+
+static int
+lua_request_get_cookies_table(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+    RequestLuaCache* cache = lua_request_get_cookies(L, request_lua);
+
+    lua_createtable(L, 0, cache->cookie_count);
+
+    // Walked backwards so the first occurrence of a name is the one left in the table.
+    for (USHORT i = cache->cookie_count; i > 0; i--)
+    {
+        const RequestLuaCookie* entry = &cache->cookies[i - 1];
+
+        lua_pushlstring(L, cache->cookie_header + entry->name_offset, entry->name_length);
+        lua_pushlstring(L, cache->cookie_header + entry->value_offset, entry->value_length);
+        lua_rawset(L, -3);
+    }
 
     return 1;
 }
 
+static void
+lua_request_add_header(lua_State* L, const char* name, size_t name_length, const char* value, size_t value_length)
+{
+    lua_pushlstring(L, name, name_length);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+
+    // Repeated headers are folded into one comma separated value, as RFC 7230 allows.
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_pushlstring(L, value, value_length);
+    }
+    else
+    {
+        lua_pushliteral(L, ", ");
+        lua_pushlstring(L, value, value_length);
+        lua_concat(L, 3);
+    }
+
+    lua_rawset(L, -3);
+}
+
 static int
-lua_request_set_url(lua_State* L)
+lua_request_get_headers(lua_State* L)
 {
-    lua_stack_guard(L, 0);
+    lua_stack_guard(L, 1);
 
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    const char* url = luaL_checkstring(L, 2);
+    const HTTP_REQUEST_HEADERS* headers = &request_lua->http_request->GetRawHttpRequest()->Headers;
 
-    bool reset_querystring = true;
+    int header_count = headers->UnknownHeaderCount;
 
-    if (lua_gettop(L) >= 3 && lua_isboolean(L, 3))
+    for (int i = 0; i < HttpHeaderRequestMaximum; i++)
     {
-        reset_querystring = lua_toboolean(L, 3);
+        if (headers->KnownHeaders[i].pRawValue)
+            header_count++;
     }
 
-    HRESULT hr = request_lua->http_request->SetUrl(
-        url, 
-        (DWORD)strlen(url), 
-        reset_querystring
-    );
+    lua_createtable(L, 0, header_count);
 
-    if (FAILED(hr))
+    for (int i = 0; i < HttpHeaderRequestMaximum; i++)
     {
-        return luaL_error(L, "failed to set url, hresult: 0x%X", hr);
+        const HTTP_KNOWN_HEADER* known_header = &headers->KnownHeaders[i];
+
+        if (known_header->pRawValue)
+        {
+            lua_pushstring(L, lua_request_headers[i].name);
+            lua_pushlstring(L, known_header->pRawValue, known_header->RawValueLength);
+            lua_rawset(L, -3);
+        }
     }
 
-    return 0;
+    for (USHORT i = 0; i < headers->UnknownHeaderCount; i++)
+    {
+        const HTTP_UNKNOWN_HEADER* unknown_header = &headers->pUnknownHeaders[i];
+
+        if (unknown_header->pName && unknown_header->pRawValue)
+        {
+            lua_request_add_header(
+                L, 
+                unknown_header->pName, 
+                unknown_header->NameLength, 
+                unknown_header->pRawValue, 
+                unknown_header->RawValueLength
+            );
+        }
+    }
+
+    return 1;
 }
 
 static int
-lua_request_read(lua_State* L)
+lua_request_push_view(lua_State* L, RequestLua* request_lua, const void* data, size_t length)
 {
-    lua_stack_guard(L, 1);
+    if (!data)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
 
-    RequestLua* request_lua = lua_request_check_type(L, 1);
+    lua_pushlightuserdata(L, (void*)data);
+    lua_pushnumber(L, (lua_Number)length);
+    lua_pushnumber(L, request_lua->epoch);
+    lua_pushlightuserdata(L, &request_lua->epoch);
 
-    ///////////////////////////////////////////////
+    return 4;
+}
 
-    IHttpRequest* http_request = request_lua->http_request;
-    DWORD remaining_bytes = http_request->GetRemainingEntityBytes();
+static int
+lua_request_get_body_view(lua_State* L)
+{
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+    RequestLuaCache* cache = lua_request_get_cache(L, request_lua);
 
-    if (remaining_bytes)
+    if (!cache->body_view)
     {
-        luaL_Buffer b;
-        luaL_buffinit(L, &b);
-
-        while (remaining_bytes)
-        {
-            unsigned char buffer[4096];
-            DWORD bytes_read = 0;
+        const HTTP_REQUEST* raw_request = request_lua->http_request->GetRawHttpRequest();
+        const HTTP_DATA_CHUNK* memory_chunk = nullptr;
 
-            HRESULT hr = http_request->ReadEntityBody(buffer, sizeof(buffer), FALSE, &bytes_read, 0);
+        size_t chunk_count = 0;
+        size_t length = 0;
 
-            if (FAILED(hr)) 
-            {   
-                return luaL_error(L, "failed to read entity body, hresult: 0x%X", hr);
-            }
+        for (USHORT i = 0; i < raw_request->EntityChunkCount; i++)
+        {
+            const HTTP_DATA_CHUNK* chunk = &raw_request->pEntityChunks[i];
 
-            if (bytes_read)
+            if (chunk->DataChunkType == HttpDataChunkFromMemory && chunk->FromMemory.BufferLength)
             {
-                luaL_addlstring(&b, (char*)buffer, bytes_read);
+                memory_chunk = chunk;
+                length += chunk->FromMemory.BufferLength;
+                chunk_count++;
             }
-
-            remaining_bytes = http_request->GetRemainingEntityBytes();
         }
 
-        luaL_pushresult(&b);
-
-        ///////////////////////////////////////////////
-
-        // rewrite: bool {optional}
-        if (lua_gettop(L) >= 2 && lua_isboolean(L, 2) && lua_toboolean(L, 2))
+        if (chunk_count == 1)
         {
-            size_t lua_buffer_length;
-            const char* lua_buffer = lua_tolstring(L, -1, &lua_buffer_length);
-
-            void* context_buffer = request_lua->http_context->AllocateRequestMemory(
-                (DWORD)lua_buffer_length
-            );
+            cache->body_view = (const char*)memory_chunk->FromMemory.pBuffer;
+        }
+        else if (chunk_count > 1)
+        {
+            char* joined = (char*)request_lua->http_context->AllocateRequestMemory((DWORD)length);
 
-            if (!context_buffer)
+            if (!joined)
             {
                 return luaL_error(L, "failed to allocate request memory");
             }
 
-            memcpy(context_buffer, lua_buffer, lua_buffer_length);
-
-            HRESULT hr = http_request->InsertEntityBody(
-                context_buffer, 
-                (DWORD)lua_buffer_length
-            );
+            size_t offset = 0;
 
-            if (FAILED(hr)) 
+            for (USHORT i = 0; i < raw_request->EntityChunkCount; i++)
             {
-                return luaL_error(L, "failed to insert entity body, hresult: 0x%X", hr);
+                const HTTP_DATA_CHUNK* chunk = &raw_request->pEntityChunks[i];
+
+                if (chunk->DataChunkType == HttpDataChunkFromMemory && chunk->FromMemory.BufferLength)
+                {
+                    memcpy(joined + offset, chunk->FromMemory.pBuffer, chunk->FromMemory.BufferLength);
+                    offset += chunk->FromMemory.BufferLength;
+                }
             }
+
+            cache->body_view = joined;
         }
-    }
-    else
-    {
-        lua_pushnil(L);
+
+        cache->body_view_length = length;
     }
 
-    return 1;
+    return lua_request_push_view(L, request_lua, cache->body_view, cache->body_view_length);
 }
 
 static int
-lua_request_set_header(lua_State* L)
+lua_request_get_header_view(lua_State* L)
 {
-    lua_stack_guard(L, 0);
-
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    const char* header_name = luaL_checkstring(L, 2);
-    const char* header_value = luaL_checkstring(L, 3);
-    bool should_replace = true;
-
-    int args = lua_gettop(L);
-    if (args >= 4 && lua_isboolean(L, 4))
-    {
-        should_replace = lua_toboolean(L, 4);
-    }
 
-    HRESULT hr = request_lua->http_request->SetHeader(
-        header_name, 
-        header_value, 
-        (unsigned int)strlen(header_value), 
-        should_replace
-    );
-
-    if (FAILED(hr))
-    {
-        return luaL_error(L, "failed to set header, hresult: 0x%X", hr);
-    }
+    USHORT header_value_size = 0;
+    PCSTR header_value = lua_request_find_header(L, request_lua, 2, &header_value_size);
 
-    return 0;
+    return lua_request_push_view(L, request_lua, header_value, header_value_size);
 }
 
 static int
-lua_request_get_header(lua_State* L)
+lua_request_get_url_view(lua_State* L)
 {
-    lua_stack_guard(L, 1);
+    static const char* const parts[] = { "full", "abs", "host", "query", nullptr };
 
     RequestLua* request_lua = lua_request_check_type(L, 1);
-    const char* header_name = luaL_checkstring(L, 2);
+    RequestLuaUrl url = (RequestLuaUrl)luaL_checkoption(L, 2, "abs", parts);
 
-    USHORT header_value_size = 0;
-    PCSTR header_value = request_lua->http_request->GetHeader(header_name, &header_value_size);
-
-    if (header_value)
-    {
-        lua_pushlstring(L, header_value, header_value_size);
-    }
-    else
-    {
-        lua_pushnil(L);
-    }
+    size_t length;
+    const char* converted = lua_request_get_url(L, request_lua, url, &length);
 
-    return 1;
+    return lua_request_push_view(L, request_lua, converted, length);
 }
 
 static int
@@ -313,7 +1168,7 @@ lua_request_delete_header(lua_State* L)
     return 0;
 }
 
-static bool lua_request_format_sockaddr(PSOCKADDR address, char* ip_address)
+static bool lua_request_format_sockaddr(PSOCKADDR address, char* ip_address, size_t ip_address_size)
 {
     assert(address != nullptr);
     assert(ip_address != nullptr);
@@ -324,7 +1179,7 @@ static bool lua_request_format_sockaddr(PSOCKADDR address, char* ip_address)
         {
             sockaddr_in* socket = (sockaddr_in*)address;
 
-            InetNtopA(socket->sin_family, &socket->sin_addr, ip_address, sizeof ip_address);
+            InetNtopA(socket->sin_family, &socket->sin_addr, ip_address, ip_address_size);
 
             return true;
         }
@@ -332,7 +1187,7 @@ static bool lua_request_format_sockaddr(PSOCKADDR address, char* ip_address)
         {
             sockaddr_in6* socket = (sockaddr_in6*)address;
 
-            InetNtopA(socket->sin6_family, &socket->sin6_addr, ip_address, sizeof ip_address);
+            InetNtopA(socket->sin6_family, &socket->sin6_addr, ip_address, ip_address_size);
 
             return true;
         }
@@ -351,7 +1206,7 @@ lua_request_get_localaddress(lua_State* L)
     char ip_address[INET6_ADDRSTRLEN] = { 0 };
     PSOCKADDR sockaddr = request_lua->http_request->GetLocalAddress();
 
-    if (!lua_request_format_sockaddr(sockaddr, ip_address))
+    if (!lua_request_format_sockaddr(sockaddr, ip_address, sizeof(ip_address)))
     {
         return luaL_error(L, "failed to get local address");
     }
@@ -371,7 +1226,7 @@ lua_request_get_remoteaddress(lua_State* L)
     char ip_address[INET6_ADDRSTRLEN] = { 0 };
     PSOCKADDR sockaddr = request_lua->http_request->GetRemoteAddress();
 
-    if (!lua_request_format_sockaddr(sockaddr, ip_address))
+    if (!lua_request_format_sockaddr(sockaddr, ip_address, sizeof(ip_address)))
     {
         return luaL_error(L, "failed to get remote address");
     }
@@ -381,6 +1236,166 @@ lua_request_get_remoteaddress(lua_State* L)
     return 1;
 }
 
+/**
+ * Returns a form reader for the request's content type, fed by the caller:
+ * `for chunk in request:Body() do form:Feed(chunk) end`.
+ */
+static int
+lua_request_form(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    USHORT content_type_length = 0;
+    PCSTR content_type = request_lua->http_request->GetHeader(HttpHeaderContentType, &content_type_length);
+
+    if (!content_type)
+    {
+        return luaL_error(L, "request has no content type");
+    }
+
+    lua_form_push(L, content_type, content_type_length, 2);
+
+    return 1;
+}
+
+/**
+ * Fetches a server variable once per request. IIS already hands the value out
+ * in request memory, so only the memo entry itself is allocated here.
+ */
+static RequestLuaServerVariable*
+lua_request_fetch_server_variable(lua_State* L, RequestLua* request_lua, RequestLuaServerVariable* variable)
+{
+    if (!variable->fetched)
+    {
+        PCSTR value = nullptr;
+        DWORD length = 0;
+
+        HRESULT hr = request_lua->http_context->GetServerVariable(variable->name, &value, &length);
+
+        if (FAILED(hr) && hr != HRESULT_FROM_WIN32(ERROR_INVALID_INDEX))
+        {
+            luaL_error(L, "failed to get server variable '%s', hresult: 0x%X", variable->name, hr);
+        }
+
+        variable->value = SUCCEEDED(hr) ? value : nullptr;
+        variable->length = SUCCEEDED(hr) ? length : 0;
+        variable->fetched = true;
+    }
+
+    return variable;
+}
+
+static RequestLuaServerVariable*
+lua_request_find_server_variable(lua_State* L, RequestLua* request_lua, int index, RequestLuaValueType* type)
+{
+    RequestLuaCache* cache = lua_request_get_cache(L, request_lua);
+
+    *type = REQUEST_LUA_STRING;
+
+    if (lua_type(L, index) == LUA_TNUMBER)
+    {
+        lua_Integer id = lua_tointeger(L, index);
+
+        if (id < 0 || id >= (lua_Integer)REQUEST_LUA_SERVER_VARIABLE_COUNT)
+        {
+            luaL_error(L, "invalid server variable id %d", (int)id);
+        }
+
+        if (!cache->server_variables)
+        {
+            DWORD size = (DWORD)(sizeof(RequestLuaServerVariable) * REQUEST_LUA_SERVER_VARIABLE_COUNT);
+
+            cache->server_variables = (RequestLuaServerVariable*)request_lua->http_context->AllocateRequestMemory(size);
+
+            if (!cache->server_variables)
+            {
+                luaL_error(L, "failed to allocate request memory");
+            }
+
+            memset(cache->server_variables, 0, size);
+        }
+
+        RequestLuaServerVariable* variable = &cache->server_variables[id];
+        variable->name = lua_request_server_variables[id].name;
+
+        *type = lua_request_server_variables[id].type;
+
+        return lua_request_fetch_server_variable(L, request_lua, variable);
+    }
+
+    size_t name_length;
+    const char* name = luaL_checklstring(L, index, &name_length);
+
+    for (RequestLuaServerVariable* variable = cache->named_server_variables; variable; variable = variable->next)
+    {
+        if (_stricmp(variable->name, name) == 0)
+            return lua_request_fetch_server_variable(L, request_lua, variable);
+    }
+
+    // The name is copied as well, the Lua string may be collected before the request ends.
+    RequestLuaServerVariable* variable = (RequestLuaServerVariable*)request_lua->http_context->AllocateRequestMemory(
+        (DWORD)(sizeof(RequestLuaServerVariable) + name_length + 1)
+    );
+
+    if (!variable)
+    {
+        luaL_error(L, "failed to allocate request memory");
+    }
+
+    char* name_copy = (char*)(variable + 1);
+    memcpy(name_copy, name, name_length + 1);
+
+    variable->name = name_copy;
+    variable->value = nullptr;
+    variable->length = 0;
+    variable->fetched = false;
+    variable->next = cache->named_server_variables;
+
+    cache->named_server_variables = variable;
+
+    return lua_request_fetch_server_variable(L, request_lua, variable);
+}
+
+/**
+ * GetServerVariable(iis.ServerVariable.X) returns a typed value, numbers and
+ * booleans included, GetServerVariable(name) returns the raw string.
+ */
+static int
+lua_request_get_server_variable(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    RequestLua* request_lua = lua_request_check_type(L, 1);
+
+    RequestLuaValueType type;
+    RequestLuaServerVariable* variable = lua_request_find_server_variable(L, request_lua, 2, &type);
+
+    if (!variable->value)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    switch (type)
+    {
+    case REQUEST_LUA_NUMBER:
+        lua_pushnumber(L, (lua_Number)_strtoui64(variable->value, nullptr, 10));
+        break;
+
+    case REQUEST_LUA_BOOLEAN:
+        lua_pushboolean(L, _stricmp(variable->value, "on") == 0 || strcmp(variable->value, "1") == 0);
+        break;
+
+    default:
+        lua_pushlstring(L, variable->value, variable->length);
+        break;
+    }
+
+    return 1;
+}
+
 static int
 lua_request_get_method(lua_State* L)
 {
@@ -403,18 +1418,30 @@ lua_request_get_method(lua_State* L)
 const luaL_Reg lua_request_methods[] = {
 
     {"Read", lua_request_read},
+    {"Body", lua_request_body},
 
     {"SetUrl", lua_request_set_url},
     {"GetFullUrl", lua_request_get_full_url},
     {"GetAbsUrl", lua_request_get_abs_url},
     {"GetHostUrl", lua_request_get_host_url},
     {"GetQueryString", lua_request_get_querystring},
+    {"GetQuery", lua_request_get_query},
+    {"GetQueryParam", lua_request_get_query_param},
 
     {"SetHeader", lua_request_set_header},
     {"GetHeader", lua_request_get_header},
+    {"GetHeaders", lua_request_get_headers},
+    {"GetCookie", lua_request_get_cookie},
+    {"GetCookies", lua_request_get_cookies_table},
     {"DeleteHeader", lua_request_delete_header},
 
     {"GetMethod", lua_request_get_method},
+    {"GetServerVariable", lua_request_get_server_variable},
+    {"Form", lua_request_form},
+
+    {"GetBodyView", lua_request_get_body_view},
+    {"GetHeaderView", lua_request_get_header_view},
+    {"GetUrlView", lua_request_get_url_view},
 
     {"GetLocalAddress", lua_request_get_localaddress},
     {"GetRemoteAddress", lua_request_get_remoteaddress},   
@@ -440,6 +1467,114 @@ const luaL_Reg lua_request_meta[] =
     {0, 0}
 };
 
+/**
+ * FFI views over request memory. The C side only hands out a pointer, length
+ * and the epoch of the bound request, this chunk turns them into iis_view_t
+ * cdata that refuse to be read once the request is no longer bound.
+ */
+static const char lua_request_views[] = R"lua(
+local methods = ...
+local ok, ffi = pcall(require, "ffi")
+
+if not ok then
+    methods.GetBodyView, methods.GetHeaderView, methods.GetUrlView = nil, nil, nil
+    return
+end
+
+ffi.cdef[[
+typedef struct iis_view_t {
+    const uint8_t* data;
+    size_t length;
+    uint32_t epoch;
+    const uint32_t* current;
+} iis_view_t;
+]]
+
+local function check(view)
+    if view.epoch ~= view.current[0] then
+        error("view used outside of its request", 3)
+    end
+end
+
+local view_methods = {}
+
+function view_methods.valid(view)
+    return view.epoch == view.current[0]
+end
+
+function view_methods.pointer(view)
+    check(view)
+    return view.data, tonumber(view.length)
+end
+
+function view_methods.byte(view, i)
+    check(view)
+
+    if i < 1 or i > tonumber(view.length) then
+        return nil
+    end
+
+    return view.data[i - 1]
+end
+
+function view_methods.sub(view, i, j)
+    check(view)
+
+    local length = tonumber(view.length)
+    i = i or 1
+    j = j or length
+
+    if i < 0 then i = length + i + 1 end
+    if j < 0 then j = length + j + 1 end
+    if i < 1 then i = 1 end
+    if j > length then j = length end
+
+    if i > j then
+        return ""
+    end
+
+    return ffi.string(view.data + i - 1, j - i + 1)
+end
+
+function view_methods.equals(view, s)
+    check(view)
+
+    local length = #s
+
+    if length ~= tonumber(view.length) then
+        return false
+    end
+
+    for i = 0, length - 1 do
+        if view.data[i] ~= s:byte(i + 1) then
+            return false
+        end
+    end
+
+    return true
+end
+
+local view_t = ffi.metatype("iis_view_t", {
+    __index = view_methods,
+    __len = function(view) return tonumber(view.length) end,
+    __tostring = function(view) check(view) return ffi.string(view.data, view.length) end,
+})
+
+for _, name in ipairs({ "GetBodyView", "GetHeaderView", "GetUrlView" }) do
+    local get = methods[name]
+
+    methods[name] = function(...)
+        local data, length, epoch, current = get(...)
+
+        if data == nil then
+            return nil
+        end
+
+        return view_t(data, length, epoch, current)
+    end
+end
+)lua";
+
 void 
 lua_request_register(lua_State* L)
 {
@@ -460,12 +1595,99 @@ lua_request_register(lua_State* L)
         lua_pushvalue(L, -3);
         lua_rawset(L, -3);
 
+        if (luaL_loadbuffer(L, lua_request_views, sizeof(lua_request_views) - 1, "=iis_view") == 0)
+        {
+            lua_pushvalue(L, -3);
+
+            if (lua_pcall(L, 1, 0, 0) != 0)
+            {
+                lua_engine_printf("%s\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        else
+        {
+            lua_engine_printf("%s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+
         lua_pop(L, 2);
     }
 }
 
+/**
+ * Returns the binary remote address when the value at index is a bound
+ * request object, and nullptr for anything else.
+ */
+PSOCKADDR
+lua_request_get_remote_sockaddr(lua_State* L, int index)
+{
+    RequestLua* request_lua = (RequestLua*)lua_touserdata(L, index);
+
+    if (!request_lua || !lua_getmetatable(L, index))
+        return nullptr;
+
+    luaL_getmetatable(L, RequestMetatable);
+    bool is_request = lua_rawequal(L, -1, -2) != 0;
+    lua_pop(L, 2);
+
+    if (!is_request || !request_lua->http_request)
+        return nullptr;
+
+    return request_lua->http_request->GetRemoteAddress();
+}
+
+/**
+ * Pushes iis.Header into the table on top of the stack, each constant is the
+ * HTTP_HEADER_ID of the header so GetHeader can index the known-header slot.
+ */
+void
+lua_request_register_headers(lua_State* L)
+{
+    if (L)
+    {
+        lua_stack_guard(L, 0);
+
+        lua_pushliteral(L, "Header");
+        lua_createtable(L, 0, HttpHeaderRequestMaximum);
+
+        for (int i = 0; i < HttpHeaderRequestMaximum; i++)
+        {
+            lua_pushstring(L, lua_request_headers[i].key);
+            lua_pushinteger(L, lua_request_headers[i].id);
+            lua_rawset(L, -3);
+        }
+
+        lua_rawset(L, -3);
+    }
+}
+
+/**
+ * Pushes iis.ServerVariable into the table on top of the stack.
+ */
+void
+lua_request_register_server_variables(lua_State* L)
+{
+    if (L)
+    {
+        lua_stack_guard(L, 0);
+
+        lua_pushliteral(L, "ServerVariable");
+        lua_createtable(L, 0, (int)REQUEST_LUA_SERVER_VARIABLE_COUNT);
+
+        for (int i = 0; i < (int)REQUEST_LUA_SERVER_VARIABLE_COUNT; i++)
+        {
+            lua_pushstring(L, lua_request_server_variables[i].key);
+            lua_pushinteger(L, i);
+            lua_rawset(L, -3);
+        }
+
+        lua_rawset(L, -3);
+    }
+}
+
 RequestLua* 
-lua_request_push(lua_State* L)
+lua_request_push(lua_State* L, DWORD read_size)
 {
     RequestLua* request_lua = nullptr;
 
@@ -473,10 +1695,86 @@ lua_request_push(lua_State* L)
     {
         lua_stack_guard(L, 1);
 
-        request_lua = (RequestLua*)lua_newuserdata(L, sizeof(RequestLua));
+        if (read_size < REQUEST_LUA_MIN_READ_SIZE)
+            read_size = REQUEST_LUA_MIN_READ_SIZE;
+
+        request_lua = (RequestLua*)lua_newuserdata(L, offsetof(RequestLua, read_buffer) + read_size);
+        request_lua->read_size = read_size;
+
         luaL_getmetatable(L, RequestMetatable);
         lua_setmetatable(L, -2);
     }
   
     return request_lua;
+}
+
+void
+lua_request_bind(
+    RequestLua* request_lua, 
+    IHttpContext* http_context, 
+    lua_State* thread, 
+    RequestLuaCache* cache
+)
+{
+    assert(request_lua != nullptr);
+
+    if (request_lua)
+    {
+        request_lua->http_context = http_context;
+        request_lua->http_request = http_context ? http_context->GetRequest() : nullptr;
+        request_lua->cache = cache;
+        request_lua->thread = thread;
+
+        // A fresh request gets a new epoch, which leaves every view of the previous one stale.
+        if (cache)
+        {
+            request_lua->epoch = cache->epoch;
+        }
+        else if (http_context)
+        {
+            if (++request_lua->next_epoch == 0)
+                request_lua->next_epoch = 1;
+
+            request_lua->epoch = request_lua->next_epoch;
+        }
+        else
+        {
+            request_lua->epoch = 0;
+        }
+    }
+}
+
+/**
+ * Pushes the results of a read that suspended the handler, these become the
+ * return values of the Body iterator call that yielded.
+ */
+int
+lua_request_complete_read(lua_State* L, RequestLuaCache* cache, DWORD bytes_read, HRESULT status)
+{
+    assert(L != nullptr);
+    assert(cache != nullptr);
+
+    if (cache)
+    {
+        cache->read_pending = false;
+    }
+
+    if (FAILED(status) && status != HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to read entity body, hresult: 0x%X", status);
+
+        return 2;
+    }
+
+    if (SUCCEEDED(status) && bytes_read && cache && cache->read_buffer)
+    {
+        lua_pushlstring(L, cache->read_buffer, min(bytes_read, cache->read_buffer_size));
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    return 1;
 }
\ No newline at end of file
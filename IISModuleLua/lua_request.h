@@ -4,13 +4,98 @@
 #ifndef _LUA_REQUEST
 #define _LUA_REQUEST
 
+typedef enum _RequestLuaUrl
+{
+    REQUEST_LUA_FULL_URL,
+    REQUEST_LUA_ABS_URL,
+    REQUEST_LUA_HOST_URL,
+    REQUEST_LUA_QUERY_STRING,
+    REQUEST_LUA_URL_COUNT
+} RequestLuaUrl;
+
+// Memoised server variable, a null value with fetched set means it does not exist.
+typedef struct _RequestLuaServerVariable
+{
+    const char* name;
+    const char* value;
+    DWORD length;
+    bool fetched;
+
+    struct _RequestLuaServerVariable* next;
+} RequestLuaServerVariable;
+
+// Offsets into the Cookie header, the header itself is never copied.
+typedef struct _RequestLuaCookie
+{
+    USHORT name_offset;
+    USHORT name_length;
+    USHORT value_offset;
+    USHORT value_length;
+} RequestLuaCookie;
+
+// Lives in request memory and is dropped with the request.
+typedef struct _RequestLuaCache
+{
+    const char* urls[REQUEST_LUA_URL_COUNT];
+    size_t url_lengths[REQUEST_LUA_URL_COUNT];
+
+    char* query_scratch;
+    size_t query_scratch_size;
+
+    // Asynchronous reads complete after the engine has moved on, so they land here.
+    char* read_buffer;
+    DWORD read_buffer_size;
+    bool read_pending;
+
+    // Request the cache belongs to, restored into the binding on resume.
+    UINT32 epoch;
+
+    // Preloaded entity chunks, joined only when there is more than one.
+    const char* body_view;
+    size_t body_view_length;
+
+    // Indexed by iis.ServerVariable, plus a list for variables looked up by name.
+    RequestLuaServerVariable* server_variables;
+    RequestLuaServerVariable* named_server_variables;
+
+    // Index of the Cookie header it was built from, rebuilt if SetHeader replaces it.
+    const char* cookie_header;
+    RequestLuaCookie* cookies;
+    USHORT cookie_count;
+} RequestLuaCache;
+
+#define REQUEST_LUA_MIN_READ_SIZE 4096
+
 typedef struct _RequestLua
 {
     IHttpContext* http_context;
     IHttpRequest* http_request;
+
+    RequestLuaCache* cache;
+
+    // Coroutine the handler runs in, reads issued from it may suspend it.
+    lua_State* thread;
+
+    // Identifies the bound request, FFI views compare against it on every access.
+    UINT32 epoch;
+    UINT32 next_epoch;
+
+    // Body reads land here and are reused for every request served by the state.
+    DWORD read_size;
+    char read_buffer[1];
 } RequestLua;
 
 void lua_request_register(lua_State* L);
-RequestLua* lua_request_push(lua_State* L);
+void lua_request_register_headers(lua_State* L);
+void lua_request_register_server_variables(lua_State* L);
+PSOCKADDR lua_request_get_remote_sockaddr(lua_State* L, int index);
+RequestLua* lua_request_push(lua_State* L, DWORD read_size);
+void lua_request_bind(
+    RequestLua* request_lua, 
+    IHttpContext* http_context, 
+    lua_State* thread, 
+    RequestLuaCache* cache
+);
+int lua_request_complete_read(lua_State* L, RequestLuaCache* cache, DWORD bytes_read, HRESULT status);
 
 #endif
\ No newline at end of file
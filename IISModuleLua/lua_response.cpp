@@ -1,77 +1,941 @@
 #include "shared.h"
 
 #define ResponseMetatable "HttpResponse"
+#define FileHandleMetatable "HttpFileHandle"
+
+typedef struct _FileHandleLua
+{
+    FileCacheEntry* entry;
+} FileHandleLua;
 
 static ResponseLua* 
 lua_response_check_type(lua_State* L, int index)
 {
-    lua_stack_guard(L, 0);
+    lua_stack_guard(L, 0);
+
+    luaL_checktype(L, index, LUA_TUSERDATA);
+
+    ResponseLua* response_lua = (ResponseLua*)luaL_checkudata(L, index, ResponseMetatable);
+
+    if (!response_lua)
+        luaL_typerror(L, index, ResponseMetatable);
+
+    if (!response_lua->http_context)
+        luaL_error(L, "context object is invalid");
+
+    if (!response_lua->http_response)
+        luaL_error(L, "response object is invalid");
+
+    return response_lua;
+}
+
+static void
+lua_response_commit_headers(IHttpResponse* http_response)
+{
+    const HTTP_KNOWN_HEADER* content_type = 
+        &http_response->GetRawHttpResponse()->Headers.KnownHeaders[HttpHeaderContentType];
+
+    if (!content_type->RawValueLength)
+    {
+        http_response->SetHeader(
+            HttpHeaderContentType, 
+            "text/html", 
+            (USHORT)strlen("text/html"), 
+            TRUE
+        );
+    }
+}
+
+static ResponseLuaBuffer*
+lua_response_get_buffer(lua_State* L, ResponseLua* response_lua)
+{
+    if (!response_lua->buffer)
+    {
+        response_lua->buffer = (ResponseLuaBuffer*)response_lua->http_context->AllocateRequestMemory(
+            sizeof(ResponseLuaBuffer)
+        );
+
+        if (!response_lua->buffer)
+        {
+            luaL_error(L, "failed to allocate request memory");
+        }
+
+        memset(response_lua->buffer, 0, sizeof(ResponseLuaBuffer));
+    }
+
+    return response_lua->buffer;
+}
+
+static void
+lua_response_check_result(lua_State* L, HRESULT hr)
+{
+    if (hr == E_OUTOFMEMORY)
+    {
+        luaL_error(L, "failed to allocate request memory");
+    }
+    else if (FAILED(hr))
+    {
+        luaL_error(L, "failed to write entity chunks, hresult: 0x%X", hr);
+    }
+}
+
+/**
+ * Writes the queue as it stands, committing the default headers on the way.
+ */
+static HRESULT
+lua_response_write_chunks(ResponseLua* response_lua, ResponseLuaBuffer* buffer, bool more_data)
+{
+    if (!buffer->chunk_count)
+        return S_OK;
+
+    IHttpResponse* http_response = response_lua->http_response;
+
+    lua_response_commit_headers(http_response);
+
+    DWORD cb_sent = 0;
+    HRESULT hr = http_response->WriteEntityChunks(
+        buffer->chunks, 
+        buffer->chunk_count, 
+        FALSE, 
+        more_data, 
+        &cb_sent
+    );
+
+    buffer->chunk_count = 0;
+
+    return hr;
+}
+
+/**
+ * Returns a fresh chunk at the end of the queue, flushing a full queue first.
+ */
+static HRESULT
+lua_response_reserve_chunk(ResponseLua* response_lua, ResponseLuaBuffer* buffer, HTTP_DATA_CHUNK** chunk)
+{
+    *chunk = nullptr;
+
+    if (buffer->chunk_count == RESPONSE_LUA_MAX_CHUNKS)
+    {
+        HRESULT hr = buffer->encoding ? 
+            lua_response_write_chunks(response_lua, buffer, true) : 
+            lua_response_flush(response_lua, true);
+
+        if (FAILED(hr))
+            return hr;
+    }
+
+    if (buffer->chunk_count == buffer->chunk_capacity)
+    {
+        USHORT capacity = buffer->chunk_capacity ? buffer->chunk_capacity * 2 : 16;
+
+        HTTP_DATA_CHUNK* chunks = (HTTP_DATA_CHUNK*)response_lua->http_context->AllocateRequestMemory(
+            capacity * sizeof(HTTP_DATA_CHUNK)
+        );
+
+        if (!chunks)
+            return E_OUTOFMEMORY;
+
+        if (buffer->chunk_count)
+        {
+            memcpy(chunks, buffer->chunks, buffer->chunk_count * sizeof(HTTP_DATA_CHUNK));
+        }
+
+        buffer->chunks = chunks;
+        buffer->chunk_capacity = capacity;
+    }
+
+    *chunk = &buffer->chunks[buffer->chunk_count++];
+    memset(*chunk, 0, sizeof(HTTP_DATA_CHUNK));
+
+    return S_OK;
+}
+
+static HRESULT
+lua_response_queue_memory(ResponseLua* response_lua, ResponseLuaBuffer* buffer, char* data, DWORD length)
+{
+    if (buffer->chunk_count)
+    {
+        HTTP_DATA_CHUNK* last = &buffer->chunks[buffer->chunk_count - 1];
+
+        if (last->DataChunkType == HttpDataChunkFromMemory &&
+            (char*)last->FromMemory.pBuffer + last->FromMemory.BufferLength == data)
+        {
+            last->FromMemory.BufferLength += length;
+            return S_OK;
+        }
+    }
+
+    HTTP_DATA_CHUNK* chunk = nullptr;
+    HRESULT hr = lua_response_reserve_chunk(response_lua, buffer, &chunk);
+
+    if (FAILED(hr))
+        return hr;
+
+    chunk->DataChunkType = HttpDataChunkFromMemory;
+    chunk->FromMemory.pBuffer = data;
+    chunk->FromMemory.BufferLength = length;
+
+    return S_OK;
+}
+
+/**
+ * Copies data into request memory and queues it. Anything at least half a
+ * block gets its own allocation rather than abandoning the current block.
+ */
+static HRESULT
+lua_response_copy(ResponseLua* response_lua, ResponseLuaBuffer* buffer, const char* data, DWORD length)
+{
+    if (!length)
+        return S_OK;
+
+    char* destination = nullptr;
+
+    if (buffer->block && RESPONSE_LUA_BLOCK_SIZE - buffer->block_used >= length)
+    {
+        destination = buffer->block + buffer->block_used;
+        buffer->block_used += length;
+    }
+    else
+    {
+        bool dedicated = length >= RESPONSE_LUA_BLOCK_SIZE / 2;
+
+        destination = (char*)response_lua->http_context->AllocateRequestMemory(
+            dedicated ? length : RESPONSE_LUA_BLOCK_SIZE
+        );
+
+        if (!destination)
+            return E_OUTOFMEMORY;
+
+        if (!dedicated)
+        {
+            buffer->block = destination;
+            buffer->block_used = length;
+        }
+    }
+
+    memcpy(destination, data, length);
+
+    return lua_response_queue_memory(response_lua, buffer, destination, length);
+}
+
+static HTTP_DATA_CHUNK*
+lua_response_next_chunk(lua_State* L, ResponseLua* response_lua, ResponseLuaBuffer* buffer)
+{
+    HTTP_DATA_CHUNK* chunk = nullptr;
+
+    lua_response_check_result(L, lua_response_reserve_chunk(response_lua, buffer, &chunk));
+
+    return chunk;
+}
+
+static void
+lua_response_add_chunk(lua_State* L, ResponseLua* response_lua, ResponseLuaBuffer* buffer, char* data, DWORD length)
+{
+    lua_response_check_result(L, lua_response_queue_memory(response_lua, buffer, data, length));
+}
+
+static void
+lua_response_append(lua_State* L, ResponseLua* response_lua, const char* data, size_t length)
+{
+    if (!length)
+        return;
+
+    if (length > MAXDWORD)
+    {
+        luaL_error(L, "attempt to append more than 4 GB");
+    }
+
+    ResponseLuaBuffer* buffer = lua_response_get_buffer(L, response_lua);
+
+    lua_response_check_result(L, lua_response_copy(response_lua, buffer, data, (DWORD)length));
+}
+
+/**
+ * Append(...) queues strings, numbers or arrays of them without calling into
+ * IIS, everything goes out in one WriteEntityChunks call on Flush or once the
+ * handler returns.
+ */
+static int
+lua_response_append_values(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    ResponseLua* response_lua = lua_response_check_type(L, 1);
+
+    int args = lua_gettop(L);
+
+    for (int i = 2; i <= args; i++)
+    {
+        if (lua_istable(L, i))
+        {
+            int count = (int)lua_objlen(L, i);
+
+            for (int j = 1; j <= count; j++)
+            {
+                lua_rawgeti(L, i, j);
+
+                if (!lua_isstring(L, -1))
+                {
+                    return luaL_error(L, "bad argument #%d to 'Append' (string expected at index %d)", i - 1, j);
+                }
+
+                size_t length;
+                const char* data = lua_tolstring(L, -1, &length);
+
+                lua_response_append(L, response_lua, data, length);
+                lua_pop(L, 1);
+            }
+        }
+        else
+        {
+            size_t length;
+            const char* data = luaL_checklstring(L, i, &length);
+
+            lua_response_append(L, response_lua, data, length);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Keeps the value at index alive until the request completes.
+ */
+static void
+lua_response_pin(lua_State* L, ResponseLua* response_lua, int index)
+{
+    lua_stack_guard(L, 0);
+
+    if (response_lua->pin_ref == LUA_NOREF)
+    {
+        lua_newtable(L);
+        response_lua->pin_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_pushvalue(L, index);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, response_lua->pin_ref);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+    lua_pop(L, 1);
+}
+
+/**
+ * WriteNoCopy(s) hands IIS a chunk pointing straight into s. The string is
+ * pinned in the registry until the request completes, so large bodies go
+ * out as a single chunk without ever being copied.
+ */
+static int
+lua_response_write_no_copy(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    ResponseLua* response_lua = lua_response_check_type(L, 1);
+
+    size_t length;
+    const char* data = luaL_checklstring(L, 2, &length);
+
+    if (!length)
+        return 0;
+
+    if (length > MAXDWORD)
+    {
+        return luaL_error(L, "attempt to write more than 4 GB");
+    }
+
+    ResponseLuaBuffer* buffer = lua_response_get_buffer(L, response_lua);
+
+    lua_response_pin(L, response_lua, 2);
+    lua_response_add_chunk(L, response_lua, buffer, (char*)data, (DWORD)length);
+
+    HRESULT hr = lua_response_flush(response_lua, true);
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to write entity chunks, hresult: 0x%X", hr);
+    }
+
+    return 0;
+}
+
+/**
+ * Opens the file at index through the shared cache and pins it for the rest
+ * of the request, the handle is left on top of the stack.
+ */
+static FileCacheEntry*
+lua_response_open_file(lua_State* L, ResponseLua* response_lua, int index)
+{
+    const char* path = luaL_checkstring(L, index);
+
+    if (response_lua->buffer && response_lua->buffer->compression)
+    {
+        luaL_error(L, "cannot send a file once compression is enabled");
+    }
+
+    char file_path[MAX_PATH];
+
+    if (!lua_script_cache_resolve_path(response_lua->directory_path, path, file_path, sizeof(file_path)))
+    {
+        luaL_error(L, "file path '%s' is too long", path);
+    }
+
+    FileHandleLua* file_handle_lua = (FileHandleLua*)lua_newuserdata(L, sizeof(FileHandleLua));
+    file_handle_lua->entry = nullptr;
+
+    luaL_getmetatable(L, FileHandleMetatable);
+    lua_setmetatable(L, -2);
+
+    file_handle_lua->entry = file_cache_acquire(file_path);
+
+    if (!file_handle_lua->entry)
+    {
+        luaL_error(L, "failed to open file '%s'", file_path);
+    }
+
+    lua_response_pin(L, response_lua, -1);
+
+    return file_handle_lua->entry;
+}
+
+static void
+lua_response_queue_file(lua_State* L, ResponseLua* response_lua, FileCacheEntry* entry, UINT64 offset, UINT64 length)
+{
+    if (!length)
+        return;
+
+    ResponseLuaBuffer* buffer = lua_response_get_buffer(L, response_lua);
+
+    HTTP_DATA_CHUNK* chunk = lua_response_next_chunk(L, response_lua, buffer);
+    chunk->DataChunkType = HttpDataChunkFromFileHandle;
+    chunk->FromFileHandle.ByteRange.StartingOffset.QuadPart = offset;
+    chunk->FromFileHandle.ByteRange.Length.QuadPart = length;
+    chunk->FromFileHandle.FileHandle = file_cache_get_handle(entry);
+}
+
+/**
+ * WriteFile(path [, offset [, length]]) sends the file from a cached handle,
+ * the contents never pass through the Lua heap. The handle stays referenced
+ * until the request completes even if the cache evicts it.
+ */
+static int
+lua_response_write_file(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    ResponseLua* response_lua = lua_response_check_type(L, 1);
+    FileCacheEntry* entry = lua_response_open_file(L, response_lua, 2);
+
+    UINT64 file_size = file_cache_get_size(entry);
+
+    // offset: number {optional}
+    lua_Number offset = luaL_optnumber(L, 3, 0);
+
+    // length: number {optional}
+    lua_Number length = luaL_optnumber(L, 4, (lua_Number)file_size - offset);
+
+    if (offset < 0 || length < 0 || offset + length > (lua_Number)file_size)
+    {
+        return luaL_error(L, "range is outside of file '%s'", lua_tostring(L, 2));
+    }
+
+    lua_response_queue_file(L, response_lua, entry, (UINT64)offset, (UINT64)length);
+
+    HRESULT hr = lua_response_flush(response_lua, true);
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to write entity chunks, hresult: 0x%X", hr);
+    }
+
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+static void
+lua_response_set_known_header(lua_State* L, IHttpResponse* http_response, HTTP_HEADER_ID id, const char* value, size_t length)
+{
+    HRESULT hr = http_response->SetHeader(id, value, (USHORT)length, TRUE);
+
+    if (FAILED(hr))
+    {
+        luaL_error(L, "failed to set header, hresult: 0x%X", hr);
+    }
+}
+
+static void
+lua_response_set_status_code(lua_State* L, IHttpResponse* http_response, USHORT status_code, const char* reason)
+{
+    HRESULT hr = http_response->SetStatus(status_code, reason);
+
+    if (FAILED(hr))
+    {
+        luaL_error(L, "unable to set status, hresult: 0x%X", hr);
+    }
+}
+
+/**
+ * If-Range holds either an entity tag, compared strongly, or a date that has
+ * to be exactly the last modification time.
+ */
+static bool
+lua_response_if_range_matches(const HTTP_KNOWN_HEADER* if_range, const char* etag, size_t etag_length, INT64 modified)
+{
+    if (!if_range->RawValueLength)
+        return true;
+
+    const char* value = if_range->pRawValue;
+    USHORT length = if_range->RawValueLength;
+
+    if (value[0] == '"' || (length >= 2 && value[0] == 'W' && value[1] == '/'))
+    {
+        return http_range_etag_matches(value, length, etag, etag_length, false);
+    }
+
+    INT64 since;
+    return http_range_parse_date(value, length, &since) && since == modified;
+}
+
+/**
+ * ServeFile(path [, content_type]) answers the request from a cached file
+ * handle the way the static file handler would. It sets ETag and
+ * Last-Modified, answers If-None-Match and If-Modified-Since with 304 and
+ * Range with 206 or 416. Multiple ranges go out as multipart/byteranges.
+ * Returns the status code, file contents are never read.
+ */
+static int
+lua_response_serve_file(lua_State* L)
+{
+    lua_stack_guard(L, 1);
+
+    ResponseLua* response_lua = lua_response_check_type(L, 1);
+    FileCacheEntry* entry = lua_response_open_file(L, response_lua, 2);
+
+    // contentType: string {optional}
+    size_t content_type_length = 0;
+    const char* content_type = luaL_optlstring(L, 3, nullptr, &content_type_length);
+
+    IHttpResponse* http_response = response_lua->http_response;
+    HTTP_REQUEST* raw_request = response_lua->http_context->GetRequest()->GetRawHttpRequest();
+    const HTTP_KNOWN_HEADER* headers = raw_request->Headers.KnownHeaders;
+
+    //////////////////////////////////////////////
+
+    UINT64 file_size = file_cache_get_size(entry);
+    FILETIME last_write_time = file_cache_get_last_write_time(entry);
+    UINT64 write_time = ((UINT64)last_write_time.dwHighDateTime << 32) | last_write_time.dwLowDateTime;
+    INT64 modified = http_range_filetime_to_seconds(write_time);
+
+    char etag[HTTP_RANGE_ETAG_SIZE];
+    size_t etag_length = http_range_format_etag(file_size, write_time, etag);
+
+    char last_modified[HTTP_RANGE_DATE_SIZE];
+    size_t last_modified_length = http_range_format_date(modified, last_modified);
+
+    lua_response_set_known_header(L, http_response, HttpHeaderEtag, etag, etag_length);
+    lua_response_set_known_header(L, http_response, HttpHeaderLastModified, last_modified, last_modified_length);
+    lua_response_set_known_header(L, http_response, HttpHeaderAcceptRanges, "bytes", strlen("bytes"));
+
+    if (content_type)
+    {
+        lua_response_set_known_header(L, http_response, HttpHeaderContentType, content_type, content_type_length);
+    }
+
+    //////////////////////////////////////////////
+
+    bool is_get = raw_request->Verb == HttpVerbGET || raw_request->Verb == HttpVerbHEAD;
+    USHORT status_code = 200;
+
+    HttpRange ranges[HTTP_RANGE_MAX_RANGES];
+    DWORD range_count = 0;
+
+    // If-None-Match takes precedence, If-Modified-Since is only looked at without it.
+    const HTTP_KNOWN_HEADER* if_none_match = &headers[HttpHeaderIfNoneMatch];
+    const HTTP_KNOWN_HEADER* if_modified_since = &headers[HttpHeaderIfModifiedSince];
+
+    if (if_none_match->RawValueLength)
+    {
+        if (http_range_etag_matches(if_none_match->pRawValue, if_none_match->RawValueLength, etag, etag_length, true))
+            status_code = is_get ? 304 : 412;
+    }
+    else if (is_get && if_modified_since->RawValueLength)
+    {
+        INT64 since;
+
+        if (http_range_parse_date(if_modified_since->pRawValue, if_modified_since->RawValueLength, &since) 
+            && modified <= since)
+        {
+            status_code = 304;
+        }
+    }
+
+    const HTTP_KNOWN_HEADER* range = &headers[HttpHeaderRange];
+
+    if (status_code == 200 && raw_request->Verb == HttpVerbGET && range->RawValueLength
+        && lua_response_if_range_matches(&headers[HttpHeaderIfRange], etag, etag_length, modified))
+    {
+        switch (http_range_parse(range->pRawValue, range->RawValueLength, file_size, ranges, &range_count))
+        {
+        case HTTP_RANGE_SATISFIABLE:
+            status_code = 206;
+            break;
+
+        case HTTP_RANGE_UNSATISFIABLE:
+            status_code = 416;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    //////////////////////////////////////////////
+
+    char content_range[96];
+    int content_range_length = 0;
+
+    switch (status_code)
+    {
+    case 304:
+        lua_response_set_status_code(L, http_response, 304, "Not Modified");
+        break;
+
+    case 412:
+        lua_response_set_status_code(L, http_response, 412, "Precondition Failed");
+        break;
+
+    case 416:
+        content_range_length = sprintf_s(content_range, "bytes */%llu", file_size);
+
+        lua_response_set_status_code(L, http_response, 416, "Range Not Satisfiable");
+        lua_response_set_known_header(L, http_response, HttpHeaderContentRange, content_range, content_range_length);
+        break;
+
+    case 206:
+        lua_response_set_status_code(L, http_response, 206, "Partial Content");
+
+        if (range_count == 1)
+        {
+            content_range_length = sprintf_s(
+                content_range, 
+                "bytes %llu-%llu/%llu", 
+                ranges[0].offset, 
+                ranges[0].offset + ranges[0].length - 1, 
+                file_size
+            );
+
+            lua_response_set_known_header(L, http_response, HttpHeaderContentRange, content_range, content_range_length);
+            lua_response_queue_file(L, response_lua, entry, ranges[0].offset, ranges[0].length);
+        }
+        else
+        {
+            // Parts carry the type the body would have had, the response itself becomes multipart.
+            if (!content_type)
+            {
+                USHORT length = 0;
+                content_type = http_response->GetHeader(HttpHeaderContentType, &length);
+                content_type_length = length;
+            }
+
+            if (!content_type || !content_type_length)
+            {
+                content_type = "application/octet-stream";
+                content_type_length = strlen(content_type);
+            }
+
+            lua_pushlstring(L, content_type, content_type_length);
+            content_type = lua_tostring(L, -1);
+
+            char boundary[24];
+            sprintf_s(boundary, "%016llx", write_time ^ file_size ^ GetTickCount64());
+
+            luaL_Buffer b;
+            luaL_buffinit(L, &b);
+            luaL_addstring(&b, "multipart/byteranges; boundary=");
+            luaL_addstring(&b, boundary);
+            luaL_pushresult(&b);
+
+            size_t multipart_length;
+            const char* multipart = lua_tolstring(L, -1, &multipart_length);
+
+            lua_response_set_known_header(L, http_response, HttpHeaderContentType, multipart, multipart_length);
+            lua_pop(L, 1);
+
+            for (DWORD i = 0; i < range_count; i++)
+            {
+                lua_pushfstring(
+                    L, 
+                    "\r\n--%s\r\nContent-Type: %s\r\n", 
+                    boundary, 
+                    content_type
+                );
+
+                size_t part_length;
+                const char* part = lua_tolstring(L, -1, &part_length);
+
+                lua_response_append(L, response_lua, part, part_length);
+                lua_pop(L, 1);
+
+                content_range_length = sprintf_s(
+                    content_range, 
+                    "Content-Range: bytes %llu-%llu/%llu\r\n\r\n", 
+                    ranges[i].offset, 
+                    ranges[i].offset + ranges[i].length - 1, 
+                    file_size
+                );
+
+                lua_response_append(L, response_lua, content_range, content_range_length);
+                lua_response_queue_file(L, response_lua, entry, ranges[i].offset, ranges[i].length);
+            }
+
+            lua_pushfstring(L, "\r\n--%s--\r\n", boundary);
+
+            size_t closing_length;
+            const char* closing = lua_tolstring(L, -1, &closing_length);
+
+            lua_response_append(L, response_lua, closing, closing_length);
+            lua_pop(L, 2);
+        }
+        break;
+
+    default:
+        lua_response_queue_file(L, response_lua, entry, 0, file_size);
+        break;
+    }
+
+    HRESULT hr = lua_response_flush(response_lua, true);
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to write entity chunks, hresult: 0x%X", hr);
+    }
+
+    lua_pop(L, 1);
+    lua_pushinteger(L, status_code);
+
+    return 1;
+}
+
+/**
+ * Reads Accept-Encoding for gzip, then deflate. A coding with q=0 is
+ * refused and * stands in for any coding that is not listed.
+ */
+static bool
+lua_response_negotiate_encoding(const char* value, DWORD length, DeflateFormat* format)
+{
+    // -1 when not listed, 0 when refused, 1 when accepted.
+    int gzip = -1;
+    int deflate = -1;
+    int any = -1;
 
-    luaL_checktype(L, index, LUA_TUSERDATA);
+    for (DWORD i = 0; i < length; )
+    {
+        DWORD end = i;
 
-    ResponseLua* response_lua = (ResponseLua*)luaL_checkudata(L, index, ResponseMetatable);
+        while (end < length && value[end] != ',')
+            end++;
 
-    if (!response_lua)
-        luaL_typerror(L, index, ResponseMetatable);
+        DWORD name = i;
 
-    if (!response_lua->http_context)
-        luaL_error(L, "context object is invalid");
+        while (name < end && (value[name] == ' ' || value[name] == '\t'))
+            name++;
 
-    if (!response_lua->http_response)
-        luaL_error(L, "response object is invalid");
+        DWORD name_end = name;
 
-    return response_lua;
+        while (name_end < end && value[name_end] != ';' && value[name_end] != ' ' && value[name_end] != '\t')
+            name_end++;
+
+        int accepted = 1;
+
+        for (DWORD j = name_end; j + 1 < end; j++)
+        {
+            if ((value[j] == 'q' || value[j] == 'Q') && value[j + 1] == '=' 
+                && (value[j - 1] == ';' || value[j - 1] == ' ' || value[j - 1] == '\t'))
+            {
+                // Any non-zero digit makes the weight positive.
+                accepted = 0;
+
+                for (j += 2; j < end && value[j] != ';'; j++)
+                {
+                    if (value[j] >= '1' && value[j] <= '9')
+                        accepted = 1;
+                }
+
+                break;
+            }
+        }
+
+        DWORD name_length = name_end - name;
+
+        if (name_length == strlen("gzip") && !_strnicmp(value + name, "gzip", name_length))
+            gzip = accepted;
+        else if (name_length == strlen("deflate") && !_strnicmp(value + name, "deflate", name_length))
+            deflate = accepted;
+        else if (name_length == 1 && value[name] == '*')
+            any = accepted;
+
+        i = end + 1;
+    }
+
+    if (gzip == 1 || (gzip == -1 && any == 1))
+    {
+        *format = DEFLATE_FORMAT_GZIP;
+        return true;
+    }
+
+    if (deflate == 1 || (deflate == -1 && any == 1))
+    {
+        *format = DEFLATE_FORMAT_ZLIB;
+        return true;
+    }
+
+    return false;
 }
 
+/**
+ * Compress([level]) encodes the rest of the output with gzip or deflate,
+ * whichever the client accepts, and returns the encoding or nil when
+ * output goes out as is. Bodies complete on the first flush below the
+ * configured minimum are sent unencoded, identical ones are compressed once.
+ * Write and Flush(true) send what they have straight away as a sync flush,
+ * which rules out both, so bodies meant for them are built with Append.
+ */
 static int
-lua_response_write(lua_State* L)
+lua_response_compress_values(lua_State* L)
 {
-    lua_stack_guard(L, 0);
+    lua_stack_guard(L, 1);
 
     ResponseLua* response_lua = lua_response_check_type(L, 1);
 
-    luaL_checktype(L, 2, LUA_TSTRING);
+    // level: number {optional}
+    lua_Integer level = luaL_optinteger(L, 2, response_lua->compression_level);
 
-    //////////////////////////////////////////////
+    if (level < 0 || level > 9)
+    {
+        return luaL_error(L, "compression level must be between 0 and 9");
+    }
 
-    size_t buffer_size;
-    const char* buffer = lua_tolstring(L, 2, &buffer_size);
+    IHttpResponse* http_response = response_lua->http_response;
 
-    //////////////////////////////////////////////
+    if (http_response->GetRawHttpResponse()->EntityChunkCount)
+    {
+        return luaL_error(L, "cannot compress after output has been written");
+    }
 
-    const size_t MAX_BYTES = 65535;
-    size_t buffer_offset = 0;
-    size_t bytes_to_write = min(max(buffer_size - buffer_offset, 0), MAX_BYTES);
-    bool has_more_data = buffer_size - bytes_to_write > 0;
+    ResponseLuaBuffer* buffer = lua_response_get_buffer(L, response_lua);
 
-    IHttpResponse* http_response = response_lua->http_response;
+    if (buffer->compression)
+    {
+        lua_pushstring(L, buffer->compression->format == DEFLATE_FORMAT_GZIP ? "gzip" : "deflate");
+        return 1;
+    }
 
-    //////////////////////////////////////////////
+    // The encoder only reads memory, and a file sent as is would corrupt the encoded body.
+    for (USHORT i = 0; i < buffer->chunk_count; i++)
+    {
+        if (buffer->chunks[i].DataChunkType != HttpDataChunkFromMemory)
+        {
+            return luaL_error(L, "cannot compress after a file has been queued");
+        }
+    }
 
-    // body: string
-    do
+    if (!level)
     {
-        HTTP_DATA_CHUNK data_chunk = HTTP_DATA_CHUNK();
-        DWORD cb_sent = 0;
+        lua_pushnil(L);
+        return 1;
+    }
 
-        data_chunk.DataChunkType = HttpDataChunkFromMemory;
-        data_chunk.FromMemory.pBuffer = PVOID((unsigned char*)buffer + buffer_offset);
-        data_chunk.FromMemory.BufferLength = USHORT(bytes_to_write);
+    // Caches have to tell the encodings apart whichever one this client gets.
+    HRESULT hr = http_response->SetHeader(HttpHeaderVary, "Accept-Encoding", (USHORT)strlen("Accept-Encoding"), FALSE);
 
-        auto hr = http_response->WriteEntityChunks(&data_chunk, 1, FALSE, has_more_data, &cb_sent);
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to set header, hresult: 0x%X", hr);
+    }
 
-        if (FAILED(hr)) 
-        {
-            return luaL_error(L, "failed to write entity chunks");
-        }
+    const HTTP_KNOWN_HEADER* accept_encoding = 
+        &response_lua->http_context->GetRequest()->GetRawHttpRequest()->Headers.KnownHeaders[HttpHeaderAcceptEncoding];
+
+    DeflateFormat format;
+
+    if (!lua_response_negotiate_encoding(accept_encoding->pRawValue, accept_encoding->RawValueLength, &format))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    const char* encoding = format == DEFLATE_FORMAT_GZIP ? "gzip" : "deflate";
+
+    ResponseLuaCompression* compression = (ResponseLuaCompression*)response_lua->http_context->AllocateRequestMemory(
+        sizeof(ResponseLuaCompression)
+    );
+
+    if (!compression)
+    {
+        return luaL_error(L, "failed to allocate request memory");
+    }
+
+    memset(compression, 0, sizeof(ResponseLuaCompression));
+    compression->format = format;
+    compression->level = (int)level;
+    compression->min_size = response_lua->compression_min_size;
+
+    hr = http_response->SetHeader(HttpHeaderContentEncoding, encoding, (USHORT)strlen(encoding), TRUE);
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to set header, hresult: 0x%X", hr);
+    }
+
+    buffer->compression = compression;
+
+    lua_pushstring(L, encoding);
+    return 1;
+}
+
+static int
+lua_response_flush_values(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    ResponseLua* response_lua = lua_response_check_type(L, 1);
+
+    // moreData: boolean {optional}
+    bool more_data = lua_gettop(L) < 2 || lua_toboolean(L, 2);
+
+    HRESULT hr = lua_response_flush(response_lua, more_data);
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to write entity chunks, hresult: 0x%X", hr);
+    }
+
+    return 0;
+}
+
+static int
+lua_response_write(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    ResponseLua* response_lua = lua_response_check_type(L, 1);
+
+    luaL_checktype(L, 2, LUA_TSTRING);
+
+    //////////////////////////////////////////////
+
+    size_t buffer_size;
+    const char* buffer = lua_tolstring(L, 2, &buffer_size);
 
-        ////////////////////////////////////////
+    //////////////////////////////////////////////
 
-        buffer_offset += bytes_to_write;
-        bytes_to_write = min(max(buffer_size - buffer_offset, 0), MAX_BYTES);
-        has_more_data = buffer_size - buffer_offset > 0;
+    IHttpResponse* http_response = response_lua->http_response;
 
-    } while (has_more_data);
+    // body: string
+    // Copied into request memory behind anything appended, IIS may hold on to
+    // the chunks until the request completes but the string is free to go as
+    // soon as this returns. Only WriteNoCopy pins.
+    lua_response_append(L, response_lua, buffer, buffer_size);
+    lua_response_check_result(L, lua_response_flush(response_lua, true));
 
     // contentType: string {optional}
     if (lua_gettop(L) >= 3 && lua_isstring(L, 3))
@@ -88,12 +952,7 @@ lua_response_write(lua_State* L)
     }
     else
     {
-        http_response->SetHeader(
-            HttpHeaderContentType, 
-            "text/html", 
-            (USHORT)strlen("text/html"), 
-            TRUE
-        );
+        lua_response_commit_headers(http_response);
     }
 
     // contentEncoding: string {optional}
@@ -122,6 +981,18 @@ lua_response_clear(lua_State* L)
 
     response_lua->http_response->Clear();
 
+    if (response_lua->buffer)
+    {
+        response_lua->buffer->chunk_count = 0;
+
+        // Nothing encoded survives the clear, so the stream starts over.
+        if (response_lua->buffer->compression)
+        {
+            response_lua->buffer->compression->deflate = nullptr;
+            response_lua->buffer->compression->finished = false;
+        }
+    }
+
     return 0;
 }
 
@@ -292,19 +1163,24 @@ lua_response_set_error_desc(lua_State* L)
 
     bool should_html_encode = lua_toboolean(L, 3);
 
-    size_t desc_wide_len;
-    wchar_t desc_wide[2048];
-    errno_t result = mbstowcs_s(
-        &desc_wide_len,
-        desc_wide,
-        desc,
-        desc_len
+    size_t desc_wide_len = utf8_convert_to_wide(desc, desc_len, nullptr, 0);
+
+    if (desc_len && !desc_wide_len)
+    {
+        return luaL_error(L, "unable to convert to wide string");
+    }
+
+    wchar_t* desc_wide = (wchar_t*)response_lua->http_context->AllocateRequestMemory(
+        (DWORD)((desc_wide_len + 1) * sizeof(wchar_t))
     );
 
-    if (result)
+    if (!desc_wide)
     {
-        return luaL_error(L, "unable to convert to narrow string");
+        return luaL_error(L, "failed to allocate request memory");
     }
+
+    utf8_convert_to_wide(desc, desc_len, desc_wide, desc_wide_len);
+    desc_wide[desc_wide_len] = L'\0';
   
     HRESULT hr = response_lua->http_response->SetErrorDescription(
         desc_wide,
@@ -402,6 +1278,14 @@ lua_response_read(lua_State* L)
     lua_stack_guard(L, 1);
 
     ResponseLua* response_lua = lua_response_check_type(L, 1);
+
+    HRESULT hr = lua_response_flush(response_lua, true);
+
+    if (FAILED(hr))
+    {
+        return luaL_error(L, "failed to write entity chunks, hresult: 0x%X", hr);
+    }
+
     HTTP_RESPONSE* raw_response = response_lua->http_response->GetRawHttpResponse();
 
     ////////////////////////////////////////////////
@@ -442,6 +1326,12 @@ const luaL_Reg lua_response_methods[] = {
 
     {"Read", lua_response_read},
     {"Write", lua_response_write},
+    {"WriteNoCopy", lua_response_write_no_copy},
+    {"WriteFile", lua_response_write_file},
+    {"ServeFile", lua_response_serve_file},
+    {"Append", lua_response_append_values},
+    {"Flush", lua_response_flush_values},
+    {"Compress", lua_response_compress_values},
     {"Clear", lua_response_clear},
     {"ClearHeaders", lua_response_clear_headers},
     {"CloseConnection", lua_response_close_connection},
@@ -481,6 +1371,18 @@ const luaL_Reg lua_response_meta[] =
     {0, 0}
 };
 
+static int
+lua_response_file_handle_gc(lua_State* L)
+{
+    lua_stack_guard(L, 0);
+
+    FileHandleLua* file_handle_lua = (FileHandleLua*)luaL_checkudata(L, 1, FileHandleMetatable);
+
+    file_handle_lua->entry = file_cache_release(file_handle_lua->entry);
+
+    return 0;
+}
+
 void 
 lua_response_register(lua_State* L)
 {
@@ -503,11 +1405,18 @@ lua_response_register(lua_State* L)
         lua_rawset(L, -3);
 
         lua_pop(L, 2);
+
+        // Only ever held in the pin table, the metatable just releases the handle.
+        luaL_newmetatable(L, FileHandleMetatable);
+        lua_pushliteral(L, "__gc");
+        lua_pushcfunction(L, lua_response_file_handle_gc);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
     }
 }
 
 ResponseLua* 
-lua_response_push(lua_State* L)
+lua_response_push(lua_State* L, const LuaConfig* config, const char* directory_path)
 {
     ResponseLua* response_lua = nullptr;
 
@@ -516,9 +1425,248 @@ lua_response_push(lua_State* L)
         lua_stack_guard(L, 1);
 
         response_lua = (ResponseLua*)lua_newuserdata(L, sizeof(ResponseLua));
+        response_lua->directory_path = directory_path;
+        response_lua->compression_level = config ? (int)config->compression_level : 6;
+        response_lua->compression_min_size = config ? config->compression_min_size : 1024;
+
         luaL_getmetatable(L, ResponseMetatable);
         lua_setmetatable(L, -2);
     }
 
     return response_lua;
-}
\ No newline at end of file
+}
+
+void
+lua_response_bind(
+    ResponseLua* response_lua, 
+    IHttpContext* http_context, 
+    ResponseLuaBuffer* buffer, 
+    int pin_ref
+)
+{
+    assert(response_lua != nullptr);
+
+    if (response_lua)
+    {
+        response_lua->http_context = http_context;
+        response_lua->http_response = http_context ? http_context->GetResponse() : nullptr;
+        response_lua->buffer = buffer;
+        response_lua->pin_ref = pin_ref;
+    }
+}
+
+static bool
+lua_response_deflate_sink(void* context, const char* data, size_t length)
+{
+    ResponseLuaCompression* compression = (ResponseLuaCompression*)context;
+    ResponseLua* response_lua = compression->response_lua;
+
+    HRESULT hr = lua_response_copy(response_lua, response_lua->buffer, data, (DWORD)length);
+
+    if (FAILED(hr))
+    {
+        compression->status = hr;
+    }
+
+    return SUCCEEDED(hr);
+}
+
+/**
+ * Replaces the queue with its encoding and writes that out. A body that is
+ * complete on the first flush skips the encoder when it is too small to be
+ * worth it or an identical one was compressed before, anything else streams
+ * through a sync flush per call.
+ */
+static HRESULT
+lua_response_compress(ResponseLua* response_lua, ResponseLuaBuffer* buffer, bool more_data)
+{
+    ResponseLuaCompression* compression = buffer->compression;
+
+    if (compression->finished)
+        return buffer->chunk_count ? HRESULT_FROM_WIN32(ERROR_INVALID_STATE) : S_OK;
+
+    // An empty sync flush would only add an empty block.
+    if (more_data && !buffer->chunk_count)
+        return S_OK;
+
+    UINT64 hash = COMPRESSION_CACHE_HASH_SEED;
+    UINT64 length = 0;
+    bool cacheable = false;
+
+    if (!compression->deflate)
+    {
+        for (USHORT i = 0; i < buffer->chunk_count; i++)
+        {
+            length += buffer->chunks[i].FromMemory.BufferLength;
+        }
+
+        if (!more_data && length < compression->min_size)
+        {
+            buffer->compression = nullptr;
+            response_lua->http_response->DeleteHeader(HttpHeaderContentEncoding);
+
+            return lua_response_write_chunks(response_lua, buffer, false);
+        }
+
+        cacheable = !more_data && length <= compression_cache_get_max_entry_size();
+
+        if (cacheable)
+        {
+            for (USHORT i = 0; i < buffer->chunk_count; i++)
+            {
+                hash = compression_cache_hash(
+                    hash, 
+                    (const char*)buffer->chunks[i].FromMemory.pBuffer, 
+                    buffer->chunks[i].FromMemory.BufferLength
+                );
+            }
+
+            CompressionCacheEntry* entry = compression_cache_acquire(
+                hash, 
+                buffer->chunks, 
+                buffer->chunk_count, 
+                compression->format, 
+                compression->level
+            );
+
+            if (entry)
+            {
+                size_t data_length;
+                const char* data = compression_cache_get_data(entry, &data_length);
+
+                char* copy = (char*)response_lua->http_context->AllocateRequestMemory((DWORD)data_length);
+
+                if (copy)
+                {
+                    memcpy(copy, data, data_length);
+                }
+
+                entry = compression_cache_release(entry);
+
+                if (!copy)
+                    return E_OUTOFMEMORY;
+
+                buffer->chunk_count = 0;
+                compression->finished = true;
+
+                HRESULT hr = lua_response_queue_memory(response_lua, buffer, copy, (DWORD)data_length);
+
+                if (FAILED(hr))
+                    return hr;
+
+                return lua_response_write_chunks(response_lua, buffer, false);
+            }
+        }
+
+        void* memory = response_lua->http_context->AllocateRequestMemory((DWORD)deflate_get_size());
+
+        if (!memory)
+            return E_OUTOFMEMORY;
+
+        compression->deflate = deflate_init(
+            memory, 
+            compression->format, 
+            compression->level, 
+            lua_response_deflate_sink, 
+            compression
+        );
+    }
+
+    // The input stays valid in request memory, encoded output goes to a fresh queue.
+    HTTP_DATA_CHUNK* input = buffer->chunks;
+    USHORT input_count = buffer->chunk_count;
+
+    buffer->chunks = nullptr;
+    buffer->chunk_count = 0;
+    buffer->chunk_capacity = 0;
+
+    compression->response_lua = response_lua;
+    compression->status = S_OK;
+    buffer->encoding = true;
+
+    bool success = true;
+
+    for (USHORT i = 0; i < input_count && success; i++)
+    {
+        success = deflate_feed(
+            compression->deflate, 
+            (const char*)input[i].FromMemory.pBuffer, 
+            input[i].FromMemory.BufferLength, 
+            DEFLATE_NO_FLUSH
+        );
+    }
+
+    if (success)
+    {
+        success = deflate_feed(compression->deflate, nullptr, 0, more_data ? DEFLATE_SYNC_FLUSH : DEFLATE_FINISH);
+    }
+
+    buffer->encoding = false;
+
+    if (!success)
+        return FAILED(compression->status) ? compression->status : E_FAIL;
+
+    if (!more_data)
+    {
+        compression->finished = true;
+
+        if (cacheable)
+        {
+            compression_cache_insert(
+                hash, 
+                input, 
+                input_count, 
+                compression->format, 
+                compression->level, 
+                buffer->chunks, 
+                buffer->chunk_count
+            );
+        }
+    }
+
+    return lua_response_write_chunks(response_lua, buffer, more_data);
+}
+
+/**
+ * Called when the handler fails. Queued output is dropped as it always was,
+ * but an encoded body that has partly gone out is finished, otherwise the
+ * client would be left waiting on a stream without its trailer.
+ */
+HRESULT
+lua_response_abort(ResponseLua* response_lua)
+{
+    assert(response_lua != nullptr);
+
+    ResponseLuaBuffer* buffer = response_lua->buffer;
+
+    if (!buffer)
+        return S_OK;
+
+    buffer->chunk_count = 0;
+
+    if (!buffer->compression || !buffer->compression->deflate || buffer->compression->finished)
+        return S_OK;
+
+    return lua_response_compress(response_lua, buffer, false);
+}
+
+/**
+ * Hands everything queued by Append to IIS in a single call, committing the
+ * default headers on the way. Once Compress has been called the queue is
+ * encoded first.
+ */
+HRESULT
+lua_response_flush(ResponseLua* response_lua, bool more_data)
+{
+    assert(response_lua != nullptr);
+
+    ResponseLuaBuffer* buffer = response_lua->buffer;
+
+    if (!buffer)
+        return S_OK;
+
+    if (buffer->compression)
+        return lua_response_compress(response_lua, buffer, more_data);
+
+    return lua_response_write_chunks(response_lua, buffer, more_data);
+}
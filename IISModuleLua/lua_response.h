@@ -4,13 +4,71 @@
 #ifndef _LUA_RESPONSE
 #define _LUA_RESPONSE
 
+#define RESPONSE_LUA_BLOCK_SIZE 16384
+#define RESPONSE_LUA_MAX_CHUNKS 4096
+
+typedef struct _ResponseLua ResponseLua;
+
+// Set up by Compress, queued output is encoded as it is flushed.
+typedef struct _ResponseLuaCompression
+{
+    DeflateFormat format;
+    int level;
+    DWORD min_size;
+
+    // Created by the first flush that encodes, the stream is finished by the last.
+    Deflate* deflate;
+    bool finished;
+
+    // Whichever binding is flushing, the sink queues output through it.
+    ResponseLua* response_lua;
+    HRESULT status;
+} ResponseLuaCompression;
+
+// Output queued by Append, lives in request memory until the request completes.
+typedef struct _ResponseLuaBuffer
+{
+    HTTP_DATA_CHUNK* chunks;
+    USHORT chunk_count;
+    USHORT chunk_capacity;
+
+    // Small appends are packed into the current block and share a chunk.
+    char* block;
+    DWORD block_used;
+
+    ResponseLuaCompression* compression;
+
+    // While encoding the queue holds compressed output, a full queue is written as is.
+    bool encoding;
+} ResponseLuaBuffer;
+
 typedef struct _ResponseLua
 {
     IHttpContext* http_context;
     IHttpResponse* http_response;
+
+    ResponseLuaBuffer* buffer;
+
+    // Table of strings and file handles handed to IIS without a copy.
+    int pin_ref;
+
+    // WriteFile resolves relative paths against the script directory.
+    const char* directory_path;
+
+    // Defaults for Compress.
+    int compression_level;
+    DWORD compression_min_size;
 } ResponseLua;
 
 void lua_response_register(lua_State* L);
-ResponseLua* lua_response_push(lua_State* L);
+ResponseLua* lua_response_push(lua_State* L, const LuaConfig* config, const char* directory_path);
+void lua_response_bind(
+    ResponseLua* response_lua, 
+    IHttpContext* http_context, 
+    ResponseLuaBuffer* buffer, 
+    int pin_ref
+);
+HRESULT lua_response_flush(ResponseLua* response_lua, bool more_data);
+HRESULT lua_response_abort(ResponseLua* response_lua);
 
 #endif
@@ -0,0 +1,551 @@
+#include "shared.h"
+
+#define LUA_SCRIPT_MAX_FILE_SIZE (64 * 1024 * 1024)
+
+/**
+ * Compiled chunks are immutable once published and shared between every
+ * engine, each holder keeps its own reference.
+ */
+typedef struct _LuaScript
+{
+	volatile LONG ref_count;
+	UINT64 hash;
+	char chunk_name[MAX_PATH + 1];
+
+	size_t size;
+	char bytecode[1];
+} LuaScript;
+
+typedef struct _LuaScriptCacheEntry
+{
+	char file_path[MAX_PATH];
+	LuaScript* script;
+	LONG generation;
+
+	struct _LuaScriptCacheEntry* next;
+} LuaScriptCacheEntry;
+
+typedef struct _LuaScriptCache
+{
+	char directory_path[MAX_PATH];
+
+	SRWLOCK lock;
+	LuaScriptCacheEntry* entries;
+	volatile LONG generation;
+} LuaScriptCache;
+
+typedef struct _LuaScriptWriter
+{
+	char* buffer;
+	size_t size;
+	size_t capacity;
+} LuaScriptWriter;
+
+static UINT64
+lua_script_cache_hash(const char* buffer, size_t size)
+{
+	UINT64 hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char)buffer[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static char*
+lua_script_cache_read_file(const char* file_path, size_t* size)
+{
+	assert(file_path != nullptr);
+	assert(size != nullptr);
+
+	char* buffer = nullptr;
+	LARGE_INTEGER file_size;
+
+	HANDLE file_handle = CreateFileA(
+		file_path,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		nullptr
+	);
+
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		lua_engine_printf("failed to open '%s'\n", file_path);
+		return buffer;
+	}
+
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart > LUA_SCRIPT_MAX_FILE_SIZE)
+	{
+		lua_engine_printf("failed to size '%s'\n", file_path);
+		goto finish;
+	}
+
+	buffer = (char*)malloc((size_t)file_size.QuadPart + 1);
+
+	if (!buffer)
+	{
+		lua_engine_printf("failed to allocate buffer for '%s'\n", file_path);
+		goto finish;
+	}
+
+	*size = 0;
+
+	while (*size < (size_t)file_size.QuadPart)
+	{
+		DWORD bytes_read = 0;
+
+		if (!ReadFile(file_handle, buffer + *size, (DWORD)(file_size.QuadPart - *size), &bytes_read, nullptr)
+			|| !bytes_read)
+		{
+			break;
+		}
+
+		*size += bytes_read;
+	}
+
+	// A file that shrank while being saved would otherwise compile half a script.
+	if (*size != (size_t)file_size.QuadPart)
+	{
+		lua_engine_printf("failed to read '%s'\n", file_path);
+
+		free(buffer);
+		buffer = nullptr;
+	}
+
+finish:
+	CloseHandle(file_handle);
+
+	return buffer;
+}
+
+static int
+lua_script_cache_writer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+	UNREFERENCED_PARAMETER(L);
+
+	LuaScriptWriter* writer = (LuaScriptWriter*)ud;
+
+	if (writer->size + sz > writer->capacity)
+	{
+		size_t capacity = max(writer->capacity * 2, writer->size + sz);
+		char* buffer = (char*)realloc(writer->buffer, capacity);
+
+		if (!buffer)
+			return 1;
+
+		writer->buffer = buffer;
+		writer->capacity = capacity;
+	}
+
+	memcpy(writer->buffer + writer->size, p, sz);
+	writer->size += sz;
+
+	return 0;
+}
+
+static LuaScript*
+lua_script_cache_build(const char* file_path, const char* source, size_t source_size, UINT64 hash)
+{
+	LuaScript* script = nullptr;
+	LuaScriptWriter writer = { 0 };
+	char chunk_name[MAX_PATH + 1];
+
+	sprintf_s(chunk_name, "@%s", file_path);
+
+	// Parsing happens once here, in a bare state, engines only ever see the bytecode.
+	lua_State* L = luaL_newstate();
+
+	if (!L)
+	{
+		lua_engine_printf("failed to create lua state for compilation\n");
+		return script;
+	}
+
+	if (luaL_loadbuffer(L, source, source_size, chunk_name) != 0)
+	{
+		lua_engine_printf("%s\n", lua_tostring(L, -1));
+		goto finish;
+	}
+
+	if (lua_dump(L, &lua_script_cache_writer, &writer) != 0 || !writer.buffer)
+	{
+		lua_engine_printf("failed to dump bytecode for '%s'\n", file_path);
+		goto finish;
+	}
+
+	script = (LuaScript*)malloc(offsetof(LuaScript, bytecode) + writer.size);
+
+	if (!script)
+	{
+		lua_engine_printf("failed to allocate compiled script for '%s'\n", file_path);
+		goto finish;
+	}
+
+	script->ref_count = 1;
+	script->hash = hash;
+	script->size = writer.size;
+	strcpy_s(script->chunk_name, chunk_name);
+	memcpy(script->bytecode, writer.buffer, writer.size);
+
+finish:
+	if (writer.buffer)
+	{
+		free(writer.buffer);
+		writer.buffer = nullptr;
+	}
+
+	lua_close(L);
+
+	return script;
+}
+
+static int
+lua_script_cache_loader(lua_State* L)
+{
+	const char* name = luaL_checkstring(L, 1);
+	LuaScriptCache* script_cache = (LuaScriptCache*)lua_touserdata(L, lua_upvalueindex(1));
+
+	char file_path[MAX_PATH];
+
+	// sprintf_s aborts the process on overflow rather than failing, so the length is checked first.
+	if (strlen(script_cache->directory_path) + strlen(name) + strlen("\\.lua") >= sizeof(file_path))
+	{
+		return luaL_error(L, "module name '%s' is too long", name);
+	}
+
+	int length = sprintf_s(file_path, "%s\\%s.lua", script_cache->directory_path, name);
+
+	// Module names use dots as separators, same as the standard searcher.
+	for (char* c = file_path + strlen(script_cache->directory_path) + 1; c < file_path + length - 4; c++)
+	{
+		if (*c == '.')
+			*c = '\\';
+	}
+
+	if (GetFileAttributesA(file_path) == INVALID_FILE_ATTRIBUTES)
+	{
+		lua_pushfstring(L, "\n\tno file '%s'", file_path);
+		return 1;
+	}
+
+	LuaScript* script = lua_script_cache_compile(script_cache, file_path);
+
+	if (!script)
+	{
+		return luaL_error(L, "error loading module '%s' from file '%s'", name, file_path);
+	}
+
+	int status = lua_script_load(L, script);
+	lua_script_release(script);
+
+	if (status != 0)
+	{
+		return lua_error(L);
+	}
+
+	return 1;
+}
+
+LuaScriptCache*
+lua_script_cache_create(const char* directory_path)
+{
+	assert(directory_path != nullptr);
+
+	LuaScriptCache* script_cache = (LuaScriptCache*)malloc(sizeof(LuaScriptCache));
+
+	assert(script_cache != nullptr);
+
+	if (script_cache)
+	{
+		strcpy_s(script_cache->directory_path, directory_path);
+		InitializeSRWLock(&script_cache->lock);
+		script_cache->entries = nullptr;
+		script_cache->generation = 0;
+	}
+
+	return script_cache;
+}
+
+LuaScriptCache*
+lua_script_cache_destroy(LuaScriptCache* script_cache)
+{
+	assert(script_cache != nullptr);
+
+	if (script_cache)
+	{
+		LuaScriptCacheEntry* entry = script_cache->entries;
+
+		while (entry)
+		{
+			LuaScriptCacheEntry* next = entry->next;
+
+			entry->script = lua_script_release(entry->script);
+			free(entry);
+
+			entry = next;
+		}
+
+		free(script_cache);
+		script_cache = nullptr;
+	}
+
+	return script_cache;
+}
+
+void
+lua_script_cache_invalidate(LuaScriptCache* script_cache)
+{
+	assert(script_cache != nullptr);
+
+	if (script_cache)
+	{
+		InterlockedIncrement(&script_cache->generation);
+	}
+}
+
+/**
+ * Re-hashes every cached file against the bytecode it was compiled from,
+ * files that were never loaded cannot affect any engine and are ignored.
+ */
+bool
+lua_script_cache_changed(LuaScriptCache* script_cache)
+{
+	assert(script_cache != nullptr);
+
+	bool changed = false;
+
+	if (!script_cache)
+		return changed;
+
+	AcquireSRWLockShared(&script_cache->lock);
+
+	for (LuaScriptCacheEntry* entry = script_cache->entries; entry && !changed; entry = entry->next)
+	{
+		size_t source_size = 0;
+		char* source = lua_script_cache_read_file(entry->file_path, &source_size);
+
+		if (source)
+		{
+			changed = !entry->script || entry->script->hash != lua_script_cache_hash(source, source_size);
+
+			free(source);
+			source = nullptr;
+		}
+		else
+		{
+			changed = true;
+		}
+	}
+
+	// Nothing cached yet, for instance because the first compile failed.
+	if (!script_cache->entries)
+	{
+		changed = true;
+	}
+
+	ReleaseSRWLockShared(&script_cache->lock);
+
+	return changed;
+}
+
+void
+lua_script_cache_register(lua_State* L, LuaScriptCache* script_cache)
+{
+	assert(L != nullptr);
+
+	if (L && script_cache)
+	{
+		lua_stack_guard(L, 0);
+
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "loaders");
+
+		// Slot in right after the preload searcher so cached bytecode wins over package.path.
+		for (int i = (int)lua_objlen(L, -1); i >= 2; i--)
+		{
+			lua_rawgeti(L, -1, i);
+			lua_rawseti(L, -2, i + 1);
+		}
+
+		lua_pushlightuserdata(L, script_cache);
+		lua_pushcclosure(L, lua_script_cache_loader, 1);
+		lua_rawseti(L, -2, 2);
+
+		lua_pop(L, 2);
+	}
+}
+
+const char*
+lua_script_cache_get_directory(const LuaScriptCache* script_cache)
+{
+	return script_cache ? script_cache->directory_path : nullptr;
+}
+
+/**
+ * Resolves paths handed in by scripts, relative ones are taken to be
+ * relative to the script directory.
+ */
+bool
+lua_script_cache_resolve_path(
+	const char* directory_path, 
+	const char* path, 
+	char* file_path, 
+	size_t file_path_size
+)
+{
+	assert(path != nullptr);
+	assert(file_path != nullptr);
+
+	bool relative = path[0] != '\\' && path[0] != '/' && !(path[0] && path[1] == ':');
+
+	// Both secure copies abort the process on overflow, so lengths are checked first.
+	if (relative && directory_path && *directory_path)
+	{
+		if (strlen(directory_path) + 1 + strlen(path) >= file_path_size)
+			return false;
+
+		sprintf_s(file_path, file_path_size, "%s\\%s", directory_path, path);
+		return true;
+	}
+
+	if (strlen(path) >= file_path_size)
+		return false;
+
+	strcpy_s(file_path, file_path_size, path);
+	return true;
+}
+
+LuaScript*
+lua_script_cache_compile(LuaScriptCache* script_cache, const char* file_path)
+{
+	assert(script_cache != nullptr);
+	assert(file_path != nullptr);
+
+	LuaScript* script = nullptr;
+	LuaScriptCacheEntry* entry = nullptr;
+
+	if (!script_cache || !file_path)
+		return script;
+
+	LONG generation = script_cache->generation;
+
+	// Entries are only revisited on disk once per cache generation.
+	AcquireSRWLockShared(&script_cache->lock);
+
+	for (entry = script_cache->entries; entry; entry = entry->next)
+	{
+		if (_stricmp(entry->file_path, file_path) == 0)
+		{
+			if (entry->generation == generation && entry->script)
+				script = lua_script_acquire(entry->script);
+
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&script_cache->lock);
+
+	if (script)
+		return script;
+
+	size_t source_size = 0;
+	char* source = lua_script_cache_read_file(file_path, &source_size);
+
+	if (!source)
+		return script;
+
+	UINT64 hash = lua_script_cache_hash(source, source_size);
+
+	AcquireSRWLockExclusive(&script_cache->lock);
+
+	for (entry = script_cache->entries; entry; entry = entry->next)
+	{
+		if (_stricmp(entry->file_path, file_path) == 0)
+			break;
+	}
+
+	if (entry && entry->script && entry->script->hash == hash)
+	{
+		entry->generation = generation;
+		script = lua_script_acquire(entry->script);
+	}
+	else
+	{
+		script = lua_script_cache_build(file_path, source, source_size, hash);
+
+		if (script)
+		{
+			if (!entry)
+			{
+				entry = (LuaScriptCacheEntry*)malloc(sizeof(LuaScriptCacheEntry));
+
+				if (entry)
+				{
+					strcpy_s(entry->file_path, file_path);
+					entry->script = nullptr;
+					entry->next = script_cache->entries;
+
+					script_cache->entries = entry;
+				}
+			}
+
+			if (entry)
+			{
+				lua_script_release(entry->script);
+
+				entry->script = lua_script_acquire(script);
+				entry->generation = generation;
+			}
+		}
+	}
+
+	ReleaseSRWLockExclusive(&script_cache->lock);
+
+	free(source);
+	source = nullptr;
+
+	return script;
+}
+
+LuaScript*
+lua_script_acquire(LuaScript* script)
+{
+	if (script)
+	{
+		InterlockedIncrement(&script->ref_count);
+	}
+
+	return script;
+}
+
+LuaScript*
+lua_script_release(LuaScript* script)
+{
+	if (script && InterlockedDecrement(&script->ref_count) == 0)
+	{
+		free(script);
+	}
+
+	return nullptr;
+}
+
+UINT64
+lua_script_get_hash(const LuaScript* script)
+{
+	return script ? script->hash : 0;
+}
+
+int
+lua_script_load(lua_State* L, const LuaScript* script)
+{
+	assert(L != nullptr);
+	assert(script != nullptr);
+
+	return luaL_loadbuffer(L, script->bytecode, script->size, script->chunk_name);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _LUA_SCRIPT_CACHE
+#define _LUA_SCRIPT_CACHE
+
+typedef struct _LuaScript LuaScript;
+typedef struct _LuaScriptCache LuaScriptCache;
+
+LuaScriptCache* lua_script_cache_create(const char* directory_path);
+LuaScriptCache* lua_script_cache_destroy(LuaScriptCache* script_cache);
+void lua_script_cache_invalidate(LuaScriptCache* script_cache);
+bool lua_script_cache_changed(LuaScriptCache* script_cache);
+void lua_script_cache_register(lua_State* L, LuaScriptCache* script_cache);
+const char* lua_script_cache_get_directory(const LuaScriptCache* script_cache);
+bool lua_script_cache_resolve_path(
+	const char* directory_path, 
+	const char* path, 
+	char* file_path, 
+	size_t file_path_size
+);
+LuaScript* lua_script_cache_compile(LuaScriptCache* script_cache, const char* file_path);
+
+LuaScript* lua_script_acquire(LuaScript* script);
+LuaScript* lua_script_release(LuaScript* script);
+UINT64 lua_script_get_hash(const LuaScript* script);
+int lua_script_load(lua_State* L, const LuaScript* script);
+
+#endif
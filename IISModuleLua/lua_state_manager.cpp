@@ -1,28 +1,216 @@
 #include "shared.h"
 
+// Each shard sits on its own cache line so pushes and pops from different
+// processors never contend on the same list header.
+typedef struct DECLSPEC_CACHEALIGN _LuaStateManagerShard
+{
+	SLIST_HEADER head;
+} LuaStateManagerShard;
+
 typedef struct _LuaStateManager
 {
 	IHttpServer* http_server;
-	SLIST_HEADER* head;
+	LuaStateManagerShard* shards;
+	DWORD shard_count;
+
+	LuaConfig config;
+	HANDLE release_semaphore;
+	std::atomic<LONG> engine_count;
+	std::atomic<LONG> waiter_count;
+
+	wchar_t directory_path[MAX_PATH];
+	char script_path[MAX_PATH];
+
+	// One watcher for the whole pool, engines compare their loaded
+	// generation against this one when they are acquired.
+	HANDLE directory_changes_handle;
+	HANDLE wait_handle;
+	std::atomic<LONG> script_generation;
+
+	// Bursts of notifications re-arm the timer, the reload runs once it goes quiet.
+	PTP_TIMER reload_timer;
+	SRWLOCK reload_lock;
+	LuaStats stats;
+
+	// Compiled once per change and shared by every engine, guarded by
+	// script_lock together with script_generation.
+	LuaScriptCache* script_cache;
+	LuaScript* script;
+	SRWLOCK script_lock;
 } LuaStateManager;
 
-typedef struct _LuaStateManagerNode 
+typedef struct _LuaStateManagerNode
 {
 	SLIST_ENTRY item_entry;
 	LuaEngine* lua_engine;
 } LuaStateManagerNode;
 
-static bool 
+static bool
 lua_state_manager_validate(LuaStateManager* lsm)
 {
 	assert(lsm != nullptr);
-	assert(lsm->head != nullptr);
+	assert(lsm->shards != nullptr);
+	assert(lsm->shard_count > 0);
 	assert(lsm->http_server != nullptr);
+	assert(lsm->release_semaphore != nullptr);
+	assert(lsm->script_cache != nullptr);
 
 	return true;
 }
 
-LuaEngine* 
+static DWORD
+lua_state_manager_current_shard(LuaStateManager* lsm)
+{
+	PROCESSOR_NUMBER processor_number;
+	GetCurrentProcessorNumberEx(&processor_number);
+
+	return ((DWORD)processor_number.Group * 64 + processor_number.Number) % lsm->shard_count;
+}
+
+static LuaEngine*
+lua_state_manager_pop(LuaStateManager* lsm)
+{
+	LuaEngine* lua_engine = nullptr;
+	SLIST_ENTRY* list_entry = nullptr;
+
+	// Prefer the local shard, whose engines were last used on this processor,
+	// and only then steal from the neighbouring shards in order.
+	DWORD shard = lua_state_manager_current_shard(lsm);
+
+	for (DWORD i = 0; i < lsm->shard_count && !list_entry; i++)
+	{
+		list_entry = InterlockedPopEntrySList(&lsm->shards[(shard + i) % lsm->shard_count].head);
+	}
+
+	if (list_entry)
+	{
+		LuaStateManagerNode* node = (LuaStateManagerNode*)list_entry;
+		lua_engine = node->lua_engine;
+
+		assert(lua_engine_get_list_entry(lua_engine) == list_entry);
+		assert(lua_engine == node->lua_engine);
+	}
+
+	return lua_engine;
+}
+
+static LuaEngine*
+lua_state_manager_grow(LuaStateManager* lsm)
+{
+	LuaEngine* lua_engine = nullptr;
+	LONG engine_count = lsm->engine_count.load();
+
+	// Reserve a slot before creating so concurrent callers can never exceed the cap.
+	while (engine_count < (LONG)lsm->config.max_engines)
+	{
+		if (lsm->engine_count.compare_exchange_weak(engine_count, engine_count + 1))
+		{
+			AcquireSRWLockShared(&lsm->script_lock);
+
+			LuaScript* script = lua_script_acquire(lsm->script);
+			LONG generation = lsm->script_generation.load();
+
+			ReleaseSRWLockShared(&lsm->script_lock);
+
+			lua_engine = lua_engine_create(lsm->script_cache, &lsm->stats, &lsm->config, script, generation);
+			lua_script_release(script);
+
+			if (!lua_engine)
+			{
+				lsm->engine_count--;
+			}
+
+			break;
+		}
+	}
+
+	return lua_engine;
+}
+
+/**
+ * Takes one waiter off the count, fails when there is none left to take.
+ */
+static bool
+lua_state_manager_take_waiter(LuaStateManager* lsm)
+{
+	LONG waiter_count = lsm->waiter_count.load();
+
+	while (waiter_count > 0)
+	{
+		if (lsm->waiter_count.compare_exchange_weak(waiter_count, waiter_count - 1))
+			return true;
+	}
+
+	return false;
+}
+
+static LuaEngine*
+lua_state_manager_wait(LuaStateManager* lsm)
+{
+	LuaEngine* lua_engine = nullptr;
+
+	if (++lsm->waiter_count > (LONG)lsm->config.max_waiters)
+	{
+		lsm->waiter_count--;
+
+		lua_engine_printf("lua engine wait queue is full, rejecting request\n");
+		return lua_engine;
+	}
+
+	ULONGLONG deadline = GetTickCount64() + lsm->config.acquire_timeout;
+
+	// The waiter count is published before popping, so a release that misses
+	// our pop is guaranteed to see us waiting and signal the semaphore.
+	// Each signal takes one waiter off the count, a woken waiter publishes
+	// itself again before it retries.
+	for (;;)
+	{
+		lua_engine = lua_state_manager_pop(lsm);
+
+		if (lua_engine)
+			break;
+
+		lua_engine = lua_state_manager_grow(lsm);
+
+		if (lua_engine)
+			break;
+
+		ULONGLONG now = GetTickCount64();
+
+		if (now >= deadline)
+			break;
+
+		if (WaitForSingleObject(lsm->release_semaphore, (DWORD)(deadline - now)) == WAIT_OBJECT_0)
+		{
+			lsm->waiter_count++;
+		}
+	}
+
+	// A signal already on its way for us is taken back so it cannot wake
+	// the next waiter for nothing.
+	if (!lua_state_manager_take_waiter(lsm))
+	{
+		WaitForSingleObject(lsm->release_semaphore, 0);
+	}
+
+	if (!lua_engine)
+	{
+		lua_engine_printf("timed out waiting for a lua engine\n");
+	}
+
+	return lua_engine;
+}
+
+static void
+lua_state_manager_signal(LuaStateManager* lsm)
+{
+	if (lua_state_manager_take_waiter(lsm))
+	{
+		ReleaseSemaphore(lsm->release_semaphore, 1, nullptr);
+	}
+}
+
+LuaEngine*
 lua_state_manager_aquire(LuaStateManager* lsm)
 {
 	assert(lua_state_manager_validate(lsm));
@@ -31,43 +219,287 @@ lua_state_manager_aquire(LuaStateManager* lsm)
 
 	if (lsm && lsm->http_server)
 	{
-		SLIST_ENTRY* list_entry = InterlockedPopEntrySList(lsm->head);
+		lua_engine = lua_state_manager_pop(lsm);
 
-		if (list_entry)
+		if (!lua_engine)
 		{
-			LuaStateManagerNode* node = (LuaStateManagerNode*)list_entry;
-			lua_engine = node->lua_engine;
+			lua_engine = lua_state_manager_grow(lsm);
+		}
 
-			assert(lua_engine_get_list_entry(lua_engine) == list_entry);
-			assert(lua_engine == node->lua_engine);
+		if (!lua_engine)
+		{
+			lua_engine = lua_state_manager_wait(lsm);
 		}
-		else
+
+		// The lock is only taken when the engine is behind, which is once per reload.
+		if (lua_engine && lua_engine_get_generation(lua_engine) != lsm->script_generation.load())
 		{
-			lua_engine = lua_engine_create(lsm->http_server->GetAppPoolName());
+			AcquireSRWLockShared(&lsm->script_lock);
+
+			LuaScript* script = lua_script_acquire(lsm->script);
+			LONG generation = lsm->script_generation.load();
+
+			ReleaseSRWLockShared(&lsm->script_lock);
+
+			lua_engine_refresh(lua_engine, generation, script);
+			lua_script_release(script);
 		}
 	}
 
 	return lua_engine;
 }
 
-LuaStateManager* 
+static void CALLBACK
+lua_state_manager_reload_callback(
+	PTP_CALLBACK_INSTANCE instance, 
+	PVOID context, 
+	PTP_TIMER timer
+)
+{
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(timer);
+	assert(context != nullptr);
+
+	LuaStateManager* lsm = (LuaStateManager*)context;
+
+	if (!lsm)
+		return;
+
+	AcquireSRWLockExclusive(&lsm->reload_lock);
+
+	// Saves that did not change the script or any module it required,
+	// as well as writes to unrelated files, never reach the engines.
+	if (!lua_script_cache_changed(lsm->script_cache))
+	{
+		InterlockedIncrement64(&lsm->stats.reloads_suppressed);
+	}
+	else
+	{
+		// Engines only move to scripts that load, a broken push keeps
+		// the pool on the last good generation.
+		lua_script_cache_invalidate(lsm->script_cache);
+
+		LuaScript* script = lua_script_cache_compile(lsm->script_cache, lsm->script_path);
+
+		if (script && lua_engine_validate(lsm->script_cache, script))
+		{
+			AcquireSRWLockExclusive(&lsm->script_lock);
+
+			LuaScript* previous_script = lsm->script;
+			lsm->script = script;
+			lsm->script_generation++;
+
+			ReleaseSRWLockExclusive(&lsm->script_lock);
+
+			lua_script_release(previous_script);
+
+			InterlockedIncrement64(&lsm->stats.reloads_performed);
+		}
+		else
+		{
+			lua_engine_printf("script failed to load, keeping the current generation\n");
+
+			lua_script_release(script);
+
+			InterlockedIncrement64(&lsm->stats.reloads_failed);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&lsm->reload_lock);
+}
+
+static void CALLBACK
+lua_state_manager_watch_callback(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
+{
+	UNREFERENCED_PARAMETER(TimerOrWaitFired);
+	assert(lpParameter != nullptr);
+
+	LuaStateManager* lsm = (LuaStateManager*)lpParameter;
+
+	if (lsm)
+	{
+		if (!FindNextChangeNotification(lsm->directory_changes_handle))
+		{
+			lua_engine_printf("failed to register a notification for further directory changes\n");
+		}
+
+		InterlockedIncrement64(&lsm->stats.notifications);
+
+		// Setting the timer again replaces the pending due time.
+		ULARGE_INTEGER due_time;
+		due_time.QuadPart = (ULONGLONG)-((LONGLONG)lsm->config.reload_debounce * 10000);
+
+		FILETIME file_due_time;
+		file_due_time.dwLowDateTime = due_time.LowPart;
+		file_due_time.dwHighDateTime = due_time.HighPart;
+
+		SetThreadpoolTimer(lsm->reload_timer, &file_due_time, 0, 0);
+	}
+}
+
+static bool
+lua_state_manager_resolve_paths(LuaStateManager* lsm)
+{
+	const wchar_t* name = lsm->http_server->GetAppPoolName();
+	wchar_t* documents_path = nullptr;
+
+	HRESULT hr = SHGetKnownFolderPath(
+		FOLDERID_Public,
+		0,
+		nullptr,
+		&documents_path
+	);
+
+	// The script path is the longest one formatted, the config path next to it
+	// is the same length. Formatting past MAX_PATH would abort the process.
+	if (SUCCEEDED(hr) && documents_path 
+		&& wcslen(documents_path) + 2 * wcslen(name) + wcslen(L"\\\\.lua") >= MAX_PATH)
+	{
+		lua_engine_printf("public documents path for the application pool is too long\n");
+
+		CoTaskMemFree(documents_path);
+		return false;
+	}
+
+	if (SUCCEEDED(hr) && documents_path)
+	{
+		swprintf_s(lsm->directory_path, L"%s\\%s", documents_path, name);
+		sprintf_s(lsm->script_path, "%ls\\%ls\\%ls.lua", documents_path, name, name);
+
+		CoTaskMemFree(documents_path);
+		documents_path = nullptr;
+
+		return true;
+	}
+
+	lua_engine_printf("failed to resolve the public documents folder\n");
+
+	return false;
+}
+
+static void
+lua_state_manager_watch(LuaStateManager* lsm)
+{
+	// The persistent wait fires once per change notification,
+	// the callback re-arms the notification itself.
+	HANDLE directory_changes_handle = FindFirstChangeNotificationW(
+		lsm->directory_path,
+		TRUE,
+		FILE_NOTIFY_CHANGE_LAST_WRITE
+	);
+
+	if (directory_changes_handle == INVALID_HANDLE_VALUE)
+	{
+		lua_engine_printf("failed to initially register for directory changes\n");
+		return;
+	}
+
+	lsm->directory_changes_handle = directory_changes_handle;
+
+	lsm->reload_timer = CreateThreadpoolTimer(
+		&lua_state_manager_reload_callback, 
+		(PVOID)lsm, 
+		nullptr
+	);
+
+	if (!lsm->reload_timer)
+	{
+		lua_engine_printf("failed to create reload timer\n");
+
+		FindCloseChangeNotification(lsm->directory_changes_handle);
+		lsm->directory_changes_handle = nullptr;
+		return;
+	}
+
+	BOOL result = RegisterWaitForSingleObject(
+		&lsm->wait_handle,
+		lsm->directory_changes_handle,
+		&lua_state_manager_watch_callback,
+		(void*)lsm,
+		INFINITE,
+		WT_EXECUTEDEFAULT
+	);
+
+	if (!result)
+	{
+		lua_engine_printf("failed to register for directory changes\n");
+
+		FindCloseChangeNotification(lsm->directory_changes_handle);
+		lsm->directory_changes_handle = nullptr;
+		lsm->wait_handle = nullptr;
+
+		CloseThreadpoolTimer(lsm->reload_timer);
+		lsm->reload_timer = nullptr;
+	}
+}
+
+static void
+lua_state_manager_unwatch(LuaStateManager* lsm)
+{
+	if (lsm->wait_handle)
+	{
+		// Blocks until any running callback has returned.
+		UnregisterWaitEx(lsm->wait_handle, INVALID_HANDLE_VALUE);
+		lsm->wait_handle = nullptr;
+	}
+
+	if (lsm->reload_timer)
+	{
+		SetThreadpoolTimer(lsm->reload_timer, nullptr, 0, 0);
+		WaitForThreadpoolTimerCallbacks(lsm->reload_timer, TRUE);
+
+		CloseThreadpoolTimer(lsm->reload_timer);
+		lsm->reload_timer = nullptr;
+	}
+
+	if (lsm->directory_changes_handle)
+	{
+		FindCloseChangeNotification(lsm->directory_changes_handle);
+		lsm->directory_changes_handle = nullptr;
+	}
+}
+
+LuaStateManager*
 lua_state_manager_destroy(LuaStateManager* lsm)
 {
 	assert(lua_state_manager_validate(lsm));
 
-	if (lsm && lsm->head)
+	if (lsm && lsm->shards)
 	{
-		SLIST_ENTRY* list_entry = InterlockedPopEntrySList(lsm->head);
+		lua_state_manager_unwatch(lsm);
 
-		while (list_entry)
+		for (DWORD i = 0; i < lsm->shard_count; i++)
 		{
-			LuaStateManagerNode* node = (LuaStateManagerNode*)list_entry;
-			node->lua_engine = lua_engine_destroy(node->lua_engine);
+			SLIST_ENTRY* list_entry = InterlockedPopEntrySList(&lsm->shards[i].head);
+
+			while (list_entry)
+			{
+				LuaStateManagerNode* node = (LuaStateManagerNode*)list_entry;
+				node->lua_engine = lua_engine_destroy(node->lua_engine);
+
+				list_entry = InterlockedPopEntrySList(&lsm->shards[i].head);
+			}
+		}
+
+		_aligned_free(lsm->shards);
 
-			list_entry = InterlockedPopEntrySList(lsm->head);
+		lsm->script = lua_script_release(lsm->script);
+
+		if (lsm->script_cache)
+		{
+			lsm->script_cache = lua_script_cache_destroy(lsm->script_cache);
 		}
 
-		_aligned_free(lsm->head);
+		// Every engine is gone, so the registry holds the last references.
+		ip_set_clear_registry();
+		file_cache_clear();
+		compression_cache_clear();
+
+		if (lsm->release_semaphore)
+		{
+			CloseHandle(lsm->release_semaphore);
+			lsm->release_semaphore = nullptr;
+		}
 
 		delete lsm;
 		lsm = nullptr;
@@ -76,7 +508,7 @@ lua_state_manager_destroy(LuaStateManager* lsm)
 	return lsm;
 }
 
-LuaStateManager* 
+LuaStateManager*
 lua_state_manager_create(IHttpServer* http_server)
 {
 	LuaStateManager* lsm = new LuaStateManager();
@@ -86,23 +518,100 @@ lua_state_manager_create(IHttpServer* http_server)
 	if (lsm)
 	{
 		lsm->http_server = http_server;
-		lsm->head = (PSLIST_HEADER)_aligned_malloc(
-			sizeof(SLIST_HEADER), 
-			MEMORY_ALLOCATION_ALIGNMENT
+		lsm->shard_count = max(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), 1);
+		lsm->shards = (LuaStateManagerShard*)_aligned_malloc(
+			sizeof(LuaStateManagerShard) * lsm->shard_count,
+			alignof(LuaStateManagerShard)
 		);
 
-		assert(lsm->head != nullptr);
+		if (lua_state_manager_resolve_paths(lsm))
+		{
+			wchar_t config_path[MAX_PATH];
+			swprintf_s(config_path, L"%s\\%s.ini", lsm->directory_path, http_server->GetAppPoolName());
+
+			lua_config_load(&lsm->config, config_path);
+		}
+		else
+		{
+			lua_config_load(&lsm->config, nullptr);
+		}
+
+		file_cache_set_capacity(lsm->config.file_cache_size);
 
-		if (!lsm->head)
+		if (!lua_allocator_probe())
 		{
+			lua_engine_printf("custom allocator rejected, lua states use the default allocator\n");
+
+			if (lsm->config.memory_limit)
+			{
+				lua_engine_printf("[memory] limit needs a GC64 build of LuaJIT and is ignored\n");
+			}
+		}
+
+		// Configured in kilobytes.
+		compression_cache_set_capacity((size_t)lsm->config.compression_cache_size * 1024);
+
+		lsm->release_semaphore = CreateSemaphore(
+			nullptr,
+			0,
+			(LONG)lsm->config.max_waiters + 1,
+			nullptr
+		);
+
+		char directory_path[MAX_PATH];
+		sprintf_s(directory_path, "%ls", lsm->directory_path);
+
+		InitializeSRWLock(&lsm->script_lock);
+		InitializeSRWLock(&lsm->reload_lock);
+		lsm->script_cache = lua_script_cache_create(directory_path);
+
+		assert(lsm->shards != nullptr);
+		assert(lsm->release_semaphore != nullptr);
+		assert(lsm->script_cache != nullptr);
+
+		if (!lsm->shards || !lsm->release_semaphore || !lsm->script_cache)
+		{
+			if (lsm->shards)
+				_aligned_free(lsm->shards);
+
+			if (lsm->release_semaphore)
+				CloseHandle(lsm->release_semaphore);
+
+			if (lsm->script_cache)
+				lua_script_cache_destroy(lsm->script_cache);
+
 			delete lsm;
 			lsm = nullptr;
 		}
 		else
 		{
-			InitializeSListHead(lsm->head);
+			for (DWORD i = 0; i < lsm->shard_count; i++)
+			{
+				InitializeSListHead(&lsm->shards[i].head);
+			}
 
 			assert(lua_state_manager_validate(lsm));
+
+			if (lsm->directory_path[0])
+			{
+				lsm->script = lua_script_cache_compile(lsm->script_cache, lsm->script_path);
+
+				lua_state_manager_watch(lsm);
+			}
+
+			// Pre-warm the pool so the first requests never pay for engine creation.
+			for (DWORD i = 0; i < lsm->config.min_engines; i++)
+			{
+				LuaEngine* lua_engine = lua_state_manager_grow(lsm);
+
+				if (!lua_engine)
+				{
+					lua_engine_printf("failed to pre-warm lua engine %u of %u\n", i + 1, lsm->config.min_engines);
+					break;
+				}
+
+				lua_state_manager_release(lsm, lua_engine);
+			}
 		}
 	}
 
@@ -120,8 +629,11 @@ lua_state_manager_release(
 
 	if (lua_engine)
 	{
-		if (lsm && lsm->head)
+		lua_engine_collect(lua_engine);
+
+		if (lsm && lsm->shards)
 		{
+			SLIST_HEADER* head = &lsm->shards[lua_state_manager_current_shard(lsm)].head;
 			LuaStateManagerNode* node = (LuaStateManagerNode*)lua_engine_get_list_entry(lua_engine);
 
 			if (node == nullptr)
@@ -139,7 +651,7 @@ lua_state_manager_release(
 					assert(lua_engine_get_list_entry(lua_engine) == (SLIST_ENTRY*)node);
 					assert(lua_engine == node->lua_engine);
 
-					InterlockedPushEntrySList(lsm->head, &node->item_entry);
+					InterlockedPushEntrySList(head, &node->item_entry);
 				}
 				else
 				{
@@ -148,8 +660,10 @@ lua_state_manager_release(
 			}
 			else
 			{
-				InterlockedPushEntrySList(lsm->head, &node->item_entry);
+				InterlockedPushEntrySList(head, &node->item_entry);
 			}
+
+			lua_state_manager_signal(lsm);
 		}
 		else
 		{
@@ -163,7 +677,14 @@ destroy:
 	if (lua_engine)
 	{
 		lua_engine = lua_engine_destroy(lua_engine);
+
+		if (lsm)
+		{
+			// Free the slot so a waiter can create a replacement engine.
+			lsm->engine_count--;
+			lua_state_manager_signal(lsm);
+		}
 	}
 finish:
 	return nullptr;
-}
\ No newline at end of file
+}
@@ -0,0 +1,52 @@
+#include "shared.h"
+
+static int
+lua_stats_get(lua_State* L)
+{
+	lua_stack_guard(L, 1);
+
+	LuaStats* stats = (LuaStats*)lua_touserdata(L, lua_upvalueindex(1));
+
+	struct counter_pair { const char* key; volatile LONG64* val; };
+	struct counter_pair counters[] =
+	{
+		{ "Notifications", &stats->notifications },
+		{ "ReloadsPerformed", &stats->reloads_performed },
+		{ "ReloadsSuppressed", &stats->reloads_suppressed },
+		{ "ReloadsFailed", &stats->reloads_failed },
+		{ "GcSteps", &stats->gc_steps },
+		{ "GcCycles", &stats->gc_cycles },
+		{ "GcTime", &stats->gc_time },
+		{ 0, 0 }
+	};
+
+	lua_createtable(L, 0, (int)_countof(counters) - 1);
+
+	for (struct counter_pair* p = counters; p->key != 0; p++)
+	{
+		lua_pushstring(L, p->key);
+		lua_pushnumber(L, (lua_Number)*p->val);
+		lua_rawset(L, -3);
+	}
+
+	return 1;
+}
+
+/**
+ * Pushes iis.Stats into the table on top of the stack.
+ */
+void
+lua_stats_register(lua_State* L, LuaStats* stats)
+{
+	assert(L != nullptr);
+
+	if (L && stats)
+	{
+		lua_stack_guard(L, 0);
+
+		lua_pushstring(L, "Stats");
+		lua_pushlightuserdata(L, stats);
+		lua_pushcclosure(L, lua_stats_get, 1);
+		lua_rawset(L, -3);
+	}
+}
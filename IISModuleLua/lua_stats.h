@@ -0,0 +1,21 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _LUA_STATS
+#define _LUA_STATS
+
+typedef struct _LuaStats
+{
+	volatile LONG64 notifications;
+	volatile LONG64 reloads_performed;
+	volatile LONG64 reloads_suppressed;
+	volatile LONG64 reloads_failed;
+
+	volatile LONG64 gc_steps;
+	volatile LONG64 gc_cycles;
+	volatile LONG64 gc_time;
+} LuaStats;
+
+void lua_stats_register(lua_State* L, LuaStats* stats);
+
+#endif
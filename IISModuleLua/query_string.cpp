@@ -0,0 +1,120 @@
+#include "shared.h"
+#include <emmintrin.h>
+
+/**
+ * Splits the next key=value pair off an application/x-www-form-urlencoded
+ * string without copying, a leading '?' and empty segments are skipped.
+ */
+bool
+query_string_next(const char** cursor, const char* end, QueryStringPair* pair)
+{
+	assert(cursor != nullptr);
+	assert(pair != nullptr);
+
+	const char* position = *cursor;
+
+	while (position < end && (*position == '&' || *position == '?'))
+		position++;
+
+	if (position >= end)
+	{
+		*cursor = end;
+		return false;
+	}
+
+	const char* separator = (const char*)memchr(position, '&', end - position);
+	const char* segment_end = separator ? separator : end;
+	const char* equals = (const char*)memchr(position, '=', segment_end - position);
+
+	pair->key = position;
+	pair->key_length = (equals ? equals : segment_end) - position;
+
+	pair->value = equals ? equals + 1 : segment_end;
+	pair->value_length = segment_end - pair->value;
+
+	*cursor = segment_end;
+
+	return true;
+}
+
+static int
+query_string_hex(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+	return -1;
+}
+
+bool
+query_string_needs_decode(const char* source, size_t length)
+{
+	return memchr(source, '%', length) || memchr(source, '+', length);
+}
+
+/**
+ * Percent-decodes into a destination of at least length bytes and returns the
+ * decoded length. Runs without '%' or '+' are copied sixteen bytes at a time,
+ * malformed escapes are kept verbatim.
+ */
+size_t
+query_string_decode(const char* source, size_t length, char* destination)
+{
+	const __m128i percent = _mm_set1_epi8('%');
+	const __m128i plus = _mm_set1_epi8('+');
+
+	size_t i = 0;
+	size_t j = 0;
+
+	while (i < length)
+	{
+		if (i + 16 <= length)
+		{
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(source + i));
+			int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(bytes, percent), 
+				_mm_cmpeq_epi8(bytes, plus)
+			));
+
+			if (!mask)
+			{
+				_mm_storeu_si128((__m128i*)(destination + j), bytes);
+
+				i += 16;
+				j += 16;
+				continue;
+			}
+
+			// Copy the plain prefix in one go, then fall through to the special byte.
+			unsigned long index;
+			_BitScanForward(&index, (unsigned long)mask);
+
+			memcpy(destination + j, source + i, index);
+
+			i += index;
+			j += index;
+		}
+
+		char c = source[i];
+
+		if (c == '+')
+		{
+			destination[j++] = ' ';
+			i++;
+		}
+		else if (c == '%' && i + 2 < length
+			&& query_string_hex(source[i + 1]) >= 0 && query_string_hex(source[i + 2]) >= 0)
+		{
+			destination[j++] = (char)(query_string_hex(source[i + 1]) * 16 + query_string_hex(source[i + 2]));
+			i += 3;
+		}
+		else
+		{
+			destination[j++] = c;
+			i++;
+		}
+	}
+
+	return j;
+}
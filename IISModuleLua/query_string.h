@@ -0,0 +1,20 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _QUERY_STRING
+#define _QUERY_STRING
+
+typedef struct _QueryStringPair
+{
+	const char* key;
+	size_t key_length;
+
+	const char* value;
+	size_t value_length;
+} QueryStringPair;
+
+bool query_string_next(const char** cursor, const char* end, QueryStringPair* pair);
+bool query_string_needs_decode(const char* source, size_t length);
+size_t query_string_decode(const char* source, size_t length, char* destination);
+
+#endif
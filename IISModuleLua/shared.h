@@ -29,9 +29,24 @@ extern "C"
 #endif
 
 #pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Synchronization.lib")
 
+#include "utf8_convert.h"
+#include "query_string.h"
+#include "form_parser.h"
+#include "ip_set.h"
+#include "file_cache.h"
+#include "http_range.h"
+#include "deflate.h"
+#include "compression_cache.h"
+#include "lua_config.h"
+#include "lua_script_cache.h"
+#include "lua_stats.h"
+#include "lua_allocator.h"
 #include "lua_engine.h"
 #include "lua_response.h"
 #include "lua_request.h"
+#include "lua_form.h"
+#include "lua_ip_set.h"
 #include "lua_state_manager.h"
 #include "lua_stack_guard.h"
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "shared.h"
+#include <emmintrin.h>
+
+/**
+ * Both directions follow the WideCharToMultiByte convention: with no destination
+ * the required size is returned, otherwise the number of units written, or zero
+ * when the destination is too small. Nothing is null terminated.
+ *
+ * URLs and headers are nearly always plain ASCII, so the leading ASCII run is
+ * copied sixteen bytes at a time and only the remainder goes through the
+ * system UTF-8 codec, which replaces unpaired surrogates and invalid
+ * sequences with U+FFFD.
+ */
+static size_t
+utf8_convert_ascii_from_wide(const wchar_t* source, size_t length, char* destination)
+{
+	const __m128i non_ascii_mask = _mm_set1_epi16((short)0xFF80);
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8)
+	{
+		__m128i units = _mm_loadu_si128((const __m128i*)(source + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii_mask), zero)) != 0xFFFF)
+			break;
+
+		if (destination)
+			_mm_storel_epi64((__m128i*)(destination + i), _mm_packus_epi16(units, units));
+	}
+
+	for (; i < length && source[i] < 0x80; i++)
+	{
+		if (destination)
+			destination[i] = (char)source[i];
+	}
+
+	return i;
+}
+
+static size_t
+utf8_convert_ascii_to_wide(const char* source, size_t length, wchar_t* destination)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(source + i));
+
+		if (_mm_movemask_epi8(bytes) != 0)
+			break;
+
+		if (destination)
+		{
+			_mm_storeu_si128((__m128i*)(destination + i), _mm_unpacklo_epi8(bytes, zero));
+			_mm_storeu_si128((__m128i*)(destination + i + 8), _mm_unpackhi_epi8(bytes, zero));
+		}
+	}
+
+	for (; i < length && (unsigned char)source[i] < 0x80; i++)
+	{
+		if (destination)
+			destination[i] = (wchar_t)source[i];
+	}
+
+	return i;
+}
+
+size_t
+utf8_convert_from_wide(
+	const wchar_t* source, 
+	size_t length, 
+	char* destination, 
+	size_t destination_size
+)
+{
+	if (!source || !length)
+		return 0;
+
+	if (destination && destination_size < length)
+		return 0;
+
+	size_t ascii_length = utf8_convert_ascii_from_wide(source, length, destination);
+
+	if (ascii_length == length)
+		return length;
+
+	int converted = WideCharToMultiByte(
+		CP_UTF8,
+		0,
+		source + ascii_length,
+		(int)(length - ascii_length),
+		destination ? destination + ascii_length : nullptr,
+		destination ? (int)(destination_size - ascii_length) : 0,
+		nullptr,
+		nullptr
+	);
+
+	return converted > 0 ? ascii_length + converted : 0;
+}
+
+size_t
+utf8_convert_to_wide(
+	const char* source, 
+	size_t length, 
+	wchar_t* destination, 
+	size_t destination_size
+)
+{
+	if (!source || !length)
+		return 0;
+
+	if (destination && destination_size < length)
+	{
+		// Every UTF-8 sequence is at least as long as its UTF-16 form,
+		// so only a buffer shorter than the input can be too small.
+		size_t required_size = utf8_convert_to_wide(source, length, nullptr, 0);
+
+		if (destination_size < required_size)
+			return 0;
+	}
+
+	size_t ascii_length = utf8_convert_ascii_to_wide(source, length, destination);
+
+	if (ascii_length == length)
+		return length;
+
+	int converted = MultiByteToWideChar(
+		CP_UTF8,
+		0,
+		source + ascii_length,
+		(int)(length - ascii_length),
+		destination ? destination + ascii_length : nullptr,
+		destination ? (int)(destination_size - ascii_length) : 0
+	);
+
+	return converted > 0 ? ascii_length + converted : 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "shared.h"
+
+#ifndef _UTF8_CONVERT
+#define _UTF8_CONVERT
+
+size_t utf8_convert_from_wide(const wchar_t* source, size_t length, char* destination, size_t destination_size);
+size_t utf8_convert_to_wide(const char* source, size_t length, wchar_t* destination, size_t destination_size);
+
+#endif
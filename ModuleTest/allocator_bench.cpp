@@ -0,0 +1,171 @@
+#include "module_test.h"
+
+#include <psapi.h>
+
+#pragma comment(lib, "Psapi.lib")
+
+#define ALLOCATOR_BENCH_SLOTS 65536
+#define ALLOCATOR_BENCH_STEPS 4000000
+
+typedef struct _AllocatorBenchResult
+{
+	double seconds;
+	size_t operations;
+	SIZE_T peak_bytes;
+	SIZE_T retained_bytes;
+} AllocatorBenchResult;
+
+// What LuaJIT does without a custom allocator.
+static void*
+allocator_bench_crt_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	UNREFERENCED_PARAMETER(ud);
+	UNREFERENCED_PARAMETER(osize);
+
+	if (nsize == 0)
+	{
+		free(ptr);
+		return nullptr;
+	}
+
+	return realloc(ptr, nsize);
+}
+
+static SIZE_T
+allocator_bench_private_bytes()
+{
+	PROCESS_MEMORY_COUNTERS_EX counters = {};
+	GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters));
+
+	return counters.PrivateUsage;
+}
+
+static UINT32
+allocator_bench_random(UINT32* seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+// Mostly small strings and tables, now and then a large buffer or array part.
+static size_t
+allocator_bench_size(UINT32* seed)
+{
+	UINT32 bucket = allocator_bench_random(seed) % 100;
+
+	if (bucket < 70)
+		return 16 + allocator_bench_random(seed) % 48;
+
+	if (bucket < 95)
+		return 64 + allocator_bench_random(seed) % 448;
+
+	return 512 + allocator_bench_random(seed) % 65024;
+}
+
+/**
+ * Fills every slot, churns through frees, reallocations and fresh blocks,
+ * then frees everything. The same seed gives both allocators the same trace.
+ */
+static AllocatorBenchResult
+allocator_bench_trace(lua_Alloc alloc, void* ud)
+{
+	AllocatorBenchResult result = {};
+
+	void** slots = (void**)calloc(ALLOCATOR_BENCH_SLOTS, sizeof(void*));
+	size_t* sizes = (size_t*)calloc(ALLOCATOR_BENCH_SLOTS, sizeof(size_t));
+	UINT32 seed = 1;
+
+	SIZE_T baseline = allocator_bench_private_bytes();
+	double start = module_test_seconds();
+
+	for (size_t i = 0; i < ALLOCATOR_BENCH_SLOTS; i++)
+	{
+		sizes[i] = allocator_bench_size(&seed);
+		slots[i] = alloc(ud, nullptr, 0, sizes[i]);
+	}
+
+	for (size_t step = 0; step < ALLOCATOR_BENCH_STEPS; step++)
+	{
+		size_t i = allocator_bench_random(&seed) % ALLOCATOR_BENCH_SLOTS;
+		UINT32 action = allocator_bench_random(&seed) % 4;
+
+		if (!slots[i])
+		{
+			sizes[i] = allocator_bench_size(&seed);
+			slots[i] = alloc(ud, nullptr, 0, sizes[i]);
+		}
+		else if (action < 2)
+		{
+			alloc(ud, slots[i], sizes[i], 0);
+			slots[i] = nullptr;
+		}
+		else if (action == 2)
+		{
+			size_t size = allocator_bench_size(&seed);
+			void* block = alloc(ud, slots[i], sizes[i], size);
+
+			if (block)
+			{
+				slots[i] = block;
+				sizes[i] = size;
+			}
+		}
+	}
+
+	SIZE_T peak = allocator_bench_private_bytes();
+	result.peak_bytes = peak > baseline ? peak - baseline : 0;
+
+	for (size_t i = 0; i < ALLOCATOR_BENCH_SLOTS; i++)
+	{
+		if (slots[i])
+			alloc(ud, slots[i], sizes[i], 0);
+	}
+
+	result.seconds = module_test_seconds() - start;
+	result.operations = ALLOCATOR_BENCH_SLOTS * 2 + ALLOCATOR_BENCH_STEPS;
+
+	SIZE_T retained = allocator_bench_private_bytes();
+	result.retained_bytes = retained > baseline ? retained - baseline : 0;
+
+	free(sizes);
+	free(slots);
+
+	return result;
+}
+
+static void
+allocator_bench_print(const char* name, const AllocatorBenchResult* result)
+{
+	printf(
+		"%-10s %6.1f ns per call, %7.1f MB private at the end of the churn, %7.1f MB kept after freeing all\n",
+		name,
+		result->seconds / result->operations * 1e9,
+		result->peak_bytes / 1048576.0,
+		result->retained_bytes / 1048576.0
+	);
+}
+
+/**
+ * The state allocator against the CRT on the same synthetic trace, with the
+ * private bytes each leaves behind. The trace is replayed directly, a 64-bit
+ * LuaJIT without GC64 refuses custom allocators for whole states.
+ */
+void
+allocator_bench_trace_replay()
+{
+	LuaAllocator* allocator = lua_allocator_create(0);
+
+	if (!allocator)
+	{
+		printf("failed to create the allocator\n");
+		return;
+	}
+
+	AllocatorBenchResult state = allocator_bench_trace(lua_allocator_alloc, allocator);
+	allocator = lua_allocator_destroy(allocator);
+
+	AllocatorBenchResult crt = allocator_bench_trace(allocator_bench_crt_alloc, nullptr);
+
+	allocator_bench_print("allocator", &state);
+	allocator_bench_print("crt", &crt);
+}
@@ -0,0 +1,96 @@
+#include "module_test.h"
+
+static const char* engine_test_script =
+	"iis.Register(function(response, request)\n"
+	"	if request:GetQueryString() ~= '?read' then\n"
+	"		response:Write('sync')\n"
+	"		return iis.Finish\n"
+	"	end\n"
+	"	local next_chunk = request:Body(5)\n"
+	"	local chunks = {}\n"
+	"	while true do\n"
+	"		local chunk = next_chunk()\n"
+	"		if not chunk then break end\n"
+	"		chunks[#chunks + 1] = chunk\n"
+	"	end\n"
+	"	response:Write(table.concat(chunks, '|'))\n"
+	"	return iis.Finish\n"
+	"end)\n";
+
+typedef struct _EngineTestRead
+{
+	StandInContext* context;
+	LuaEngineRequest request;
+	HANDLE finished;
+	REQUEST_NOTIFICATION_STATUS status;
+	volatile LONG completions;
+} EngineTestRead;
+
+// Where the module's OnAsyncCompletion would run.
+static void
+engine_test_read_completed(void* context, DWORD bytes_read, HRESULT status)
+{
+	EngineTestRead* read = (EngineTestRead*)context;
+
+	InterlockedIncrement(&read->completions);
+	read->status = lua_engine_resume_request(&read->request, read->context, bytes_read, status);
+
+	if (read->status != RQ_NOTIFICATION_PENDING)
+		SetEvent(read->finished);
+}
+
+/**
+ * A handler waiting on the body gives the engine up: another request is
+ * served on it in the meantime, and the timer thread resumes the first one
+ * read by read until the body runs out.
+ */
+void
+engine_test_suspended_read()
+{
+	ModuleTestEngine* engine = module_test_engine_create(engine_test_script);
+
+	if (!module_test_check(engine != nullptr))
+		return;
+
+	const char body[] = "hello world, async";
+
+	StandInContext suspended;
+	suspended.request.SetCookedUrl(L"localhost", L"/upload", L"?read");
+	suspended.request.SetBody(body, sizeof(body) - 1);
+
+	EngineTestRead read = {};
+	read.context = &suspended;
+	read.finished = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	module_test_request_init(&read.request);
+
+	suspended.request.SetReadDelay(20, engine_test_read_completed, &read);
+
+	REQUEST_NOTIFICATION_STATUS status = lua_engine_begin_request(engine->lua_engine, &suspended, &read.request);
+
+	module_test_check(status == RQ_NOTIFICATION_PENDING);
+
+	StandInContext meanwhile;
+	module_test_check(module_test_run_request(engine, &meanwhile) == RQ_NOTIFICATION_FINISH_REQUEST);
+	module_test_check(meanwhile.response.GetBody() == "sync");
+
+	if (status == RQ_NOTIFICATION_PENDING)
+	{
+		module_test_check(WaitForSingleObject(read.finished, 5000) == WAIT_OBJECT_0);
+		module_test_check(read.status == RQ_NOTIFICATION_FINISH_REQUEST);
+	}
+
+	suspended.request.WaitForReads();
+
+	module_test_check(read.completions == 4);
+	module_test_check(suspended.response.GetBody() == "hello| worl|d, as|ync");
+
+	lua_engine_end_request(&read.request);
+
+	// The finished coroutine went back to the engine, the next request runs on it.
+	StandInContext after;
+	module_test_check(module_test_run_request(engine, &after) == RQ_NOTIFICATION_FINISH_REQUEST);
+	module_test_check(after.response.GetBody() == "sync");
+
+	CloseHandle(read.finished);
+	module_test_engine_destroy(engine);
+}
@@ -0,0 +1,162 @@
+#include "module_test.h"
+
+#define FORM_BENCH_REQUESTS 20000
+#define FORM_BENCH_FILE_SIZE 65536
+
+// The Lua parser is the one scripts used before Form, it needs the whole body
+// in one string. Both count what they saw so their results can be compared.
+static const char* form_bench_script =
+	"local function lua_multipart(body, boundary, on_file)\n"
+	"	local fields, files = {}, {}\n"
+	"	local delimiter = '\\r\\n--' .. boundary\n"
+	"	local position = select(2, body:find('--' .. boundary, 1, true)) + 1\n"
+	"	while body:sub(position, position + 1) ~= '--' do\n"
+	"		local headers_end = body:find('\\r\\n\\r\\n', position, true)\n"
+	"		local headers = body:sub(position + 2, headers_end - 1)\n"
+	"		local part_end = body:find(delimiter, headers_end + 4, true)\n"
+	"		local value = body:sub(headers_end + 4, part_end - 1)\n"
+	"		local part = { name = headers:match('name=\"([^\"]*)\"'), filename = headers:match('filename=\"([^\"]*)\"') }\n"
+	"		if part.filename then\n"
+	"			files[#files + 1] = part\n"
+	"			on_file(part, value)\n"
+	"			on_file(part, nil)\n"
+	"		else\n"
+	"			fields[part.name] = value\n"
+	"		end\n"
+	"		position = part_end + #delimiter\n"
+	"	end\n"
+	"	return fields, files\n"
+	"end\n"
+	"iis.Register(function(response, request)\n"
+	"	local mode = request:GetHeader('X-Bench')\n"
+	"	local file_bytes = 0\n"
+	"	local function on_file(part, chunk)\n"
+	"		if chunk then file_bytes = file_bytes + #chunk end\n"
+	"	end\n"
+	"	local fields, files\n"
+	"	if mode == 'form' then\n"
+	"		local form = request:Form({ on_file = on_file })\n"
+	"		for chunk in request:Body() do form:Feed(chunk) end\n"
+	"		fields, files = form:Finish()\n"
+	"	elseif mode == 'form-lua' then\n"
+	"		local chunks = {}\n"
+	"		for chunk in request:Body() do chunks[#chunks + 1] = chunk end\n"
+	"		local boundary = request:GetHeader('Content-Type'):match('boundary=(.+)$')\n"
+	"		fields, files = lua_multipart(table.concat(chunks), boundary, on_file)\n"
+	"	else\n"
+	"		return iis.Finish\n"
+	"	end\n"
+	"	response:Write(string.format('%d %d %d', #fields.comment, #files, file_bytes))\n"
+	"	return iis.Finish\n"
+	"end)\n";
+
+static const char* form_bench_boundary = "----FormBenchBoundary7MA4YWxkTrZu0gW";
+
+static const char* form_bench_fields[][2] = {
+	{ "title", "Quarterly report" },
+	{ "author", "j.doe@example.com" },
+	{ "category", "finance" },
+	{ "tags", "q3,revenue,forecast" },
+	{ "visibility", "internal" },
+};
+
+/**
+ * An upload form as a browser sends it: a few short fields, a longer text
+ * area and one file.
+ */
+static std::string
+form_bench_body()
+{
+	std::string body;
+
+	for (auto& field : form_bench_fields)
+	{
+		body += "--" + std::string(form_bench_boundary) + "\r\n";
+		body += "Content-Disposition: form-data; name=\"" + std::string(field[0]) + "\"\r\n\r\n";
+		body += std::string(field[1]) + "\r\n";
+	}
+
+	body += "--" + std::string(form_bench_boundary) + "\r\n";
+	body += "Content-Disposition: form-data; name=\"comment\"\r\n\r\n";
+
+	for (int i = 0; i < 40; i++)
+		body += "Figures are preliminary until the audit closes. ";
+
+	body += "\r\n";
+
+	body += "--" + std::string(form_bench_boundary) + "\r\n";
+	body += "Content-Disposition: form-data; name=\"attachment\"; filename=\"report.pdf\"\r\n";
+	body += "Content-Type: application/pdf\r\n\r\n";
+
+	UINT32 seed = 1;
+
+	for (int i = 0; i < FORM_BENCH_FILE_SIZE; i++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		body += (char)(seed >> 24);
+	}
+
+	body += "\r\n--" + std::string(form_bench_boundary) + "--\r\n";
+
+	return body;
+}
+
+/**
+ * Average time the handler takes to read the form in the given mode, the
+ * response of the last request goes to result.
+ */
+static double
+form_bench_requests(ModuleTestEngine* engine, const char* mode, const std::string& body, std::string* result)
+{
+	std::string content_type = "multipart/form-data; boundary=" + std::string(form_bench_boundary);
+	double seconds = 0;
+
+	for (DWORD i = 0; i < FORM_BENCH_REQUESTS; i++)
+	{
+		StandInContext context;
+		context.request.SetCookedUrl(L"localhost", L"/upload", L"");
+		context.request.SetHeader(HttpHeaderContentType, content_type.c_str(), (USHORT)content_type.size(), TRUE);
+		context.request.SetHeader("X-Bench", mode, (USHORT)strlen(mode), TRUE);
+		context.request.SetBody(body.data(), body.size());
+
+		double start = module_test_seconds();
+		module_test_run_request(engine, &context);
+		seconds += module_test_seconds() - start;
+
+		if (i == FORM_BENCH_REQUESTS - 1)
+			*result = context.response.GetBody();
+	}
+
+	return seconds / FORM_BENCH_REQUESTS;
+}
+
+/**
+ * Form fed from the body reader against a Lua multipart parser over the
+ * concatenated body. A request that reads nothing is taken off both.
+ */
+void
+form_bench_multipart()
+{
+	ModuleTestEngine* engine = module_test_engine_create(form_bench_script);
+
+	if (!engine)
+		return;
+
+	std::string body = form_bench_body();
+	std::string native_result;
+	std::string lua_result;
+
+	double none = form_bench_requests(engine, "none", body, &native_result);
+	double native = form_bench_requests(engine, "form", body, &native_result) - none;
+	double lua = form_bench_requests(engine, "form-lua", body, &lua_result) - none;
+
+	printf(
+		"%zu bytes: Form %7.2f us, Lua parser %7.2f us per request%s\n",
+		body.size(),
+		native * 1e6,
+		lua * 1e6,
+		native_result == lua_result ? "" : ", results differ"
+	);
+
+	module_test_engine_destroy(engine);
+}
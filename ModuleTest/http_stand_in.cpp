@@ -0,0 +1,940 @@
+#include "http_stand_in.h"
+
+static const char* stand_in_request_header_names[HttpHeaderRequestMaximum] = {
+	"Cache-Control", "Connection", "Date", "Keep-Alive", "Pragma", "Trailer", "Transfer-Encoding",
+	"Upgrade", "Via", "Warning", "Allow", "Content-Length", "Content-Type", "Content-Encoding",
+	"Content-Language", "Content-Location", "Content-MD5", "Content-Range", "Expires", "Last-Modified",
+	"Accept", "Accept-Charset", "Accept-Encoding", "Accept-Language", "Authorization", "Cookie",
+	"Expect", "From", "Host", "If-Match", "If-Modified-Since", "If-None-Match", "If-Range",
+	"If-Unmodified-Since", "Max-Forwards", "Proxy-Authorization", "Referer", "Range", "TE",
+	"Translate", "User-Agent"
+};
+
+static const char* stand_in_response_header_names[HttpHeaderResponseMaximum] = {
+	"Cache-Control", "Connection", "Date", "Keep-Alive", "Pragma", "Trailer", "Transfer-Encoding",
+	"Upgrade", "Via", "Warning", "Allow", "Content-Length", "Content-Type", "Content-Encoding",
+	"Content-Language", "Content-Location", "Content-MD5", "Content-Range", "Expires", "Last-Modified",
+	"Accept-Ranges", "Age", "ETag", "Location", "Proxy-Authenticate", "Retry-After", "Server",
+	"Set-Cookie", "Vary", "WWW-Authenticate"
+};
+
+static int
+stand_in_find_header(const char** names, int count, PCSTR name)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (!_stricmp(names[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
+static int
+stand_in_find_unknown(const std::vector<std::string>& names, PCSTR name)
+{
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (!_stricmp(names[i].c_str(), name))
+			return (int)i;
+	}
+
+	return -1;
+}
+
+// IIS joins a header that is added rather than replaced onto the existing value.
+static void
+stand_in_store_header(std::string* header, PCSTR value, USHORT length, BOOL replace)
+{
+	if (!length)
+		length = (USHORT)strlen(value);
+
+	if (!replace && !header->empty())
+		header->append(", ");
+	else
+		header->clear();
+
+	header->append(value, length);
+}
+
+static void
+stand_in_sync_headers(
+	HTTP_KNOWN_HEADER* known_headers,
+	const std::string* known_values,
+	int known_count,
+	const std::vector<std::string>& unknown_names,
+	const std::vector<std::string>& unknown_values,
+	std::vector<HTTP_UNKNOWN_HEADER>* unknown_headers
+)
+{
+	for (int i = 0; i < known_count; i++)
+	{
+		known_headers[i].pRawValue = known_values[i].empty() ? nullptr : known_values[i].c_str();
+		known_headers[i].RawValueLength = (USHORT)known_values[i].size();
+	}
+
+	unknown_headers->resize(unknown_names.size());
+
+	for (size_t i = 0; i < unknown_names.size(); i++)
+	{
+		HTTP_UNKNOWN_HEADER* header = &(*unknown_headers)[i];
+		header->pName = unknown_names[i].c_str();
+		header->NameLength = (USHORT)unknown_names[i].size();
+		header->pRawValue = unknown_values[i].c_str();
+		header->RawValueLength = (USHORT)unknown_values[i].size();
+	}
+}
+
+StandInRequest::StandInRequest() :
+	raw(),
+	host_length(0),
+	abs_path_length(0),
+	local_address(),
+	remote_address(),
+	body_offset(0),
+	inserted_chunk(),
+	read_delay(0),
+	completion(nullptr),
+	completion_context(nullptr),
+	read_timer(nullptr),
+	read_buffer(nullptr),
+	read_size(0)
+{
+	raw.Verb = HttpVerbGET;
+
+	local_address.sin_family = AF_INET;
+	local_address.sin_port = htons(80);
+	local_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	remote_address.sin_family = AF_INET;
+	remote_address.sin_port = htons(50000);
+	remote_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	SetCookedUrl(L"localhost", L"/", L"");
+	SyncHeaders();
+}
+
+StandInRequest::~StandInRequest()
+{
+	if (read_timer)
+	{
+		SetThreadpoolTimer(read_timer, nullptr, 0, 0);
+		WaitForThreadpoolTimerCallbacks(read_timer, TRUE);
+		CloseThreadpoolTimer(read_timer);
+	}
+}
+
+/**
+ * The query keeps its leading '?', as it does in the cooked url IIS hands out.
+ */
+void
+StandInRequest::SetCookedUrl(const wchar_t* host, const wchar_t* abs_path, const wchar_t* query)
+{
+	full_url = L"http://";
+	full_url += host;
+	full_url += abs_path;
+	full_url += query;
+
+	host_length = wcslen(host);
+	abs_path_length = wcslen(abs_path);
+
+	size_t host_offset = wcslen(L"http://");
+	size_t query_length = wcslen(query);
+	HTTP_COOKED_URL* cooked_url = &raw.CookedUrl;
+
+	cooked_url->pFullUrl = full_url.c_str();
+	cooked_url->FullUrlLength = (USHORT)(full_url.size() * sizeof(wchar_t));
+	cooked_url->pHost = cooked_url->pFullUrl + host_offset;
+	cooked_url->HostLength = (USHORT)(host_length * sizeof(wchar_t));
+	cooked_url->pAbsPath = cooked_url->pHost + host_length;
+	cooked_url->AbsPathLength = (USHORT)(abs_path_length * sizeof(wchar_t));
+	cooked_url->pQueryString = query_length ? cooked_url->pAbsPath + abs_path_length : nullptr;
+	cooked_url->QueryStringLength = (USHORT)(query_length * sizeof(wchar_t));
+}
+
+void
+StandInRequest::SetBody(const char* data, size_t length)
+{
+	body.assign(data, length);
+	body_offset = 0;
+}
+
+/**
+ * Asynchronous reads then always pend and complete after the delay on a
+ * thread pool thread, the way a slow client's body arrives.
+ */
+void
+StandInRequest::SetReadDelay(DWORD milliseconds, StandInCompletion completion, void* completion_context)
+{
+	if (!read_timer)
+		read_timer = CreateThreadpoolTimer(CompleteRead, this, nullptr);
+
+	assert(read_timer != nullptr);
+
+	this->read_delay = milliseconds;
+	this->completion = completion;
+	this->completion_context = completion_context;
+}
+
+void
+StandInRequest::WaitForReads()
+{
+	if (read_timer)
+		WaitForThreadpoolTimerCallbacks(read_timer, FALSE);
+}
+
+VOID CALLBACK
+StandInRequest::CompleteRead(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer)
+{
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(timer);
+
+	StandInRequest* request = (StandInRequest*)context;
+
+	VOID* buffer = request->read_buffer;
+	request->read_buffer = nullptr;
+
+	DWORD bytes_read = request->CopyBody(buffer, request->read_size);
+
+	// The completion may well start the next read from here.
+	request->completion(
+		request->completion_context,
+		bytes_read,
+		bytes_read ? S_OK : HRESULT_FROM_WIN32(ERROR_HANDLE_EOF)
+	);
+}
+
+DWORD
+StandInRequest::CopyBody(VOID* buffer, DWORD size)
+{
+	size_t remaining = body.size() - body_offset;
+	DWORD bytes = (DWORD)min((size_t)size, remaining);
+
+	memcpy(buffer, body.data() + body_offset, bytes);
+	body_offset += bytes;
+
+	return bytes;
+}
+
+void
+StandInRequest::SyncHeaders()
+{
+	stand_in_sync_headers(
+		raw.Headers.KnownHeaders,
+		known_headers,
+		HttpHeaderRequestMaximum,
+		unknown_names,
+		unknown_values,
+		&unknown_headers
+	);
+
+	raw.Headers.UnknownHeaderCount = (USHORT)unknown_headers.size();
+	raw.Headers.pUnknownHeaders = unknown_headers.empty() ? nullptr : unknown_headers.data();
+}
+
+HTTP_REQUEST*
+StandInRequest::GetRawHttpRequest()
+{
+	return &raw;
+}
+
+const HTTP_REQUEST*
+StandInRequest::GetRawHttpRequest() const
+{
+	return &raw;
+}
+
+PCSTR
+StandInRequest::GetHeader(PCSTR pszHeaderName, USHORT* pcchHeaderValue) const
+{
+	int id = stand_in_find_header(stand_in_request_header_names, HttpHeaderRequestMaximum, pszHeaderName);
+
+	if (id >= 0)
+		return GetHeader((HTTP_HEADER_ID)id, pcchHeaderValue);
+
+	int index = stand_in_find_unknown(unknown_names, pszHeaderName);
+
+	if (pcchHeaderValue)
+		*pcchHeaderValue = index >= 0 ? (USHORT)unknown_values[index].size() : 0;
+
+	return index >= 0 ? unknown_values[index].c_str() : nullptr;
+}
+
+PCSTR
+StandInRequest::GetHeader(HTTP_HEADER_ID ulHeaderIndex, USHORT* pcchHeaderValue) const
+{
+	if (pcchHeaderValue)
+		*pcchHeaderValue = raw.Headers.KnownHeaders[ulHeaderIndex].RawValueLength;
+
+	return raw.Headers.KnownHeaders[ulHeaderIndex].pRawValue;
+}
+
+HRESULT
+StandInRequest::SetHeader(PCSTR pszHeaderName, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace)
+{
+	int id = stand_in_find_header(stand_in_request_header_names, HttpHeaderRequestMaximum, pszHeaderName);
+
+	if (id >= 0)
+		return SetHeader((HTTP_HEADER_ID)id, pszHeaderValue, cchHeaderValue, fReplace);
+
+	int index = stand_in_find_unknown(unknown_names, pszHeaderName);
+
+	if (index < 0)
+	{
+		unknown_names.push_back(pszHeaderName);
+		unknown_values.push_back(std::string());
+		index = (int)unknown_names.size() - 1;
+	}
+
+	stand_in_store_header(&unknown_values[index], pszHeaderValue, cchHeaderValue, fReplace);
+	SyncHeaders();
+
+	return S_OK;
+}
+
+HRESULT
+StandInRequest::SetHeader(HTTP_HEADER_ID ulHeaderIndex, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace)
+{
+	if (ulHeaderIndex < 0 || ulHeaderIndex >= HttpHeaderRequestMaximum)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+	stand_in_store_header(&known_headers[ulHeaderIndex], pszHeaderValue, cchHeaderValue, fReplace);
+	SyncHeaders();
+
+	return S_OK;
+}
+
+HRESULT
+StandInRequest::DeleteHeader(PCSTR pszHeaderName)
+{
+	int id = stand_in_find_header(stand_in_request_header_names, HttpHeaderRequestMaximum, pszHeaderName);
+
+	if (id >= 0)
+		return DeleteHeader((HTTP_HEADER_ID)id);
+
+	int index = stand_in_find_unknown(unknown_names, pszHeaderName);
+
+	if (index >= 0)
+	{
+		unknown_names.erase(unknown_names.begin() + index);
+		unknown_values.erase(unknown_values.begin() + index);
+		SyncHeaders();
+	}
+
+	return S_OK;
+}
+
+HRESULT
+StandInRequest::DeleteHeader(HTTP_HEADER_ID ulHeaderIndex)
+{
+	if (ulHeaderIndex < 0 || ulHeaderIndex >= HttpHeaderRequestMaximum)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+	known_headers[ulHeaderIndex].clear();
+	SyncHeaders();
+
+	return S_OK;
+}
+
+PCSTR
+StandInRequest::GetHttpMethod() const
+{
+	return "GET";
+}
+
+/**
+ * Rewrites the path, and the query when the url carries one or the old one is
+ * reset, leaving the host alone.
+ */
+HRESULT
+StandInRequest::SetUrl(PCWSTR pszUrl, DWORD cchUrl, BOOL fResetQueryString)
+{
+	std::wstring url(pszUrl, cchUrl);
+	std::wstring host(raw.CookedUrl.pHost, host_length);
+	std::wstring query = raw.CookedUrl.pQueryString ?
+		std::wstring(raw.CookedUrl.pQueryString, raw.CookedUrl.QueryStringLength / sizeof(wchar_t)) :
+		std::wstring();
+
+	size_t query_start = url.find(L'?');
+
+	if (query_start != std::wstring::npos)
+		query = url.substr(query_start);
+	else if (fResetQueryString)
+		query.clear();
+
+	SetCookedUrl(host.c_str(), url.substr(0, query_start).c_str(), query.c_str());
+
+	return S_OK;
+}
+
+HRESULT
+StandInRequest::SetUrl(PCSTR pszUrl, DWORD cchUrl, BOOL fResetQueryString)
+{
+	int length = MultiByteToWideChar(CP_UTF8, 0, pszUrl, (int)cchUrl, nullptr, 0);
+
+	if (cchUrl && !length)
+		return HRESULT_FROM_WIN32(GetLastError());
+
+	std::wstring url(length, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, pszUrl, (int)cchUrl, &url[0], length);
+
+	return SetUrl(url.c_str(), (DWORD)url.size(), fResetQueryString);
+}
+
+PSOCKADDR
+StandInRequest::GetLocalAddress() const
+{
+	return (PSOCKADDR)&local_address;
+}
+
+PSOCKADDR
+StandInRequest::GetRemoteAddress() const
+{
+	return (PSOCKADDR)&remote_address;
+}
+
+HRESULT
+StandInRequest::ReadEntityBody(
+	VOID* pvBuffer,
+	DWORD cbBuffer,
+	BOOL fAsync,
+	DWORD* pcbBytesReceived,
+	BOOL* pfCompletionPending
+)
+{
+	*pcbBytesReceived = 0;
+
+	if (pfCompletionPending)
+		*pfCompletionPending = FALSE;
+
+	if (fAsync && read_timer && pfCompletionPending)
+	{
+		// IIS allows one outstanding read per request.
+		if (read_buffer)
+			return HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+
+		read_buffer = pvBuffer;
+		read_size = cbBuffer;
+
+		ULARGE_INTEGER due_time;
+		due_time.QuadPart = (ULONGLONG)-((LONGLONG)read_delay * 10000);
+
+		FILETIME file_due_time;
+		file_due_time.dwLowDateTime = due_time.LowPart;
+		file_due_time.dwHighDateTime = due_time.HighPart;
+
+		*pfCompletionPending = TRUE;
+		SetThreadpoolTimer(read_timer, &file_due_time, 0, 0);
+
+		return S_OK;
+	}
+
+	*pcbBytesReceived = CopyBody(pvBuffer, cbBuffer);
+
+	return *pcbBytesReceived ? S_OK : HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+}
+
+/**
+ * Hands the body that was already read back as the preloaded entity, the
+ * buffer stays owned by the caller.
+ */
+HRESULT
+StandInRequest::InsertEntityBody(VOID* pvBuffer, DWORD cbBuffer)
+{
+	inserted_chunk.DataChunkType = HttpDataChunkFromMemory;
+	inserted_chunk.FromMemory.pBuffer = pvBuffer;
+	inserted_chunk.FromMemory.BufferLength = cbBuffer;
+
+	raw.EntityChunkCount = 1;
+	raw.pEntityChunks = &inserted_chunk;
+
+	return S_OK;
+}
+
+DWORD
+StandInRequest::GetRemainingEntityBytes()
+{
+	return (DWORD)(body.size() - body_offset);
+}
+
+StandInResponse::StandInResponse() :
+	raw(),
+	write_count(0),
+	kernel_cache_enabled(true)
+{
+	raw.StatusCode = 200;
+	reason = "OK";
+	raw.pReason = reason.c_str();
+	raw.ReasonLength = (USHORT)reason.size();
+
+	SyncHeaders();
+}
+
+std::string
+StandInResponse::GetBody() const
+{
+	std::string body;
+
+	for (const HTTP_DATA_CHUNK& chunk : chunks)
+	{
+		if (chunk.DataChunkType == HttpDataChunkFromMemory)
+		{
+			body.append((const char*)chunk.FromMemory.pBuffer, chunk.FromMemory.BufferLength);
+		}
+		else if (chunk.DataChunkType == HttpDataChunkFromFileHandle)
+		{
+			const HTTP_BYTE_RANGE* range = &chunk.FromFileHandle.ByteRange;
+			ULONGLONG offset = range->StartingOffset.QuadPart;
+			ULONGLONG remaining = range->Length.QuadPart;
+
+			if (remaining == HTTP_BYTE_RANGE_TO_EOF)
+			{
+				LARGE_INTEGER size;
+				GetFileSizeEx(chunk.FromFileHandle.FileHandle, &size);
+				remaining = size.QuadPart - offset;
+			}
+
+			// The handle may have been opened for overlapped io, so read as if it was.
+			OVERLAPPED overlapped = {};
+			overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+			char buffer[65536];
+
+			while (remaining)
+			{
+				DWORD size = (DWORD)min(remaining, (ULONGLONG)sizeof(buffer));
+				DWORD bytes_read = 0;
+
+				overlapped.Offset = (DWORD)offset;
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+				if (!ReadFile(chunk.FromFileHandle.FileHandle, buffer, size, nullptr, &overlapped)
+					&& GetLastError() != ERROR_IO_PENDING)
+					break;
+
+				if (!GetOverlappedResult(chunk.FromFileHandle.FileHandle, &overlapped, &bytes_read, TRUE) || !bytes_read)
+					break;
+
+				body.append(buffer, bytes_read);
+				offset += bytes_read;
+				remaining -= bytes_read;
+			}
+
+			CloseHandle(overlapped.hEvent);
+		}
+	}
+
+	return body;
+}
+
+bool
+StandInResponse::BodyUnchanged() const
+{
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		const HTTP_DATA_CHUNK* chunk = &chunks[i];
+
+		if (chunk->DataChunkType != HttpDataChunkFromMemory)
+			continue;
+
+		if (snapshots[i].size() != chunk->FromMemory.BufferLength
+			|| memcmp(snapshots[i].data(), chunk->FromMemory.pBuffer, snapshots[i].size()))
+			return false;
+	}
+
+	return true;
+}
+
+DWORD
+StandInResponse::GetWriteCount() const
+{
+	return write_count;
+}
+
+void
+StandInResponse::SyncHeaders()
+{
+	stand_in_sync_headers(
+		raw.Headers.KnownHeaders,
+		known_headers,
+		HttpHeaderResponseMaximum,
+		unknown_names,
+		unknown_values,
+		&unknown_headers
+	);
+
+	raw.Headers.UnknownHeaderCount = (USHORT)unknown_headers.size();
+	raw.Headers.pUnknownHeaders = unknown_headers.empty() ? nullptr : unknown_headers.data();
+}
+
+HTTP_RESPONSE*
+StandInResponse::GetRawHttpResponse()
+{
+	return &raw;
+}
+
+const HTTP_RESPONSE*
+StandInResponse::GetRawHttpResponse() const
+{
+	return &raw;
+}
+
+HRESULT
+StandInResponse::SetStatus(
+	USHORT statusCode,
+	PCSTR pszReason,
+	USHORT uSubStatus,
+	HRESULT hrErrorToReport,
+	IAppHostConfigException* pException,
+	BOOL fTrySkipCustomErrors
+)
+{
+	UNREFERENCED_PARAMETER(uSubStatus);
+	UNREFERENCED_PARAMETER(hrErrorToReport);
+	UNREFERENCED_PARAMETER(pException);
+	UNREFERENCED_PARAMETER(fTrySkipCustomErrors);
+
+	reason = pszReason ? pszReason : "";
+
+	raw.StatusCode = statusCode;
+	raw.pReason = reason.c_str();
+	raw.ReasonLength = (USHORT)reason.size();
+
+	return S_OK;
+}
+
+HRESULT
+StandInResponse::Redirect(PCSTR pszUrl, BOOL fResetStatusCode, BOOL fIncludeParameters)
+{
+	UNREFERENCED_PARAMETER(fIncludeParameters);
+
+	if (fResetStatusCode)
+		SetStatus(302, "Redirect");
+
+	return SetHeader(HttpHeaderLocation, pszUrl, (USHORT)strlen(pszUrl), TRUE);
+}
+
+HRESULT
+StandInResponse::SetErrorDescription(PCWSTR pszDescription, DWORD cchDescription, BOOL fHtmlEncode)
+{
+	UNREFERENCED_PARAMETER(pszDescription);
+	UNREFERENCED_PARAMETER(cchDescription);
+	UNREFERENCED_PARAMETER(fHtmlEncode);
+
+	return S_OK;
+}
+
+PCSTR
+StandInResponse::GetHeader(PCSTR pszHeaderName, USHORT* pcchHeaderValue) const
+{
+	int id = stand_in_find_header(stand_in_response_header_names, HttpHeaderResponseMaximum, pszHeaderName);
+
+	if (id >= 0)
+		return GetHeader((HTTP_HEADER_ID)id, pcchHeaderValue);
+
+	int index = stand_in_find_unknown(unknown_names, pszHeaderName);
+
+	if (pcchHeaderValue)
+		*pcchHeaderValue = index >= 0 ? (USHORT)unknown_values[index].size() : 0;
+
+	return index >= 0 ? unknown_values[index].c_str() : nullptr;
+}
+
+PCSTR
+StandInResponse::GetHeader(HTTP_HEADER_ID ulHeaderIndex, USHORT* pcchHeaderValue) const
+{
+	if (pcchHeaderValue)
+		*pcchHeaderValue = raw.Headers.KnownHeaders[ulHeaderIndex].RawValueLength;
+
+	return raw.Headers.KnownHeaders[ulHeaderIndex].pRawValue;
+}
+
+HRESULT
+StandInResponse::SetHeader(PCSTR pszHeaderName, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace)
+{
+	int id = stand_in_find_header(stand_in_response_header_names, HttpHeaderResponseMaximum, pszHeaderName);
+
+	if (id >= 0)
+		return SetHeader((HTTP_HEADER_ID)id, pszHeaderValue, cchHeaderValue, fReplace);
+
+	int index = stand_in_find_unknown(unknown_names, pszHeaderName);
+
+	if (index < 0)
+	{
+		unknown_names.push_back(pszHeaderName);
+		unknown_values.push_back(std::string());
+		index = (int)unknown_names.size() - 1;
+	}
+
+	stand_in_store_header(&unknown_values[index], pszHeaderValue, cchHeaderValue, fReplace);
+	SyncHeaders();
+
+	return S_OK;
+}
+
+HRESULT
+StandInResponse::SetHeader(HTTP_HEADER_ID ulHeaderIndex, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace)
+{
+	if (ulHeaderIndex < 0 || ulHeaderIndex >= HttpHeaderResponseMaximum)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+	stand_in_store_header(&known_headers[ulHeaderIndex], pszHeaderValue, cchHeaderValue, fReplace);
+	SyncHeaders();
+
+	return S_OK;
+}
+
+HRESULT
+StandInResponse::DeleteHeader(PCSTR pszHeaderName)
+{
+	int id = stand_in_find_header(stand_in_response_header_names, HttpHeaderResponseMaximum, pszHeaderName);
+
+	if (id >= 0)
+		return DeleteHeader((HTTP_HEADER_ID)id);
+
+	int index = stand_in_find_unknown(unknown_names, pszHeaderName);
+
+	if (index >= 0)
+	{
+		unknown_names.erase(unknown_names.begin() + index);
+		unknown_values.erase(unknown_values.begin() + index);
+		SyncHeaders();
+	}
+
+	return S_OK;
+}
+
+HRESULT
+StandInResponse::DeleteHeader(HTTP_HEADER_ID ulHeaderIndex)
+{
+	if (ulHeaderIndex < 0 || ulHeaderIndex >= HttpHeaderResponseMaximum)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+	known_headers[ulHeaderIndex].clear();
+	SyncHeaders();
+
+	return S_OK;
+}
+
+VOID
+StandInResponse::Clear()
+{
+	chunks.clear();
+	snapshots.clear();
+
+	raw.EntityChunkCount = 0;
+	raw.pEntityChunks = nullptr;
+}
+
+VOID
+StandInResponse::ClearHeaders()
+{
+	for (std::string& header : known_headers)
+		header.clear();
+
+	unknown_names.clear();
+	unknown_values.clear();
+	SyncHeaders();
+}
+
+VOID
+StandInResponse::SetNeedDisconnect()
+{
+}
+
+VOID
+StandInResponse::ResetConnection()
+{
+}
+
+VOID
+StandInResponse::DisableKernelCache(ULONG reason)
+{
+	UNREFERENCED_PARAMETER(reason);
+
+	kernel_cache_enabled = false;
+}
+
+BOOL
+StandInResponse::GetKernelCacheEnabled() const
+{
+	return kernel_cache_enabled;
+}
+
+VOID
+StandInResponse::DisableBuffering()
+{
+}
+
+VOID
+StandInResponse::CloseConnection()
+{
+}
+
+/**
+ * Keeps the chunks by reference, as buffered IIS does until the request
+ * completes, along with a copy of what each memory chunk held at the time.
+ */
+HRESULT
+StandInResponse::WriteEntityChunks(
+	HTTP_DATA_CHUNK* pDataChunks,
+	USHORT nChunks,
+	BOOL fAsync,
+	BOOL fMoreData,
+	DWORD* pcbSent,
+	BOOL* pfCompletionExpected
+)
+{
+	UNREFERENCED_PARAMETER(fAsync);
+	UNREFERENCED_PARAMETER(fMoreData);
+
+	DWORD sent = 0;
+
+	for (USHORT i = 0; i < nChunks; i++)
+	{
+		const HTTP_DATA_CHUNK* chunk = &pDataChunks[i];
+
+		chunks.push_back(*chunk);
+
+		if (chunk->DataChunkType == HttpDataChunkFromMemory)
+		{
+			snapshots.push_back(std::string((const char*)chunk->FromMemory.pBuffer, chunk->FromMemory.BufferLength));
+			sent += chunk->FromMemory.BufferLength;
+		}
+		else
+		{
+			snapshots.push_back(std::string());
+		}
+	}
+
+	raw.EntityChunkCount = (USHORT)chunks.size();
+	raw.pEntityChunks = chunks.empty() ? nullptr : chunks.data();
+
+	write_count++;
+
+	if (pcbSent)
+		*pcbSent = sent;
+
+	if (pfCompletionExpected)
+		*pfCompletionExpected = FALSE;
+
+	return S_OK;
+}
+
+StandInContext::StandInContext()
+{
+}
+
+StandInContext::~StandInContext()
+{
+	for (auto& block : request_memory)
+	{
+		memset(block.first, 0xDD, block.second);
+		free(block.first);
+	}
+}
+
+void
+StandInContext::SetServerVariable(const char* name, const char* value)
+{
+	int index = stand_in_find_unknown(variable_names, name);
+
+	if (index >= 0)
+	{
+		variable_values[index] = value;
+	}
+	else
+	{
+		variable_names.push_back(name);
+		variable_values.push_back(value);
+	}
+}
+
+IHttpRequest*
+StandInContext::GetRequest()
+{
+	return &request;
+}
+
+IHttpResponse*
+StandInContext::GetResponse()
+{
+	return &response;
+}
+
+VOID*
+StandInContext::AllocateRequestMemory(DWORD cbAllocation)
+{
+	void* block = malloc(cbAllocation ? cbAllocation : 1);
+
+	if (block)
+		request_memory.push_back(std::make_pair(block, cbAllocation));
+
+	return block;
+}
+
+/**
+ * Values are copied into request memory, which is where IIS hands them out from.
+ */
+HRESULT
+StandInContext::GetServerVariable(PCSTR pszVariableName, PCSTR* ppszValue, DWORD* pcchValueLength)
+{
+	int index = stand_in_find_unknown(variable_names, pszVariableName);
+
+	if (index < 0)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_INDEX);
+
+	const std::string& value = variable_values[index];
+	char* copy = (char*)AllocateRequestMemory((DWORD)value.size() + 1);
+
+	if (!copy)
+		return E_OUTOFMEMORY;
+
+	memcpy(copy, value.c_str(), value.size() + 1);
+
+	*ppszValue = copy;
+
+	if (pcchValueLength)
+		*pcchValueLength = (DWORD)value.size();
+
+	return S_OK;
+}
+
+HRESULT
+StandInContext::GetServerVariable(PCSTR pszVariableName, PCWSTR* ppszValue, DWORD* pcchValueLength)
+{
+	PCSTR value = nullptr;
+	DWORD length = 0;
+
+	HRESULT hr = GetServerVariable(pszVariableName, &value, &length);
+
+	if (FAILED(hr))
+		return hr;
+
+	int wide_length = MultiByteToWideChar(CP_UTF8, 0, value, (int)length, nullptr, 0);
+	wchar_t* copy = (wchar_t*)AllocateRequestMemory((DWORD)(wide_length + 1) * sizeof(wchar_t));
+
+	if (!copy)
+		return E_OUTOFMEMORY;
+
+	MultiByteToWideChar(CP_UTF8, 0, value, (int)length, copy, wide_length);
+	copy[wide_length] = L'\0';
+
+	*ppszValue = copy;
+
+	if (pcchValueLength)
+		*pcchValueLength = (DWORD)wide_length;
+
+	return S_OK;
+}
+
+StandInServer::StandInServer(const wchar_t* app_pool_name) :
+	app_pool_name(app_pool_name)
+{
+}
+
+PCWSTR
+StandInServer::GetAppPoolName() const
+{
+	return app_pool_name.c_str();
+}
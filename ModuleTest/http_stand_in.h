@@ -0,0 +1,197 @@
+#pragma once
+#include "shared.h"
+
+#include <string>
+#include <vector>
+
+#ifndef _HTTP_STAND_IN
+#define _HTTP_STAND_IN
+
+/**
+ * In-process stand-ins for the IIS request objects. Request memory lives
+ * until the context is destroyed, written chunks are kept the way IIS keeps
+ * them until the request completes, and asynchronous reads complete on a
+ * thread pool timer.
+ */
+
+// Delivered on the timer thread, where IIS would call OnAsyncCompletion.
+typedef void (*StandInCompletion)(void* context, DWORD bytes_read, HRESULT status);
+
+class StandInRequest : public IHttpRequest
+{
+public:
+	StandInRequest();
+	~StandInRequest();
+
+	void SetCookedUrl(const wchar_t* host, const wchar_t* abs_path, const wchar_t* query);
+	void SetBody(const char* data, size_t length);
+	void SetReadDelay(DWORD milliseconds, StandInCompletion completion, void* completion_context);
+	void WaitForReads();
+
+	HTTP_REQUEST* GetRawHttpRequest();
+	const HTTP_REQUEST* GetRawHttpRequest() const;
+
+	PCSTR GetHeader(PCSTR pszHeaderName, USHORT* pcchHeaderValue = NULL) const;
+	PCSTR GetHeader(HTTP_HEADER_ID ulHeaderIndex, USHORT* pcchHeaderValue = NULL) const;
+	HRESULT SetHeader(PCSTR pszHeaderName, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace);
+	HRESULT SetHeader(HTTP_HEADER_ID ulHeaderIndex, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace);
+	HRESULT DeleteHeader(PCSTR pszHeaderName);
+	HRESULT DeleteHeader(HTTP_HEADER_ID ulHeaderIndex);
+
+	PCSTR GetHttpMethod() const;
+	HRESULT SetUrl(PCWSTR pszUrl, DWORD cchUrl, BOOL fResetQueryString);
+	HRESULT SetUrl(PCSTR pszUrl, DWORD cchUrl, BOOL fResetQueryString);
+
+	PSOCKADDR GetLocalAddress() const;
+	PSOCKADDR GetRemoteAddress() const;
+
+	HRESULT ReadEntityBody(
+		VOID* pvBuffer,
+		DWORD cbBuffer,
+		BOOL fAsync,
+		DWORD* pcbBytesReceived,
+		BOOL* pfCompletionPending = NULL
+	);
+	HRESULT InsertEntityBody(VOID* pvBuffer, DWORD cbBuffer);
+	DWORD GetRemainingEntityBytes();
+
+private:
+	static VOID CALLBACK CompleteRead(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+
+	DWORD CopyBody(VOID* buffer, DWORD size);
+	void SyncHeaders();
+
+	HTTP_REQUEST raw;
+	std::wstring full_url;
+	size_t host_length;
+	size_t abs_path_length;
+
+	std::string known_headers[HttpHeaderRequestMaximum];
+	std::vector<std::string> unknown_names;
+	std::vector<std::string> unknown_values;
+	std::vector<HTTP_UNKNOWN_HEADER> unknown_headers;
+
+	SOCKADDR_IN local_address;
+	SOCKADDR_IN remote_address;
+
+	std::string body;
+	size_t body_offset;
+	HTTP_DATA_CHUNK inserted_chunk;
+
+	DWORD read_delay;
+	StandInCompletion completion;
+	void* completion_context;
+	PTP_TIMER read_timer;
+	VOID* read_buffer;
+	DWORD read_size;
+};
+
+class StandInResponse : public IHttpResponse
+{
+public:
+	StandInResponse();
+
+	// The body as IIS would send it now, read through the recorded chunks.
+	std::string GetBody() const;
+
+	// Whether every memory chunk still holds what it held when it was written.
+	bool BodyUnchanged() const;
+
+	DWORD GetWriteCount() const;
+
+	HTTP_RESPONSE* GetRawHttpResponse();
+	const HTTP_RESPONSE* GetRawHttpResponse() const;
+
+	HRESULT SetStatus(
+		USHORT statusCode,
+		PCSTR pszReason,
+		USHORT uSubStatus = 0,
+		HRESULT hrErrorToReport = S_OK,
+		IAppHostConfigException* pException = NULL,
+		BOOL fTrySkipCustomErrors = FALSE
+	);
+	HRESULT Redirect(PCSTR pszUrl, BOOL fResetStatusCode = TRUE, BOOL fIncludeParameters = FALSE);
+	HRESULT SetErrorDescription(PCWSTR pszDescription, DWORD cchDescription, BOOL fHtmlEncode = TRUE);
+
+	PCSTR GetHeader(PCSTR pszHeaderName, USHORT* pcchHeaderValue = NULL) const;
+	PCSTR GetHeader(HTTP_HEADER_ID ulHeaderIndex, USHORT* pcchHeaderValue = NULL) const;
+	HRESULT SetHeader(PCSTR pszHeaderName, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace);
+	HRESULT SetHeader(HTTP_HEADER_ID ulHeaderIndex, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace);
+	HRESULT DeleteHeader(PCSTR pszHeaderName);
+	HRESULT DeleteHeader(HTTP_HEADER_ID ulHeaderIndex);
+
+	VOID Clear();
+	VOID ClearHeaders();
+	VOID SetNeedDisconnect();
+	VOID ResetConnection();
+	VOID DisableKernelCache(ULONG reason = 9);
+	BOOL GetKernelCacheEnabled() const;
+	VOID DisableBuffering();
+	VOID CloseConnection();
+
+	HRESULT WriteEntityChunks(
+		HTTP_DATA_CHUNK* pDataChunks,
+		USHORT nChunks,
+		BOOL fAsync,
+		BOOL fMoreData,
+		DWORD* pcbSent,
+		BOOL* pfCompletionExpected = NULL
+	);
+
+private:
+	void SyncHeaders();
+
+	HTTP_RESPONSE raw;
+	std::string reason;
+
+	std::string known_headers[HttpHeaderResponseMaximum];
+	std::vector<std::string> unknown_names;
+	std::vector<std::string> unknown_values;
+	std::vector<HTTP_UNKNOWN_HEADER> unknown_headers;
+
+	std::vector<HTTP_DATA_CHUNK> chunks;
+	std::vector<std::string> snapshots;
+	DWORD write_count;
+
+	bool kernel_cache_enabled;
+};
+
+class StandInContext : public IHttpContext
+{
+public:
+	StandInContext();
+	~StandInContext();
+
+	void SetServerVariable(const char* name, const char* value);
+
+	IHttpRequest* GetRequest();
+	IHttpResponse* GetResponse();
+
+	VOID* AllocateRequestMemory(DWORD cbAllocation);
+
+	HRESULT GetServerVariable(PCSTR pszVariableName, PCSTR* ppszValue, DWORD* pcchValueLength);
+	HRESULT GetServerVariable(PCSTR pszVariableName, PCWSTR* ppszValue, DWORD* pcchValueLength);
+
+	StandInRequest request;
+	StandInResponse response;
+
+private:
+	// Poisoned before it is freed, so a late reader sees garbage rather than old data.
+	std::vector<std::pair<void*, DWORD>> request_memory;
+
+	std::vector<std::string> variable_names;
+	std::vector<std::string> variable_values;
+};
+
+class StandInServer : public IHttpServer
+{
+public:
+	StandInServer(const wchar_t* app_pool_name);
+
+	PCWSTR GetAppPoolName() const;
+
+private:
+	std::wstring app_pool_name;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+
+/**
+ * Stand-in for the SDK's httpserv.h, ModuleTest puts this directory ahead of
+ * the SDK so the module sources compile unchanged against the classes in
+ * http_stand_in.h. Only the members the module calls are declared, with the
+ * signatures the SDK gives them.
+ */
+
+#include <http.h>
+
+#ifndef _HTTPSERV_STAND_IN
+#define _HTTPSERV_STAND_IN
+
+enum REQUEST_NOTIFICATION_STATUS
+{
+	RQ_NOTIFICATION_CONTINUE,
+	RQ_NOTIFICATION_PENDING,
+	RQ_NOTIFICATION_FINISH_REQUEST
+};
+
+class IAppHostConfigException;
+
+class IHttpServer
+{
+public:
+	virtual PCWSTR GetAppPoolName() const = 0;
+};
+
+class IHttpRequest
+{
+public:
+	virtual HTTP_REQUEST* GetRawHttpRequest() = 0;
+	virtual const HTTP_REQUEST* GetRawHttpRequest() const = 0;
+
+	virtual PCSTR GetHeader(PCSTR pszHeaderName, USHORT* pcchHeaderValue = NULL) const = 0;
+	virtual PCSTR GetHeader(HTTP_HEADER_ID ulHeaderIndex, USHORT* pcchHeaderValue = NULL) const = 0;
+	virtual HRESULT SetHeader(PCSTR pszHeaderName, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace) = 0;
+	virtual HRESULT SetHeader(HTTP_HEADER_ID ulHeaderIndex, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace) = 0;
+	virtual HRESULT DeleteHeader(PCSTR pszHeaderName) = 0;
+	virtual HRESULT DeleteHeader(HTTP_HEADER_ID ulHeaderIndex) = 0;
+
+	virtual PCSTR GetHttpMethod() const = 0;
+	virtual HRESULT SetUrl(PCWSTR pszUrl, DWORD cchUrl, BOOL fResetQueryString) = 0;
+	virtual HRESULT SetUrl(PCSTR pszUrl, DWORD cchUrl, BOOL fResetQueryString) = 0;
+
+	virtual PSOCKADDR GetLocalAddress() const = 0;
+	virtual PSOCKADDR GetRemoteAddress() const = 0;
+
+	virtual HRESULT ReadEntityBody(
+		VOID* pvBuffer,
+		DWORD cbBuffer,
+		BOOL fAsync,
+		DWORD* pcbBytesReceived,
+		BOOL* pfCompletionPending = NULL
+	) = 0;
+	virtual HRESULT InsertEntityBody(VOID* pvBuffer, DWORD cbBuffer) = 0;
+	virtual DWORD GetRemainingEntityBytes() = 0;
+};
+
+class IHttpResponse
+{
+public:
+	virtual HTTP_RESPONSE* GetRawHttpResponse() = 0;
+	virtual const HTTP_RESPONSE* GetRawHttpResponse() const = 0;
+
+	virtual HRESULT SetStatus(
+		USHORT statusCode,
+		PCSTR pszReason,
+		USHORT uSubStatus = 0,
+		HRESULT hrErrorToReport = S_OK,
+		IAppHostConfigException* pException = NULL,
+		BOOL fTrySkipCustomErrors = FALSE
+	) = 0;
+	virtual HRESULT Redirect(PCSTR pszUrl, BOOL fResetStatusCode = TRUE, BOOL fIncludeParameters = FALSE) = 0;
+	virtual HRESULT SetErrorDescription(PCWSTR pszDescription, DWORD cchDescription, BOOL fHtmlEncode = TRUE) = 0;
+
+	virtual PCSTR GetHeader(PCSTR pszHeaderName, USHORT* pcchHeaderValue = NULL) const = 0;
+	virtual PCSTR GetHeader(HTTP_HEADER_ID ulHeaderIndex, USHORT* pcchHeaderValue = NULL) const = 0;
+	virtual HRESULT SetHeader(PCSTR pszHeaderName, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace) = 0;
+	virtual HRESULT SetHeader(HTTP_HEADER_ID ulHeaderIndex, PCSTR pszHeaderValue, USHORT cchHeaderValue, BOOL fReplace) = 0;
+	virtual HRESULT DeleteHeader(PCSTR pszHeaderName) = 0;
+	virtual HRESULT DeleteHeader(HTTP_HEADER_ID ulHeaderIndex) = 0;
+
+	virtual VOID Clear() = 0;
+	virtual VOID ClearHeaders() = 0;
+	virtual VOID SetNeedDisconnect() = 0;
+	virtual VOID ResetConnection() = 0;
+	virtual VOID DisableKernelCache(ULONG reason = 9) = 0;
+	virtual BOOL GetKernelCacheEnabled() const = 0;
+	virtual VOID DisableBuffering() = 0;
+	virtual VOID CloseConnection() = 0;
+
+	virtual HRESULT WriteEntityChunks(
+		HTTP_DATA_CHUNK* pDataChunks,
+		USHORT nChunks,
+		BOOL fAsync,
+		BOOL fMoreData,
+		DWORD* pcbSent,
+		BOOL* pfCompletionExpected = NULL
+	) = 0;
+};
+
+class IHttpContext
+{
+public:
+	virtual IHttpRequest* GetRequest() = 0;
+	virtual IHttpResponse* GetResponse() = 0;
+
+	virtual VOID* AllocateRequestMemory(DWORD cbAllocation) = 0;
+
+	virtual HRESULT GetServerVariable(PCSTR pszVariableName, PCSTR* ppszValue, DWORD* pcchValueLength) = 0;
+	virtual HRESULT GetServerVariable(PCSTR pszVariableName, PCWSTR* ppszValue, DWORD* pcchValueLength) = 0;
+};
+
+#endif
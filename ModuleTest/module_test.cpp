@@ -0,0 +1,262 @@
+#include "module_test.h"
+
+static const ModuleTestCase module_test_cases[] = {
+	{ "engine suspended read", engine_test_suspended_read },
+	{ "response buffers survive collection", response_test_buffers_survive_collection },
+	{ "response compress after file", response_test_compress_after_file },
+	{ "response failed handler finishes stream", response_test_failed_handler_finishes_stream },
+};
+
+static const ModuleTestCase module_test_benches[] = {
+	{ "state", state_bench_acquire_release },
+	{ "lock", state_bench_request_lock },
+	{ "allocator", allocator_bench_trace_replay },
+	{ "url", request_bench_url_conversion },
+	{ "query", request_bench_query_parser },
+	{ "form", form_bench_multipart },
+	{ "cookie", request_bench_cookies },
+	{ "write", response_bench_write_batching },
+};
+
+static int module_test_failures = 0;
+
+bool
+module_test_check_at(bool condition, const char* expression, const char* file, int line)
+{
+	if (!condition)
+	{
+		printf("FAIL %s(%d): %s\n", file, line, expression);
+		module_test_failures++;
+	}
+
+	return condition;
+}
+
+static bool
+module_test_write_path(const char* file_path, const std::string& data)
+{
+	HANDLE file = CreateFileA(file_path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	DWORD written = 0;
+	BOOL success = WriteFile(file, data.data(), (DWORD)data.size(), &written, nullptr);
+
+	CloseHandle(file);
+
+	return success && written == data.size();
+}
+
+bool
+module_test_write_file(const ModuleTestEngine* engine, const char* name, const std::string& data)
+{
+	char file_path[MAX_PATH];
+	sprintf_s(file_path, "%s\\%s", engine->directory_path, name);
+
+	return module_test_write_path(file_path, data);
+}
+
+ModuleTestEngine*
+module_test_engine_create(const char* script)
+{
+	static volatile LONG sequence = 0;
+
+	ModuleTestEngine* engine = new ModuleTestEngine();
+
+	char temp_path[MAX_PATH];
+	GetTempPathA(MAX_PATH, temp_path);
+
+	sprintf_s(
+		engine->directory_path,
+		"%sModuleTest.%lu.%ld",
+		temp_path,
+		GetCurrentProcessId(),
+		InterlockedIncrement(&sequence)
+	);
+
+	lua_config_load(&engine->config, nullptr);
+
+	char script_path[MAX_PATH];
+	sprintf_s(script_path, "%s\\test.lua", engine->directory_path);
+
+	LuaScript* compiled = nullptr;
+
+	if (!CreateDirectoryA(engine->directory_path, nullptr) || !module_test_write_path(script_path, script))
+	{
+		printf("failed to write '%s'\n", script_path);
+		goto error;
+	}
+
+	engine->script_cache = lua_script_cache_create(engine->directory_path);
+
+	if (!engine->script_cache)
+		goto error;
+
+	compiled = lua_script_cache_compile(engine->script_cache, script_path);
+
+	if (!compiled)
+	{
+		printf("failed to compile '%s'\n", script_path);
+		goto error;
+	}
+
+	engine->lua_engine = lua_engine_create(engine->script_cache, &engine->stats, &engine->config, compiled, 1);
+	lua_script_release(compiled);
+
+	if (!engine->lua_engine)
+	{
+		printf("failed to create the engine for '%s'\n", script_path);
+		goto error;
+	}
+
+	return engine;
+
+error:
+	return module_test_engine_destroy(engine);
+}
+
+ModuleTestEngine*
+module_test_engine_destroy(ModuleTestEngine* engine)
+{
+	if (engine->lua_engine)
+		lua_engine_destroy(engine->lua_engine);
+
+	if (engine->script_cache)
+		lua_script_cache_destroy(engine->script_cache);
+
+	// Cached handles would keep the scratch files open.
+	file_cache_clear();
+
+	char pattern[MAX_PATH];
+	sprintf_s(pattern, "%s\\*", engine->directory_path);
+
+	WIN32_FIND_DATAA find_data;
+	HANDLE find = FindFirstFileA(pattern, &find_data);
+
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				continue;
+
+			char file_path[MAX_PATH];
+			sprintf_s(file_path, "%s\\%s", engine->directory_path, find_data.cFileName);
+			DeleteFileA(file_path);
+		}
+		while (FindNextFileA(find, &find_data));
+
+		FindClose(find);
+	}
+
+	RemoveDirectoryA(engine->directory_path);
+
+	delete engine;
+
+	return nullptr;
+}
+
+void
+module_test_request_init(LuaEngineRequest* request)
+{
+	*request = { 0 };
+	request->thread_ref = LUA_NOREF;
+	request->pin_ref = LUA_NOREF;
+}
+
+/**
+ * Serves a request the handler finishes without suspending, as OnBeginRequest
+ * and the module's destructor would.
+ */
+REQUEST_NOTIFICATION_STATUS
+module_test_run_request(ModuleTestEngine* engine, StandInContext* context)
+{
+	LuaEngineRequest request;
+	module_test_request_init(&request);
+
+	REQUEST_NOTIFICATION_STATUS status = lua_engine_begin_request(engine->lua_engine, context, &request);
+	lua_engine_end_request(&request);
+
+	return status;
+}
+
+double
+module_test_seconds()
+{
+	static LARGE_INTEGER frequency = {};
+	LARGE_INTEGER counter;
+
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+
+	return (double)counter.QuadPart / frequency.QuadPart;
+}
+
+static int
+module_test_run()
+{
+	int failed_cases = 0;
+	int cases = 0;
+
+	for (const ModuleTestCase& test_case : module_test_cases)
+	{
+		int failures = module_test_failures;
+
+		cases++;
+		test_case.run();
+
+		if (module_test_failures != failures)
+		{
+			printf("FAIL %s\n", test_case.name);
+			failed_cases++;
+		}
+	}
+
+	printf("%d of %d cases passed\n", cases - failed_cases, cases);
+
+	return failed_cases;
+}
+
+static int
+module_test_bench(const char* name)
+{
+	int benches = 0;
+
+	for (const ModuleTestCase& bench : module_test_benches)
+	{
+		if (name && strcmp(name, bench.name))
+			continue;
+
+		printf("%s\n", bench.name);
+		bench.run();
+		benches++;
+	}
+
+	if (!benches)
+	{
+		printf("no benchmark named '%s'\n", name);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+	// Process wide settings the state manager would otherwise make.
+	LuaConfig config;
+	lua_config_load(&config, nullptr);
+
+	file_cache_set_capacity(config.file_cache_size);
+	lua_allocator_probe();
+	compression_cache_set_capacity((size_t)config.compression_cache_size * 1024);
+
+	if (argc >= 2 && !strcmp(argv[1], "bench"))
+		return module_test_bench(argc >= 3 ? argv[2] : nullptr);
+
+	return module_test_run();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "shared.h"
+#include "http_stand_in.h"
+
+#include <string>
+
+#ifndef _MODULE_TEST
+#define _MODULE_TEST
+
+/**
+ * Tests and benchmarks that drive the module through the stand-in IIS
+ * objects, in process and without a web server.
+ *
+ *   ModuleTest.exe              runs every test, exit code is the failure count
+ *   ModuleTest.exe bench [name] runs every benchmark, or the one named
+ */
+
+typedef void (*ModuleTestRun)();
+
+typedef struct _ModuleTestCase
+{
+	const char* name;
+	ModuleTestRun run;
+} ModuleTestCase;
+
+// An engine running one script, compiled from a scratch directory of its own.
+typedef struct _ModuleTestEngine
+{
+	char directory_path[MAX_PATH];
+	LuaConfig config;
+	LuaStats stats;
+	LuaScriptCache* script_cache;
+	LuaEngine* lua_engine;
+} ModuleTestEngine;
+
+// Counts a failure and reports where it happened, the test carries on.
+#define module_test_check(condition) module_test_check_at((condition), #condition, __FILE__, __LINE__)
+
+bool module_test_check_at(bool condition, const char* expression, const char* file, int line);
+
+ModuleTestEngine* module_test_engine_create(const char* script);
+ModuleTestEngine* module_test_engine_destroy(ModuleTestEngine* engine);
+bool module_test_write_file(const ModuleTestEngine* engine, const char* name, const std::string& data);
+
+void module_test_request_init(LuaEngineRequest* request);
+REQUEST_NOTIFICATION_STATUS module_test_run_request(ModuleTestEngine* engine, StandInContext* context);
+
+double module_test_seconds();
+
+void engine_test_suspended_read();
+void response_test_buffers_survive_collection();
+void response_test_compress_after_file();
+void response_test_failed_handler_finishes_stream();
+
+void state_bench_acquire_release();
+void state_bench_request_lock();
+void allocator_bench_trace_replay();
+void request_bench_url_conversion();
+void request_bench_query_parser();
+void form_bench_multipart();
+void request_bench_cookies();
+void response_bench_write_batching();
+
+#endif
@@ -0,0 +1,211 @@
+#include "module_test.h"
+
+#include <locale.h>
+
+#define REQUEST_BENCH_CONVERSIONS 1000000
+#define REQUEST_BENCH_REQUESTS 100000
+
+// Each request does one lookup the way the header X-Bench asks for, the Lua
+// versions are what scripts did before the native parsers.
+static const char* request_bench_script =
+	"local function unescape(s)\n"
+	"	s = s:gsub('%+', ' ')\n"
+	"	return (s:gsub('%%(%x%x)', function(h) return string.char(tonumber(h, 16)) end))\n"
+	"end\n"
+	"local function gmatch_query(query)\n"
+	"	local values = {}\n"
+	"	for key, value in query:gmatch('([^&=?]+)=?([^&]*)') do\n"
+	"		values[unescape(key)] = unescape(value)\n"
+	"	end\n"
+	"	return values\n"
+	"end\n"
+	"local function gmatch_cookie(header, name)\n"
+	"	for key, value in header:gmatch('([^;=%s]+)=([^;]*)') do\n"
+	"		if key == name then return value end\n"
+	"	end\n"
+	"end\n"
+	"iis.Register(function(response, request)\n"
+	"	local mode = request:GetHeader('X-Bench')\n"
+	"	if mode == 'query' then\n"
+	"		request:GetQuery()\n"
+	"	elseif mode == 'query-gmatch' then\n"
+	"		gmatch_query(request:GetQueryString())\n"
+	"	elseif mode == 'cookie' then\n"
+	"		request:GetCookie('session')\n"
+	"	elseif mode == 'cookie-gmatch' then\n"
+	"		gmatch_cookie(request:GetHeader('Cookie'), 'session')\n"
+	"	end\n"
+	"	return iis.Finish\n"
+	"end)\n";
+
+static const wchar_t* request_bench_query =
+	L"?q=iis+lua+module&page=3&sort=relevance&filter=type%3Ddoc&filter=lang%3Den"
+	L"&utm_source=newsletter&utm_medium=email&utm_campaign=spring%202024"
+	L"&session_id=8f14e45fceea167a5a36dedd4bea2543&ref=https%3A%2F%2Fexample.com%2Fstart";
+
+static const wchar_t* request_bench_urls[] = {
+	L"/api/v1/users/12345/orders?page=2&sort=desc&filter=status%3Dopen",
+	L"/static/scripts/app.3f9c2b1e.min.js",
+	L"/suche/stra\u00dfe/m\u00fcnchen?q=caf\u00e9+cr\u00e8me&lang=de",
+	L"/\u691c\u7d22/\u6771\u4eac?q=\u30e9\u30fc\u30e1\u30f3",
+};
+
+static double
+request_bench_convert(const std::wstring& url, std::string* output)
+{
+	double start = module_test_seconds();
+
+	for (DWORD i = 0; i < REQUEST_BENCH_CONVERSIONS; i++)
+	{
+		// Sized first and then converted, the way the url memo does it.
+		size_t length = utf8_convert_from_wide(url.c_str(), url.size(), nullptr, 0);
+		output->resize(length);
+		utf8_convert_from_wide(url.c_str(), url.size(), &(*output)[0], length);
+	}
+
+	return (module_test_seconds() - start) / REQUEST_BENCH_CONVERSIONS;
+}
+
+static double
+request_bench_wcstombs(const std::wstring& url, std::string* output)
+{
+	double start = module_test_seconds();
+
+	for (DWORD i = 0; i < REQUEST_BENCH_CONVERSIONS; i++)
+	{
+		size_t length = 0;
+		wcstombs_s(&length, nullptr, 0, url.c_str(), 0);
+		output->resize(length);
+		wcstombs_s(&length, &(*output)[0], length, url.c_str(), _TRUNCATE);
+		output->resize(length ? length - 1 : 0);
+	}
+
+	return (module_test_seconds() - start) / REQUEST_BENCH_CONVERSIONS;
+}
+
+/**
+ * URL transcoding with the module's converter against wcstombs_s, which it
+ * replaced. wcstombs_s runs under a UTF-8 locale so both produce the same
+ * bytes, the outputs are compared on the way.
+ */
+void
+request_bench_url_conversion()
+{
+	std::wstring long_query = L"/search?";
+
+	while (long_query.size() < 2000)
+		long_query += L"tag=performance&tag=iis&tag=lua&";
+
+	std::vector<std::wstring> urls(request_bench_urls, request_bench_urls + _countof(request_bench_urls));
+	urls.push_back(long_query);
+
+	setlocale(LC_CTYPE, ".UTF8");
+
+	for (const std::wstring& url : urls)
+	{
+		std::string converted;
+		std::string expected;
+
+		double convert_seconds = request_bench_convert(url, &converted);
+		double wcstombs_seconds = request_bench_wcstombs(url, &expected);
+
+		printf(
+			"%5zu chars: utf8_convert %7.1f ns, wcstombs_s %7.1f ns%s\n",
+			url.size(),
+			convert_seconds * 1e9,
+			wcstombs_seconds * 1e9,
+			converted == expected ? "" : ", outputs differ"
+		);
+	}
+
+	setlocale(LC_CTYPE, "C");
+}
+
+/**
+ * Average time the handler takes for one request in the given mode, the
+ * stand-in objects are set up outside the timed part. cookie is optional.
+ */
+static double
+request_bench_requests(ModuleTestEngine* engine, const char* mode, const std::string* cookie)
+{
+	double seconds = 0;
+
+	for (DWORD i = 0; i < REQUEST_BENCH_REQUESTS; i++)
+	{
+		StandInContext context;
+		context.request.SetCookedUrl(L"localhost", L"/search", request_bench_query);
+		context.request.SetHeader("X-Bench", mode, (USHORT)strlen(mode), TRUE);
+
+		if (cookie)
+			context.request.SetHeader(HttpHeaderCookie, cookie->c_str(), (USHORT)cookie->size(), TRUE);
+
+		double start = module_test_seconds();
+		module_test_run_request(engine, &context);
+		seconds += module_test_seconds() - start;
+	}
+
+	return seconds / REQUEST_BENCH_REQUESTS;
+}
+
+/**
+ * GetQuery against a gmatch parser in Lua on a query with encoded values and
+ * a repeated key. A request that looks nothing up is taken off both.
+ */
+void
+request_bench_query_parser()
+{
+	ModuleTestEngine* engine = module_test_engine_create(request_bench_script);
+
+	if (!engine)
+		return;
+
+	double none = request_bench_requests(engine, "none", nullptr);
+	double native = request_bench_requests(engine, "query", nullptr) - none;
+	double gmatch = request_bench_requests(engine, "query-gmatch", nullptr) - none;
+
+	printf(
+		"%zu chars: GetQuery %6.2f us, gmatch %6.2f us per request\n",
+		wcslen(request_bench_query),
+		native * 1e6,
+		gmatch * 1e6
+	);
+
+	module_test_engine_destroy(engine);
+}
+
+/**
+ * GetCookie against a gmatch scan in Lua on a Cookie header of about 4 KB,
+ * analytics and consent cookies first and the session cookie last.
+ */
+void
+request_bench_cookies()
+{
+	ModuleTestEngine* engine = module_test_engine_create(request_bench_script);
+
+	if (!engine)
+		return;
+
+	std::string cookie = "_ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1700000000; consent=analytics%3Dyes%26ads%3Dno";
+
+	for (int i = 0; cookie.size() < 4000; i++)
+	{
+		char pair[128];
+		sprintf_s(pair, "; pref_%d=%08x%08x%08x%08x", i, i * 2654435761u, i * 40503u, i ^ 0x5bd1e995, i * 97u);
+		cookie += pair;
+	}
+
+	cookie += "; session=8f14e45fceea167a5a36dedd4bea2543";
+
+	double none = request_bench_requests(engine, "none", &cookie);
+	double native = request_bench_requests(engine, "cookie", &cookie) - none;
+	double gmatch = request_bench_requests(engine, "cookie-gmatch", &cookie) - none;
+
+	printf(
+		"%zu byte header: GetCookie %6.2f us, gmatch %6.2f us per request\n",
+		cookie.size(),
+		native * 1e6,
+		gmatch * 1e6
+	);
+
+	module_test_engine_destroy(engine);
+}
@@ -0,0 +1,168 @@
+#include "module_test.h"
+
+static const char* response_test_script =
+	"local function piece(i, base)\n"
+	"	return string.rep(string.char(base + i % 26), 1000 + i)\n"
+	"end\n"
+	"iis.Register(function(response, request)\n"
+	"	local query = request:GetQueryString()\n"
+	"	if query == '?write' then\n"
+	"		for i = 1, 64 do response:Write(piece(i, 65)) end\n"
+	"		response:WriteNoCopy(string.rep('n', 70000) .. 'end')\n"
+	"		response:Append(string.rep('a', 300), 42, { 'x', 'y' })\n"
+	"		response:Flush()\n"
+	"	elseif query == '?file' then\n"
+	"		response:WriteFile('payload.txt')\n"
+	"		response:Write(pcall(response.Compress, response) and 'compressed' or 'refused')\n"
+	"		return iis.Finish\n"
+	"	elseif query == '?fail' then\n"
+	"		response:Compress()\n"
+	"		response:Write(string.rep('compressible text ', 2000))\n"
+	"		response:Append('dropped')\n"
+	"		error('handler failed after a sync flush')\n"
+	"	end\n"
+	"	-- Whatever the collector frees gets reused with other contents.\n"
+	"	collectgarbage('collect')\n"
+	"	local churn = {}\n"
+	"	for i = 1, 64 do churn[i] = piece(i, 97) end\n"
+	"	collectgarbage('collect')\n"
+	"	return iis.Finish\n"
+	"end)\n";
+
+static UINT32
+response_test_crc32(const std::string& data)
+{
+	UINT32 crc = 0xffffffff;
+
+	for (unsigned char c : data)
+	{
+		crc ^= c;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+	}
+
+	return ~crc;
+}
+
+static UINT32
+response_test_read_le32(const std::string& data, size_t offset)
+{
+	const unsigned char* bytes = (const unsigned char*)data.data() + offset;
+
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((UINT32)bytes[3] << 24);
+}
+
+/**
+ * IIS holds on to written chunks until the request completes. Nothing they
+ * point at may move or be reused once the strings they came from are
+ * collected, whether in the handler that wrote them or in later requests.
+ */
+void
+response_test_buffers_survive_collection()
+{
+	ModuleTestEngine* engine = module_test_engine_create(response_test_script);
+
+	if (!module_test_check(engine != nullptr))
+		return;
+
+	std::string expected;
+
+	for (int i = 1; i <= 64; i++)
+		expected.append(1000 + i, (char)('A' + i % 26));
+
+	expected.append(70000, 'n');
+	expected.append("end");
+	expected.append(300, 'a');
+	expected.append("42xy");
+
+	StandInContext written;
+	written.request.SetCookedUrl(L"localhost", L"/", L"?write");
+
+	LuaEngineRequest request;
+	module_test_request_init(&request);
+
+	module_test_check(lua_engine_begin_request(engine->lua_engine, &written, &request) == RQ_NOTIFICATION_FINISH_REQUEST);
+	module_test_check(written.response.BodyUnchanged());
+	module_test_check(written.response.GetBody() == expected);
+
+	for (int i = 0; i < 4; i++)
+	{
+		StandInContext churn;
+		module_test_check(module_test_run_request(engine, &churn) == RQ_NOTIFICATION_FINISH_REQUEST);
+	}
+
+	module_test_check(written.response.BodyUnchanged());
+	module_test_check(written.response.GetBody() == expected);
+
+	lua_engine_end_request(&request);
+
+	module_test_engine_destroy(engine);
+}
+
+/**
+ * A file that has gone out can not be encoded after the fact, Compress
+ * refuses and the body stays as it was sent.
+ */
+void
+response_test_compress_after_file()
+{
+	ModuleTestEngine* engine = module_test_engine_create(response_test_script);
+
+	if (!module_test_check(engine != nullptr))
+		return;
+
+	std::string payload(5000, 'p');
+	module_test_check(module_test_write_file(engine, "payload.txt", payload));
+
+	StandInContext context;
+	context.request.SetCookedUrl(L"localhost", L"/", L"?file");
+	context.request.SetHeader(HttpHeaderAcceptEncoding, "gzip", 4, TRUE);
+
+	module_test_check(module_test_run_request(engine, &context) == RQ_NOTIFICATION_FINISH_REQUEST);
+	module_test_check(context.response.GetHeader(HttpHeaderContentEncoding) == nullptr);
+	module_test_check(context.response.GetBody() == payload + "refused");
+
+	module_test_engine_destroy(engine);
+}
+
+/**
+ * Once part of an encoded body has gone out, a failing handler still ends
+ * the stream. What it had only queued is dropped, the gzip trailer covers
+ * exactly what was written.
+ */
+void
+response_test_failed_handler_finishes_stream()
+{
+	ModuleTestEngine* engine = module_test_engine_create(response_test_script);
+
+	if (!module_test_check(engine != nullptr))
+		return;
+
+	std::string written;
+
+	for (int i = 0; i < 2000; i++)
+		written.append("compressible text ");
+
+	StandInContext context;
+	context.request.SetCookedUrl(L"localhost", L"/", L"?fail");
+	context.request.SetHeader(HttpHeaderAcceptEncoding, "gzip", 4, TRUE);
+
+	module_test_run_request(engine, &context);
+
+	USHORT encoding_length = 0;
+	PCSTR encoding = context.response.GetHeader(HttpHeaderContentEncoding, &encoding_length);
+
+	module_test_check(encoding && std::string(encoding, encoding_length) == "gzip");
+
+	std::string body = context.response.GetBody();
+
+	if (module_test_check(body.size() > 18))
+	{
+		module_test_check((unsigned char)body[0] == 0x1f && (unsigned char)body[1] == 0x8b);
+		module_test_check(response_test_read_le32(body, body.size() - 8) == response_test_crc32(written));
+		module_test_check(response_test_read_le32(body, body.size() - 4) == (UINT32)written.size());
+	}
+
+	module_test_engine_destroy(engine);
+}
@@ -0,0 +1,209 @@
+#include "module_test.h"
+
+#define STATE_BENCH_ITERATIONS 200000
+#define STATE_BENCH_MAX_THREADS 64
+#define STATE_BENCH_LOCKS 10000000
+#define STATE_BENCH_REQUESTS 200000
+
+typedef struct _StateBenchNode
+{
+	SLIST_ENTRY entry;
+	LuaEngine* lua_engine;
+} StateBenchNode;
+
+typedef struct _StateBenchRun
+{
+	HANDLE start;
+	DWORD iterations;
+
+	LuaStateManager* lsm;
+
+	// The pool as it was before sharding, one list every processor pushes and pops.
+	SLIST_HEADER* single_list;
+} StateBenchRun;
+
+static DWORD WINAPI
+state_bench_sharded(LPVOID context)
+{
+	StateBenchRun* run = (StateBenchRun*)context;
+
+	WaitForSingleObject(run->start, INFINITE);
+
+	for (DWORD i = 0; i < run->iterations; i++)
+	{
+		LuaEngine* lua_engine = lua_state_manager_aquire(run->lsm);
+
+		if (lua_engine)
+			lua_state_manager_release(run->lsm, lua_engine);
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI
+state_bench_single_list(LPVOID context)
+{
+	StateBenchRun* run = (StateBenchRun*)context;
+
+	WaitForSingleObject(run->start, INFINITE);
+
+	for (DWORD i = 0; i < run->iterations; i++)
+	{
+		SLIST_ENTRY* list_entry = InterlockedPopEntrySList(run->single_list);
+
+		if (list_entry)
+			InterlockedPushEntrySList(run->single_list, list_entry);
+	}
+
+	return 0;
+}
+
+/**
+ * Runs routine on thread_count threads released together, returns the
+ * seconds until the last one is done.
+ */
+static double
+state_bench_run_threads(DWORD thread_count, LPTHREAD_START_ROUTINE routine, StateBenchRun* run)
+{
+	HANDLE threads[STATE_BENCH_MAX_THREADS];
+
+	run->start = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+	for (DWORD i = 0; i < thread_count; i++)
+		threads[i] = CreateThread(nullptr, 0, routine, run, 0, nullptr);
+
+	double start = module_test_seconds();
+
+	SetEvent(run->start);
+	WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+
+	double seconds = module_test_seconds() - start;
+
+	for (DWORD i = 0; i < thread_count; i++)
+		CloseHandle(threads[i]);
+
+	CloseHandle(run->start);
+
+	return seconds;
+}
+
+/**
+ * Acquire and release throughput from one thread up to one per processor,
+ * through the sharded state manager and through a single SLIST. The single
+ * list moves bare nodes, so it is the cost of the list alone.
+ */
+void
+state_bench_acquire_release()
+{
+	StandInServer server(L"ModuleTestBench");
+	LuaStateManager* lsm = lua_state_manager_create(&server);
+
+	if (!lsm)
+	{
+		printf("failed to create the state manager\n");
+		return;
+	}
+
+	DWORD processors = min(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), STATE_BENCH_MAX_THREADS);
+
+	SLIST_HEADER* single_list = (SLIST_HEADER*)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
+	StateBenchNode* nodes = (StateBenchNode*)_aligned_malloc(sizeof(StateBenchNode) * processors, MEMORY_ALLOCATION_ALIGNMENT);
+
+	InitializeSListHead(single_list);
+
+	for (DWORD i = 0; i < processors; i++)
+	{
+		nodes[i].lua_engine = nullptr;
+		InterlockedPushEntrySList(single_list, &nodes[i].entry);
+	}
+
+	StateBenchRun run = {};
+	run.iterations = STATE_BENCH_ITERATIONS;
+	run.lsm = lsm;
+	run.single_list = single_list;
+
+	for (DWORD threads = 1; ; threads = min(threads * 2, processors))
+	{
+		double operations = (double)threads * run.iterations;
+
+		double single_seconds = state_bench_run_threads(threads, state_bench_single_list, &run);
+		double sharded_seconds = state_bench_run_threads(threads, state_bench_sharded, &run);
+
+		printf(
+			"%3lu threads: single list %7.2f M/s, sharded %7.2f M/s\n",
+			threads,
+			operations / single_seconds / 1e6,
+			operations / sharded_seconds / 1e6
+		);
+
+		if (threads == processors)
+			break;
+	}
+
+	_aligned_free(nodes);
+	_aligned_free(single_list);
+
+	lua_state_manager_destroy(lsm);
+}
+
+/**
+ * Per-request cost of the engine lock, the kernel mutex it replaced against
+ * the state word it uses now, both uncontended as they nearly always are.
+ * An empty handler's whole request is timed alongside for scale.
+ */
+void
+state_bench_request_lock()
+{
+	HANDLE mutex = CreateMutex(nullptr, FALSE, nullptr);
+
+	double start = module_test_seconds();
+
+	for (DWORD i = 0; i < STATE_BENCH_LOCKS; i++)
+	{
+		WaitForSingleObject(mutex, INFINITE);
+		ReleaseMutex(mutex);
+	}
+
+	double mutex_seconds = module_test_seconds() - start;
+
+	CloseHandle(mutex);
+
+	volatile LONG state = 0;
+
+	start = module_test_seconds();
+
+	for (DWORD i = 0; i < STATE_BENCH_LOCKS; i++)
+	{
+		while (InterlockedCompareExchange(&state, 1, 0) != 0)
+			YieldProcessor();
+
+		InterlockedExchange(&state, 0);
+		WakeByAddressSingle((PVOID)&state);
+	}
+
+	double state_seconds = module_test_seconds() - start;
+
+	printf(
+		"kernel mutex %6.1f ns, state word %6.1f ns per lock and unlock\n",
+		mutex_seconds / STATE_BENCH_LOCKS * 1e9,
+		state_seconds / STATE_BENCH_LOCKS * 1e9
+	);
+
+	ModuleTestEngine* engine = module_test_engine_create("iis.Register(function(response, request) return iis.Finish end)\n");
+
+	if (!engine)
+		return;
+
+	StandInContext context;
+
+	start = module_test_seconds();
+
+	for (DWORD i = 0; i < STATE_BENCH_REQUESTS; i++)
+		module_test_run_request(engine, &context);
+
+	double request_seconds = module_test_seconds() - start;
+
+	printf("empty handler %6.2f us per request\n", request_seconds / STATE_BENCH_REQUESTS * 1e6);
+
+	module_test_engine_destroy(engine);
+}